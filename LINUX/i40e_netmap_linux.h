@@ -270,7 +270,7 @@ i40e_netmap_txsync(struct netmap_kring *kring, int flags)
 	struct netmap_ring *ring = kring->ring;
 	u_int nm_i;	/* index into the netmap ring */
 	u_int nic_i;	/* index into the NIC ring */
-	u_int n;
+	u_int n = 0;
 	u_int const lim = kring->nkr_num_slots - 1;
 	u_int const head = kring->rhead;
 	/*
@@ -278,6 +278,7 @@ i40e_netmap_txsync(struct netmap_kring *kring, int flags)
 	 * them every half ring, or where NS_REPORT is set
 	 */
 	u_int report_frequency = kring->nkr_num_slots >> 1;
+	int report = 0;
 
 	/* device-specific */
 	struct i40e_netdev_priv *np = netdev_priv(ifp);
@@ -353,6 +354,7 @@ i40e_netmap_txsync(struct netmap_kring *kring, int flags)
 
 			NM_CHECK_ADDR_LEN(na, addr, len);
 
+			report |= slot->flags & NS_REPORT;
 			if (slot->flags & NS_BUF_CHANGED) {
 				/* buffer has changed, reload map */
 				//netmap_reload_map(na, txr->dma.tag, txbuf->map, addr);
@@ -376,7 +378,14 @@ i40e_netmap_txsync(struct netmap_kring *kring, int flags)
 		/* synchronize the NIC ring */
 		//bus_dmamap_sync(txr->dma.tag, txr->dma.map,
 		//	BUS_DMASYNC_PREREAD | BUS_DMASYNC_PREWRITE);
+	}
 
+	/*
+	 * The doorbell may be delayed to batch several txsyncs in a
+	 * single register write, see nm_txdb_kick().
+	 */
+	if (nm_txdb_kick(kring, n, report, flags)) {
+		nic_i = netmap_idx_k2n(kring, kring->nr_hwcur);
 		/* (re)start the tx unit up to slot nic_i (excluded) */
 		wmb();
 		writel(nic_i, txr->tail);
@@ -247,7 +247,7 @@ ixgbe_netmap_txsync(struct netmap_kring *kring, int flags)
 	u_int ring_nr = kring->ring_id;
 	u_int nm_i;	/* index into the netmap ring */
 	u_int nic_i;	/* index into the NIC ring */
-	u_int n;
+	u_int n = 0;
 	u_int const lim = kring->nkr_num_slots - 1;
 	u_int const head = kring->rhead;
 	/*
@@ -255,6 +255,7 @@ ixgbe_netmap_txsync(struct netmap_kring *kring, int flags)
 	 * them every half ring, or where NS_REPORT is set
 	 */
 	u_int report_frequency = kring->nkr_num_slots >> 1;
+	int report = 0;
 
 	/* device-specific */
 	struct NM_IXGBE_ADAPTER *adapter = netdev_priv(ifp);
@@ -317,6 +318,7 @@ ixgbe_netmap_txsync(struct netmap_kring *kring, int flags)
 
 			NM_CHECK_ADDR_LEN(na, addr, len);
 
+			report |= slot->flags & NS_REPORT;
 			if (slot->flags & NS_BUF_CHANGED) {
 				/* buffer has changed, reload map */
 				// netmap_reload_map(pdev, DMA_TO_DEVICE, old_addr, addr);
@@ -335,7 +337,14 @@ ixgbe_netmap_txsync(struct netmap_kring *kring, int flags)
 			nic_i = nm_next(nic_i, lim);
 		}
 		kring->nr_hwcur = head;
+	}
 
+	/*
+	 * The doorbell may be delayed to batch several txsyncs in a
+	 * single register write, see nm_txdb_kick().
+	 */
+	if (nm_txdb_kick(kring, n, report, flags)) {
+		nic_i = netmap_idx_k2n(kring, kring->nr_hwcur);
 		wmb();	/* synchronize writes to the NIC ring */
 		/* (re)start the tx unit up to slot nic_i (excluded) */
 		IXGBE_WRITE_REG(&adapter->hw, NM_IXGBE_TDT(txr->reg_idx), nic_i);
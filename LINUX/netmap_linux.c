@@ -255,6 +255,110 @@ nm_os_mbuf_has_offld(struct mbuf *m)
 	return m->ip_summed == CHECKSUM_PARTIAL || skb_is_gso(m);
 }
 
+/* The virtio-net header mirrors the skb offload fields, see also
+ * virtio_net_hdr_from_skb() and virtio_net_hdr_to_skb(). The offsets
+ * are relative to m->data, which points to the ethernet header. */
+int
+nm_os_mbuf_vnet_hdr_get(struct mbuf *m, struct nm_vnet_hdr *vh)
+{
+	memset(vh, 0, sizeof(*vh));
+
+	if (skb_is_gso(m)) {
+		struct skb_shared_info *sinfo = skb_shinfo(m);
+
+		if (sinfo->gso_type & SKB_GSO_TCPV4) {
+			vh->gso_type = VIRTIO_NET_HDR_GSO_TCPV4;
+		} else if (sinfo->gso_type & SKB_GSO_TCPV6) {
+			vh->gso_type = VIRTIO_NET_HDR_GSO_TCPV6;
+		} else {
+			return -1;
+		}
+		if (sinfo->gso_type & SKB_GSO_TCP_ECN) {
+			vh->gso_type |= VIRTIO_NET_HDR_GSO_ECN;
+		}
+		vh->hdr_len = skb_headlen(m);
+		vh->gso_size = sinfo->gso_size;
+	}
+
+	if (m->ip_summed == CHECKSUM_PARTIAL) {
+		vh->flags = VIRTIO_NET_HDR_F_NEEDS_CSUM;
+		vh->csum_start = m->csum_start - skb_headroom(m);
+		vh->csum_offset = m->csum_offset;
+	} else if (m->ip_summed == CHECKSUM_UNNECESSARY) {
+		vh->flags = VIRTIO_NET_HDR_F_DATA_VALID;
+	} else if (vh->gso_type != VIRTIO_NET_HDR_GSO_NONE) {
+		return -1; /* the segments would need a checksum */
+	}
+
+	return 0;
+}
+
+int
+nm_os_mbuf_vnet_hdr_set(struct mbuf *m, const struct nm_vnet_hdr *vh)
+{
+	u_int gso_type;
+
+	if (vh->flags & VIRTIO_NET_HDR_F_NEEDS_CSUM) {
+		if (!skb_partial_csum_set(m, vh->csum_start,
+					  vh->csum_offset)) {
+			return -1;
+		}
+	} else if (vh->flags & VIRTIO_NET_HDR_F_DATA_VALID) {
+		m->ip_summed = CHECKSUM_UNNECESSARY;
+	}
+
+	switch (vh->gso_type & ~VIRTIO_NET_HDR_GSO_ECN) {
+	case VIRTIO_NET_HDR_GSO_NONE:
+		return 0;
+	case VIRTIO_NET_HDR_GSO_TCPV4:
+		gso_type = SKB_GSO_TCPV4;
+		break;
+	case VIRTIO_NET_HDR_GSO_TCPV6:
+		gso_type = SKB_GSO_TCPV6;
+		break;
+	default:
+		/* UFO is gone from recent kernels. */
+		return -1;
+	}
+	if (vh->gso_type & VIRTIO_NET_HDR_GSO_ECN) {
+		gso_type |= SKB_GSO_TCP_ECN;
+	}
+	/* The segments need a checksum, and the transport header
+	 * is set by skb_partial_csum_set(). */
+	if (vh->gso_size == 0 || !(vh->flags & VIRTIO_NET_HDR_F_NEEDS_CSUM)) {
+		return -1;
+	}
+	skb_shinfo(m)->gso_size = vh->gso_size;
+	/* The header comes from an untrusted source. */
+	skb_shinfo(m)->gso_type = gso_type | SKB_GSO_DODGY;
+	skb_shinfo(m)->gso_segs = 0;
+
+	return 0;
+}
+
+uint64_t
+nm_os_timestamp_ns(void)
+{
+	return ktime_to_ns(ktime_get_real());
+}
+
+void
+nm_os_mbuf_timestamp_set(struct mbuf *m)
+{
+	/* the stack only stamps skbs if someone asked for it */
+	if (!ktime_to_ns(m->tstamp))
+		__net_timestamp(m);
+}
+
+uint64_t
+nm_os_mbuf_timestamp(struct mbuf *m)
+{
+	uint64_t ts = ktime_to_ns(m->tstamp);
+
+	/* like on FreeBSD, never report 0 for an unstamped skb */
+	return ts ? ts : nm_os_timestamp_ns();
+}
+
 #ifdef WITH_GENERIC
 /* ####################### MITIGATION SUPPORT ###################### */
 
@@ -285,11 +389,7 @@ generic_timer_handler(struct hrtimer *t)
      * a notification.
      */
     mit->mit_pending = 0;
-    /* below is a variation of netmap_generic_irq  XXX revise */
-    if (nm_netmap_on(mit->mit_na)) {
-        netmap_common_irq(mit->mit_na, mit->mit_ring_idx, &work_done);
-        generic_rate(0, 0, 0, 0, 0, 1);
-    }
+    netmap_generic_irq(mit->mit_na, mit->mit_ring_idx, &work_done);
     nm_os_mitigation_restart(mit);
 
     return HRTIMER_RESTART;
@@ -333,6 +433,66 @@ nm_os_mitigation_cleanup(struct nm_generic_mit *mit)
 }
 
 
+/* #################### TX DOORBELL TIMER ################### */
+
+#ifdef NETMAP_LINUX_HAVE_HRTIMER_SOFT
+/* The handler runs the txsync (and possibly nm_notify()), so it must
+ * not run in hardirq context. Without soft hrtimers there is no timer,
+ * and the doorbell is always rung at once. */
+static enum hrtimer_restart
+nm_txdb_timer_handler(struct hrtimer *t)
+{
+	struct nm_txdb *db = container_of(t, struct nm_txdb, timer);
+
+	if (netmap_txdb_expire(db))
+		nm_os_txdb_arm(db, db->usecs);
+	return HRTIMER_NORESTART;
+}
+
+int
+nm_os_txdb_init(struct nm_txdb *db)
+{
+	hrtimer_init(&db->timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL_SOFT);
+	db->timer.function = &nm_txdb_timer_handler;
+	return 0;
+}
+
+int
+nm_os_txdb_arm(struct nm_txdb *db, u_int usecs)
+{
+	/* also works from the handler, where the timer is not queued */
+	db->usecs = usecs;
+	if (!hrtimer_is_queued(&db->timer))
+		hrtimer_start(&db->timer, ktime_set(0, usecs * 1000),
+				HRTIMER_MODE_REL_SOFT);
+	return 0;
+}
+
+void
+nm_os_txdb_fini(struct nm_txdb *db)
+{
+	hrtimer_cancel(&db->timer);
+}
+#else  /* !NETMAP_LINUX_HAVE_HRTIMER_SOFT */
+int
+nm_os_txdb_init(struct nm_txdb *db)
+{
+	return EOPNOTSUPP;
+}
+
+int
+nm_os_txdb_arm(struct nm_txdb *db, u_int usecs)
+{
+	return EOPNOTSUPP;
+}
+
+void
+nm_os_txdb_fini(struct nm_txdb *db)
+{
+}
+#endif /* !NETMAP_LINUX_HAVE_HRTIMER_SOFT */
+
+
 
 /* #################### GENERIC ADAPTER SUPPORT ################### */
 
@@ -712,6 +872,46 @@ nm_os_catch_tx(struct netmap_generic_adapter *gna, int intercept)
 	return 0;
 }
 
+/* Put in the (empty) mbuf the packet stored in the a->nslots slots
+ * starting at a->slot_idx, skipping the virtio-net header if any.
+ * Returns -1 if the mbuf cannot be enlarged to hold the packet. */
+static int
+generic_mbuf_fill(struct nm_os_gen_arg *a, struct mbuf *m)
+{
+	struct netmap_kring *kring = a->kring;
+	struct netmap_adapter *na = kring->na;
+	struct netmap_ring *ring = kring->ring;
+	u_int const lim = kring->nkr_num_slots - 1;
+	u_int skip = a->vh ? na->virt_hdr_len : 0;
+	u_int totlen = 0, i, j;
+
+	for (i = 0, j = a->slot_idx; i < a->nslots; i++, j = nm_next(j, lim)) {
+		totlen += min_t(u_int, ring->slot[j].len, NETMAP_BUF_SIZE(na));
+	}
+	totlen -= skip;
+
+	/* Copy the netmap buffers into the linear area, growing it if
+	 * needed (the mbuf is not shared yet). */
+	if (unlikely(skb_tailroom(m) < totlen) &&
+			pskb_expand_head(m, 0, totlen - skb_tailroom(m),
+					 GFP_ATOMIC)) {
+		RD(5, "Failed to expand mbuf to %u bytes", totlen);
+		return -1;
+	}
+	for (i = 0, j = a->slot_idx; i < a->nslots; i++, j = nm_next(j, lim)) {
+		struct netmap_slot *slot = &ring->slot[j];
+		u_int len = min_t(u_int, slot->len, NETMAP_BUF_SIZE(na));
+		char *addr = NMB(na, slot);
+
+		if (i == 0) {
+			addr += skip;
+			len -= skip;
+		}
+		memcpy(skb_put(m, len), addr, len);
+	}
+	return 0;
+}
+
 /* Transmit routine used by generic_netmap_txsync(). Returns 0 on success
    and -1 on error (which may be packet drops or other errors). */
 int
@@ -738,6 +938,11 @@ nm_os_generic_xmit_frame(struct nm_os_gen_arg *a)
 	m->data = m->head + ifp->needed_headroom;
 	skb_reset_tail_pointer(m);
 	skb_reset_mac_header(m);
+	/* Clear the offloads requested for the previous packet. */
+	m->ip_summed = CHECKSUM_NONE;
+	skb_shinfo(m)->gso_size = 0;
+	skb_shinfo(m)->gso_type = 0;
+	skb_shinfo(m)->gso_segs = 0;
 
         /* Initialize the header pointers assuming this is an IPv4 packet.
          * This is useful to make netmap interact well with TC when
@@ -747,10 +952,31 @@ nm_os_generic_xmit_frame(struct nm_os_gen_arg *a)
 	m->protocol = htons(ETH_P_IP);
 	m->pkt_type = PACKET_HOST;
 
-	/* Copy a netmap buffer into the mbuf.
-	 * TODO Support the slot flags (NS_MOREFRAG, NS_INDIRECT). */
-	skb_copy_to_linear_data(m, a->addr, len); // skb_store_bits(m, 0, addr, len);
-	skb_put(m, len);
+	/* Copy the netmap buffers into the mbuf (NS_INDIRECT buffers
+	 * have already been copied by generic_netmap_txsync()). */
+	if (a->nslots > 1) {
+		if (generic_mbuf_fill(a, m)) {
+			return -1;
+		}
+	} else {
+		skb_copy_to_linear_data(m, a->addr, len); // skb_store_bits(m, 0, addr, len);
+		skb_put(m, len);
+	}
+
+	if (a->vh) {
+		/* Let the device (or the stack, in dev_queue_xmit())
+		 * do the offloads requested by the virtio-net header. */
+		if (likely(skb_headlen(m) >= ETH_HLEN)) {
+			m->protocol = eth_hdr(m)->h_proto;
+		}
+		if (unlikely(nm_os_mbuf_vnet_hdr_set(m, a->vh))) {
+			RD(5, "%s: bad virtio-net header, offloads ignored",
+				ifp->name);
+			m->ip_summed = CHECKSUM_NONE;
+			skb_shinfo(m)->gso_size = 0;
+			skb_shinfo(m)->gso_type = 0;
+		}
+	}
 
 	/* Hold a reference on this, we are going to recycle mbufs as
 	 * much as possible. */
@@ -772,6 +998,19 @@ nm_os_generic_xmit_frame(struct nm_os_gen_arg *a)
 	skb_set_queue_mapping(m, a->ring_nr);
 	m->priority = a->qevent ? NM_MAGIC_PRIORITY_TXQE : NM_MAGIC_PRIORITY_TX;
 
+	if (a->batch) {
+		/* Bulk mode: nm_os_generic_xmit_burst() will pass the
+		 * mbuf to the driver together with the other ones. */
+		m->next = NULL;
+		if (a->tail)
+			((struct mbuf *)a->tail)->next = m;
+		else
+			a->head = m;
+		a->tail = m;
+		a->queued++;
+		return 0;
+	}
+
 	ret = dev_queue_xmit(m);
 
 	if (unlikely(ret != NET_XMIT_SUCCESS)) {
@@ -797,11 +1036,89 @@ nm_os_generic_xmit_frame(struct nm_os_gen_arg *a)
 	return 0;
 }
 
+#ifdef NETMAP_LINUX_HAVE_NETDEV_START_XMIT
+#define nm_netdev_start_xmit(m, ifp, txq, more) \
+	netdev_start_xmit(m, ifp, txq, more)
+#else  /* !NETMAP_LINUX_HAVE_NETDEV_START_XMIT */
+/* No xmit_more on these kernels, the driver rings the doorbell on
+ * every mbuf. */
+#define nm_netdev_start_xmit(m, ifp, txq, more) \
+	(ifp)->netdev_ops->ndo_start_xmit(m, ifp)
+#endif /* !NETMAP_LINUX_HAVE_NETDEV_START_XMIT */
+
+#ifdef NETMAP_LINUX_HAVE_NETDEV_LLTX
+#define NM_NETDEV_LLTX(ifp)	((ifp)->lltx)
+#else  /* !NETMAP_LINUX_HAVE_NETDEV_LLTX */
+#define NM_NETDEV_LLTX(ifp)	((ifp)->features & NETIF_F_LLTX)
+#endif /* !NETMAP_LINUX_HAVE_NETDEV_LLTX */
+
+/* Bulk transmit routine used by generic_netmap_txsync() when txqdisc
+ * is not used. The mbufs queued by nm_os_generic_xmit_frame() are
+ * passed straight to the driver, bypassing the qdisc layer (and the
+ * packet taps): the tx lock is taken once per burst and all the mbufs
+ * but the last one are marked with xmit_more, so that the driver can
+ * ring the doorbell only once. If the driver queue fills up, the
+ * remaining mbufs are not transmitted and go back to the tx pool.
+ * Returns the number of such mbufs, and sets a->m to the first one. */
+int
+nm_os_generic_xmit_burst(struct nm_os_gen_arg *a)
+{
+	struct ifnet *ifp = a->ifp;
+	struct mbuf *m = a->head, *next;
+	struct netdev_queue *txq;
+	int lltx = NM_NETDEV_LLTX(ifp);
+	int left = 0;
+
+	a->head = a->tail = NULL;
+	a->queued = 0;
+	if (m == NULL) {
+		return 0;
+	}
+
+	txq = netdev_get_tx_queue(ifp, a->ring_nr < ifp->real_num_tx_queues ?
+					a->ring_nr : 0);
+	local_bh_disable();
+	if (!lltx) {
+		__netif_tx_lock(txq, smp_processor_id());
+	}
+	for (; m != NULL; m = next) {
+		netdev_tx_t ret = NETDEV_TX_BUSY;
+
+		next = m->next;
+		m->next = NULL;
+		if (likely(!left && netif_running(ifp) &&
+				!netif_xmit_frozen_or_stopped(txq))) {
+			/* The driver rings the doorbell anyway if it
+			 * stops the queue, so a refused mbuf after an
+			 * xmit_more one does not leave packets behind. */
+			ret = nm_netdev_start_xmit(m, ifp, txq, next != NULL);
+		}
+		if (unlikely(!dev_xmit_complete(ret))) {
+			/* Drop our reference and make the mbuf
+			 * reclaimable by generic_netmap_tx_clean(). */
+			m->priority = 0;
+			kfree_skb(m);
+			if (left++ == 0) {
+				a->m = m;
+			}
+		}
+	}
+	if (!lltx) {
+		__netif_tx_unlock(txq);
+	}
+	local_bh_enable();
+
+	return left;
+}
+
 void
 nm_os_generic_set_features(struct netmap_generic_adapter *gna)
 {
 	gna->rxsg = 1; /* Supported through skb_copy_bits(). */
+	gna->txsg = 1; /* Copied into the linear area. */
 	gna->txqdisc = netmap_generic_txqdisc;
+	gna->txbatch = netmap_generic_txbatch > 1 ? netmap_generic_txbatch : 0;
+	gna->vnethdr = 1; /* Through the skb offload fields. */
 }
 #endif /* WITH_GENERIC */
 
@@ -1323,16 +1640,391 @@ struct nm_kctx {
 	/* notify function, only needed when use_kthread == 0 */
 	nm_kctx_notify_fn_t notify_fn;
 
+	/* incremented on each notification from the guest (may be NULL) */
+	uint64_t *kicks;
+
 	/* integer to manage multiple worker contexts */
 	long type;
 
 	/* does this kernel context use a kthread ? */
 	int use_kthread;
+
+	/* should it run on the shared workers (if ptnetmap_workers > 0) ? */
+	int pooled;
+	struct nm_kctx_worker *owner;	/* worker running the context */
+	struct nm_kctx_worker *queued_on; /* runq holding the context */
+	struct list_head runq_entry;
+	atomic_t pstate;		/* NM_KCTX_* below */
+};
+
+/*
+ * Shared workers.
+ *
+ * Pooled contexts do not get a kthread each, but are multiplexed on at
+ * most ptnetmap_workers kthreads, pinned on different cores. Each context
+ * is owned by the worker with the fewest contexts when it is started, and
+ * a wakeup puts it on the run queue of its owner. A worker with an empty
+ * run queue steals the last pending context of the busiest worker, and
+ * idle workers are woken up when a run queue holds more than one context.
+ * The worker switches to the address space of each context before running
+ * it, and releases it when it goes to sleep.
+ *
+ * pstate tracks where a pooled context is, and is only moved from
+ * NM_KCTX_QUEUED to NM_KCTX_RUNNING under the lock of the run queue.
+ */
+#define NM_KCTX_IDLE		0	/* not scheduled */
+#define NM_KCTX_QUEUED		1	/* on a run queue */
+#define NM_KCTX_RUNNING		2	/* running on a worker */
+#define NM_KCTX_RERUN		3	/* woken up while running */
+#define NM_KCTX_STOPPING	4	/* stopped while running */
+#define NM_KCTX_STOPPED		5
+
+struct nm_kctx_worker {
+	struct task_struct *task;
+	spinlock_t lock;		/* protects runq and qlen */
+	struct list_head runq;
+	u_int qlen;
+	u_int nctx;			/* owned contexts (pool mutex) */
+	int idle;
 };
 
+static DEFINE_MUTEX(nm_kctx_pool_lock);
+static struct nm_kctx_worker *nm_kctx_workers;
+static int nm_kctx_num_workers;
+static int nm_kctx_pool_users;
+
+static void
+nm_kctx_pool_enqueue(struct nm_kctx_worker *w, struct nm_kctx *nmk)
+{
+	unsigned long flags;
+	int busy, i;
+
+	spin_lock_irqsave(&w->lock, flags);
+	list_add_tail(&nmk->runq_entry, &w->runq);
+	nmk->queued_on = w;
+	busy = (++w->qlen > 1);
+	spin_unlock_irqrestore(&w->lock, flags);
+
+	wake_up_process(w->task);
+	if (!busy)
+		return;
+	/* The owner has a backlog, let an idle worker steal from it. */
+	smp_mb(); /* qlen before idle, see nm_kctx_pool_worker() */
+	for (i = 0; i < nm_kctx_num_workers; i++) {
+		struct nm_kctx_worker *t = nm_kctx_workers + i;
+
+		if (t != w && NM_ACCESS_ONCE(t->idle)) {
+			wake_up_process(t->task);
+			break;
+		}
+	}
+}
+
+/* Take the first (or, when stealing, the last) pending context of w. */
+static struct nm_kctx *
+nm_kctx_pool_dequeue(struct nm_kctx_worker *w, int steal)
+{
+	struct nm_kctx *nmk = NULL;
+	unsigned long flags;
+
+	spin_lock_irqsave(&w->lock, flags);
+	if (w->qlen > (steal ? 1 : 0)) {
+		nmk = steal ?
+			list_entry(w->runq.prev, struct nm_kctx, runq_entry) :
+			list_entry(w->runq.next, struct nm_kctx, runq_entry);
+		list_del(&nmk->runq_entry);
+		nmk->queued_on = NULL;
+		w->qlen--;
+		atomic_set(&nmk->pstate, NM_KCTX_RUNNING);
+	}
+	spin_unlock_irqrestore(&w->lock, flags);
+
+	return nmk;
+}
+
+static struct nm_kctx *
+nm_kctx_pool_steal(struct nm_kctx_worker *w)
+{
+	struct nm_kctx_worker *victim = NULL;
+	u_int qlen = 1;
+	int i;
+
+	for (i = 0; i < nm_kctx_num_workers; i++) {
+		struct nm_kctx_worker *t = nm_kctx_workers + i;
+
+		if (t != w && NM_ACCESS_ONCE(t->qlen) > qlen) {
+			victim = t;
+			qlen = t->qlen;
+		}
+	}
+
+	return victim ? nm_kctx_pool_dequeue(victim, 1) : NULL;
+}
+
+/* Is there something that w can run or steal? */
+static int
+nm_kctx_pool_has_work(struct nm_kctx_worker *w)
+{
+	int i;
+
+	if (NM_ACCESS_ONCE(w->qlen))
+		return 1;
+	for (i = 0; i < nm_kctx_num_workers; i++) {
+		if (NM_ACCESS_ONCE(nm_kctx_workers[i].qlen) > 1)
+			return 1;
+	}
+	return 0;
+}
+
+static void
+nm_kctx_pool_wakeup(struct nm_kctx *nmk)
+{
+	for (;;) {
+		int s = atomic_read(&nmk->pstate);
+
+		if (s == NM_KCTX_IDLE) {
+			if (atomic_cmpxchg(&nmk->pstate, s,
+					   NM_KCTX_QUEUED) == s) {
+				nm_kctx_pool_enqueue(nmk->owner, nmk);
+				return;
+			}
+		} else if (s == NM_KCTX_RUNNING) {
+			/* The worker will run it again. */
+			if (atomic_cmpxchg(&nmk->pstate, s,
+					   NM_KCTX_RERUN) == s)
+				return;
+		} else {
+			/* Already pending, or stopped. */
+			return;
+		}
+	}
+}
+
+/* The worker is done with nmk: requeue it if it was woken up meanwhile. */
+static void
+nm_kctx_pool_done(struct nm_kctx *nmk)
+{
+	for (;;) {
+		int s = atomic_read(&nmk->pstate);
+
+		if (s == NM_KCTX_RUNNING) {
+			if (atomic_cmpxchg(&nmk->pstate, s,
+					   NM_KCTX_IDLE) == s)
+				return;
+		} else if (s == NM_KCTX_RERUN) {
+			atomic_set(&nmk->pstate, NM_KCTX_QUEUED);
+			nm_kctx_pool_enqueue(nmk->owner, nmk);
+			return;
+		} else { /* NM_KCTX_STOPPING */
+			atomic_set(&nmk->pstate, NM_KCTX_STOPPED);
+			return;
+		}
+	}
+}
+
+static void
+nm_kctx_pool_switch_mm(struct mm_struct **cur, struct mm_struct *mm)
+{
+	if (*cur == mm)
+		return;
+	if (*cur) {
+		unuse_mm(*cur);
+		mmput(*cur);
+	}
+	*cur = mm;
+	if (mm) {
+		atomic_inc(&mm->mm_users);
+		use_mm(mm);
+	}
+}
+
+static int
+nm_kctx_pool_worker(void *data)
+{
+	struct nm_kctx_worker *w = data;
+	struct mm_struct *cur_mm = NULL;
+	mm_segment_t oldfs = get_fs();
+
+	set_fs(USER_DS);
+
+	while (!kthread_should_stop()) {
+		struct nm_kctx *nmk;
+
+		nmk = nm_kctx_pool_dequeue(w, 0);
+		if (nmk == NULL)
+			nmk = nm_kctx_pool_steal(w);
+		if (nmk == NULL) {
+			if (cur_mm) {
+				/* Do not pin the address space of a VM
+				 * while sleeping. */
+				nm_kctx_pool_switch_mm(&cur_mm, NULL);
+				continue;
+			}
+			/*
+			 * Set INTERRUPTIBLE state before the last check,
+			 * so that a wake_up_process() issued after the
+			 * check is not lost.
+			 */
+			set_current_state(TASK_INTERRUPTIBLE);
+			NM_ACCESS_ONCE(w->idle) = 1;
+			smp_mb(); /* idle before qlen */
+			if (!nm_kctx_pool_has_work(w) && !kthread_should_stop())
+				schedule();
+			__set_current_state(TASK_RUNNING);
+			NM_ACCESS_ONCE(w->idle) = 0;
+			continue;
+		}
+
+		nm_kctx_pool_switch_mm(&cur_mm, nmk->mm);
+		nmk->worker_fn(nmk->worker_private, 1); /* work */
+		nm_kctx_pool_done(nmk);
+		if (need_resched())
+			schedule();
+	}
+
+	__set_current_state(TASK_RUNNING);
+	nm_kctx_pool_switch_mm(&cur_mm, NULL);
+	set_fs(oldfs);
+	return 0;
+}
+
+static void
+nm_kctx_pool_destroy(void)
+{
+	int i;
+
+	for (i = 0; i < nm_kctx_num_workers; i++) {
+		if (nm_kctx_workers[i].task)
+			kthread_stop(nm_kctx_workers[i].task);
+	}
+	kfree(nm_kctx_workers);
+	nm_kctx_workers = NULL;
+	nm_kctx_num_workers = 0;
+}
+
+static int
+nm_kctx_pool_create(void)
+{
+	int n = min_t(int, ptnetmap_workers, num_online_cpus());
+	int i = 0, cpu;
+
+	nm_kctx_workers = kcalloc(n, sizeof(*nm_kctx_workers), GFP_KERNEL);
+	if (nm_kctx_workers == NULL)
+		return ENOMEM;
+	nm_kctx_num_workers = n;
+
+	for_each_online_cpu(cpu) {
+		struct nm_kctx_worker *w = nm_kctx_workers + i;
+
+		if (i == n)
+			break;
+		spin_lock_init(&w->lock);
+		INIT_LIST_HEAD(&w->runq);
+		w->task = kthread_create(nm_kctx_pool_worker, w,
+					 "nmkpool:%d", i);
+		if (IS_ERR(w->task)) {
+			int error = -PTR_ERR(w->task);
+
+			w->task = NULL;
+			nm_kctx_pool_destroy();
+			return error;
+		}
+		kthread_bind(w->task, cpu);
+		wake_up_process(w->task);
+		i++;
+	}
+
+	return 0;
+}
+
+/* Assign nmk to the least loaded shared worker, creating the workers
+ * for the first pooled context. */
+static int
+nm_kctx_pool_attach(struct nm_kctx *nmk)
+{
+	struct nm_kctx_worker *w;
+	int error = 0, i;
+
+	mutex_lock(&nm_kctx_pool_lock);
+	if (nm_kctx_pool_users == 0) {
+		error = nm_kctx_pool_create();
+		if (error)
+			goto out;
+	}
+	w = nm_kctx_workers;
+	for (i = 1; i < nm_kctx_num_workers; i++) {
+		if (nm_kctx_workers[i].nctx < w->nctx)
+			w = nm_kctx_workers + i;
+	}
+	w->nctx++;
+	nm_kctx_pool_users++;
+	atomic_set(&nmk->pstate, NM_KCTX_IDLE);
+	nmk->owner = w;
+out:
+	mutex_unlock(&nm_kctx_pool_lock);
+	return error;
+}
+
+/* Wait until nmk is neither queued nor running, and release its worker. */
+static void
+nm_kctx_pool_detach(struct nm_kctx *nmk)
+{
+	for (;;) {
+		int s = atomic_read(&nmk->pstate);
+
+		if (s == NM_KCTX_STOPPED)
+			break;
+		if (s == NM_KCTX_IDLE) {
+			if (atomic_cmpxchg(&nmk->pstate, s,
+					   NM_KCTX_STOPPED) == s)
+				break;
+			continue;
+		}
+		if (s == NM_KCTX_QUEUED) {
+			struct nm_kctx_worker *w;
+
+			w = NM_ACCESS_ONCE(nmk->queued_on);
+
+			if (w) {
+				unsigned long flags;
+
+				spin_lock_irqsave(&w->lock, flags);
+				if (nmk->queued_on == w) {
+					list_del(&nmk->runq_entry);
+					nmk->queued_on = NULL;
+					w->qlen--;
+					atomic_set(&nmk->pstate,
+						   NM_KCTX_STOPPED);
+				}
+				spin_unlock_irqrestore(&w->lock, flags);
+			}
+			continue;
+		}
+		if (s == NM_KCTX_RUNNING || s == NM_KCTX_RERUN) {
+			if (atomic_cmpxchg(&nmk->pstate, s,
+					   NM_KCTX_STOPPING) != s)
+				continue;
+		}
+		/* Wait for the worker to complete the current run. */
+		usleep_range(10, 50);
+	}
+
+	mutex_lock(&nm_kctx_pool_lock);
+	nmk->owner->nctx--;
+	nmk->owner = NULL;
+	if (--nm_kctx_pool_users == 0)
+		nm_kctx_pool_destroy();
+	mutex_unlock(&nm_kctx_pool_lock);
+}
+
 void inline
 nm_os_kctx_worker_wakeup(struct nm_kctx *nmk)
 {
+	if (nmk->owner) {
+		nm_kctx_pool_wakeup(nmk);
+		return;
+	}
+
 	if (!nmk->worker) {
 		/* Propagate notification to the user. */
 		nmk->notify_fn(nmk->worker_private);
@@ -1372,7 +2064,9 @@ nm_kctx_poll_wakeup(wait_queue_t *wq, unsigned mode, int sync, void *key)
 	 * wake it up, otherwise do the work here. */
 
 	nmk = container_of(wq, struct nm_kctx, waitq);
-	if (nmk->worker) {
+	if (nmk->kicks)
+		(*nmk->kicks)++;
+	if (nmk->worker || nmk->owner) {
 		nm_os_kctx_worker_wakeup(nmk);
 	} else {
 		nmk->worker_fn(nmk->worker_private, 0);
@@ -1547,6 +2241,12 @@ nm_os_kctx_worker_setaff(struct nm_kctx *nmk, int affinity)
 	nmk->affinity = affinity;
 }
 
+int
+nm_os_kctx_worker_shared(struct nm_kctx *nmk)
+{
+	return nmk->owner != NULL;
+}
+
 struct nm_kctx *
 nm_os_kctx_create(struct nm_kctx_cfg *cfg, unsigned int cfgtype,
 		     void *opaque)
@@ -1554,7 +2254,8 @@ nm_os_kctx_create(struct nm_kctx_cfg *cfg, unsigned int cfgtype,
 	struct nm_kctx *nmk = NULL;
 	int error;
 
-	if (cfgtype != PTNETMAP_CFGTYPE_QEMU) {
+	/* cfgtype is only meaningful for ptnetmap (opaque != NULL) */
+	if (opaque && cfgtype != PTNETMAP_CFGTYPE_QEMU) {
 		D("Unsupported cfgtype %u", cfgtype);
 		return NULL;
 	}
@@ -1571,8 +2272,10 @@ nm_os_kctx_create(struct nm_kctx_cfg *cfg, unsigned int cfgtype,
 	nmk->worker_fn = cfg->worker_fn;
 	nmk->worker_private = cfg->worker_private;
 	nmk->notify_fn = cfg->notify_fn;
+	nmk->kicks = cfg->kicks;
 	nmk->type = cfg->type;
 	nmk->use_kthread = cfg->use_kthread;
+	nmk->pooled = cfg->pooled && ptnetmap_workers > 0;
 	atomic_set(&nmk->scheduled, 0);
 	nmk->attach_user = cfg->attach_user;
 
@@ -1594,7 +2297,7 @@ nm_os_kctx_worker_start(struct nm_kctx *nmk)
 {
 	int error = 0;
 
-	if (nmk->worker) {
+	if (nmk->worker || nmk->owner) {
 		return EBUSY;
 	}
 
@@ -1603,8 +2306,14 @@ nm_os_kctx_worker_start(struct nm_kctx *nmk)
 		nmk->mm = get_task_mm(current);
 	}
 
-	/* Run the context in a kernel thread, if needed. */
-	if (nmk->use_kthread) {
+	/* Run the context on the shared workers, or in its own kernel
+	 * thread, if needed. */
+	if (nmk->use_kthread && nmk->pooled) {
+		error = nm_kctx_pool_attach(nmk);
+		if (error) {
+			goto err;
+		}
+	} else if (nmk->use_kthread) {
 		char name[16];
 
 		snprintf(name, sizeof(name), "nmkth:%d:%ld", current->pid,
@@ -1629,6 +2338,9 @@ nm_os_kctx_worker_start(struct nm_kctx *nmk)
 	return 0;
 
 err:
+	if (nmk->owner) {
+		nm_kctx_pool_detach(nmk);
+	}
 	if (nmk->worker) {
 		kthread_stop(nmk->worker);
 		nmk->worker = NULL;
@@ -1645,6 +2357,10 @@ nm_os_kctx_worker_stop(struct nm_kctx *nmk)
 {
 	nm_kctx_stop_poll(nmk);
 
+	if (nmk->owner) {
+		nm_kctx_pool_detach(nmk);
+	}
+
 	if (nmk->worker) {
 		kthread_stop(nmk->worker);
 		nmk->worker = NULL;
@@ -1662,7 +2378,7 @@ nm_os_kctx_destroy(struct nm_kctx *nmk)
 	if (!nmk)
 		return;
 
-	if (nmk->worker) {
+	if (nmk->worker || nmk->owner) {
 		nm_os_kctx_worker_stop(nmk);
 	}
 
@@ -1903,80 +2619,248 @@ ptnetmap_guest_fini(void)
 #ifdef WITH_SINK
 
 /*
- * An emulated netmap-enabled device acting as a packet sink, useful for
- * performance tests of netmap applications or other netmap subsystems
- * (i.e. VALE, ptnetmap).
+ * Null NICs: emulated netmap-enabled devices with no hardware behind,
+ * useful for performance tests of netmap applications or other netmap
+ * subsystems (i.e. VALE, ptnetmap) on machines without real NICs.
+ *
+ * Packets sent on the tx rings are discarded, at the speed of a link
+ * with the configured line rate, per-packet and per-batch latencies.
+ * The link is emulated by recording, for each slot, the time at which
+ * its packet leaves the "wire". Normally (asynchronous mode) slots are
+ * reclaimed by txsync() once their time has come, and a timer raises
+ * the tx interrupt when half of the pending packets are gone, similarly
+ * to what happens with real NICs. In synchronous mode txsync() waits
+ * for its packets, emulating a packet consumer.
  *
- * The sink_delay_ns parameter is used to tune the speed of the packet sink
- * device. The absolute value of the parameter is interpreted as the number
- * of nanoseconds that are required to send a packet into the sink.
- * For positive values, the sink device emulates a NIC transmitting packets
- * asynchronously with respect to the txsync() caller, similarly to what
- * happens with real NICs.
- * For negative values, the sink device emulates a packet consumer,
- * transmitting packets synchronously with respect to the txsync() caller.
+ * The rx rings are filled by rxsync() with copies of a template frame,
+ * at the configured rate. Frames arrived while the ring was full are
+ * counted as drops, and a periodic timer raises the rx interrupt.
+ *
+ * Null NICs are created, configured and destroyed through NIOCCONFIG
+ * (see struct nm_sink_req in netmap.h). One of them (nmsink0) is
+ * created when the module is loaded: the absolute value of the
+ * sink_delay_ns parameter is its per-packet latency, and negative
+ * values select the synchronous mode.
  */
 static int sink_delay_ns = 100;
-module_param(sink_delay_ns, int, 0644);
-static struct net_device *nm_sink_netdev = NULL; /* global sink netdev */
-s64 nm_sink_next_link_idle; /* for link emulation */
+module_param(sink_delay_ns, int, 0444);
+
+#define NM_SINK_SLOTS		1024
+#define NM_SINK_MAX_RINGS	64
+#define NM_SINK_MAX_SLOTS	16384
+#define NM_SINK_MAX_LEN		2048
+#define NM_SINK_RX_BATCH_NS	20000
+#define NM_SINK_MIN_NS		1000	/* shortest rx interrupt interval */
+#define NM_SINK_TXSYNC_MAX_NS	1000000	/* longest busy wait in txsync */
+#define NM_SINK_WIRE_OVERHEAD	24	/* preamble, FCS and IFG */
+
+struct nm_sink;
+
+/* per-ring state of the emulation */
+struct nm_sink_ring {
+	struct nm_sink		*sink;
+	u_int			ring_id;
+	struct hrtimer		timer;		/* tx or rx interrupt */
+
+	u64			next_ns;	/* tx: the link becomes idle,
+						 * rx: the next frame arrives */
+	u64			rem_ps;		/* fractions of ns of next_ns */
+	int			restart;	/* rx: reset next_ns */
+	u64			*done_ns;	/* tx: completion time of the
+						 * packet in each slot */
+};
+
+/* a null NIC, stored as the private part of its net_device */
+struct nm_sink {
+	struct list_head	list;
+	struct net_device	*netdev;
+	struct nm_sink_req	cfg;		/* current configuration */
+
+	/* derived from cfg */
+	u64			byte_ps;	/* serialization of a byte */
+	u64			rx_period_ps;	/* between rx frames */
+
+	char			*tmpl;		/* rx template frame */
+	struct nm_sink_ring	*tx_rings;
+	struct nm_sink_ring	*rx_rings;
+	int			dying;		/* being deleted, under
+						 * NMG_LOCK */
+};
 
-#define NM_SINK_SLOTS	1024
-#define NM_SINK_DELAY_NS \
-	((unsigned int)(sink_delay_ns > 0 ? sink_delay_ns : -sink_delay_ns))
+static LIST_HEAD(nm_sink_list);
+static DEFINE_MUTEX(nm_sink_lock);	/* protects nm_sink_list */
 
-static int
-nm_sink_register(struct netmap_adapter *na, int onoff)
+/* broadcast 10.0.0.1:1234 -> 10.0.0.2:1234 UDP frame */
+static const u8 nm_sink_default_tmpl[60] = {
+	0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0x00, 0x00,
+	0x00, 0x00, 0x00, 0x01, 0x08, 0x00, 0x45, 0x00,
+	0x00, 0x2e, 0x00, 0x00, 0x40, 0x00, 0x40, 0x11,
+	0x26, 0xbd, 0x0a, 0x00, 0x00, 0x01, 0x0a, 0x00,
+	0x00, 0x02, 0x04, 0xd2, 0x04, 0xd2, 0x00, 0x1a,
+};
+
+static inline struct nm_sink *
+nm_sink_of(struct netmap_adapter *na)
 {
-	if (onoff)
-		nm_set_native_flags(na);
-	else
-		nm_clear_native_flags(na);
+	return netdev_priv(na->ifp);
+}
 
-	nm_sink_next_link_idle = ktime_get_ns();
+/* to be called after any change of s->cfg */
+static void
+nm_sink_update(struct nm_sink *s)
+{
+	s->byte_ps = s->cfg.tx_bps ?
+		div64_u64(8000000000000ULL, s->cfg.tx_bps) : 0;
+	s->rx_period_ps = s->cfg.rx_pps ?
+		div64_u64(1000000000000ULL, s->cfg.rx_pps) : 0;
+	if (s->cfg.rx_pps && !s->rx_period_ps)
+		s->rx_period_ps = 1;
+}
 
-	return 0;
+static enum hrtimer_restart
+nm_sink_tx_timer(struct hrtimer *t)
+{
+	struct nm_sink_ring *r = container_of(t, struct nm_sink_ring, timer);
+
+	netmap_tx_irq(r->sink->netdev, r->ring_id);
+	return HRTIMER_NORESTART;
 }
 
-static inline void
-nm_sink_emu(unsigned int n)
+static enum hrtimer_restart
+nm_sink_rx_timer(struct hrtimer *t)
 {
-	u64 wait_until = nm_sink_next_link_idle;
-	u64 now = ktime_get_ns();
+	struct nm_sink_ring *r = container_of(t, struct nm_sink_ring, timer);
+	struct nm_sink *s = r->sink;
+	u_int work_done;
+
+	netmap_rx_irq(s->netdev, r->ring_id, &work_done);
+	hrtimer_forward_now(t, ns_to_ktime(s->cfg.rx_batch_ns));
+	return HRTIMER_RESTART;
+}
+
+static void
+nm_sink_rx_start(struct nm_sink *s)
+{
+	int i;
+
+	for (i = 0; i < s->cfg.rx_rings; i++) {
+		struct nm_sink_ring *r = &s->rx_rings[i];
 
-	if (sink_delay_ns < 0 || nm_sink_next_link_idle < now) {
-		/* If we are emulating packet consumer mode or the link went
-		 * idle some time ago, we need to update the link emulation
-		 * variable, because we don't want the caller to accumulate
-		 * credit. */
-		nm_sink_next_link_idle = now;
+		r->restart = 1;
+		if (s->cfg.rx_pps)
+			hrtimer_start(&r->timer, ns_to_ktime(s->cfg.rx_batch_ns),
+					HRTIMER_MODE_REL);
 	}
-	/* Schedule new transmissions. */
-	nm_sink_next_link_idle += n * NM_SINK_DELAY_NS;
-	if (sink_delay_ns < 0) {
-		/* In packet consumer mode we emulate synchronous
-		 * transmission, so we have to wait right now for the link
-		 * to become idle. */
-		wait_until = nm_sink_next_link_idle;
+}
+
+static void
+nm_sink_timers_stop(struct nm_sink *s)
+{
+	int i;
+
+	for (i = 0; i < s->cfg.tx_rings; i++)
+		hrtimer_cancel(&s->tx_rings[i].timer);
+	for (i = 0; i < s->cfg.rx_rings; i++)
+		hrtimer_cancel(&s->rx_rings[i].timer);
+}
+
+static int
+nm_sink_register(struct netmap_adapter *na, int onoff)
+{
+	struct nm_sink *s = nm_sink_of(na);
+	u64 now = ktime_get_ns();
+	int i;
+
+	if (onoff) {
+		if (s->dying)
+			return EBUSY;
+		for (i = 0; i < s->cfg.tx_rings; i++) {
+			s->tx_rings[i].next_ns = now;
+			s->tx_rings[i].rem_ps = 0;
+		}
+		nm_set_native_flags(na);
+		nm_sink_rx_start(s);
+	} else {
+		nm_sink_timers_stop(s);
+		nm_clear_native_flags(na);
 	}
-	while (ktime_get_ns() < wait_until) ;
+
+	return 0;
 }
 
 static int
 nm_sink_txsync(struct netmap_kring *kring, int flags)
 {
-	unsigned int const lim = kring->nkr_num_slots - 1;
-	unsigned int const head = kring->rhead;
-	unsigned int n; /* num of packets to be transmitted */
+	struct netmap_adapter *na = kring->na;
+	struct nm_sink *s = nm_sink_of(na);
+	struct nm_sink_ring *r = &s->tx_rings[kring->ring_id];
+	struct netmap_ring *ring = kring->ring;
+	u_int const lim = kring->nkr_num_slots - 1;
+	u_int const head = kring->rhead;
+	u_int nm_i = kring->nr_hwcur;
+	u64 const byte_ps = s->byte_ps;
+	u64 const pkt_ps = (u64)s->cfg.tx_pkt_ns * 1000;
+	u64 now = ktime_get_ns();
+	u64 t;
+	u32 ns;
 
-	n = kring->nkr_num_slots + head - kring->nr_hwcur;
-	if (n >= kring->nkr_num_slots) {
-		n -= kring->nkr_num_slots;
+	/*
+	 * First part: schedule the new packets on the link, which does
+	 * not accumulate credit while idle.
+	 */
+	if (nm_i != head) {
+		t = now + s->cfg.tx_batch_ns;
+		if (r->next_ns > t) {
+			t = r->next_ns;
+		} else {
+			r->rem_ps = 0;
+		}
+		for (; nm_i != head; nm_i = nm_next(nm_i, lim)) {
+			u_int len = ring->slot[nm_i].len;
+
+			r->rem_ps += (len + NM_SINK_WIRE_OVERHEAD) * byte_ps +
+				pkt_ps;
+			t += div_u64_rem(r->rem_ps, 1000, &ns);
+			r->rem_ps = ns;
+			r->done_ns[nm_i] = t;
+		}
+		r->next_ns = t;
+		kring->nr_hwcur = head;
+	}
+
+	if (s->cfg.flags & NM_SINK_TXSYNC) {
+		/* a packet consumer: wait for the link to become idle,
+		 * but not longer than NM_SINK_TXSYNC_MAX_NS; slower links
+		 * complete the rest as in asynchronous mode */
+		t = min_t(u64, r->next_ns, now + NM_SINK_TXSYNC_MAX_NS);
+		while ((now = ktime_get_ns()) < t)
+			cpu_relax();
+		if (now >= r->next_ns) {
+			kring->nr_hwtail = nm_prev(kring->nr_hwcur, lim);
+			return 0;
+		}
 	}
-	kring->nr_hwcur = head;
-	kring->nr_hwtail = nm_prev(kring->nr_hwcur, lim);
 
-	nm_sink_emu(n);
+	/*
+	 * Second part: reclaim the slots of the packets already sent,
+	 * and arm the interrupt for half of the others.
+	 */
+	nm_i = nm_next(kring->nr_hwtail, lim);
+	while (nm_i != kring->nr_hwcur && r->done_ns[nm_i] <= now) {
+		kring->nr_hwtail = nm_i;
+		nm_i = nm_next(nm_i, lim);
+	}
+	if (nm_i != kring->nr_hwcur && !hrtimer_is_queued(&r->timer)) {
+		u_int pending = kring->nr_hwcur - nm_i;
+
+		if (pending > lim)
+			pending += kring->nkr_num_slots;
+		nm_i += pending / 2;
+		if (nm_i > lim)
+			nm_i -= kring->nkr_num_slots;
+		hrtimer_start(&r->timer, ns_to_ktime(r->done_ns[nm_i] - now),
+				HRTIMER_MODE_REL);
+	}
 
 	return 0;
 }
@@ -1984,9 +2868,63 @@ nm_sink_txsync(struct netmap_kring *kring, int flags)
 static int
 nm_sink_rxsync(struct netmap_kring *kring, int flags)
 {
+	struct netmap_adapter *na = kring->na;
+	struct nm_sink *s = nm_sink_of(na);
+	struct nm_sink_ring *r = &s->rx_rings[kring->ring_id];
+	struct netmap_ring *ring = kring->ring;
+	u_int const lim = kring->nkr_num_slots - 1;
 	u_int const head = kring->rhead;
+	u64 const period_ps = s->rx_period_ps;
+	u64 now = ktime_get_ns();
+
+	if (head > lim)
+		return netmap_ring_reinit(kring);
+
+	/*
+	 * First part: the frames arrived since the last call. Those
+	 * that do not fit in the ring are lost.
+	 */
+	if (r->restart || !period_ps) {
+		r->restart = 0;
+		r->next_ns = now;
+		r->rem_ps = 0;
+	}
+	if (period_ps && r->next_ns <= now) {
+		u_int const stop = nm_prev(kring->nr_hwcur, lim);
+		u_int len = s->cfg.rx_len;
+		u_int nm_i = kring->nr_hwtail;
+		u32 ns;
+
+		if (len > NETMAP_BUF_SIZE(na))
+			len = NETMAP_BUF_SIZE(na);
+		for (; nm_i != stop && r->next_ns <= now;
+				nm_i = nm_next(nm_i, lim)) {
+			struct netmap_slot *slot = &ring->slot[nm_i];
+
+			memcpy(NMB(na, slot), s->tmpl, len);
+			slot->len = len;
+			slot->flags = 0;
+			r->rem_ps += period_ps;
+			r->next_ns += div_u64_rem(r->rem_ps, 1000, &ns);
+			r->rem_ps = ns;
+		}
+		kring->nr_hwtail = nm_i;
+		if (r->next_ns <= now) {
+			/* ring full */
+			u64 late_ps = (now - r->next_ns) * 1000;
+			u64 lost = 1;
+
+			if (late_ps > r->rem_ps)
+				lost += div64_u64(late_ps - r->rem_ps,
+						period_ps);
+
+			kring->stats.drops += lost;
+			r->rem_ps += lost * period_ps;
+			r->next_ns += div_u64_rem(r->rem_ps, 1000, &ns);
+			r->rem_ps = ns;
+		}
+	}
 
-	/* First part: nothing received for now. */
 	/* Second part: skip past packets that userspace has released */
 	kring->nr_hwcur = head;
 
@@ -2000,7 +2938,6 @@ static netdev_tx_t
 nm_sink_start_xmit(struct sk_buff *skb, struct net_device *netdev)
 {
 	kfree_skb(skb);
-	nm_sink_emu(1);
 	return NETDEV_TX_OK;
 }
 
@@ -2010,52 +2947,275 @@ static const struct net_device_ops nm_sink_netdev_ops = {
 	.ndo_start_xmit = nm_sink_start_xmit,
 };
 
-int
-netmap_sink_init(void)
+static void
+nm_sink_free_rings(struct nm_sink *s)
+{
+	int i;
+
+	if (s->tx_rings) {
+		for (i = 0; i < s->cfg.tx_rings; i++)
+			kfree(s->tx_rings[i].done_ns);
+	}
+	kfree(s->tx_rings);
+	kfree(s->rx_rings);
+	kfree(s->tmpl);
+}
+
+/* check the rates and latencies of a request, and apply them to cfg */
+static int
+nm_sink_set_rates(struct nm_sink_req *cfg, const struct nm_sink_req *req)
+{
+	if (req->flags & ~NM_SINK_TXSYNC)
+		return EINVAL;
+	cfg->flags = req->flags;
+	cfg->tx_bps = req->tx_bps;
+	cfg->tx_pkt_ns = req->tx_pkt_ns;
+	cfg->tx_batch_ns = req->tx_batch_ns;
+	cfg->rx_pps = req->rx_pps;
+	cfg->rx_batch_ns = req->rx_batch_ns ? req->rx_batch_ns :
+		NM_SINK_RX_BATCH_NS;
+	/* each rx interrupt costs a timer and a wakeup */
+	if (cfg->rx_batch_ns < NM_SINK_MIN_NS)
+		cfg->rx_batch_ns = NM_SINK_MIN_NS;
+	return 0;
+}
+
+/*
+ * Create a null NIC. The name may contain a %d, replaced with the
+ * first free index; the actual name is returned in name.
+ */
+static int
+nm_sink_create(char *name, const struct nm_sink_req *req)
 {
 	struct netmap_adapter na;
 	struct net_device *netdev;
-	int err;
+	struct nm_sink_req cfg;
+	struct nm_sink *s;
+	int i, err;
+
+	bzero(&cfg, sizeof(cfg));
+	cfg.magic = NM_SINK_MAGIC;
+	cfg.tx_rings = req->tx_rings ? req->tx_rings : 1;
+	cfg.rx_rings = req->rx_rings ? req->rx_rings : 1;
+	cfg.tx_slots = req->tx_slots ? req->tx_slots : NM_SINK_SLOTS;
+	cfg.rx_slots = req->rx_slots ? req->rx_slots : NM_SINK_SLOTS;
+	cfg.rx_len = req->rx_template ? req->rx_len :
+		sizeof(nm_sink_default_tmpl);
+	if (cfg.tx_rings > NM_SINK_MAX_RINGS ||
+	    cfg.rx_rings > NM_SINK_MAX_RINGS ||
+	    cfg.tx_slots < 2 || cfg.tx_slots > NM_SINK_MAX_SLOTS ||
+	    cfg.rx_slots < 2 || cfg.rx_slots > NM_SINK_MAX_SLOTS ||
+	    cfg.rx_len == 0 || cfg.rx_len > NM_SINK_MAX_LEN)
+		return EINVAL;
+	err = nm_sink_set_rates(&cfg, req);
+	if (err)
+		return err;
 
-	netdev = alloc_etherdev(0);
-	if (!netdev) {
+	netdev = alloc_etherdev_mqs(sizeof(*s), cfg.tx_rings, cfg.rx_rings);
+	if (!netdev)
 		return ENOMEM;
-	}
-	netdev->netdev_ops = &nm_sink_netdev_ops ;
-	strncpy(netdev->name, "nmsink", sizeof(netdev->name) - 1);
+	netdev->netdev_ops = &nm_sink_netdev_ops;
 	netdev->features = NETIF_F_HIGHDMA;
-	strcpy(netdev->name, "nmsink%d");
+	strncpy(netdev->name, name, sizeof(netdev->name) - 1);
+	s = netdev_priv(netdev);
+	s->netdev = netdev;
+	s->cfg = cfg;
+	nm_sink_update(s);
+
+	err = ENOMEM;
+	s->tmpl = kzalloc(cfg.rx_len, GFP_KERNEL);
+	s->tx_rings = kcalloc(cfg.tx_rings, sizeof(*s->tx_rings), GFP_KERNEL);
+	s->rx_rings = kcalloc(cfg.rx_rings, sizeof(*s->rx_rings), GFP_KERNEL);
+	if (!s->tmpl || !s->tx_rings || !s->rx_rings)
+		goto err_free;
+	for (i = 0; i < cfg.tx_rings; i++) {
+		struct nm_sink_ring *r = &s->tx_rings[i];
+
+		r->done_ns = kcalloc(cfg.tx_slots, sizeof(*r->done_ns),
+				GFP_KERNEL);
+		if (!r->done_ns)
+			goto err_free;
+		r->sink = s;
+		r->ring_id = i;
+		hrtimer_init(&r->timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+		r->timer.function = &nm_sink_tx_timer;
+	}
+	for (i = 0; i < cfg.rx_rings; i++) {
+		struct nm_sink_ring *r = &s->rx_rings[i];
+
+		r->sink = s;
+		r->ring_id = i;
+		hrtimer_init(&r->timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+		r->timer.function = &nm_sink_rx_timer;
+	}
+	if (req->rx_template) {
+		if (copyin((void *)(uintptr_t)req->rx_template, s->tmpl,
+					cfg.rx_len)) {
+			err = EFAULT;
+			goto err_free;
+		}
+	} else {
+		memcpy(s->tmpl, nm_sink_default_tmpl, cfg.rx_len);
+	}
+
 	err = register_netdev(netdev);
 	if (err) {
-		free_netdev(netdev);
+		err = -err;
+		goto err_free;
 	}
 
 	bzero(&na, sizeof(na));
 	na.ifp = netdev;
-	na.num_tx_desc = NM_SINK_SLOTS;
-	na.num_rx_desc = NM_SINK_SLOTS;
+	na.num_tx_desc = cfg.tx_slots;
+	na.num_rx_desc = cfg.rx_slots;
 	na.nm_register = nm_sink_register;
 	na.nm_txsync = nm_sink_txsync;
 	na.nm_rxsync = nm_sink_rxsync;
-	na.num_tx_rings = na.num_rx_rings = 1;
-	netmap_attach(&na);
+	na.num_tx_rings = cfg.tx_rings;
+	na.num_rx_rings = cfg.rx_rings;
+	err = netmap_attach(&na);
+	if (err) {
+		unregister_netdev(netdev);
+		goto err_free;
+	}
 
 	netif_carrier_on(netdev);
-	nm_sink_netdev = netdev;
+	list_add_tail(&s->list, &nm_sink_list);
+	strncpy(name, netdev->name, IFNAMSIZ);
 
 	return 0;
+
+err_free:
+	nm_sink_free_rings(s);
+	free_netdev(netdev);
+	return err;
 }
 
-void
-netmap_sink_fini(void)
+static void
+nm_sink_destroy(struct nm_sink *s)
 {
-	struct net_device *netdev = nm_sink_netdev;
+	struct net_device *netdev = s->netdev;
 
-	nm_sink_netdev = NULL;
+	list_del(&s->list);
+	nm_sink_timers_stop(s);
 	unregister_netdev(netdev);
 	netmap_detach(netdev);
+	nm_sink_free_rings(s);
 	free_netdev(netdev);
 }
+
+static struct nm_sink *
+nm_sink_find(const char *name)
+{
+	struct nm_sink *s;
+
+	list_for_each_entry(s, &nm_sink_list, list) {
+		if (!strncmp(s->netdev->name, name, IFNAMSIZ))
+			return s;
+	}
+	return NULL;
+}
+
+int
+nm_os_sink_config(struct nm_ifreq *nr)
+{
+	struct nm_sink_req *req = (struct nm_sink_req *)nr->data;
+	struct nm_sink *s;
+	int error = 0;
+
+	nr->nifr_name[sizeof(nr->nifr_name) - 1] = '\0';
+	if (req->cmd != NM_SINK_GET && !capable(CAP_NET_ADMIN))
+		return EPERM;
+
+	mutex_lock(&nm_sink_lock);
+	if (req->cmd == NM_SINK_CREATE) {
+		error = nm_sink_create(nr->nifr_name, req);
+		if (!error) {
+			s = nm_sink_find(nr->nifr_name);
+			*req = s->cfg;
+		}
+		goto out;
+	}
+
+	s = nm_sink_find(nr->nifr_name);
+	if (s == NULL) {
+		error = ENXIO;
+		goto out;
+	}
+	switch (req->cmd) {
+	case NM_SINK_DELETE:
+		/* NIOCREGIF runs under NMG_LOCK: once dying is set, no
+		 * one can put the interface in netmap mode */
+		NMG_LOCK();
+		if (nm_netmap_on(NA(s->netdev)))
+			error = EBUSY;
+		else
+			s->dying = 1;
+		NMG_UNLOCK();
+		if (!error)
+			nm_sink_destroy(s);
+		break;
+
+	case NM_SINK_SET:
+		error = nm_sink_set_rates(&s->cfg, req);
+		if (error)
+			break;
+		NMG_LOCK();
+		nm_sink_update(s);
+		if (nm_netmap_on(NA(s->netdev))) {
+			/* the rx timers follow the new rates */
+			int i;
+
+			for (i = 0; i < s->cfg.rx_rings; i++)
+				hrtimer_cancel(&s->rx_rings[i].timer);
+			nm_sink_rx_start(s);
+		}
+		NMG_UNLOCK();
+		/* fallthrough */
+	case NM_SINK_GET:
+		*req = s->cfg;
+		break;
+
+	default:
+		error = EINVAL;
+		break;
+	}
+out:
+	mutex_unlock(&nm_sink_lock);
+	return error;
+}
+
+int
+netmap_sink_init(void)
+{
+	struct nm_sink_req req;
+	char name[IFNAMSIZ] = "nmsink%d";
+	int err;
+
+	bzero(&req, sizeof(req));
+	if (sink_delay_ns < 0) {
+		req.flags = NM_SINK_TXSYNC;
+		req.tx_pkt_ns = -sink_delay_ns;
+	} else {
+		req.tx_pkt_ns = sink_delay_ns;
+	}
+	mutex_lock(&nm_sink_lock);
+	err = nm_sink_create(name, &req);
+	mutex_unlock(&nm_sink_lock);
+
+	return err;
+}
+
+void
+netmap_sink_fini(void)
+{
+	struct nm_sink *s, *tmp;
+
+	mutex_lock(&nm_sink_lock);
+	list_for_each_entry_safe(s, tmp, &nm_sink_list, list)
+		nm_sink_destroy(s);
+	mutex_unlock(&nm_sink_lock);
+}
 #endif  /* WITH_SINK */
 
 
@@ -58,6 +58,7 @@ struct ptnet_info;
 struct ptnet_queue {
 	struct ptnet_info *pi;
 	struct ptnet_ring *ptring;
+	int event_idx;		/* ptring layout, PTNETMAP_F_EVENT_IDX */
 	int kring_id;
 	u8* __iomem kick;
 
@@ -127,9 +128,11 @@ hang_tmr_callback(unsigned long arg)
 	struct netmap_kring *kring = na->rx_rings + prq->q.kring_id;
 	struct netmap_ring *ring = kring->ring;
 
-	pr_info("HANG RX#%d: hwc %u h %u c %u hwt %u t %u rx.guest_need_kick %u\n",
+	pr_info("HANG RX#%d: hwc %u h %u c %u hwt %u t %u rx.intr %u\n",
 		kring->ring_id, kring->nr_hwcur, ring->head, ring->cur,
-		kring->nr_hwtail, ring->tail, prq->q.ptring->guest_need_kick);
+		kring->nr_hwtail, ring->tail, prq->q.event_idx ?
+		prq->q.ptring->hwtail_event :
+		((struct ptnet_ring_legacy *)prq->q.ptring)->guest_need_kick);
 
 	if (mod_timer(&prq->hang_timer,
 		      jiffies + msecs_to_jiffies(HANG_INTVAL_MS))) {
@@ -139,12 +142,12 @@ hang_tmr_callback(unsigned long arg)
 #endif
 
 static inline void
-ptnet_sync_tail(struct ptnet_ring *ptring, struct netmap_kring *kring)
+ptnet_sync_tail(struct ptnet_queue *pq, struct netmap_kring *kring)
 {
 	struct netmap_ring *ring = kring->ring;
 
 	/* Update hwcur and hwtail as known by the host. */
-        ptnetmap_guest_read_kring_csb(ptring, kring);
+        ptnetmap_guest_read_kring_csb(pq->ptring, pq->event_idx, kring);
 
 	/* nm_sync_finalize */
 	ring->tail = kring->rtail = kring->nr_hwtail;
@@ -226,7 +229,7 @@ ptnet_start_xmit(struct sk_buff *skb, struct net_device *netdev)
 
 	/* Update hwcur and hwtail (completed TX slots) as known by the host,
 	 * by reading from CSB. */
-	ptnet_sync_tail(ptring, kring);
+	ptnet_sync_tail(pq, kring);
 
 	if (unlikely(ptnet_tx_slots(a.ring) < pi->min_tx_slots)) {
 		ND(1, "TX ring unexpected overflow, requeuing");
@@ -315,30 +318,35 @@ ptnet_start_xmit(struct sk_buff *skb, struct net_device *netdev)
 	kring->rhead = a.ring->head;
 
 	if (!XMIT_MORE(skb)) {
+		uint32_t old_head = PTNET_RING_FIELD(ptring, pq->event_idx,
+						     head);
+
 		/* Tell the host to process the new packets, updating cur and
 		 * head in the CSB. */
-		ptnetmap_guest_write_kring_csb(ptring, kring->rcur,
-					       kring->rhead);
-	}
-
-        /* Ask for a kick from a guest to the host if needed. */
-	if (NM_ACCESS_ONCE(ptring->host_need_kick)) {
-		ptring->sync_flags = NAF_FORCE_RECLAIM;
-		iowrite32(0, pq->kick);
+		ptnetmap_guest_write_kring_csb(ptring, pq->event_idx,
+					       kring->rcur, kring->rhead);
+
+		/* Ask for a kick from a guest to the host if needed. */
+		if (ptnetmap_guest_need_kick(ptring, pq->event_idx, old_head,
+					     kring->nkr_num_slots)) {
+			PTNET_RING_FIELD(ptring, pq->event_idx, sync_flags) =
+				NAF_FORCE_RECLAIM;
+			iowrite32(0, pq->kick);
+		}
 	}
 
         /* No more TX slots for further transmissions. We have to stop the
 	 * qdisc layer and enable notifications. */
 	if (ptnet_tx_slots(a.ring) < pi->min_tx_slots) {
 		netif_stop_subqueue(netdev, pq->kring_id);
-		ptring->guest_need_kick = 1;
+		ptnetmap_guest_intr_enable(ptring, pq->event_idx, 1);
 
                 /* Double check. */
-		ptnet_sync_tail(ptring, kring);
+		ptnet_sync_tail(pq, kring);
 		if (unlikely(ptnet_tx_slots(a.ring) >= pi->min_tx_slots)) {
 			/* More TX space came in the meanwhile. */
 			netif_start_subqueue(netdev, pq->kring_id);
-			ptring->guest_need_kick = 0;
+			ptnetmap_guest_intr_enable(ptring, pq->event_idx, 0);
 		}
 	}
 
@@ -406,13 +414,13 @@ ptnet_napi_schedule(struct ptnet_queue *pq)
 	/* Disable RX interrupts and schedule NAPI. */
 
 	if (likely(napi_schedule_prep(&prq->napi))) {
-		/* It's good thing to reset rx.guest_need_kick as soon as
+		/* It's good thing to reset rx.hwtail_event as soon as
 		 * possible. */
-		pq->ptring->guest_need_kick = 0;
+		ptnetmap_guest_intr_enable(pq->ptring, pq->event_idx, 0);
 		__napi_schedule(&prq->napi);
 	} else {
 		/* NAPI is already scheduled and we are ok with it. */
-		pq->ptring->guest_need_kick = 1;
+		ptnetmap_guest_intr_enable(pq->ptring, pq->event_idx, 1);
 	}
 }
 
@@ -496,7 +504,7 @@ ptnet_rx_poll(struct napi_struct *napi, int budget)
 
 	/* Update hwtail, rtail, tail and hwcur to what is known from the host,
 	 * reading from CSB. */
-	ptnet_sync_tail(ptring, kring);
+	ptnet_sync_tail(pq, kring);
 
 	kring->nr_kflags &= ~NKR_PENDINTR;
 
@@ -692,7 +700,7 @@ out_of_slots:
 		/* Budget was not fully consumed, since we have no more
 		 * completed RX slots. We can enable notifications and
 		 * exit polling mode. */
-                ptring->guest_need_kick = 1;
+                ptnetmap_guest_intr_enable(ptring, pq->event_idx, 1);
 #ifdef NETMAP_LINUX_HAVE_NAPI_COMPLETE_DONE
 		napi_complete_done(napi, work_done);
 #else
@@ -700,7 +708,7 @@ out_of_slots:
 #endif
 
                 /* Double check for more completed RX slots. */
-		ptnet_sync_tail(ptring, kring);
+		ptnet_sync_tail(pq, kring);
 		if (head != ring->tail) {
 			/* If there is more work to do, disable notifications
 			 * and reschedule. */
@@ -718,14 +726,19 @@ out_of_slots:
 		/* Tell the host (through the CSB) about the updated ring->cur and
 		 * ring->head (RX buffer refill).
 		 */
+		uint32_t old_head = PTNET_RING_FIELD(ptring, pq->event_idx,
+						     head);
+
 		ring->head = ring->cur = head;
 		kring->rcur = ring->cur;
 		kring->rhead = ring->head;
-		ptnetmap_guest_write_kring_csb(ptring, kring->rcur,
-					       kring->rhead);
+		ptnetmap_guest_write_kring_csb(ptring, pq->event_idx,
+					       kring->rcur, kring->rhead);
 		/* Kick the host if needed. */
-		if (NM_ACCESS_ONCE(ptring->host_need_kick)) {
-			ptring->sync_flags = NAF_FORCE_READ;
+		if (ptnetmap_guest_need_kick(ptring, pq->event_idx, old_head,
+					     kring->nkr_num_slots)) {
+			PTNET_RING_FIELD(ptring, pq->event_idx, sync_flags) =
+				NAF_FORCE_READ;
 			iowrite32(0, pq->kick);
 		}
 	}
@@ -1046,6 +1059,7 @@ ptnet_sync_from_csb(struct ptnet_info *pi, struct netmap_adapter *na)
 	 * CSB. */
 	for (i = 0; i < pi->num_rings; i++) {
 		struct ptnet_ring *ptring = pi->queues[i]->ptring;
+		int event_idx = pi->queues[i]->event_idx;
 		struct netmap_kring *kring;
 
 		if (i < na->num_tx_rings) {
@@ -1053,15 +1067,17 @@ ptnet_sync_from_csb(struct ptnet_info *pi, struct netmap_adapter *na)
 		} else {
 			kring = na->rx_rings + i - na->num_tx_rings;
 		}
-		kring->rhead = kring->ring->head = ptring->head;
-		kring->rcur = kring->ring->cur = ptring->cur;
-		kring->nr_hwcur = ptring->hwcur;
-		kring->nr_hwtail = kring->rtail =
-			kring->ring->tail = ptring->hwtail;
+		kring->rhead = kring->ring->head =
+			PTNET_RING_FIELD(ptring, event_idx, head);
+		kring->rcur = kring->ring->cur =
+			PTNET_RING_FIELD(ptring, event_idx, cur);
+		kring->nr_hwcur = PTNET_RING_FIELD(ptring, event_idx, hwcur);
+		kring->nr_hwtail = kring->rtail = kring->ring->tail =
+			PTNET_RING_FIELD(ptring, event_idx, hwtail);
 
 		ND("%d,%d: csb {hc %u h %u c %u ht %u}", t, i,
-		   ptring->hwcur, ptring->head, ptring->cur,
-		   ptring->hwtail);
+		   kring->nr_hwcur, kring->rhead, kring->rcur,
+		   kring->nr_hwtail);
 		ND("%d,%d: kring {hc %u rh %u rc %u h %u c %u ht %u rt %u t %u}",
 		   t, i, kring->nr_hwcur, kring->rhead, kring->rcur,
 		   kring->ring->head, kring->ring->cur, kring->nr_hwtail,
@@ -1108,7 +1124,8 @@ ptnet_nm_register(struct netmap_adapter *na, int onoff)
 		D("Exit netmap mode, re-enable interrupts");
 		for (i = 0; i < pi->num_rings; i++) {
 			ptring = pi->queues[i]->ptring;
-			ptring->guest_need_kick = 1;
+			ptnetmap_guest_intr_enable(ptring,
+					pi->queues[i]->event_idx, 1);
 		}
 		if (netif_running(netdev)) {
 			D("Exit netmap mode, schedule NAPI to flush RX ring");
@@ -1124,8 +1141,9 @@ ptnet_nm_register(struct netmap_adapter *na, int onoff)
 			/* Initialize notification enable fields in the CSB. */
 			for (i = 0; i < pi->num_rings; i++) {
 				ptring = pi->queues[i]->ptring;
-				ptring->host_need_kick = 1;
-				ptring->guest_need_kick = (i >= pi->num_tx_rings);
+				ptnetmap_guest_intr_enable(ptring,
+						pi->queues[i]->event_idx,
+						(i >= pi->num_tx_rings));
 			}
 
 			/* Set the virtio-net header length. */
@@ -1218,7 +1236,8 @@ ptnet_nm_txsync(struct netmap_kring *kring, int flags)
 	struct ptnet_queue *pq = pi->queues[kring->ring_id];
 	bool notify;
 
-	notify = netmap_pt_guest_txsync(pq->ptring, kring, flags);
+	notify = netmap_pt_guest_txsync(pq->ptring, pq->event_idx, kring,
+					flags);
 	if (notify) {
 		iowrite32(0, pq->kick);
 	}
@@ -1233,7 +1252,8 @@ ptnet_nm_rxsync(struct netmap_kring *kring, int flags)
 	struct ptnet_queue *pq = pi->rxqueues[kring->ring_id];
 	bool notify;
 
-	notify = netmap_pt_guest_rxsync(pq->ptring, kring, flags);
+	notify = netmap_pt_guest_rxsync(pq->ptring, pq->event_idx, kring,
+					flags);
 	if (notify) {
 		iowrite32(0, pq->kick);
 	}
@@ -1249,7 +1269,7 @@ ptnet_nm_intr(struct netmap_adapter *na, int onoff)
 
 	for (i = 0; i < pi->num_rings; i++) {
 		struct ptnet_queue *pq = pi->queues[i];
-		pq->ptring->guest_need_kick = onoff;
+		ptnetmap_guest_intr_enable(pq->ptring, pq->event_idx, onoff);
 	}
 }
 
@@ -1320,18 +1340,31 @@ ptnet_probe(struct pci_dev *pdev, const struct pci_device_id *ent)
 		goto err_iomap;
 	}
 
-	/* Feature negotiation with the hypervisor. */
+	num_tx_rings = ioread32(ioaddr + PTNET_IO_NUM_TX_RINGS);
+	num_rx_rings = ioread32(ioaddr + PTNET_IO_NUM_RX_RINGS);
+
+	/* Feature negotiation with the hypervisor. The CSB layout used
+	 * with event indexes holds fewer rings. */
 	if (ptnet_vnet_hdr) {
 		ptfeatures |= PTNETMAP_F_VNET_HDR;
 	}
+	if (num_tx_rings + num_rx_rings <= PTNET_CSB_MAX_RINGS(1)) {
+		ptfeatures |= PTNETMAP_F_EVENT_IDX;
+	}
 	iowrite32(ptfeatures, ioaddr + PTNET_IO_PTFEAT); /* wanted */
 	ptfeatures = ioread32(ioaddr + PTNET_IO_PTFEAT); /* acked */
 
 	/* Allocate a multi-queue Ethernet device, with space for
 	 * the adapter struct and per-ring structs. */
 	err = -ENOMEM;
-	num_tx_rings = ioread32(ioaddr + PTNET_IO_NUM_TX_RINGS);
-	num_rx_rings = ioread32(ioaddr + PTNET_IO_NUM_RX_RINGS);
+	if (num_tx_rings + num_rx_rings >
+			PTNET_CSB_MAX_RINGS(ptfeatures &
+					    PTNETMAP_F_EVENT_IDX)) {
+		pr_err("%s: %u rings do not fit in the CSB\n", __func__,
+		       num_tx_rings + num_rx_rings);
+		err = -EINVAL;
+		goto err_ptfeat;
+	}
 	queue_pairs = min(num_tx_rings, num_rx_rings);
 	netdev = alloc_etherdev_mq(sizeof(*pi) +
 				   (num_tx_rings + num_rx_rings) *
@@ -1415,7 +1448,8 @@ ptnet_probe(struct pci_dev *pdev, const struct pci_device_id *ent)
 		pq->pi = pi;
 		pq->kring_id = i;
 		pq->kick = ioaddr + PTNET_IO_KICK_BASE + 4 * i;
-		pq->ptring = pi->csb->rings + i;
+		pq->event_idx = !!(ptfeatures & PTNETMAP_F_EVENT_IDX);
+		pq->ptring = PTNET_CSB_RING(pi->csb->rings, pq->event_idx, i);
 		if (i >= num_tx_rings) {
 			pq->kring_id -= num_tx_rings;
 		}
@@ -0,0 +1,87 @@
+#!/bin/bash
+## Measure the transmit rate of the netmap generic (emulated) adapter
+## over a veth pair, with the different generic tx modes:
+##
+##   qdisc   generic_txqdisc=1 (packets go through the netmap qdisc)
+##   single  generic_txqdisc=0, generic_txbatch=0 (one dev_queue_xmit()
+##           per packet)
+##   bulk    generic_txqdisc=0, generic_txbatch=$BATCH (bursts passed
+##           to the driver with xmit_more, bypassing the qdisc)
+##
+## Usage: veth-generic-bench.sh [-p pkt-gen] [-d seconds] [-l len] [-b batch]
+##
+## The netmap module must be loaded, and pkt-gen must be in the PATH
+## (or given with -p). The script creates (and removes) the veth pair
+## nmbench0/nmbench1 and prints the rate seen by the receiver.
+
+PKTGEN=pkt-gen
+DURATION=10
+LEN=60
+BATCH=32
+IF0=nmbench0
+IF1=nmbench1
+PARAMS=/sys/module/netmap/parameters
+
+while getopts "p:d:l:b:" opt; do
+    case $opt in
+    p) PKTGEN=$OPTARG ;;
+    d) DURATION=$OPTARG ;;
+    l) LEN=$OPTARG ;;
+    b) BATCH=$OPTARG ;;
+    *) grep '^##' $0 | sed 's/^## \{0,1\}//'; exit 1 ;;
+    esac
+done
+
+if [ ! -d $PARAMS ]; then
+    echo "netmap module not loaded"
+    exit 1
+fi
+
+function param()
+{
+    echo $2 > $PARAMS/$1 || exit 1
+}
+
+SAVED_ADMODE=$(cat $PARAMS/admode)
+SAVED_TXQDISC=$(cat $PARAMS/generic_txqdisc)
+SAVED_TXBATCH=$(cat $PARAMS/generic_txbatch)
+
+function cleanup()
+{
+    ip link del $IF0 2> /dev/null
+    param admode $SAVED_ADMODE
+    param generic_txqdisc $SAVED_TXQDISC
+    param generic_txbatch $SAVED_TXBATCH
+}
+trap cleanup EXIT
+
+# one run: $1 = label, $2 = txqdisc, $3 = txbatch
+function run()
+{
+    local out
+
+    # the generic adapter reads the parameters when it is created,
+    # so use a fresh veth pair for each run
+    ip link del $IF0 2> /dev/null
+    param admode 2
+    param generic_txqdisc $2
+    param generic_txbatch $3
+    ip link add $IF0 type veth peer name $IF1 || exit 1
+    ip link set $IF0 up
+    ip link set $IF1 up
+
+    out=$(mktemp)
+    timeout -s INT $((DURATION + 3)) \
+        $PKTGEN -i netmap:$IF1 -f rx -N > $out 2>&1 &
+    sleep 1
+    timeout -s INT $DURATION \
+        $PKTGEN -i netmap:$IF0 -f tx -l $LEN -N > /dev/null 2>&1
+    wait
+    printf "%-8s %s\n" $1 "$(grep '^Speed:' $out | sed 's/ Bandwidth.*//')"
+    rm -f $out
+}
+
+echo "veth, $LEN bytes, ${DURATION}s per run"
+run qdisc 1 0
+run single 0 0
+run bulk 0 $BATCH
@@ -33,6 +33,17 @@
 #error "netmap pipes are required by veth native adapter"
 #endif /* WITH_PIPES */
 
+/*
+ * The native veth adapter works like a netmap pipe: each hw kring is
+ * cross linked with the opposite kring of the peer (tx ring i with peer
+ * rx ring i and vice versa), and the pipe txsync/rxsync move the slots
+ * between them, swapping the buffers when both ends use the same
+ * allocator (and copying them otherwise). Packets never go through the
+ * skb path of the peer. There is one ring pair per tx queue of the
+ * device ('ip link add ... numtxqueues N'), so that the traffic between
+ * two netmap applications can be spread on several rings.
+ */
+
 static int veth_open(struct ifnet *ifp);
 static int veth_close(struct ifnet *ifp);
 
@@ -249,6 +260,15 @@ veth_netmap_krings_create(struct netmap_adapter *na)
 		return ENXIO;
 	}
 
+	/* the rings are cross linked one to one */
+	if (na->num_tx_rings != peer_na->num_rx_rings ||
+			na->num_rx_rings != peer_na->num_tx_rings) {
+		D("%s and its peer have a different number of queues",
+		  na->name);
+		error = EINVAL;
+		goto err;
+	}
+
 	/* create my krings */
 	error = netmap_krings_create(na, 0);
 	if (error)
@@ -338,7 +358,7 @@ veth_netmap_attach(struct ifnet *ifp)
 	na.nm_krings_create = veth_netmap_krings_create;
 	na.nm_krings_delete = veth_netmap_krings_delete;
 	na.nm_dtor = veth_netmap_dtor;
-	na.num_tx_rings = na.num_rx_rings = 1;
+	na.num_tx_rings = na.num_rx_rings = ifp->real_num_tx_queues;
 	netmap_attach_ext(&na, sizeof(struct netmap_veth_adapter),
 			0 /* do not ovveride reg */);
 }
@@ -173,12 +173,98 @@ virtio_netmap_init_sgs(struct virtnet_info *vi)
 #endif /* VIRTIO_NOTIFY */
 
 
+#ifndef NETMAP_LINUX_VIRTIO_16_TO_CPU
+/* Before virtio 1.0 support, devices used the guest endianness. */
+#define virtio16_to_cpu(_vdev, _v)	({ (void)(_vdev); (u16)(_v); })
+#endif /* !VIRTIO_16_TO_CPU */
+
+
+#ifdef NETMAP_LINUX_VIRTIO_MULTI_QUEUE
+#define VIRTIO_NETMAP_NUM_QUEUES(_vi)	(_vi)->curr_queue_pairs
+#else  /* !MULTI_QUEUE */
+#define VIRTIO_NETMAP_NUM_QUEUES(_vi)	({ (void)(_vi); 1; })
+#endif /* !MULTI_QUEUE */
+
+
+/* Max number of netmap slots (NS_MOREFRAG chains) sent in a single
+ * virtio descriptor chain, which is published as a single indirect
+ * descriptor when the device supports them. It is limited by the
+ * scatterlists of the driver, which also hold the virtio-net header. */
+#if defined(NETMAP_LINUX_VIRTIO_MULTI_QUEUE) || defined(NETMAP_LINUX_VIRTIO_SG)
+#define VIRTIO_NETMAP_MAX_FRAGS		(MAX_SKB_FRAGS + 1)
+#else  /* !MULTI_QUEUE && !SG */
+#define VIRTIO_NETMAP_MAX_FRAGS		1
+#endif /* !MULTI_QUEUE && !SG */
+
+
 struct netmap_virtio_adapter {
 	struct netmap_hw_adapter hwna; /* base class */
 	struct virtio_net_hdr_mrg_rxbuf shared_rxvhdr ____cacheline_aligned_in_smp;
 	struct virtio_net_hdr_mrg_rxbuf shared_txvhdr ____cacheline_aligned_in_smp;
+	/* TX tokens: a chain of n slots is added with &tx_tokens[n - 1],
+	 * so that txsync knows how many slots are released when the
+	 * chain is used. */
+	char tx_tokens[VIRTIO_NETMAP_MAX_FRAGS];
+	/* Mergeable RX buffers still expected for the packet being
+	 * received on each RX ring, allocated in netmap mode. */
+	u16 *rx_frags;
 };
 
+/* Return the number of slots of a TX chain given its token, or 0 if
+ * the token is not ours (i.e., it is a sk_buff). Only the address of
+ * the adapter is used, since it may already be gone (see the
+ * virtnet_remove() patch). */
+static inline u_int
+virtio_netmap_tx_nslots(struct netmap_adapter *na, void *token)
+{
+	struct netmap_virtio_adapter *vna = (struct netmap_virtio_adapter *)na;
+	char *t = token;
+
+	if (t < vna->tx_tokens || t >= vna->tx_tokens + VIRTIO_NETMAP_MAX_FRAGS)
+		return 0;
+	return t - vna->tx_tokens + 1;
+}
+
+/* Expose a netmap buffer to the hypervisor for reception.
+ * With mergeable RX buffers, the virtio-net header of each buffer is
+ * stored at the end of the buffer itself, since it holds the number
+ * of buffers of the packet (see virtio_netmap_rxsync()). */
+static inline int
+virtio_netmap_add_rxbuf(struct netmap_adapter *na, struct virtqueue *vq,
+			struct scatterlist *sg, void *addr, size_t vnet_hdr_len,
+			int mergeable)
+{
+	struct netmap_virtio_adapter *vna = (struct netmap_virtio_adapter *)na;
+	u_int bufsize = NETMAP_BUF_SIZE(na);
+
+	if (mergeable) {
+		bufsize -= vnet_hdr_len;
+		sg_set_buf(sg, (char *)addr + bufsize, vnet_hdr_len);
+	} else {
+		sg_set_buf(sg, &vna->shared_rxvhdr, vnet_hdr_len);
+	}
+	sg_set_buf(sg + 1, addr, bufsize);
+
+	return virtqueue_add_inbuf(vq, sg, 2, na, GFP_ATOMIC);
+}
+
+/* A mergeable RX buffer that is not the first one of its packet has no
+ * virtio-net header, so the device wrote the first vnet_hdr_len bytes
+ * of data in the header area at the end of the netmap buffer. Move them
+ * in front of the rest. */
+static inline void
+virtio_netmap_rx_frag_fixup(char *addr, u_int len, size_t vnet_hdr_len,
+			    u_int bufsize)
+{
+	char tmp[sizeof(struct virtio_net_hdr_mrg_rxbuf)];
+	u_int n = len < vnet_hdr_len ? len : vnet_hdr_len;
+
+	memcpy(tmp, addr + bufsize - vnet_hdr_len, n);
+	if (len > n)
+		memmove(addr + n, addr, len - n);
+	memcpy(addr, tmp, n);
+}
+
 static void
 virtio_netmap_clean_used_rings(struct virtnet_info *vi,
 			       struct netmap_adapter *na)
@@ -192,7 +278,7 @@ virtio_netmap_clean_used_rings(struct virtnet_info *vi,
 		int n = 0;
 
 		while ((token = virtqueue_get_buf(vq, &wlen)) != NULL) {
-			if (token != na) {
+			if (!virtio_netmap_tx_nslots(na, token)) {
 				/* Not ours, it's a sk_buff,
 				 * let's free. */
 				dev_kfree_skb(token);
@@ -299,6 +385,15 @@ virtio_netmap_reg(struct netmap_adapter *na, int onoff)
 	}
 
 	if (onoff) {
+		if (hwrings_pending && vna->rx_frags == NULL) {
+			vna->rx_frags = nm_os_malloc(sizeof(*vna->rx_frags) *
+						nma_get_nrings(na, NR_RX));
+			if (vna->rx_frags == NULL) {
+				error = ENOMEM;
+				goto out;
+			}
+		}
+
 		if (hwrings_pending) {
 			/* TX shared virtio-net header must be zeroed because its
 			 * content is exposed to the host. RX shared virtio-net
@@ -367,9 +462,13 @@ virtio_netmap_reg(struct netmap_adapter *na, int onoff)
 			virtio_netmap_clean_used_rings(vi, na);
 
 			virtio_netmap_reclaim_unused(vi);
+
+			nm_os_free(vna->rx_frags);
+			vna->rx_frags = NULL;
 		}
 	}
 
+out:
 	if (was_up) {
 		/* Up the interface. This also enables the napi. */
 		virtnet_open(ifp);
@@ -387,7 +486,7 @@ virtio_netmap_txsync(struct netmap_kring *kring, int flags)
 	struct netmap_ring *ring = kring->ring;
 	u_int ring_nr = kring->ring_id;
 	u_int nm_i;	/* index into the netmap ring */
-	u_int nic_i;	/* index into the NIC ring */
+	u_int nic_i;	/* dummy, the NIC ring is not accessed */
 	u_int n;
 	u_int const lim = kring->nkr_num_slots - 1;
 	u_int const head = kring->rhead;
@@ -401,22 +500,22 @@ virtio_netmap_txsync(struct netmap_kring *kring, int flags)
 	size_t vnet_hdr_len = vi->mergeable_rx_bufs ?
 				sizeof(vna->shared_txvhdr) :
 				sizeof(vna->shared_txvhdr.hdr);
-	struct netmap_adapter *token;
+	void *token;
 	int interrupts = !(kring->nr_kflags & NKR_NOINTR);
 	int nospace = 0;
 
 	virtqueue_disable_cb(vq);
 
 	/* Free used slots. We only consider our own used buffers, recognized
-	 * by the token we passed to virtqueue_add_outbuf.
+	 * by the token we passed to virtqueue_add_outbuf, which also tells
+	 * the number of slots of the chain.
 	 */
 	n = 0;
 	for (;;) {
 		token = virtqueue_get_buf(vq, &nic_i); /* dummy 2nd arg */
 		if (token == NULL)
 			break;
-		if (likely(token == na))
-			n++;
+		n += virtio_netmap_tx_nslots(na, token);
 	}
 	kring->nr_hwtail += n;
 	if (kring->nr_hwtail > lim)
@@ -434,35 +533,70 @@ virtio_netmap_txsync(struct netmap_kring *kring, int flags)
 
 	nm_i = kring->nr_hwcur;
 	if (nm_i != head) {	/* we have new packets to send */
-		nic_i = netmap_idx_k2n(kring, nm_i);
-		for (n = 0; nm_i != head; n++) {
-			struct netmap_slot *slot = &ring->slot[nm_i];
-			u_int len = slot->len;
-			void *addr = NMB(na, slot);
+		int badpkt = 0;
 
-			NM_CHECK_ADDR_LEN(na, addr, len);
+		for (n = 0; nm_i != head; n++) {
+			u_int nfrags = 1, i;
+
+			/* A packet is made of the slots up to the first
+			 * one without NS_MOREFRAG. Stop if the last ones
+			 * have not been published yet. */
+			for (i = nm_i; ring->slot[i].flags & NS_MOREFRAG;
+					nfrags++) {
+				i = nm_next(i, lim);
+				if (unlikely(i == head))
+					break;
+			}
+			if (unlikely(i == head))
+				break;
+			if (unlikely(nfrags > VIRTIO_NETMAP_MAX_FRAGS)) {
+				RD(3, "%s: %u slots packet, max is %d",
+				   kring->name, nfrags,
+				   VIRTIO_NETMAP_MAX_FRAGS);
+				badpkt = 1;
+				break;
+			}
 
-			slot->flags &= ~(NS_REPORT | NS_BUF_CHANGED);
 			/* Initialize the scatterlist and expose it to
-			 * the hypervisor. */
+			 * the hypervisor. The whole packet uses a single
+			 * (indirect) descriptor if the device supports
+			 * indirect descriptors. */
 			COMPAT_INIT_SG(sg);
+			if (nfrags > 1)
+				sg_init_table(sg, nfrags + 1);
 			sg_set_buf(sg, &vna->shared_txvhdr, vnet_hdr_len);
-			sg_set_buf(sg + 1, addr, len);
-			nospace = virtqueue_add_outbuf(vq, sg, 2, na, GFP_ATOMIC);
+			for (i = 1; i <= nfrags; i++) {
+				struct netmap_slot *slot = &ring->slot[nm_i];
+				u_int len = slot->len;
+				void *addr = NMB(na, slot);
+
+				NM_CHECK_ADDR_LEN(na, addr, len);
+
+				slot->flags &= ~(NS_REPORT | NS_BUF_CHANGED);
+				sg_set_buf(sg + i, addr, len);
+				nm_i = nm_next(nm_i, lim);
+			}
+			nospace = virtqueue_add_outbuf(vq, sg, nfrags + 1,
+					&vna->tx_tokens[nfrags - 1], GFP_ATOMIC);
+			if (nfrags > 1)
+				sg_init_table(sg, 2);
 			if (nospace) {
 				RD(3, "virtqueue_add_outbuf failed [err=%d]",
 				   nospace);
+				/* go back to the first slot of the packet */
+				nm_i = nm_i >= nfrags ? nm_i - nfrags :
+					nm_i + lim + 1 - nfrags;
 				break;
 			}
-
-			nm_i = nm_next(nm_i, lim);
-			nic_i = nm_next(nic_i, lim);
 		}
 
 		virtqueue_kick(vq);
 
 		/* Update hwcur depending on where we stopped. */
 		kring->nr_hwcur = nm_i; /* note we migth break early */
+
+		if (unlikely(badpkt))
+			return netmap_ring_reinit(kring);
 	}
 out:
 	/* No more free virtio descriptors or netmap slots? Ask the
@@ -498,9 +632,11 @@ virtio_netmap_rxsync(struct netmap_kring *kring, int flags)
 	struct virtnet_info *vi = netdev_priv(ifp);
 	struct virtqueue *vq = GET_RX_VQ(vi, ring_nr);
 	struct scatterlist *sg = GET_RX_SG(vi, ring_nr);
-	size_t vnet_hdr_len = vi->mergeable_rx_bufs ?
+	int mergeable = vi->mergeable_rx_bufs;
+	size_t vnet_hdr_len = mergeable ?
 				sizeof(vna->shared_rxvhdr) :
 				sizeof(vna->shared_rxvhdr.hdr);
+	u_int bufsize = NETMAP_BUF_SIZE(na);
 	int interrupts = !(kring->nr_kflags & NKR_NOINTR);
 
 	/* XXX netif_carrier_ok ? */
@@ -517,16 +653,22 @@ virtio_netmap_rxsync(struct netmap_kring *kring, int flags)
 	 * matching buffers, because of free_unused_bufs() and
 	 * virtio_netmap_init_buffers(). We may need to stop early to avoid
 	 * hwtail to overrun hwcur;
+	 * With mergeable RX buffers, a packet may use several buffers, the
+	 * number being in the virtio-net header of the first one. They are
+	 * returned to netmap as a NS_MOREFRAG chain of slots.
 	 */
+retry:
 	if (netmap_no_pendintr || force_update) {
 		uint32_t hwtail_lim = nm_prev(kring->nr_hwcur, lim);
 		uint16_t slot_flags = kring->nkr_slot_flags;
+		u16 *frags = &vna->rx_frags[ring_nr];
 		struct netmap_adapter *token;
 
 
 		nm_i = kring->nr_hwtail;
 		n = 0;
 		while (nm_i != hwtail_lim) {
+			struct netmap_slot *slot = &ring->slot[nm_i];
 			int len;
 			token = virtqueue_get_buf(vq, &len);
 			if (token == NULL)
@@ -537,20 +679,36 @@ virtio_netmap_rxsync(struct netmap_kring *kring, int flags)
 			if (unlikely(token != na)) {
 				RD(5, "Received unexpected virtqueue token %p\n",
 						token);
-			} else {
-				/* Skip the virtio-net header. */
+				continue;
+			}
+			if (*frags == 0) {
+				/* First buffer, skip the virtio-net header. */
 				len -= vnet_hdr_len;
 				if (unlikely(len < 0)) {
 					RD(5, "Truncated virtio-net-header, missing %d"
 							" bytes", -len);
 					len = 0;
 				}
+				if (mergeable) {
+					struct virtio_net_hdr_mrg_rxbuf *vh =
+						(void *)((char *)NMB(na, slot) +
+						bufsize - vnet_hdr_len);
 
-				ring->slot[nm_i].len = len;
-				ring->slot[nm_i].flags = slot_flags;
-				nm_i = nm_next(nm_i, lim);
-				n++;
+					*frags = virtio16_to_cpu(vi->vdev,
+							vh->num_buffers);
+				}
+				if (*frags == 0)
+					*frags = 1;
+			} else {
+				virtio_netmap_rx_frag_fixup(NMB(na, slot), len,
+						vnet_hdr_len, bufsize);
 			}
+			(*frags)--;
+
+			slot->len = len;
+			slot->flags = slot_flags | (*frags ? NS_MOREFRAG : 0);
+			nm_i = nm_next(nm_i, lim);
+			n++;
 		}
 		kring->nr_hwtail = nm_i;
 		kring->nr_kflags &= ~NKR_PENDINTR;
@@ -578,9 +736,8 @@ virtio_netmap_rxsync(struct netmap_kring *kring, int flags)
 			/* Initialize the scatterlist and expose it to
 			 * the hypervisor. */
 			COMPAT_INIT_SG(sg);
-			sg_set_buf(sg, &vna->shared_rxvhdr, vnet_hdr_len);
-			sg_set_buf(sg + 1, addr, NETMAP_BUF_SIZE(na));
-			nospace = virtqueue_add_inbuf(vq, sg, 2, na, GFP_ATOMIC);
+			nospace = virtio_netmap_add_rxbuf(na, vq, sg, addr,
+					vnet_hdr_len, mergeable);
 			if (nospace) {
 				RD(3, "virtqueue_add_inbuf failed [err=%d]",
 				   nospace);
@@ -595,10 +752,16 @@ virtio_netmap_rxsync(struct netmap_kring *kring, int flags)
 
 	/* We have finished processing used RX buffers, so we have to tell
 	 * the hypervisor to make a call when more used RX buffers will be
-	 * ready.
+	 * ready. With VIRTIO_RING_F_EVENT_IDX this only moves the used event
+	 * index of this queue. If some buffers were used in the meantime no
+	 * interrupt is coming for them, so import them now, unless the ring
+	 * is full.
 	 */
-	if (interrupts) {
-		virtqueue_enable_cb(vq);
+	if (interrupts && !virtqueue_enable_cb(vq) &&
+			kring->nr_hwtail != nm_prev(kring->nr_hwcur, lim)) {
+		virtqueue_disable_cb(vq);
+		force_update = 1;
+		goto retry;
 	}
 
 
@@ -638,6 +801,7 @@ virtio_netmap_init_buffers(struct virtnet_info *vi)
 		if (!slot) {
 			continue;
 		}
+		vna->rx_frags[r] = 0;
 
 		/*
 		 * Add exactly na->num_rx_desc descriptor chains to this RX
@@ -654,9 +818,8 @@ virtio_netmap_init_buffers(struct virtnet_info *vi)
 			slot = &ring->slot[i];
 			addr = NMB(na, slot);
 			COMPAT_INIT_SG(sg);
-			sg_set_buf(sg, &vna->shared_rxvhdr, vnet_hdr_len);
-			sg_set_buf(sg + 1, addr, NETMAP_BUF_SIZE(na));
-			err = virtqueue_add_inbuf(vq, sg, 2, na, GFP_ATOMIC);
+			err = virtio_netmap_add_rxbuf(na, vq, sg, addr,
+					vnet_hdr_len, vi->mergeable_rx_bufs);
 			if (err < 0) {
 				D("virtqueue_add_inbuf failed");
 
@@ -708,9 +871,8 @@ virtio_netmap_config(struct netmap_adapter *na, u_int *txr, u_int *txd,
 	struct ifnet *ifp = na->ifp;
 	struct virtnet_info *vi = netdev_priv(ifp);
 
-	*txr = ifp->real_num_tx_queues;
+	*txr = *rxr = VIRTIO_NETMAP_NUM_QUEUES(vi);
 	*txd = virtqueue_get_vring_size(GET_TX_VQ(vi, 0));
-	*rxr = 1;
 	*rxd = virtqueue_get_vring_size(GET_RX_VQ(vi, 0));
 	D("virtio config txq=%d, txd=%d rxq=%d, rxd=%d",
 			*txr, *txd, *rxr, *rxd);
@@ -729,7 +891,7 @@ virtio_netmap_attach(struct virtnet_info *vi)
 	na.ifp = vi->dev;
 	na.num_tx_desc = virtqueue_get_vring_size(GET_TX_VQ(vi, 0));
 	na.num_rx_desc = virtqueue_get_vring_size(GET_RX_VQ(vi, 0));
-	na.num_tx_rings = na.num_rx_rings = 1;
+	na.num_tx_rings = na.num_rx_rings = VIRTIO_NETMAP_NUM_QUEUES(vi);
 	na.nm_register = virtio_netmap_reg;
 	na.nm_txsync = virtio_netmap_txsync;
 	na.nm_rxsync = virtio_netmap_rxsync;
@@ -744,6 +906,6 @@ virtio_netmap_attach(struct virtnet_info *vi)
 
 	D("virtio attached txq=%d, txd=%d rxq=%d, rxd=%d",
 			na.num_tx_rings, na.num_tx_desc,
-			na.num_tx_rings, na.num_rx_desc);
+			na.num_rx_rings, na.num_rx_desc);
 }
 /* end of file */
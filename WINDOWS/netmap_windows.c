@@ -197,6 +197,7 @@ win_make_mbuf(struct net_device *ifp, uint32_t length, const char *data)
 		return NULL;
 	}
 	m->dev = ifp;
+	m->m_tstamp = 0;
 	if (data) // XXX otherwise zero memory ?
 		RtlCopyMemory(m->pkt, data, length);
 	return m;
@@ -381,6 +382,16 @@ nm_os_generic_xmit_frame(struct nm_os_gen_arg *a)
 	return -1;
 }
 
+/*
+ * Bulk mode is not supported (gna->txbatch is 0): packets are chained
+ * by nm_os_generic_xmit_frame() itself and injected on the final call.
+ */
+int
+nm_os_generic_xmit_burst(struct nm_os_gen_arg *a)
+{
+	return 0;
+}
+
 /*
  * XXX We do not know how many descriptors and rings we have yet
  */
@@ -406,7 +417,10 @@ nm_os_generic_set_features(struct netmap_generic_adapter *gna)
 {
 	/* No support for now. */
 	gna->rxsg = 0;
+	gna->txsg = 0;
 	gna->txqdisc = 0;
+	gna->txbatch = 0;
+	gna->vnethdr = 0;
 }
 //
 
@@ -939,11 +953,7 @@ generic_timer_handler(struct hrtimer *t)
 	* a notification.
 	*/
 	mit->mit_pending = 0;
-	/* below is a variation of netmap_generic_irq  XXX revise */
-	if (nm_netmap_on(mit->mit_na)) {
-		netmap_common_irq(mit->mit_na, mit->mit_ring_idx, &work_done);
-		generic_rate(0, 0, 0, 0, 0, 1);
-	}
+	netmap_generic_irq(mit->mit_na, mit->mit_ring_idx, &work_done);
 	nm_os_mitigation_restart(mit);
 	return HRTIMER_RESTART;
 #endif
@@ -994,6 +1004,24 @@ void nm_os_mitigation_cleanup(struct nm_generic_mit *mit)
 	//hrtimer_cancel(&mit->mit_timer);
 }
 
+/* No tx doorbell timer yet, native drivers always ring the doorbell. */
+int
+nm_os_txdb_init(struct nm_txdb *db)
+{
+	return EOPNOTSUPP;
+}
+
+int
+nm_os_txdb_arm(struct nm_txdb *db, u_int usecs)
+{
+	return EOPNOTSUPP;
+}
+
+void
+nm_os_txdb_fini(struct nm_txdb *db)
+{
+}
+
 u_int
 nm_os_ncpus(void)
 {
@@ -1006,6 +1034,42 @@ nm_os_mbuf_has_offld(struct mbuf *m)
 	return 0;  // TODO
 }
 
+int
+nm_os_mbuf_vnet_hdr_get(struct mbuf *m, struct nm_vnet_hdr *vh)
+{
+	RtlZeroMemory(vh, sizeof(*vh));
+	return 0;  // TODO
+}
+
+int
+nm_os_mbuf_vnet_hdr_set(struct mbuf *m, const struct nm_vnet_hdr *vh)
+{
+	return (vh->gso_type || vh->flags) ? -1 : 0;  // TODO
+}
+
+uint64_t
+nm_os_timestamp_ns(void)
+{
+	LARGE_INTEGER t;
+
+	/* 100ns units since January 1, 1601, convert to the unix epoch */
+	KeQuerySystemTime(&t);
+	return ((uint64_t)t.QuadPart - 116444736000000000ULL) * 100;
+}
+
+void
+nm_os_mbuf_timestamp_set(struct mbuf *m)
+{
+	if (m->m_tstamp == 0)
+		m->m_tstamp = nm_os_timestamp_ns();
+}
+
+uint64_t
+nm_os_mbuf_timestamp(struct mbuf *m)
+{
+	return m->m_tstamp ? m->m_tstamp : nm_os_timestamp_ns();
+}
+
 void
 nm_os_get_module(void)
 {
@@ -1029,6 +1093,12 @@ nm_os_kctx_worker_setaff(struct nm_kctx *nmk, int affinity)
 	// TODO
 }
 
+int
+nm_os_kctx_worker_shared(struct nm_kctx *nmk)
+{
+	return 0;
+}
+
 struct nm_kctx *
 nm_os_kctx_create(struct nm_kctx_cfg *cfg, unsigned int cfgtype,
 		     void *opaque)
@@ -288,6 +288,7 @@ struct mbuf {
 	uint32_t		m_len;
 	struct net_device	*dev;
 	PVOID			pkt;
+	uint64_t		m_tstamp;	/* arrival time (ns), 0 if unset */
 	void*(*netmap_default_mbuf_destructor)(struct mbuf *m);
 };
 
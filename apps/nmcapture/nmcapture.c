@@ -0,0 +1,939 @@
+/*
+ * Copyright (C) 2017 Universita` di Pisa. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *   1. Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * nmcapture: capture the traffic of a netmap port to pcap or pcapng files.
+ *
+ * The traffic is taken from copy or zero-copy monitors, one per ring of
+ * the port (or from any netmap port opened as is, e.g. a pipe endpoint),
+ * and the rings are spread among a number of workers. Each worker has a
+ * capture thread, which formats the packets into large buffers, and a
+ * writer thread, which writes the full buffers to the worker's own files.
+ * The two threads use double buffering, so the capture thread only waits
+ * if the disk cannot keep up, and the monitor rings (which count what
+ * they lose) absorb the bursts.
+ *
+ * Buffers are written with aligned sizes and offsets, so the files can be
+ * opened with O_DIRECT and bypass the page cache. The tail of a buffer
+ * that does not fill a whole block is carried over to the next buffer,
+ * and the last block of a file is padded and then truncated.
+ */
+
+#define NETMAP_WITH_LIBS
+#include <net/netmap_user.h>
+#include <net/netmap.h>
+
+#include <errno.h>
+#include <stdio.h>
+#include <inttypes.h>	/* PRI* macros */
+#include <string.h>	/* strcmp */
+#include <fcntl.h>	/* open */
+#include <unistd.h>	/* close, pwrite, ftruncate */
+#include <signal.h>	/* signal */
+#include <stdlib.h>	/* atoi, calloc, posix_memalign */
+#include <libgen.h>	/* basename */
+#include <pthread.h>
+#include <sys/ioctl.h>	/* ioctl */
+#include <sys/poll.h>
+#include <sys/time.h>
+
+#ifndef O_DIRECT
+#define O_DIRECT 0	/* not available, use the page cache */
+#endif
+
+#define NMC_ALIGN	4096		/* O_DIRECT block alignment */
+#define NMC_NBUFS	2		/* buffers per worker */
+#define NMC_DEF_BUFSIZE	(4 << 20)	/* default size of the buffers */
+#define NMC_MAX_SOURCES	128		/* rings per port, or ports */
+#define NMC_MAX_WORKERS	64
+#define NMC_DEF_WORKERS	4
+#define NMC_MAX_SNAPLEN	65535
+#define NMC_BENCH_PORT	"vale-nmcapture:gen"
+
+enum { FMT_PCAP, FMT_PCAPNG };
+enum { MODE_COPY, MODE_ZCOPY, MODE_RAW };
+
+/* pcap file header, nanosecond timestamps */
+#define PCAP_MAGIC_NS	0xa1b23c4d
+struct pcap_hdr {
+	uint32_t	magic;
+	uint16_t	version_major;
+	uint16_t	version_minor;
+	int32_t		thiszone;
+	uint32_t	sigfigs;
+	uint32_t	snaplen;
+	uint32_t	linktype;
+};
+
+struct pcap_rec {
+	uint32_t	ts_sec;
+	uint32_t	ts_nsec;
+	uint32_t	caplen;
+	uint32_t	len;
+};
+
+/* pcapng blocks (section header, interface description with
+ * nanosecond resolution, enhanced packet)
+ */
+#define PCAPNG_SHB	0x0a0d0d0a
+#define PCAPNG_IDB	0x00000001
+#define PCAPNG_EPB	0x00000006
+#define PCAPNG_BOM	0x1a2b3c4d
+
+struct pcapng_shb {
+	uint32_t	type;
+	uint32_t	total_len;
+	uint32_t	bom;
+	uint16_t	major;
+	uint16_t	minor;
+	int64_t		section_len;
+	uint32_t	total_len2;
+} __attribute__((packed));
+
+struct pcapng_idb {
+	uint32_t	type;
+	uint32_t	total_len;
+	uint16_t	linktype;
+	uint16_t	reserved;
+	uint32_t	snaplen;
+	uint16_t	opt_tsresol;	/* if_tsresol = 9, nanoseconds */
+	uint16_t	opt_tsresol_len;
+	uint8_t		tsresol;
+	uint8_t		pad[3];
+	uint32_t	opt_end;
+	uint32_t	total_len2;
+};
+
+struct pcapng_epb {
+	uint32_t	type;
+	uint32_t	total_len;
+	uint32_t	ifid;
+	uint32_t	ts_high;
+	uint32_t	ts_low;
+	uint32_t	caplen;
+	uint32_t	len;
+	/* followed by the data, padded to 32 bits, and total_len */
+};
+
+struct nmc_source {
+	char name[128];
+	struct nm_desc *d;
+	int copymon;		/* copy monitor, with kernel counters */
+	int meta;		/* frames start with a struct nm_mon_meta */
+};
+
+struct nmc_buf {
+	char *data;
+	size_t len;		/* bytes used */
+	int new_file;		/* the first buffer of a new file */
+	int last;		/* the last buffer of the file */
+};
+
+struct nmc_worker {
+	int id;
+	pthread_t capture_th;
+	pthread_t writer_th;
+
+	struct nmc_source *src[NMC_MAX_SOURCES];
+	int nsrc;
+
+	/* buffers are filled by the capture thread in circular order,
+	 * and written by the writer thread in the same order
+	 */
+	struct nmc_buf bufs[NMC_NBUFS];
+	int fill;		/* being filled */
+	int nfull;		/* waiting for the writer */
+	int next_write;		/* next buffer for the writer */
+	int done;		/* no more buffers will come */
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+
+	/* capture thread: bytes in the current file, including
+	 * the ones still in the buffers
+	 */
+	uint64_t file_bytes;
+
+	/* writer thread */
+	int fd;
+	unsigned int file_seq;
+	uint64_t file_pos;
+
+	/* counters, read by the main thread without locking */
+	uint64_t pkts;
+	uint64_t bytes;
+	uint64_t written;
+	uint64_t stalls;	/* waits for a free buffer */
+	int error;
+};
+
+static struct {
+	const char *prefix;
+	int format;
+	int mode;
+	int direct;
+	int nworkers;
+	size_t bufsize;
+	uint64_t rotate;	/* bytes per file, 0 = no rotation */
+	unsigned int max_files;	/* files per worker, 0 = no limit */
+	unsigned int snaplen;
+	int interval;
+	int duration;
+	int bench;
+	int bench_len;
+
+	struct nmc_source src[NMC_MAX_SOURCES];
+	int nsrc;
+	struct nmc_worker *workers;
+	struct nm_desc *bench_d;
+} g;
+
+static volatile int do_abort;
+
+static void
+sigint_h(int sig)
+{
+	(void)sig;
+	do_abort = 1;
+	signal(SIGINT, SIG_DFL);
+}
+
+/*
+ * Writer side.
+ */
+
+static const char *
+fmt_ext(void)
+{
+	return g.format == FMT_PCAPNG ? "pcapng" : "pcap";
+}
+
+static int
+writer_open(struct nmc_worker *w)
+{
+	char path[1024];
+	unsigned int seq = w->file_seq++;
+
+	if (g.max_files)
+		seq %= g.max_files;
+	if (g.nworkers == 1 && g.rotate == 0)
+		snprintf(path, sizeof(path), "%s", g.prefix);
+	else
+		snprintf(path, sizeof(path), "%s-%d-%04u.%s", g.prefix,
+			w->id, seq, fmt_ext());
+	w->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC |
+			(g.direct ? O_DIRECT : 0), 0644);
+	if (w->fd < 0 && g.direct && errno == EINVAL) {
+		/* e.g. tmpfs does not support O_DIRECT */
+		D("%s: O_DIRECT not supported, using the page cache", path);
+		g.direct = 0;
+		w->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	}
+	if (w->fd < 0) {
+		D("cannot open %s: %s", path, strerror(errno));
+		return -1;
+	}
+	w->file_pos = 0;
+	return 0;
+}
+
+static int
+writer_write(struct nmc_worker *w, struct nmc_buf *b)
+{
+	size_t len = b->len, done = 0;
+
+	if (b->last && g.direct && (len & (NMC_ALIGN - 1))) {
+		/* pad the last block, the file is truncated later */
+		size_t padded = (len + NMC_ALIGN - 1) & ~(size_t)(NMC_ALIGN - 1);
+
+		memset(b->data + len, 0, padded - len);
+		len = padded;
+	}
+	while (done < len) {
+		ssize_t ret = pwrite(w->fd, b->data + done, len - done,
+				w->file_pos + done);
+
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			D("worker %d: write error: %s", w->id, strerror(errno));
+			return -1;
+		}
+		done += ret;
+	}
+	w->file_pos += b->len;
+	w->written += b->len;
+	if (b->last) {
+		if (len != b->len && ftruncate(w->fd, w->file_pos) < 0) {
+			D("worker %d: truncate error: %s", w->id,
+				strerror(errno));
+			return -1;
+		}
+		close(w->fd);
+		w->fd = -1;
+	}
+	return 0;
+}
+
+static void *
+writer_body(void *arg)
+{
+	struct nmc_worker *w = arg;
+
+	for (;;) {
+		struct nmc_buf *b;
+
+		pthread_mutex_lock(&w->lock);
+		while (w->nfull == 0 && !w->done)
+			pthread_cond_wait(&w->cond, &w->lock);
+		if (w->nfull == 0) {
+			pthread_mutex_unlock(&w->lock);
+			break;
+		}
+		b = &w->bufs[w->next_write];
+		pthread_mutex_unlock(&w->lock);
+
+		if (!w->error) {
+			if (b->new_file && writer_open(w) < 0)
+				w->error = 1;
+			else if (writer_write(w, b) < 0)
+				w->error = 1;
+			if (w->error)
+				do_abort = 1;
+		}
+
+		pthread_mutex_lock(&w->lock);
+		b->len = 0;
+		b->new_file = b->last = 0;
+		w->next_write = (w->next_write + 1) % NMC_NBUFS;
+		w->nfull--;
+		pthread_cond_broadcast(&w->cond);
+		pthread_mutex_unlock(&w->lock);
+	}
+	if (w->fd >= 0)
+		close(w->fd);
+	return NULL;
+}
+
+/*
+ * Capture side.
+ */
+
+/* Pass the current buffer to the writer and move to the next one.
+ * Unless the buffer ends the file, only whole blocks are written,
+ * and the tail moves to the next buffer.
+ */
+static void
+capture_flush(struct nmc_worker *w, int last)
+{
+	struct nmc_buf *b = &w->bufs[w->fill], *nb;
+	int next = (w->fill + 1) % NMC_NBUFS;
+	size_t tail = 0;
+
+	if (b->len == 0 && !b->new_file)
+		return;
+	pthread_mutex_lock(&w->lock);
+	if (w->nfull == NMC_NBUFS - 1) {
+		w->stalls++;
+		while (w->nfull == NMC_NBUFS - 1)
+			pthread_cond_wait(&w->cond, &w->lock);
+	}
+	pthread_mutex_unlock(&w->lock);
+
+	nb = &w->bufs[next];
+	if (last) {
+		b->last = 1;
+	} else {
+		tail = b->len & (NMC_ALIGN - 1);
+		b->len -= tail;
+		memcpy(nb->data, b->data + b->len, tail);
+	}
+	nb->len = tail;
+
+	pthread_mutex_lock(&w->lock);
+	w->nfull++;
+	w->fill = next;
+	pthread_cond_broadcast(&w->cond);
+	pthread_mutex_unlock(&w->lock);
+}
+
+/* start a new file in the current (empty) buffer */
+static void
+capture_file_start(struct nmc_worker *w)
+{
+	struct nmc_buf *b = &w->bufs[w->fill];
+	unsigned int snaplen = g.snaplen ? g.snaplen : NMC_MAX_SNAPLEN;
+
+	b->new_file = 1;
+	if (g.format == FMT_PCAP) {
+		struct pcap_hdr *h = (struct pcap_hdr *)(b->data + b->len);
+
+		h->magic = PCAP_MAGIC_NS;
+		h->version_major = 2;
+		h->version_minor = 4;
+		h->thiszone = 0;
+		h->sigfigs = 0;
+		h->snaplen = snaplen;
+		h->linktype = 1; /* ethernet */
+		b->len += sizeof(*h);
+	} else {
+		struct pcapng_shb *s = (struct pcapng_shb *)(b->data + b->len);
+		struct pcapng_idb *i = (struct pcapng_idb *)(s + 1);
+
+		s->type = PCAPNG_SHB;
+		s->total_len = s->total_len2 = sizeof(*s);
+		s->bom = PCAPNG_BOM;
+		s->major = 1;
+		s->minor = 0;
+		s->section_len = -1;
+		memset(i, 0, sizeof(*i));
+		i->type = PCAPNG_IDB;
+		i->total_len = i->total_len2 = sizeof(*i);
+		i->linktype = 1; /* ethernet */
+		i->snaplen = snaplen;
+		i->opt_tsresol = 9;
+		i->opt_tsresol_len = 1;
+		i->tsresol = 9; /* 10^-9 */
+		b->len += sizeof(*s) + sizeof(*i);
+	}
+	w->file_bytes = b->len;
+}
+
+static void
+capture_put(struct nmc_worker *w, uint64_t ts, const char *pkt,
+		unsigned int caplen, unsigned int len)
+{
+	struct nmc_buf *b = &w->bufs[w->fill];
+	size_t rec;
+
+	if (g.format == FMT_PCAP)
+		rec = sizeof(struct pcap_rec) + caplen;
+	else
+		rec = sizeof(struct pcapng_epb) + ((caplen + 3) & ~3) + 4;
+
+	if (g.rotate && w->file_bytes + rec > g.rotate &&
+			w->file_bytes > NMC_ALIGN) {
+		capture_flush(w, 1);
+		capture_file_start(w);
+		b = &w->bufs[w->fill];
+	}
+	if (b->len + rec > g.bufsize) {
+		capture_flush(w, 0);
+		b = &w->bufs[w->fill];
+	}
+
+	if (g.format == FMT_PCAP) {
+		struct pcap_rec *r = (struct pcap_rec *)(b->data + b->len);
+
+		r->ts_sec = ts / 1000000000;
+		r->ts_nsec = ts % 1000000000;
+		r->caplen = caplen;
+		r->len = len;
+		memcpy(r + 1, pkt, caplen);
+	} else {
+		struct pcapng_epb *e = (struct pcapng_epb *)(b->data + b->len);
+		char *p = (char *)(e + 1);
+
+		e->type = PCAPNG_EPB;
+		e->total_len = rec;
+		e->ifid = 0;
+		e->ts_high = ts >> 32;
+		e->ts_low = ts & 0xffffffff;
+		e->caplen = caplen;
+		e->len = len;
+		memcpy(p, pkt, caplen);
+		memset(p + caplen, 0, ((caplen + 3) & ~3) - caplen);
+		memcpy(p + ((caplen + 3) & ~3), &e->total_len, 4);
+	}
+	b->len += rec;
+	w->file_bytes += rec;
+	w->pkts++;
+	w->bytes += len;
+}
+
+static void
+capture_ring(struct nmc_worker *w, struct nmc_source *s,
+		struct netmap_ring *ring)
+{
+	uint64_t ring_ts = ring->ts.tv_sec * 1000000000ULL +
+		ring->ts.tv_usec * 1000ULL;
+	uint32_t head = ring->head;
+	uint32_t n = nm_ring_space(ring);
+
+	for ( ; n; n--, head = nm_ring_next(ring, head)) {
+		struct netmap_slot *slot = &ring->slot[head];
+		const char *p = NETMAP_BUF(ring, slot->buf_idx);
+		unsigned int caplen = slot->len, len = slot->len;
+		uint64_t ts = ring_ts;
+
+		if (s->meta) {
+			const struct nm_mon_meta *m =
+				(const struct nm_mon_meta *)p;
+
+			if (caplen < sizeof(*m))
+				continue;
+			ts = m->ts;
+			len = m->len;
+			p += sizeof(*m);
+			caplen -= sizeof(*m);
+		}
+		if (g.snaplen && caplen > g.snaplen)
+			caplen = g.snaplen; /* the kernel could not do it */
+		capture_put(w, ts, p, caplen, len);
+	}
+	ring->head = ring->cur = head;
+}
+
+static void *
+capture_body(void *arg)
+{
+	struct nmc_worker *w = arg;
+	struct pollfd pfd[NMC_MAX_SOURCES];
+	int i;
+
+	capture_file_start(w);
+	while (!do_abort) {
+		for (i = 0; i < w->nsrc; i++) {
+			pfd[i].fd = w->src[i]->d->fd;
+			pfd[i].events = POLLIN;
+			pfd[i].revents = 0;
+		}
+		if (poll(pfd, w->nsrc, 500) < 0) {
+			if (errno == EINTR)
+				continue;
+			D("worker %d: poll error: %s", w->id, strerror(errno));
+			break;
+		}
+		for (i = 0; i < w->nsrc; i++) {
+			struct nm_desc *d = w->src[i]->d;
+			int r;
+
+			if (pfd[i].revents & POLLERR) {
+				D("worker %d: error on %s", w->id,
+					w->src[i]->name);
+				do_abort = 1;
+				break;
+			}
+			for (r = d->first_rx_ring; r <= d->last_rx_ring; r++)
+				capture_ring(w, w->src[i],
+					NETMAP_RXRING(d->nifp, r));
+		}
+	}
+	capture_flush(w, 1);
+
+	pthread_mutex_lock(&w->lock);
+	w->done = 1;
+	pthread_cond_broadcast(&w->cond);
+	pthread_mutex_unlock(&w->lock);
+	return NULL;
+}
+
+/*
+ * Drops counted by the copy monitors (see NM_MONSAMPLE_MAGIC).
+ * Returns -1 if the source has no counters.
+ */
+static int64_t
+source_drops(struct nmc_source *s)
+{
+	struct nm_ifreq ifr;
+	struct nm_mon_sampling *req = (struct nm_mon_sampling *)ifr.data;
+
+	if (!s->copymon)
+		return -1;
+	memset(&ifr, 0, sizeof(ifr));
+	memcpy(ifr.nifr_name, s->d->req.nr_name, sizeof(ifr.nifr_name));
+	req->magic = NM_MONSAMPLE_MAGIC;
+	req->flags = NM_MONSAMPLE_GET;
+	if (ioctl(s->d->fd, NIOCCONFIG, &ifr) < 0)
+		return -1;
+	return req->overflows + req->capped;
+}
+
+/*
+ * Benchmark mode: a thread transmits as fast as it can on a VALE
+ * port, and we capture from a copy monitor on its tx ring.
+ */
+static void *
+bench_body(void *arg)
+{
+	struct nm_desc *d = arg;
+	struct netmap_ring *ring = NETMAP_TXRING(d->nifp, d->first_tx_ring);
+	struct pollfd pfd = { .fd = d->fd, .events = POLLOUT };
+	char frame[2048];
+	unsigned int i;
+
+	memset(frame, 0, sizeof(frame));
+	memset(frame, 0xff, 6);		/* broadcast */
+	frame[12] = 0x08;		/* IPv4 ethertype */
+	for (i = 14; i < (unsigned int)g.bench_len; i++)
+		frame[i] = i;
+
+	while (!do_abort) {
+		uint32_t head = ring->head, n = nm_ring_space(ring);
+
+		if (n == 0) {
+			poll(&pfd, 1, 500);
+			continue;
+		}
+		for ( ; n; n--, head = nm_ring_next(ring, head)) {
+			struct netmap_slot *slot = &ring->slot[head];
+
+			nm_pkt_copy(frame, NETMAP_BUF(ring, slot->buf_idx),
+					g.bench_len);
+			slot->len = g.bench_len;
+		}
+		ring->head = ring->cur = head;
+		ioctl(d->fd, NIOCTXSYNC, NULL);
+	}
+	return NULL;
+}
+
+/* add the sources of one port, according to the mode */
+static int
+add_port(const char *port)
+{
+	struct nmreq nmr;
+	struct nm_desc tmp;
+	char err[MAXERRMSG], flags[32];
+	int fd, nrings, r;
+
+	if (g.mode == MODE_RAW) {
+		if (g.nsrc == NMC_MAX_SOURCES)
+			return -1;
+		snprintf(g.src[g.nsrc++].name, sizeof(g.src[0].name), "%s",
+				port);
+		return 0;
+	}
+
+	/* one monitor for each ring of the port */
+	memset(&tmp, 0, sizeof(tmp));
+	if (nm_parse(port, &tmp, err) < 0) {
+		D("%s: %s", port, err);
+		return -1;
+	}
+	memset(&nmr, 0, sizeof(nmr));
+	memcpy(nmr.nr_name, tmp.req.nr_name, sizeof(nmr.nr_name));
+	nmr.nr_version = NETMAP_API;
+	fd = open("/dev/netmap", O_RDWR);
+	if (fd < 0) {
+		D("/dev/netmap: %s", strerror(errno));
+		return -1;
+	}
+	if (ioctl(fd, NIOCGINFO, &nmr) < 0) {
+		D("%s: %s", port, strerror(errno));
+		close(fd);
+		return -1;
+	}
+	close(fd);
+	nrings = nmr.nr_rx_rings > nmr.nr_tx_rings ?
+		nmr.nr_rx_rings : nmr.nr_tx_rings;
+
+	if (g.mode == MODE_ZCOPY) {
+		snprintf(flags, sizeof(flags), "z");
+	} else {
+		/* the generator of the benchmark only transmits */
+		snprintf(flags, sizeof(flags), "%sm", g.bench ? "t" : "rt");
+		if (g.snaplen)
+			snprintf(flags + strlen(flags),
+				sizeof(flags) - strlen(flags), "s%u", g.snaplen);
+	}
+	for (r = 0; r < nrings; r++) {
+		struct nmc_source *s;
+
+		if (g.nsrc == NMC_MAX_SOURCES)
+			return -1;
+		s = &g.src[g.nsrc++];
+		snprintf(s->name, sizeof(s->name), "%s-%d/%s", port, r, flags);
+		s->copymon = s->meta = (g.mode == MODE_COPY);
+	}
+	return 0;
+}
+
+static void
+print_stats(uint64_t *prev_pkts, uint64_t *prev_bytes, uint64_t *prev_written,
+		double dt)
+{
+	uint64_t pkts = 0, bytes = 0, written = 0, stalls = 0;
+	int64_t drops = 0;
+	int i, have_drops = 0;
+
+	for (i = 0; i < g.nworkers; i++) {
+		pkts += g.workers[i].pkts;
+		bytes += g.workers[i].bytes;
+		written += g.workers[i].written;
+		stalls += g.workers[i].stalls;
+	}
+	for (i = 0; i < g.nsrc; i++) {
+		int64_t d = source_drops(&g.src[i]);
+
+		if (d >= 0) {
+			drops += d;
+			have_drops = 1;
+		}
+	}
+	if (dt > 0) {
+		printf("%.3f Mpps %.3f Gbps, writing %.1f MB/s",
+			(pkts - *prev_pkts) / dt / 1e6,
+			(bytes - *prev_bytes) * 8 / dt / 1e9,
+			(written - *prev_written) / dt / 1e6);
+	} else {
+		printf("%" PRIu64 " packets %" PRIu64 " bytes, "
+			"%" PRIu64 " bytes written", pkts, bytes, written);
+	}
+	if (have_drops)
+		printf(", %" PRId64 " dropped", drops);
+	else
+		printf(", drops unknown");
+	printf(", %" PRIu64 " stalls\n", stalls);
+	fflush(stdout);
+	*prev_pkts = pkts;
+	*prev_bytes = bytes;
+	*prev_written = written;
+}
+
+static void
+usage(const char *command)
+{
+	fprintf(stderr,
+		"Usage:\n"
+		"%s -i port [-i port ...] -w prefix [options]\n"
+		"\t-i port	port to capture from (netmap:eth0, vale0:p, ...)\n"
+		"\t-w prefix	output file, or prefix of the output files\n"
+		"\t-n		write pcapng instead of pcap\n"
+		"\t-z		use zero-copy monitors\n"
+		"\t-r		capture from the ports as named (e.g. pipes)\n"
+		"\t		instead of monitoring them\n"
+		"\t-s snaplen	bytes captured per packet\n"
+		"\t-t workers	number of capture/writer thread pairs\n"
+		"\t-b size	buffer size in KB (default %d)\n"
+		"\t-D		write with O_DIRECT\n"
+		"\t-C size	rotate the files every size MB\n"
+		"\t-W count	keep at most count files per worker\n"
+		"\t-v interval	print statistics every interval seconds\n"
+		"\t-d seconds	stop after the given time\n"
+		"\t-B len	benchmark: capture len byte packets generated\n"
+		"\t		on a VALE port (no -i needed)\n",
+		command, NMC_DEF_BUFSIZE >> 10);
+	exit(1);
+}
+
+int
+main(int argc, char *argv[])
+{
+	const char *command = basename(argv[0]);
+	uint64_t prev_pkts = 0, prev_bytes = 0, prev_written = 0;
+	const char *ports[NMC_MAX_SOURCES];
+	struct timeval t0, t1, tlast;
+	pthread_t bench_th;
+	int ch, i, nports = 0, error = 0;
+
+	memset(&g, 0, sizeof(g));
+	g.bufsize = NMC_DEF_BUFSIZE;
+	g.mode = MODE_COPY;
+
+	while ((ch = getopt(argc, argv, "i:w:nzrs:t:b:DC:W:v:d:B:")) != -1) {
+		switch (ch) {
+		case 'i':
+			if (nports == NMC_MAX_SOURCES)
+				usage(command);
+			ports[nports++] = optarg;
+			break;
+		case 'w':
+			g.prefix = optarg;
+			break;
+		case 'n':
+			g.format = FMT_PCAPNG;
+			break;
+		case 'z':
+			g.mode = MODE_ZCOPY;
+			break;
+		case 'r':
+			g.mode = MODE_RAW;
+			break;
+		case 's':
+			g.snaplen = atoi(optarg);
+			if (g.snaplen > NMC_MAX_SNAPLEN)
+				g.snaplen = NMC_MAX_SNAPLEN;
+			break;
+		case 't':
+			g.nworkers = atoi(optarg);
+			break;
+		case 'b':
+			g.bufsize = (size_t)atoi(optarg) << 10;
+			break;
+		case 'D':
+			g.direct = 1;
+			break;
+		case 'C':
+			g.rotate = (uint64_t)atoi(optarg) << 20;
+			break;
+		case 'W':
+			g.max_files = atoi(optarg);
+			break;
+		case 'v':
+			g.interval = atoi(optarg);
+			break;
+		case 'd':
+			g.duration = atoi(optarg);
+			break;
+		case 'B':
+			g.bench = 1;
+			g.bench_len = atoi(optarg);
+			break;
+		default:
+			usage(command);
+		}
+	}
+	if (optind != argc || g.prefix == NULL)
+		usage(command);
+	if (g.bench) {
+		if (nports || g.mode != MODE_COPY) {
+			D("-B only works with copy monitors and no -i");
+			return 1;
+		}
+		if (g.bench_len < 60 || g.bench_len > 2048)
+			g.bench_len = 60;
+		/* the port must be in netmap mode to be monitored */
+		g.bench_d = nm_open(NMC_BENCH_PORT, NULL, 0, NULL);
+		if (g.bench_d == NULL) {
+			D("cannot open %s", NMC_BENCH_PORT);
+			return 1;
+		}
+		ports[nports++] = NMC_BENCH_PORT;
+	}
+	for (i = 0; i < nports; i++) {
+		if (add_port(ports[i]) < 0)
+			return 1;
+	}
+	if (g.nsrc == 0)
+		usage(command);
+	/* whole blocks, and room for the largest record */
+	if (g.bufsize < 16 * NMC_ALIGN)
+		g.bufsize = 16 * NMC_ALIGN;
+	g.bufsize &= ~(size_t)(NMC_ALIGN - 1);
+	if (g.nworkers <= 0)
+		g.nworkers = g.nsrc < NMC_DEF_WORKERS ? g.nsrc : NMC_DEF_WORKERS;
+	if (g.nworkers > g.nsrc)
+		g.nworkers = g.nsrc;
+	if (g.nworkers > NMC_MAX_WORKERS)
+		g.nworkers = NMC_MAX_WORKERS;
+
+	/* copy monitors have their own memory, so each source
+	 * is mapped on its own
+	 */
+	for (i = 0; i < g.nsrc; i++) {
+		struct nmc_source *s = &g.src[i];
+		struct netmap_ring *ring;
+		int r;
+
+		s->d = nm_open(s->name, NULL, 0, NULL);
+		if (s->d == NULL) {
+			D("cannot open %s", s->name);
+			return 1;
+		}
+		/* we take the time of the sync if the kernel does not
+		 * give us one
+		 */
+		for (r = s->d->first_rx_ring; r <= s->d->last_rx_ring; r++) {
+			ring = NETMAP_RXRING(s->d->nifp, r);
+			ring->flags |= NR_TIMESTAMP;
+		}
+	}
+
+	g.workers = calloc(g.nworkers, sizeof(*g.workers));
+	if (g.workers == NULL) {
+		D("out of memory");
+		return 1;
+	}
+	for (i = 0; i < g.nsrc; i++) {
+		struct nmc_worker *w = &g.workers[i % g.nworkers];
+
+		w->src[w->nsrc++] = &g.src[i];
+	}
+
+	signal(SIGINT, sigint_h);
+	for (i = 0; i < g.nworkers; i++) {
+		struct nmc_worker *w = &g.workers[i];
+		int j;
+
+		w->id = i;
+		w->fd = -1;
+		pthread_mutex_init(&w->lock, NULL);
+		pthread_cond_init(&w->cond, NULL);
+		for (j = 0; j < NMC_NBUFS; j++) {
+			if (posix_memalign((void **)&w->bufs[j].data,
+					NMC_ALIGN, g.bufsize)) {
+				D("out of memory");
+				return 1;
+			}
+		}
+		if (pthread_create(&w->writer_th, NULL, writer_body, w) ||
+		    pthread_create(&w->capture_th, NULL, capture_body, w)) {
+			D("cannot create the threads");
+			return 1;
+		}
+	}
+	if (g.bench && pthread_create(&bench_th, NULL, bench_body, g.bench_d)) {
+		D("cannot create the benchmark thread");
+		return 1;
+	}
+
+	gettimeofday(&t0, NULL);
+	tlast = t0;
+	while (!do_abort) {
+		sleep(1);
+		gettimeofday(&t1, NULL);
+		if (g.duration && t1.tv_sec - t0.tv_sec >= g.duration)
+			break;
+		if (g.interval && t1.tv_sec - tlast.tv_sec >= g.interval) {
+			print_stats(&prev_pkts, &prev_bytes, &prev_written,
+				(t1.tv_sec - tlast.tv_sec) +
+				(t1.tv_usec - tlast.tv_usec) / 1e6);
+			tlast = t1;
+		}
+	}
+	do_abort = 1;
+
+	if (g.bench)
+		pthread_join(bench_th, NULL);
+	for (i = 0; i < g.nworkers; i++) {
+		pthread_join(g.workers[i].capture_th, NULL);
+		pthread_join(g.workers[i].writer_th, NULL);
+		if (g.workers[i].error)
+			error = 1;
+	}
+	prev_pkts = prev_bytes = prev_written = 0;
+	print_stats(&prev_pkts, &prev_bytes, &prev_written, 0);
+
+	for (i = g.nsrc - 1; i >= 0; i--)
+		nm_close(g.src[i].d);
+	if (g.bench_d)
+		nm_close(g.bench_d);
+	for (i = 0; i < g.nworkers; i++) {
+		free(g.workers[i].bufs[0].data);
+		free(g.workers[i].bufs[1].data);
+	}
+	free(g.workers);
+	return error;
+}
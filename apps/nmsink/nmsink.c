@@ -0,0 +1,259 @@
+/*
+ * Copyright (C) 2017 Universita` di Pisa. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *   1. Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * nmsink: create, configure and destroy the null NICs of the linux
+ * netmap module (see struct nm_sink_req in net/netmap.h).
+ */
+
+#include <net/netmap_user.h>
+#include <net/netmap.h>
+
+#include <errno.h>
+#include <stdio.h>
+#include <inttypes.h>	/* PRI* macros */
+#include <string.h>	/* strcmp */
+#include <fcntl.h>	/* open */
+#include <unistd.h>	/* close */
+#include <sys/ioctl.h>	/* ioctl */
+#include <stdlib.h>	/* strtoull */
+#include <libgen.h>	/* basename */
+
+/* parse a number with an optional K, M or G (powers of 1000) suffix */
+static int
+parse_rate(const char *s, uint64_t *v)
+{
+	char *end;
+
+	*v = strtoull(s, &end, 0);
+	switch (*end) {
+	case 'k': case 'K':
+		*v *= 1000;
+		end++;
+		break;
+	case 'm': case 'M':
+		*v *= 1000000;
+		end++;
+		break;
+	case 'g': case 'G':
+		*v *= 1000000000;
+		end++;
+		break;
+	}
+	return (end == s || *end != '\0') ? -1 : 0;
+}
+
+static int
+sink_ioctl(int fd, char *name, struct nm_sink_req *req)
+{
+	struct nm_ifreq ifr;
+
+	memset(&ifr, 0, sizeof(ifr));
+	strncpy(ifr.nifr_name, name, sizeof(ifr.nifr_name) - 1);
+	req->magic = NM_SINK_MAGIC;
+	memcpy(ifr.data, req, sizeof(*req));
+	if (ioctl(fd, NIOCCONFIG, &ifr) < 0)
+		return -1;
+	memcpy(req, ifr.data, sizeof(*req));
+	/* the kernel may have picked the name */
+	strncpy(name, ifr.nifr_name, IFNAMSIZ);
+	return 0;
+}
+
+static void
+print_sink(const char *name, const struct nm_sink_req *req)
+{
+	printf("%s: %u tx rings of %u slots, %u rx rings of %u slots\n",
+		name, req->tx_rings, req->tx_slots,
+		req->rx_rings, req->rx_slots);
+	printf("  tx: %s, ", (req->flags & NM_SINK_TXSYNC) ?
+			"synchronous" : "asynchronous");
+	if (req->tx_bps)
+		printf("%" PRIu64 " bps, ", req->tx_bps);
+	else
+		printf("no line rate, ");
+	printf("%u ns per packet, %u ns per batch\n",
+		req->tx_pkt_ns, req->tx_batch_ns);
+	if (req->rx_pps)
+		printf("  rx: %" PRIu64 " pps per ring, %u bytes, "
+			"interrupt every %u ns\n", req->rx_pps, req->rx_len,
+			req->rx_batch_ns);
+	else
+		printf("  rx: off\n");
+}
+
+static void
+usage(const char *command)
+{
+	fprintf(stderr,
+		"Usage:\n"
+		"%s [-c | -d | -s] [options] name\n"
+		"\t-c		create the null NIC (name may contain %%d)\n"
+		"\t-d		destroy it\n"
+		"\t-s		change its configuration\n"
+		"\t		(with none of them, show the configuration)\n"
+		"\t-t rings	tx rings (-c only)\n"
+		"\t-r rings	rx rings (-c only)\n"
+		"\t-T slots	slots per tx ring (-c only)\n"
+		"\t-R slots	slots per rx ring (-c only)\n"
+		"\t-f file		rx template frame (-c only)\n"
+		"\t-b bps		tx line rate, 0 for none (K, M, G suffixes)\n"
+		"\t-l ns		tx latency per packet\n"
+		"\t-L ns		tx latency per batch\n"
+		"\t-y		synchronous tx (txsync waits for the packets)\n"
+		"\t-a		asynchronous tx\n"
+		"\t-p pps		rx rate per ring, 0 for none (K, M, G suffixes)\n"
+		"\t-i ns		rx interrupt interval\n",
+		command);
+	exit(1);
+}
+
+int
+main(int argc, char *argv[])
+{
+	const char *command = basename(argv[0]);
+	struct nm_sink_req req, set;
+	uint16_t cmd = NM_SINK_GET;
+	char name[IFNAMSIZ];
+	char tmpl[2048];
+	int ch, fd, sync = -1;
+	int64_t bps = -1, pkt_ns = -1, batch_ns = -1, pps = -1, rx_ns = -1;
+	uint64_t v;
+	FILE *f;
+
+	memset(&set, 0, sizeof(set));
+	while ((ch = getopt(argc, argv, "cdst:r:T:R:f:b:l:L:yap:i:")) != -1) {
+		switch (ch) {
+		case 'c':
+			cmd = NM_SINK_CREATE;
+			break;
+		case 'd':
+			cmd = NM_SINK_DELETE;
+			break;
+		case 's':
+			cmd = NM_SINK_SET;
+			break;
+		case 't':
+			set.tx_rings = atoi(optarg);
+			break;
+		case 'r':
+			set.rx_rings = atoi(optarg);
+			break;
+		case 'T':
+			set.tx_slots = atoi(optarg);
+			break;
+		case 'R':
+			set.rx_slots = atoi(optarg);
+			break;
+		case 'f':
+			f = fopen(optarg, "r");
+			if (f == NULL) {
+				perror(optarg);
+				return 1;
+			}
+			set.rx_len = fread(tmpl, 1, sizeof(tmpl), f);
+			fclose(f);
+			set.rx_template = (uintptr_t)tmpl;
+			break;
+		case 'b':
+			if (parse_rate(optarg, &v) < 0)
+				usage(command);
+			bps = v;
+			break;
+		case 'l':
+			pkt_ns = atoi(optarg);
+			break;
+		case 'L':
+			batch_ns = atoi(optarg);
+			break;
+		case 'y':
+			sync = 1;
+			break;
+		case 'a':
+			sync = 0;
+			break;
+		case 'p':
+			if (parse_rate(optarg, &v) < 0)
+				usage(command);
+			pps = v;
+			break;
+		case 'i':
+			rx_ns = atoi(optarg);
+			break;
+		default:
+			usage(command);
+		}
+	}
+	if (optind != argc - 1)
+		usage(command);
+	memset(name, 0, sizeof(name));
+	strncpy(name, argv[optind], sizeof(name) - 1);
+
+	fd = open("/dev/netmap", O_RDWR);
+	if (fd < 0) {
+		perror("/dev/netmap");
+		return 1;
+	}
+
+	/* start from the current configuration when changing it */
+	memset(&req, 0, sizeof(req));
+	if (cmd == NM_SINK_CREATE) {
+		req = set;
+	} else if (cmd == NM_SINK_SET || cmd == NM_SINK_GET) {
+		req.cmd = NM_SINK_GET;
+		if (sink_ioctl(fd, name, &req) < 0)
+			goto fail;
+	}
+	if (cmd == NM_SINK_GET || cmd == NM_SINK_DELETE)
+		goto apply;
+	if (sync >= 0)
+		req.flags = sync ? NM_SINK_TXSYNC : 0;
+	if (bps >= 0)
+		req.tx_bps = bps;
+	if (pkt_ns >= 0)
+		req.tx_pkt_ns = pkt_ns;
+	if (batch_ns >= 0)
+		req.tx_batch_ns = batch_ns;
+	if (pps >= 0)
+		req.rx_pps = pps;
+	if (rx_ns >= 0)
+		req.rx_batch_ns = rx_ns;
+
+apply:
+	if (cmd != NM_SINK_GET) {
+		req.cmd = cmd;
+		if (sink_ioctl(fd, name, &req) < 0)
+			goto fail;
+	}
+	if (cmd != NM_SINK_DELETE)
+		print_sink(name, &req);
+	close(fd);
+	return 0;
+
+fail:
+	fprintf(stderr, "%s: %s: %s\n", command, name, strerror(errno));
+	close(fd);
+	return 1;
+}
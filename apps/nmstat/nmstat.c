@@ -0,0 +1,336 @@
+/*
+ * Copyright (C) 2017 Universita` di Pisa. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *   1. Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * nmstat: show the per-ring statistics of a netmap port
+ * (see struct nm_kring_stats in net/netmap.h), and point out the
+ * rings that look starving or saturated. With -n, show the
+ * notification statistics of a ptnetmap or emulated adapter
+ * (struct nm_adapter_stats) instead.
+ */
+
+#include <net/netmap_user.h>
+#include <net/netmap.h>
+
+#include <errno.h>
+#include <stdio.h>
+#include <inttypes.h>	/* PRI* macros */
+#include <string.h>	/* strcmp */
+#include <fcntl.h>	/* open */
+#include <unistd.h>	/* close, sleep */
+#include <sys/ioctl.h>	/* ioctl */
+#include <stdlib.h>	/* atoi, calloc */
+#include <libgen.h>	/* basename */
+
+/* a ring is starving if most of the syncs find nothing to do */
+#define STARVING_SLOTS_PER_SYNC	0.1
+/* a ring is saturated if many syncs leave it full */
+#define SATURATED_FULL_PCT	10
+
+struct ring_snap {
+	struct nm_kring_stats cur;
+	struct nm_kring_stats prev;
+};
+
+static int
+get_stats(int fd, const char *name, int tx, int ring, int reset,
+		struct nm_kring_stats *ks)
+{
+	struct nm_ifreq ifr;
+	struct nm_kring_stats *req = (struct nm_kring_stats *)ifr.data;
+
+	memset(&ifr, 0, sizeof(ifr));
+	strncpy(ifr.nifr_name, name, sizeof(ifr.nifr_name) - 1);
+	req->magic = NM_KSTATS_MAGIC;
+	req->ring_id = ring;
+	req->tx = tx;
+	req->flags = reset ? NM_KSTATS_RESET : 0;
+	if (ioctl(fd, NIOCCONFIG, &ifr) < 0)
+		return -1;
+	*ks = *req;
+	return 0;
+}
+
+static int
+get_adstats(int fd, const char *name, int tx, int reset,
+		struct nm_adapter_stats *as)
+{
+	struct nm_ifreq ifr;
+	struct nm_adapter_stats *req = (struct nm_adapter_stats *)ifr.data;
+
+	memset(&ifr, 0, sizeof(ifr));
+	strncpy(ifr.nifr_name, name, sizeof(ifr.nifr_name) - 1);
+	req->magic = NM_ADSTATS_MAGIC;
+	req->tx = tx;
+	req->flags = reset ? NM_ADSTATS_RESET : 0;
+	if (ioctl(fd, NIOCCONFIG, &ifr) < 0)
+		return -1;
+	*as = *req;
+	return 0;
+}
+
+/* upper bound of the histogram bucket where the given percentile falls */
+static uint64_t
+hist_percentile(const uint64_t *h, int len, uint64_t total, int pct)
+{
+	uint64_t sum = 0, target = (total * pct + 99) / 100;
+	int i;
+
+	for (i = 0; i < len; i++) {
+		sum += h[i];
+		if (sum >= target)
+			break;
+	}
+	if (i == len)
+		i--;
+	return 1ULL << (i + 1);
+}
+
+static const char *
+fmt_ns(uint64_t ns, char *buf, size_t len)
+{
+	if (ns < 10000)
+		snprintf(buf, len, "%" PRIu64 "ns", ns);
+	else if (ns < 10000000)
+		snprintf(buf, len, "%" PRIu64 "us", ns / 1000);
+	else
+		snprintf(buf, len, "%" PRIu64 "ms", ns / 1000000);
+	return buf;
+}
+
+static void
+print_ring(int tx, int ring, const struct nm_kring_stats *c,
+		const struct nm_kring_stats *p)
+{
+	uint64_t syncs = c->syncs - p->syncs;
+	uint64_t slots = c->slots - p->slots;
+	uint64_t full = c->full - p->full;
+	uint64_t reinits = c->reinits - p->reinits;
+	uint64_t drops = c->drops - p->drops;
+	uint64_t h[NM_SYNC_HIST_LEN];
+	uint32_t busy;
+	const char *status = "";
+	char b50[24], b99[24];
+	int i;
+
+	for (i = 0; i < NM_SYNC_HIST_LEN; i++)
+		h[i] = c->hist[i] - p->hist[i];
+
+	/* slots owned by the application (rx) or by the NIC (tx) */
+	if (tx)
+		busy = (c->hwcur + c->num_slots - c->hwtail - 1) % c->num_slots;
+	else
+		busy = (c->hwtail + c->num_slots - c->hwcur) % c->num_slots;
+
+	if (reinits)
+		status = "ERRORS";
+	else if (drops)
+		status = "DROPPING";
+	else if (syncs && full * 100 >= syncs * SATURATED_FULL_PCT)
+		status = "SATURATED";
+	else if (syncs && (double)slots / syncs < STARVING_SLOTS_PER_SYNC)
+		status = "STARVING";
+
+	printf("%s %3d %12" PRIu64 " %9.2f %10" PRIu64 " %5.1f%% %5" PRIu64
+		" %9" PRIu64 " %8s %8s %6u/%-6u %s\n",
+		tx ? "tx" : "rx", ring, syncs,
+		syncs ? (double)slots / syncs : 0.0,
+		c->notifies - p->notifies,
+		syncs ? 100.0 * full / syncs : 0.0,
+		reinits, drops,
+		syncs ? fmt_ns(hist_percentile(h, NM_SYNC_HIST_LEN, syncs, 50),
+			b50, sizeof(b50)) : "-",
+		syncs ? fmt_ns(hist_percentile(h, NM_SYNC_HIST_LEN, syncs, 99),
+			b99, sizeof(b99)) : "-",
+		busy, c->num_slots, status);
+}
+
+static void
+print_adapter(int tx, const struct nm_adapter_stats *c,
+		const struct nm_adapter_stats *p)
+{
+	uint64_t syncs = c->syncs - p->syncs;
+	uint64_t slots = c->slots - p->slots;
+	uint64_t h[NM_BATCH_HIST_LEN];
+	int i;
+
+	for (i = 0; i < NM_BATCH_HIST_LEN; i++)
+		h[i] = c->hist[i] - p->hist[i];
+
+	printf("%s %3u %10" PRIu64 " %10" PRIu64 " %10" PRIu64 " %10" PRIu64
+		" %12" PRIu64 " %10" PRIu64 " %9.2f %6" PRIu64 " %6" PRIu64
+		" %9" PRIu64 "\n",
+		tx ? "tx" : "rx", c->num_rings,
+		c->kicks - p->kicks, c->wakeups - p->wakeups,
+		c->intrs - p->intrs,
+		c->intrs_suppressed - p->intrs_suppressed,
+		syncs, c->dry_syncs - p->dry_syncs,
+		syncs ? (double)slots / syncs : 0.0,
+		syncs ? hist_percentile(h, NM_BATCH_HIST_LEN, syncs, 50) : 0,
+		syncs ? hist_percentile(h, NM_BATCH_HIST_LEN, syncs, 99) : 0,
+		c->drops - p->drops);
+}
+
+/* the -n mode: notification statistics of the whole adapter */
+static int
+adapter_loop(const char *command, int fd, const char *name, int interval,
+		int reset)
+{
+	struct nm_adapter_stats cur[2], prev[2];
+	int t;
+
+	memset(prev, 0, sizeof(prev));
+	for (;;) {
+		printf("%s %3s %10s %10s %10s %10s %12s %10s %9s %6s %6s %9s\n",
+			"  ", "rgs", "kicks", "wakeups", "intrs", "intr-supp",
+			"syncs", "dry", "batch", "p50", "p99", "drops");
+		for (t = 0; t < 2; t++) {
+			if (get_adstats(fd, name, t, reset, &cur[t]) < 0) {
+				fprintf(stderr, "%s: cannot get stats for %s: %s\n",
+					command, name, strerror(errno));
+				return 1;
+			}
+			print_adapter(t, &cur[t], &prev[t]);
+			/* with reset the kernel starts from zero */
+			if (reset)
+				memset(&prev[t], 0, sizeof(prev[t]));
+			else
+				prev[t] = cur[t];
+		}
+		if (interval <= 0)
+			break;
+		printf("\n");
+		fflush(stdout);
+		sleep(interval);
+	}
+	return 0;
+}
+
+static void
+usage(const char *command)
+{
+	fprintf(stderr,
+		"Usage:\n"
+		"%s [-i interval] [-n] [-z] port\n"
+		"\t-i interval	print the differences every interval seconds\n"
+		"\t-n		show the notification statistics of the adapter\n"
+		"\t-z		clear the counters after reading them\n"
+		"\n"
+		"Statistics are only collected when the netmap sync_stats\n"
+		"parameter is set (dev.netmap.sync_stats on FreeBSD,\n"
+		"/sys/module/netmap/parameters/sync_stats on linux),\n"
+		"the ones shown with -n are always collected.\n",
+		command);
+	exit(1);
+}
+
+int
+main(int argc, char *argv[])
+{
+	const char *command = basename(argv[0]);
+	struct ring_snap *snaps[2] = { NULL, NULL };
+	int nrings[2];
+	int ch, fd, t, i, interval = 0, reset = 0, adapter = 0;
+	const char *name;
+
+	while ((ch = getopt(argc, argv, "i:nz")) != -1) {
+		switch (ch) {
+		case 'i':
+			interval = atoi(optarg);
+			break;
+		case 'n':
+			adapter = 1;
+			break;
+		case 'z':
+			reset = 1;
+			break;
+		default:
+			usage(command);
+		}
+	}
+	if (optind != argc - 1)
+		usage(command);
+	name = argv[optind];
+
+	fd = open("/dev/netmap", O_RDWR);
+	if (fd < 0) {
+		perror("/dev/netmap");
+		return 1;
+	}
+
+	if (adapter) {
+		ch = adapter_loop(command, fd, name, interval, reset);
+		close(fd);
+		return ch;
+	}
+
+	/* ring 0 always exists, use it to learn the number of rings */
+	for (t = 0; t < 2; t++) {
+		struct nm_kring_stats ks;
+
+		if (get_stats(fd, name, t, 0, 0, &ks) < 0) {
+			fprintf(stderr, "%s: cannot get stats for %s: %s\n",
+				command, name, strerror(errno));
+			return 1;
+		}
+		nrings[t] = ks.num_rings;
+		snaps[t] = calloc(nrings[t], sizeof(struct ring_snap));
+		if (snaps[t] == NULL) {
+			perror("calloc");
+			return 1;
+		}
+	}
+
+	for (;;) {
+		printf("%s %3s %12s %9s %10s %6s %5s %9s %8s %8s %13s\n",
+			"  ", "id", "syncs", "slots/sy", "notifies",
+			"full", "reinit", "drops", "p50", "p99", "busy/slots");
+		for (t = 0; t < 2; t++) {
+			for (i = 0; i < nrings[t]; i++) {
+				struct ring_snap *s = &snaps[t][i];
+
+				if (get_stats(fd, name, t, i, reset, &s->cur) < 0) {
+					fprintf(stderr, "%s: ring %d: %s\n",
+						command, i, strerror(errno));
+					continue;
+				}
+				print_ring(t, i, &s->cur, &s->prev);
+				/* with reset the kernel starts from zero */
+				if (reset)
+					memset(&s->prev, 0, sizeof(s->prev));
+				else
+					s->prev = s->cur;
+			}
+		}
+		if (interval <= 0)
+			break;
+		printf("\n");
+		fflush(stdout);
+		sleep(interval);
+	}
+
+	close(fd);
+	return 0;
+}
@@ -279,6 +279,7 @@ struct glob_arg {
 #define OPT_RANDOM_SRC  512
 #define OPT_RANDOM_DST  1024
 #define OPT_PPS_STATS   2048
+#define OPT_SLOT_TS	4096	/* per-slot rx timestamps (ping/pong) */
 	int dev_type;
 #ifndef NO_PCAP
 	pcap_t *p;
@@ -1243,6 +1244,14 @@ ping_body(void *data)
 		return NULL;
 	}
 
+	if (targ->g->options & OPT_SLOT_TS) {
+		/* ask the kernel to stamp each received slot */
+		for (i = targ->nmd->first_rx_ring;
+			i <= targ->nmd->last_rx_ring; i++) {
+			NETMAP_RXRING(nifp, i)->flags |= NR_SLOT_TIMESTAMP;
+		}
+	}
+
 	bzero(&buckets, sizeof(buckets));
 	clock_gettime(CLOCK_REALTIME_PRECISE, &last_print);
 	now = last_print;
@@ -1324,7 +1333,13 @@ ping_body(void *data)
 				slot = &ring->slot[ring->cur];
 				p = NETMAP_BUF(ring, slot->buf_idx);
 
-				clock_gettime(CLOCK_REALTIME_PRECISE, &now);
+				if ((targ->g->options & OPT_SLOT_TS) && slot->ptr) {
+					/* arrival time recorded by the kernel */
+					now.tv_sec = slot->ptr / 1000000000;
+					now.tv_nsec = slot->ptr % 1000000000;
+				} else {
+					clock_gettime(CLOCK_REALTIME_PRECISE, &now);
+				}
 				bcopy(p+42, &seq, sizeof(seq));
 				tp = (struct tstamp *)(p+46);
 				ts.tv_sec = (time_t)tp->sec;
@@ -1415,6 +1430,8 @@ pong_body(void *data)
 	struct netmap_ring *txring, *rxring;
 	int i, rx = 0;
 	uint64_t sent = 0, n = targ->g->npackets;
+	int slot_ts = targ->g->options & OPT_SLOT_TS;
+	uint64_t t_resid = 0, n_resid = 0; /* time spent in the rx ring, ns */
 
 	if (targ->g->nthreads > 1) {
 		D("can only reply ping with 1 thread");
@@ -1423,8 +1440,15 @@ pong_body(void *data)
 	if (n > 0)
 		D("understood ponger %llu but don't know how to do it",
 			(unsigned long long)n);
+	if (slot_ts) {
+		for (i = targ->nmd->first_rx_ring;
+			i <= targ->nmd->last_rx_ring; i++) {
+			NETMAP_RXRING(nifp, i)->flags |= NR_SLOT_TIMESTAMP;
+		}
+	}
 	while (!targ->cancel && (n == 0 || sent < n)) {
 		uint32_t txcur, txavail;
+		uint64_t t_now = 0;
 //#define BUSYWAIT
 #ifdef BUSYWAIT
 		ioctl(pfd.fd, NIOCRXSYNC, NULL);
@@ -1439,6 +1463,12 @@ pong_body(void *data)
 		txring = NETMAP_TXRING(nifp, 0);
 		txcur = txring->cur;
 		txavail = nm_ring_space(txring);
+		if (slot_ts) {
+			struct timespec now;
+
+			clock_gettime(CLOCK_REALTIME_PRECISE, &now);
+			t_now = now.tv_sec * 1000000000ULL + now.tv_nsec;
+		}
 		/* see what we got back */
 		for (i = targ->nmd->first_rx_ring; i <= targ->nmd->last_rx_ring; i++) {
 			rxring = NETMAP_RXRING(nifp, i);
@@ -1451,6 +1481,10 @@ pong_body(void *data)
 				//D("got pkt %p of size %d", src, slot->len);
 				rxring->head = rxring->cur = nm_ring_next(rxring, cur);
 				rx++;
+				if (slot_ts && slot->ptr && slot->ptr < t_now) {
+					t_resid += t_now - slot->ptr;
+					n_resid++;
+				}
 				if (txavail == 0)
 					continue;
 				dst = NETMAP_BUF(txring,
@@ -1480,6 +1514,11 @@ pong_body(void *data)
 		//D("tx %d rx %d", sent, rx);
 	}
 
+	if (n_resid > 0) {
+		D("average delay from arrival to reply over %llu packets: %d ns",
+			(unsigned long long)n_resid, (int)(t_resid / n_resid));
+	}
+
 	targ->completed = 1;
 
 	/* reset the ``used`` flag. */
@@ -2284,6 +2323,7 @@ usage(void)
 		     "\t			OPT_RANDOM_SRC  512\n"
 		     "\t			OPT_RANDOM_DST  1024\n"
 		     "\t			OPT_PPS_STATS   2048\n"
+		     "\t			OPT_SLOT_TS     4096 (kernel rx timestamps, ping/pong)\n"
 		     "\t-W			exit RX with no traffic\n"
 		     "\t-v			verbose (more v = more verbose)\n"
 		     "\t-C vale-config		specify a vale config\n"
@@ -133,6 +133,7 @@ struct ptnet_queue {
 	void				*cookie;
 	int				kring_id;
 	struct ptnet_ring		*ptring;
+	int				event_idx; /* ptring layout */
 	unsigned int			kick;
 	struct mtx			lock;
 	struct buf_ring			*bufring; /* for TX queues */
@@ -316,10 +317,17 @@ ptnet_attach(device_t dev)
 		return (ENXIO);
 	}
 
-	/* Negotiate features with the hypervisor. */
+	num_tx_rings = bus_read_4(sc->iomem, PTNET_IO_NUM_TX_RINGS);
+	num_rx_rings = bus_read_4(sc->iomem, PTNET_IO_NUM_RX_RINGS);
+
+	/* Negotiate features with the hypervisor. The CSB layout used
+	 * with event indexes holds fewer rings. */
 	if (ptnet_vnet_hdr) {
 		ptfeatures |= PTNETMAP_F_VNET_HDR;
 	}
+	if (num_tx_rings + num_rx_rings <= PTNET_CSB_MAX_RINGS(1)) {
+		ptfeatures |= PTNETMAP_F_EVENT_IDX;
+	}
 	bus_write_4(sc->iomem, PTNET_IO_PTFEAT, ptfeatures); /* wanted */
 	ptfeatures = bus_read_4(sc->iomem, PTNET_IO_PTFEAT); /* acked */
 	sc->ptfeatures = ptfeatures;
@@ -346,8 +354,14 @@ ptnet_attach(device_t dev)
 		bus_write_4(sc->iomem, PTNET_IO_CSBBAL, paddr & 0xffffffff);
 	}
 
-	num_tx_rings = bus_read_4(sc->iomem, PTNET_IO_NUM_TX_RINGS);
-	num_rx_rings = bus_read_4(sc->iomem, PTNET_IO_NUM_RX_RINGS);
+	if (num_tx_rings + num_rx_rings >
+			PTNET_CSB_MAX_RINGS(ptfeatures &
+					    PTNETMAP_F_EVENT_IDX)) {
+		device_printf(dev, "%u rings do not fit in the CSB\n",
+			      num_tx_rings + num_rx_rings);
+		err = EINVAL;
+		goto err_path;
+	}
 	sc->num_rings = num_tx_rings + num_rx_rings;
 	sc->num_tx_rings = num_tx_rings;
 
@@ -366,7 +380,8 @@ ptnet_attach(device_t dev)
 		pq->sc = sc;
 		pq->kring_id = i;
 		pq->kick = PTNET_IO_KICK_BASE + 4 * i;
-		pq->ptring = sc->csb->rings + i;
+		pq->event_idx = !!(ptfeatures & PTNETMAP_F_EVENT_IDX);
+		pq->ptring = PTNET_CSB_RING(sc->csb->rings, pq->event_idx, i);
 		snprintf(pq->lock_name, sizeof(pq->lock_name), "%s-%d",
 			 device_get_nameunit(dev), i);
 		mtx_init(&pq->lock, pq->lock_name, NULL, MTX_DEF);
@@ -779,7 +794,8 @@ ptnet_ioctl(if_t ifp, u_long cmd, caddr_t data)
 					/* Make sure the worker sees the
 					 * IFF_DRV_RUNNING down. */
 					PTNET_Q_LOCK(pq);
-					pq->ptring->guest_need_kick = 0;
+					ptnetmap_guest_intr_enable(pq->ptring,
+							pq->event_idx, 0);
 					PTNET_Q_UNLOCK(pq);
 					/* Wait for rescheduling to finish. */
 					if (pq->taskq) {
@@ -793,7 +809,8 @@ ptnet_ioctl(if_t ifp, u_long cmd, caddr_t data)
 				for (i = 0; i < sc->num_rings; i++) {
 					pq = sc-> queues + i;
 					PTNET_Q_LOCK(pq);
-					pq->ptring->guest_need_kick = 1;
+					ptnetmap_guest_intr_enable(pq->ptring,
+							pq->event_idx, 1);
 					PTNET_Q_UNLOCK(pq);
 				}
 			}
@@ -1112,6 +1129,7 @@ ptnet_sync_from_csb(struct ptnet_softc *sc, struct netmap_adapter *na)
 	 * CSB. */
 	for (i = 0; i < sc->num_rings; i++) {
 		struct ptnet_ring *ptring = sc->queues[i].ptring;
+		int event_idx = sc->queues[i].event_idx;
 		struct netmap_kring *kring;
 
 		if (i < na->num_tx_rings) {
@@ -1119,15 +1137,17 @@ ptnet_sync_from_csb(struct ptnet_softc *sc, struct netmap_adapter *na)
 		} else {
 			kring = na->rx_rings + i - na->num_tx_rings;
 		}
-		kring->rhead = kring->ring->head = ptring->head;
-		kring->rcur = kring->ring->cur = ptring->cur;
-		kring->nr_hwcur = ptring->hwcur;
-		kring->nr_hwtail = kring->rtail =
-			kring->ring->tail = ptring->hwtail;
+		kring->rhead = kring->ring->head =
+			PTNET_RING_FIELD(ptring, event_idx, head);
+		kring->rcur = kring->ring->cur =
+			PTNET_RING_FIELD(ptring, event_idx, cur);
+		kring->nr_hwcur = PTNET_RING_FIELD(ptring, event_idx, hwcur);
+		kring->nr_hwtail = kring->rtail = kring->ring->tail =
+			PTNET_RING_FIELD(ptring, event_idx, hwtail);
 
 		ND("%d,%d: csb {hc %u h %u c %u ht %u}", t, i,
-		   ptring->hwcur, ptring->head, ptring->cur,
-		   ptring->hwtail);
+		   kring->nr_hwcur, kring->rhead, kring->rcur,
+		   kring->nr_hwtail);
 		ND("%d,%d: kring {hc %u rh %u rc %u h %u c %u ht %u rt %u t %u}",
 		   t, i, kring->nr_hwcur, kring->rhead, kring->rcur,
 		   kring->ring->head, kring->ring->cur, kring->nr_hwtail,
@@ -1171,7 +1191,8 @@ ptnet_nm_register(struct netmap_adapter *na, int onoff)
 		D("Exit netmap mode, re-enable interrupts");
 		for (i = 0; i < sc->num_rings; i++) {
 			pq = sc->queues + i;
-			pq->ptring->guest_need_kick = 1;
+			ptnetmap_guest_intr_enable(pq->ptring,
+					pq->event_idx, 1);
 		}
 	}
 
@@ -1180,10 +1201,10 @@ ptnet_nm_register(struct netmap_adapter *na, int onoff)
 			/* Initialize notification enable fields in the CSB. */
 			for (i = 0; i < sc->num_rings; i++) {
 				pq = sc->queues + i;
-				pq->ptring->host_need_kick = 1;
-				pq->ptring->guest_need_kick =
+				ptnetmap_guest_intr_enable(pq->ptring,
+					pq->event_idx,
 					(!(ifp->if_capenable & IFCAP_POLLING)
-						&& i >= sc->num_tx_rings);
+						&& i >= sc->num_tx_rings));
 			}
 
 			/* Set the virtio-net header length. */
@@ -1259,7 +1280,8 @@ ptnet_nm_txsync(struct netmap_kring *kring, int flags)
 	struct ptnet_queue *pq = sc->queues + kring->ring_id;
 	bool notify;
 
-	notify = netmap_pt_guest_txsync(pq->ptring, kring, flags);
+	notify = netmap_pt_guest_txsync(pq->ptring, pq->event_idx, kring,
+					flags);
 	if (notify) {
 		ptnet_kick(pq);
 	}
@@ -1274,7 +1296,8 @@ ptnet_nm_rxsync(struct netmap_kring *kring, int flags)
 	struct ptnet_queue *pq = sc->rxqueues + kring->ring_id;
 	bool notify;
 
-	notify = netmap_pt_guest_rxsync(pq->ptring, kring, flags);
+	notify = netmap_pt_guest_rxsync(pq->ptring, pq->event_idx, kring,
+					flags);
 	if (notify) {
 		ptnet_kick(pq);
 	}
@@ -1290,7 +1313,7 @@ ptnet_nm_intr(struct netmap_adapter *na, int onoff)
 
 	for (i = 0; i < sc->num_rings; i++) {
 		struct ptnet_queue *pq = sc->queues + i;
-		pq->ptring->guest_need_kick = onoff;
+		ptnetmap_guest_intr_enable(pq->ptring, pq->event_idx, onoff);
 	}
 }
 
@@ -1657,12 +1680,12 @@ ptnet_rx_csum(struct mbuf *m, struct virtio_net_hdr *hdr)
 /* End of offloading-related functions to be shared with vtnet. */
 
 static inline void
-ptnet_sync_tail(struct ptnet_ring *ptring, struct netmap_kring *kring)
+ptnet_sync_tail(struct ptnet_queue *pq, struct netmap_kring *kring)
 {
 	struct netmap_ring *ring = kring->ring;
 
 	/* Update hwcur and hwtail as known by the host. */
-        ptnetmap_guest_read_kring_csb(ptring, kring);
+        ptnetmap_guest_read_kring_csb(pq->ptring, pq->event_idx, kring);
 
 	/* nm_sync_finalize */
 	ring->tail = kring->rtail = kring->nr_hwtail;
@@ -1674,6 +1697,7 @@ ptnet_ring_update(struct ptnet_queue *pq, struct netmap_kring *kring,
 {
 	struct netmap_ring *ring = kring->ring;
 	struct ptnet_ring *ptring = pq->ptring;
+	uint32_t old_head = PTNET_RING_FIELD(ptring, pq->event_idx, head);
 
 	/* Some packets have been pushed to the netmap ring. We have
 	 * to tell the host to process the new packets, updating cur
@@ -1683,11 +1707,14 @@ ptnet_ring_update(struct ptnet_queue *pq, struct netmap_kring *kring,
 	/* Mimic nm_txsync_prologue/nm_rxsync_prologue. */
 	kring->rcur = kring->rhead = head;
 
-	ptnetmap_guest_write_kring_csb(ptring, kring->rcur, kring->rhead);
+	ptnetmap_guest_write_kring_csb(ptring, pq->event_idx, kring->rcur,
+				       kring->rhead);
 
 	/* Kick the host if needed. */
-	if (NM_ACCESS_ONCE(ptring->host_need_kick)) {
-		ptring->sync_flags = sync_flags;
+	if (ptnetmap_guest_need_kick(ptring, pq->event_idx, old_head,
+				     kring->nkr_num_slots)) {
+		PTNET_RING_FIELD(ptring, pq->event_idx, sync_flags) =
+			sync_flags;
 		ptnet_kick(pq);
 	}
 }
@@ -1748,17 +1775,18 @@ ptnet_drain_transmit_queue(struct ptnet_queue *pq, unsigned int budget,
 			/* We ran out of slot, let's see if the host has
 			 * freed up some, by reading hwcur and hwtail from
 			 * the CSB. */
-			ptnet_sync_tail(ptring, kring);
+			ptnet_sync_tail(pq, kring);
 
 			if (PTNET_TX_NOSPACE(head, kring, minspace)) {
 				/* Still no slots available. Reactivate the
 				 * interrupts so that we can be notified
 				 * when some free slots are made available by
 				 * the host. */
-				ptring->guest_need_kick = 1;
+				ptnetmap_guest_intr_enable(ptring,
+						pq->event_idx, 1);
 
 				/* Double-check. */
-				ptnet_sync_tail(ptring, kring);
+				ptnet_sync_tail(pq, kring);
 				if (likely(PTNET_TX_NOSPACE(head, kring,
 							    minspace))) {
 					break;
@@ -1767,7 +1795,8 @@ ptnet_drain_transmit_queue(struct ptnet_queue *pq, unsigned int budget,
 				RD(1, "Found more slots by doublecheck");
 				/* More slots were freed before reactivating
 				 * the interrupts. */
-				ptring->guest_need_kick = 0;
+				ptnetmap_guest_intr_enable(ptring,
+						pq->event_idx, 0);
 			}
 		}
 
@@ -2027,21 +2056,23 @@ host_sync:
 			/* We ran out of slot, let's see if the host has
 			 * added some, by reading hwcur and hwtail from
 			 * the CSB. */
-			ptnet_sync_tail(ptring, kring);
+			ptnet_sync_tail(pq, kring);
 
 			if (head == ring->tail) {
 				/* Still no slots available. Reactivate
-				 * interrupts as they were disabled by the
-				 * host thread right before issuing the
-				 * last interrupt. */
-				ptring->guest_need_kick = 1;
+				 * interrupts, moving the event index past
+				 * the one that triggered the last
+				 * interrupt. */
+				ptnetmap_guest_intr_enable(ptring,
+						pq->event_idx, 1);
 
 				/* Double-check. */
-				ptnet_sync_tail(ptring, kring);
+				ptnet_sync_tail(pq, kring);
 				if (likely(head == ring->tail)) {
 					break;
 				}
-				ptring->guest_need_kick = 0;
+				ptnetmap_guest_intr_enable(ptring,
+						pq->event_idx, 0);
 			}
 		}
 
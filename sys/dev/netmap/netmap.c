@@ -515,16 +515,56 @@ int netmap_generic_mit = 100*1000;
  */
 int netmap_generic_txqdisc = 1;
 
+/* When txqdisc is not used, generic adapters may bypass the qdisc
+ * layer altogether and pass up to netmap_generic_txbatch mbufs to the
+ * driver in a single burst (0 or 1 to disable). Not all the systems
+ * support this, see nm_os_generic_set_features().
+ */
+int netmap_generic_txbatch = 32;
+
 /* Default number of slots and queues for generic adapters. */
 int netmap_generic_ringsize = 1024;
 int netmap_generic_rings = 1;
 
+/* Number of rx rings exposed by generic adapters on devices with a
+ * single rx queue (0 or 1 to disable). The packets are distributed
+ * among the rings by a symmetric hash of their addresses and ports.
+ */
+int netmap_generic_rss_rings = 0;
+
+/* Length of the virtio-net header (0, 10 or 12) that generic adapters
+ * put in front of each packet, when the OS supports it. The header
+ * carries the checksum and segmentation offloads, so that TSO frames
+ * can go from a VALE port to the NIC (and GRO frames back) without
+ * being segmented in software.
+ */
+int netmap_generic_vnet_hdr = 0;
+
 /* Non-zero if ptnet devices are allowed to use virtio-net headers. */
 int ptnet_vnet_hdr = 1;
 
 /* 0 if ptnetmap should not use worker threads for TX processing */
 int ptnetmap_tx_workers = 1;
 
+/* If non-zero, the ptnetmap rings are served by (at most) this many
+ * shared worker threads, rather than by one thread per ring. */
+int ptnetmap_workers = 0;
+
+/* Maximum time (in microseconds) the ptnetmap handlers keep polling
+ * after running out of work, before re-enabling the notifications.
+ * The actual window adapts to the traffic; 0 disables polling. */
+int ptnetmap_poll_usecs = 0;
+
+/* Non-zero to collect per-ring statistics (struct nm_kring_stats). */
+int netmap_sync_stats = 0;
+
+/* Tx doorbell coalescing for native adapters (see struct nm_txdb):
+ * drivers notify the NIC after netmap_txdb_slots new slots (0 disables
+ * coalescing) or netmap_txdb_usecs microseconds, whichever comes first.
+ */
+int netmap_txdb_slots = 0;
+int netmap_txdb_usecs = 20;
+
 /*
  * SYSCTL calls are grouped between SYSBEGIN and SYSEND to be emulated
  * in some other operating systems
@@ -549,9 +589,17 @@ SYSCTL_INT(_dev_netmap, OID_AUTO, admode, CTLFLAG_RW, &netmap_admode, 0 , "");
 SYSCTL_INT(_dev_netmap, OID_AUTO, generic_mit, CTLFLAG_RW, &netmap_generic_mit, 0 , "");
 SYSCTL_INT(_dev_netmap, OID_AUTO, generic_ringsize, CTLFLAG_RW, &netmap_generic_ringsize, 0 , "");
 SYSCTL_INT(_dev_netmap, OID_AUTO, generic_rings, CTLFLAG_RW, &netmap_generic_rings, 0 , "");
+SYSCTL_INT(_dev_netmap, OID_AUTO, generic_rss_rings, CTLFLAG_RW, &netmap_generic_rss_rings, 0 , "");
+SYSCTL_INT(_dev_netmap, OID_AUTO, generic_vnet_hdr, CTLFLAG_RW, &netmap_generic_vnet_hdr, 0 , "");
 SYSCTL_INT(_dev_netmap, OID_AUTO, generic_txqdisc, CTLFLAG_RW, &netmap_generic_txqdisc, 0 , "");
+SYSCTL_INT(_dev_netmap, OID_AUTO, generic_txbatch, CTLFLAG_RW, &netmap_generic_txbatch, 0 , "");
 SYSCTL_INT(_dev_netmap, OID_AUTO, ptnet_vnet_hdr, CTLFLAG_RW, &ptnet_vnet_hdr, 0 , "");
 SYSCTL_INT(_dev_netmap, OID_AUTO, ptnetmap_tx_workers, CTLFLAG_RW, &ptnetmap_tx_workers, 0 , "");
+SYSCTL_INT(_dev_netmap, OID_AUTO, ptnetmap_workers, CTLFLAG_RW, &ptnetmap_workers, 0 , "");
+SYSCTL_INT(_dev_netmap, OID_AUTO, ptnetmap_poll_usecs, CTLFLAG_RW, &ptnetmap_poll_usecs, 0 , "");
+SYSCTL_INT(_dev_netmap, OID_AUTO, sync_stats, CTLFLAG_RW, &netmap_sync_stats, 0 , "");
+SYSCTL_INT(_dev_netmap, OID_AUTO, tx_doorbell_slots, CTLFLAG_RW, &netmap_txdb_slots, 0 , "");
+SYSCTL_INT(_dev_netmap, OID_AUTO, tx_doorbell_usecs, CTLFLAG_RW, &netmap_txdb_usecs, 0 , "");
 
 SYSEND;
 
@@ -857,6 +905,12 @@ netmap_krings_create(struct netmap_adapter *na, u_int tailroom)
 				kring->name, kring->rhead, kring->rcur, kring->rtail);
 			mtx_init(&kring->q_lock, (t == NR_TX ? "nm_txq_lock" : "nm_rxq_lock"), NULL, MTX_DEF);
 			nm_os_selinfo_init(&kring->si);
+			if (t == NR_TX && i < nma_get_nrings(na, t) &&
+					(na->na_flags & NAF_NATIVE)) {
+				kring->txdb.kring = kring;
+				if (nm_os_txdb_init(&kring->txdb))
+					kring->txdb.kring = NULL;
+			}
 		}
 		nm_os_selinfo_init(&na->si[t]);
 	}
@@ -885,6 +939,8 @@ netmap_krings_delete(struct netmap_adapter *na)
 
 	/* we rely on the krings layout described above */
 	for ( ; kring != na->tailroom; kring++) {
+		if (kring->txdb.kring)
+			nm_os_txdb_fini(&kring->txdb);
 		mtx_destroy(&kring->q_lock);
 		nm_os_selinfo_uninit(&kring->si);
 	}
@@ -920,12 +976,17 @@ netmap_hw_krings_delete(struct netmap_adapter *na)
 /* call with NMG_LOCK held */
 static void netmap_unset_ringid(struct netmap_priv_d *);
 static void netmap_krings_put(struct netmap_priv_d *);
+static void netmap_sync_kloop_stop(struct netmap_priv_d *);
+static void netmap_rx_filter_release(struct netmap_priv_d *);
 void
 netmap_do_unregif(struct netmap_priv_d *priv)
 {
 	struct netmap_adapter *na = priv->np_na;
 
 	NMG_LOCK_ASSERT();
+	/* the sync loop must not touch the rings from now on */
+	netmap_sync_kloop_stop(priv);
+	netmap_rx_filter_release(priv);
 	na->active_fds--;
 	/* unset nr_pending_mode and possibly release exclusive mode */
 	netmap_krings_put(priv);
@@ -1112,23 +1173,31 @@ netmap_grab_packets(struct netmap_kring *kring, struct mbq *q, int force)
 	u_int const head = kring->rhead;
 	u_int n;
 	struct netmap_adapter *na = kring->na;
+	u_int const hdr = na->virt_hdr_len;
 
 	for (n = kring->nr_hwcur; n != head; n = nm_next(n, lim)) {
 		struct mbuf *m;
 		struct netmap_slot *slot = &kring->ring->slot[n];
+		char *buf = NMB(na, slot);
 
 		if ((slot->flags & NS_FORWARD) == 0 && !force)
 			continue;
-		if (slot->len < 14 || slot->len > NETMAP_BUF_SIZE(na)) {
+		if (slot->len < hdr + 14 || slot->len > NETMAP_BUF_SIZE(na)) {
 			RD(5, "bad pkt at %d len %d", n, slot->len);
 			continue;
 		}
 		slot->flags &= ~NS_FORWARD; // XXX needed ?
 		/* XXX TODO: adapt to the case of a multisegment packet */
-		m = m_devget(NMB(na, slot), slot->len, 0, na->ifp, NULL);
+		m = m_devget(buf + hdr, slot->len - hdr, 0, na->ifp, NULL);
 
 		if (m == NULL)
 			break;
+		if (hdr && nm_os_mbuf_vnet_hdr_set(m,
+				(struct nm_vnet_hdr *)buf)) {
+			RD(5, "bad virtio-net header at %d", n);
+			m_freem(m);
+			continue;
+		}
 		mbq_enqueue(q, m);
 	}
 }
@@ -1280,13 +1349,31 @@ netmap_rxsync_from_host(struct netmap_kring *kring, int flags)
 		while ( nm_i != stop_i && (m = mbq_dequeue(q)) != NULL ) {
 			int len = MBUF_LEN(m);
 			struct netmap_slot *slot = &ring->slot[nm_i];
-
-			m_copydata(m, 0, len, NMB(na, slot));
+			u_int hdr = na->virt_hdr_len;
+			char *buf = NMB(na, slot);
+
+			if (hdr) {
+				/* describe the offloads in the header */
+				bzero(buf, hdr);
+				if (nm_os_mbuf_vnet_hdr_get(m,
+					    (struct nm_vnet_hdr *)buf)) {
+					RD(1, "%s drop mbuf with unknown offloadings",
+						na->name);
+					mbq_enqueue(&fq, m);
+					continue;
+				}
+			}
+			m_copydata(m, 0, len, buf + hdr);
+			if (nm_kring_rx_filter_drop(kring, buf + hdr, len, len)) {
+				/* keep the slot for the next packet */
+				mbq_enqueue(&fq, m);
+				continue;
+			}
 			ND("nm %d len %d", nm_i, len);
 			if (netmap_verbose)
-                                D("%s", nm_dump_buf(NMB(na, slot),len, 128, NULL));
+                                D("%s", nm_dump_buf(buf + hdr, len, 128, NULL));
 
-			slot->len = len;
+			slot->len = hdr + len;
 			slot->flags = kring->nkr_slot_flags;
 			nm_i = nm_next(nm_i, lim);
 			mbq_enqueue(&fq, m);
@@ -1696,6 +1783,8 @@ netmap_ring_reinit(struct netmap_kring *kring)
 
 	// XXX KASSERT nm_kr_tryget
 	RD(10, "called for %s", kring->name);
+	if (unlikely(netmap_sync_stats))
+		kring->stats.reinits++;
 	// XXX probably wrong to trust userspace
 	kring->rhead = ring->head;
 	kring->rcur  = ring->cur;
@@ -1773,9 +1862,28 @@ netmap_interp_ringid(struct netmap_priv_d *priv, uint16_t ringid, uint32_t flags
 			continue;
 		}
 		switch (reg) {
+		case NR_REG_PIPE_SLAVE:
+			if (na->na_flags & NAF_PIPE_FANOUT) {
+				/* each consumer of a fan-out pipe gets
+				 * the first free rx ring, and no tx ring */
+				j = 0;
+				if (t == NR_RX) {
+					while (na->rx_rings != NULL &&
+					    j < na->num_rx_rings &&
+					    na->rx_rings[j].users > 0)
+						j++;
+					if (j == na->num_rx_rings) {
+						D("%s: no free fan-out rings", na->name);
+						return EBUSY;
+					}
+				}
+				priv->np_qfirst[t] = j;
+				priv->np_qlast[t] = (t == NR_RX ? j + 1 : j);
+				break;
+			}
+			/* fallthrough */
 		case NR_REG_ALL_NIC:
 		case NR_REG_PIPE_MASTER:
-		case NR_REG_PIPE_SLAVE:
 			priv->np_qfirst[t] = 0;
 			priv->np_qlast[t] = nma_get_nrings(na, t);
 			ND("ALL/PIPE: %s %d %d", nm_txrx2str(t),
@@ -1814,6 +1922,8 @@ netmap_interp_ringid(struct netmap_priv_d *priv, uint16_t ringid, uint32_t flags
 		}
 	}
 	priv->np_flags = (flags & ~NR_REG_MASK) | reg;
+	if (reg == NR_REG_PIPE_SLAVE && (na->na_flags & NAF_PIPE_FANOUT))
+		priv->np_flags |= NR_EXCLUSIVE;
 
 	/* Allow transparent forwarding mode in the host --> nic
 	 * direction only if all the TX hw rings have been opened. */
@@ -2159,6 +2269,61 @@ nm_sync_finalize(struct netmap_kring *kring)
 		kring->rhead, kring->rcur, kring->rtail);
 }
 
+/*
+ * Per-ring statistics. Each [tr]xsync issued on behalf of userspace
+ * is wrapped by nm_sync_stats_begin() and nm_sync_stats_end(), which
+ * only cost a test when netmap_sync_stats is not set.
+ */
+static inline void
+nm_sync_stats_begin(struct netmap_kring *kring)
+{
+	if (likely(!netmap_sync_stats))
+		return;
+	kring->stats.pos = (kring->tx == NR_TX) ?
+		kring->nr_hwcur : kring->nr_hwtail;
+	kring->stats.t0 = nm_os_timestamp_ns();
+}
+
+static void
+nm_sync_stats_update(struct netmap_kring *kring)
+{
+	struct netmap_kring_stats *st = &kring->stats;
+	u_int const lim = kring->nkr_num_slots - 1;
+	uint64_t dt = nm_os_timestamp_ns() - st->t0;
+	int n;
+	u_int b;
+
+	if (kring->tx == NR_TX) {
+		/* slots transmitted; the ring is full if the user
+		 * has no free slots left */
+		n = kring->nr_hwcur - st->pos;
+		if (kring->nr_hwtail == kring->nr_hwcur)
+			st->full++;
+	} else {
+		/* slots received; the ring is full if there is
+		 * no room for new packets */
+		n = kring->nr_hwtail - st->pos;
+		if (kring->nr_hwtail == nm_prev(kring->nr_hwcur, lim))
+			st->full++;
+	}
+	if (n < 0)
+		n += lim + 1;
+	st->syncs++;
+	st->slots += n;
+
+	for (b = 0; dt > 1 && b < NM_SYNC_HIST_LEN - 1; b++)
+		dt >>= 1;
+	st->hist[b]++;
+	st->t0 = 0;
+}
+
+static inline void
+nm_sync_stats_end(struct netmap_kring *kring)
+{
+	if (unlikely(kring->stats.t0 != 0))
+		nm_sync_stats_update(kring);
+}
+
 /* set ring timestamp */
 static inline void
 ring_timestamp_set(struct netmap_ring *ring)
@@ -2168,6 +2333,460 @@ ring_timestamp_set(struct netmap_ring *ring)
 	}
 }
 
+/*
+ * set per-slot timestamps (NR_SLOT_TIMESTAMP) on the slots made
+ * available by the last rxsync, i.e. from the old hwtail onwards,
+ * unless the adapter already did it on its own.
+ */
+static inline void
+ring_slot_timestamp_set(struct netmap_kring *kring, u_int old_hwtail)
+{
+	struct netmap_ring *ring = kring->ring;
+	u_int const lim = kring->nkr_num_slots - 1;
+	uint64_t now;
+	u_int i;
+
+	if (likely(!nm_kring_slot_ts(kring)) || old_hwtail == kring->nr_hwtail)
+		return;
+	if ((kring->na->na_flags & NAF_SLOT_TIMESTAMP) &&
+			kring->ring_id < kring->na->num_rx_rings)
+		return; /* not a host ring, the adapter took care of it */
+
+	now = nm_os_timestamp_ns();
+	for (i = old_hwtail; i != kring->nr_hwtail; i = nm_next(i, lim)) {
+		ring->slot[i].ptr = now;
+	}
+}
+
+
+/*
+ * In-kernel sync loop (NETMAP_SYNC_KLOOP_START).
+ *
+ * A kernel thread, pinned on a core chosen by the application, keeps
+ * scanning the rings bound to a file descriptor and runs txsync/rxsync
+ * whenever needed, exactly as NIOCTXSYNC/NIOCRXSYNC would do.
+ * The application only updates head/cur and watches tail in the shared
+ * rings, and never needs to issue a system call on the datapath.
+ * TX rings are skipped when there is nothing to transmit and nothing
+ * to reclaim; RX rings are always synced, since this is how new
+ * packets are discovered without interrupts.
+ * Concurrent syscalls on the same rings are still allowed, and are
+ * serialized by nm_kr_tryget().
+ */
+struct netmap_sync_kloop {
+	struct nm_kctx *nmk;
+	struct netmap_priv_d *priv;
+};
+
+static void
+netmap_sync_kloop_worker(void *data, int is_kthread)
+{
+	struct netmap_sync_kloop *kl = data;
+	struct netmap_priv_d *priv = kl->priv;
+	struct netmap_adapter *na = priv->np_na;
+	int sync_flags = priv->np_sync_flags;
+	struct mbq q;
+	u_int i;
+
+	mbq_init(&q);
+
+	for (i = priv->np_qfirst[NR_TX]; i < priv->np_qlast[NR_TX]; i++) {
+		struct netmap_kring *kring = &na->tx_rings[i];
+		struct netmap_ring *ring = kring->ring;
+
+		if (ring->head == kring->rhead && kring->nr_hwtail ==
+			    nm_prev(kring->nr_hwcur, kring->nkr_num_slots - 1)) {
+			continue; /* nothing to send, nothing to reclaim */
+		}
+		if (unlikely(nm_kr_tryget(kring, 1, NULL))) {
+			continue;
+		}
+		if (nm_txsync_prologue(kring, ring) >= kring->nkr_num_slots) {
+			netmap_ring_reinit(kring);
+		} else {
+			nm_sync_stats_begin(kring);
+			if (kring->nm_sync(kring, sync_flags | NAF_FORCE_RECLAIM) == 0) {
+				nm_sync_finalize(kring);
+			}
+			nm_sync_stats_end(kring);
+		}
+		nm_kr_put(kring);
+	}
+
+	for (i = priv->np_qfirst[NR_RX]; i < priv->np_qlast[NR_RX]; i++) {
+		struct netmap_kring *kring = &na->rx_rings[i];
+		struct netmap_ring *ring = kring->ring;
+		u_int hwtail;
+
+		if (unlikely(nm_kr_tryget(kring, 1, NULL))) {
+			continue;
+		}
+		if (nm_rxsync_prologue(kring, ring) >= kring->nkr_num_slots) {
+			netmap_ring_reinit(kring);
+		}
+		if (nm_may_forward_up(kring)) {
+			/* transparent forwarding, see netmap_poll() */
+			netmap_grab_packets(kring, &q, netmap_fwd);
+		}
+		hwtail = kring->nr_hwtail;
+		nm_sync_stats_begin(kring);
+		if (kring->nm_sync(kring, sync_flags | NAF_FORCE_READ) == 0) {
+			nm_sync_finalize(kring);
+			ring_slot_timestamp_set(kring, hwtail);
+		}
+		nm_sync_stats_end(kring);
+		ring_timestamp_set(ring);
+		nm_kr_put(kring);
+	}
+
+	if (mbq_peek(&q)) {
+		netmap_send_up(na->ifp, &q);
+	}
+}
+
+/* call with NMG_LOCK held */
+static int
+netmap_sync_kloop_start(struct netmap_priv_d *priv, struct nmreq *nmr)
+{
+	struct netmap_sync_kloop *kl;
+	struct nm_kctx_cfg kcfg;
+	u_int cpu = nmr->nr_arg1;
+	int error;
+
+	NMG_LOCK_ASSERT();
+	if (priv->np_nifp == NULL) {
+		return ENXIO;
+	}
+	if (priv->np_kloop != NULL) {
+		D("sync loop already running on %s", priv->np_na->name);
+		return EBUSY;
+	}
+	if (cpu >= nm_os_ncpus()) {
+		D("invalid cpu %u (only %u available)", cpu, nm_os_ncpus());
+		return EINVAL;
+	}
+
+	kl = nm_os_malloc(sizeof(*kl));
+	if (kl == NULL) {
+		return ENOMEM;
+	}
+	kl->priv = priv;
+
+	bzero(&kcfg, sizeof(kcfg));
+	kcfg.worker_fn = netmap_sync_kloop_worker;
+	kcfg.worker_private = kl;
+	kcfg.use_kthread = 1;
+	kl->nmk = nm_os_kctx_create(&kcfg, 0, NULL);
+	if (kl->nmk == NULL) {
+		nm_os_free(kl);
+		return ENOMEM;
+	}
+	nm_os_kctx_worker_setaff(kl->nmk, cpu);
+
+	error = nm_os_kctx_worker_start(kl->nmk);
+	if (error) {
+		nm_os_kctx_destroy(kl->nmk);
+		nm_os_free(kl);
+		return error;
+	}
+	priv->np_kloop = kl;
+	if (netmap_verbose)
+		D("sync loop started on %s, cpu %u", priv->np_na->name, cpu);
+
+	return 0;
+}
+
+/* call with NMG_LOCK held */
+static void
+netmap_sync_kloop_stop(struct netmap_priv_d *priv)
+{
+	struct netmap_sync_kloop *kl = priv->np_kloop;
+
+	NMG_LOCK_ASSERT();
+	if (kl == NULL) {
+		return;
+	}
+	nm_os_kctx_worker_stop(kl->nmk);
+	nm_os_kctx_destroy(kl->nmk);
+	nm_os_free(kl);
+	priv->np_kloop = NULL;
+}
+
+
+/*
+ * NIOCCONFIG handler for struct nm_kring_stats requests.
+ * The port is looked up by name, without binding it.
+ */
+static int
+netmap_kring_stats_get(struct nm_ifreq *ifr)
+{
+	struct nm_kring_stats *ks = (struct nm_kring_stats *)ifr->data;
+	struct netmap_adapter *na = NULL;
+	struct ifnet *ifp = NULL;
+	struct netmap_kring *kring;
+	struct nmreq nmr;
+	enum txrx t = ks->tx ? NR_TX : NR_RX;
+	int error;
+
+	bzero(&nmr, sizeof(nmr));
+	strncpy(nmr.nr_name, ifr->nifr_name, sizeof(nmr.nr_name) - 1);
+	nmr.nr_version = NETMAP_API;
+
+	NMG_LOCK();
+	error = netmap_get_na(&nmr, &na, &ifp, NULL, 0 /* don't create */);
+	if (error || na == NULL) {
+		error = error ? error : ENXIO;
+		goto out;
+	}
+	if (NMR(na, t) == NULL) {
+		/* no krings, the port is not in netmap mode */
+		error = ENXIO;
+		goto out;
+	}
+	ks->num_rings = netmap_real_rings(na, t);
+	if (ks->ring_id >= ks->num_rings) {
+		error = EINVAL;
+		goto out;
+	}
+	kring = &NMR(na, t)[ks->ring_id];
+	ks->num_slots = kring->nkr_num_slots;
+	ks->hwcur = kring->nr_hwcur;
+	ks->hwtail = kring->nr_hwtail;
+	ks->syncs = kring->stats.syncs;
+	ks->slots = kring->stats.slots;
+	ks->notifies = kring->stats.notifies;
+	ks->full = kring->stats.full;
+	ks->reinits = kring->stats.reinits;
+	ks->drops = kring->stats.drops;
+	memcpy(ks->hist, kring->stats.hist, sizeof(ks->hist));
+	if (ks->flags & NM_KSTATS_RESET) {
+		bzero(&kring->stats, sizeof(kring->stats));
+	}
+out:
+	netmap_unget_na(na, ifp);
+	NMG_UNLOCK();
+	return error;
+}
+
+
+
+/*
+ * NIOCCONFIG handler for struct nm_adapter_stats requests.
+ * The port is looked up by name, without binding it, and the
+ * notification statistics of its hardware rings are summed up.
+ */
+static int
+netmap_adapter_stats_get(struct nm_ifreq *ifr)
+{
+	struct nm_adapter_stats *as = (struct nm_adapter_stats *)ifr->data;
+	struct netmap_adapter *na = NULL;
+	struct ifnet *ifp = NULL;
+	struct nmreq nmr;
+	enum txrx t = as->tx ? NR_TX : NR_RX;
+	int error, i, b;
+
+	bzero(&nmr, sizeof(nmr));
+	strncpy(nmr.nr_name, ifr->nifr_name, sizeof(nmr.nr_name) - 1);
+	nmr.nr_version = NETMAP_API;
+
+	NMG_LOCK();
+	error = netmap_get_na(&nmr, &na, &ifp, NULL, 0 /* don't create */);
+	if (error || na == NULL) {
+		error = error ? error : ENXIO;
+		goto out;
+	}
+	if (NMR(na, t) == NULL) {
+		/* no krings, the port is not in netmap mode */
+		error = ENXIO;
+		goto out;
+	}
+	as->num_rings = nma_get_nrings(na, t);
+	as->kicks = as->wakeups = as->intrs = as->intrs_suppressed = 0;
+	as->syncs = as->dry_syncs = as->slots = as->drops = 0;
+	bzero(as->hist, sizeof(as->hist));
+	for (i = 0; i < as->num_rings; i++) {
+		struct netmap_kring_nstats *ns = &NMR(na, t)[i].nstats;
+
+		as->kicks += ns->kicks;
+		as->wakeups += ns->wakeups;
+		as->intrs += ns->intrs;
+		as->intrs_suppressed += ns->intrs_suppressed;
+		as->syncs += ns->syncs;
+		as->dry_syncs += ns->dry_syncs;
+		as->slots += ns->slots;
+		as->drops += ns->drops;
+		for (b = 0; b < NM_BATCH_HIST_LEN; b++)
+			as->hist[b] += ns->hist[b];
+		if (as->flags & NM_ADSTATS_RESET) {
+			bzero(ns, sizeof(*ns));
+		}
+	}
+out:
+	netmap_unget_na(na, ifp);
+	NMG_UNLOCK();
+	return error;
+}
+
+
+/* Replace the rx filter of a kring and return the old one, taking
+ * the lock that protects the datapath which reads it.
+ * Once we return, nobody can be using the old filter any more.
+ */
+static struct nm_bpf_prog *
+netmap_kring_swap_rx_filter(struct netmap_kring *kring,
+		struct nm_bpf_prog *prog)
+{
+	struct nm_bpf_prog *old;
+
+	if (kring->nm_sync == netmap_rxsync_from_host) {
+		/* the host rxsync runs under the lock of its queue */
+		mbq_lock(&kring->rx_queue);
+		old = kring->rx_filter;
+		kring->rx_filter = prog;
+		mbq_unlock(&kring->rx_queue);
+		return old;
+	}
+#ifdef WITH_VALE
+	old = netmap_bdg_swap_rx_filter(kring, prog);
+#else
+	/* copy monitors and generic adapters run it under the q_lock */
+	mtx_lock(&kring->q_lock);
+	old = kring->rx_filter;
+	kring->rx_filter = prog;
+	mtx_unlock(&kring->q_lock);
+#endif /* WITH_VALE */
+	return old;
+}
+
+
+/*
+ * Replace the rx filter of a kring with prog (NULL detaches it),
+ * on behalf of priv, and free the old one.
+ * We do not wait for the rxsync of the kring: the swap is done under
+ * the lock the readers of the filter hold, so this also works on
+ * stopped rings, whose nr_busy is held until they are restarted.
+ */
+static void
+netmap_kring_set_rx_filter(struct netmap_kring *kring,
+		struct netmap_priv_d *priv, struct nm_bpf_prog *prog)
+{
+	struct nm_bpf_prog *old;
+
+	old = netmap_kring_swap_rx_filter(kring, prog);
+	kring->rx_filter_owner = prog ? priv : NULL;
+	if (old)
+		nm_os_free(old);
+}
+
+
+/* Detach the rx filters that priv attached to its rings. */
+static void
+netmap_rx_filter_release(struct netmap_priv_d *priv)
+{
+	struct netmap_adapter *na = priv->np_na;
+	u_int i;
+
+	for (i = priv->np_qfirst[NR_RX]; i < priv->np_qlast[NR_RX]; i++) {
+		struct netmap_kring *kring = &NMR(na, NR_RX)[i];
+
+		if (kring->rx_filter && kring->rx_filter_owner == priv)
+			netmap_kring_set_rx_filter(kring, NULL, NULL);
+	}
+}
+
+
+/*
+ * NIOCCONFIG handler for struct nm_rx_filter requests: attach a
+ * filter to all the rx rings bound to priv, or detach it.
+ * Either all the rings get the new filter or none does.
+ */
+static int
+netmap_rx_filter_config(struct netmap_priv_d *priv, struct nm_ifreq *ifr)
+{
+	struct nm_rx_filter *req = (struct nm_rx_filter *)ifr->data;
+	struct nm_bpf_insn *insns = NULL;
+	struct nm_bpf_prog **progs = NULL;
+	struct netmap_adapter *na;
+	size_t size = req->len * sizeof(*insns);
+	u_int i, n, nrings;
+	int error = 0;
+
+	if (!(req->flags & NM_RXFILTER_GET) && req->len > 0) {
+		if (req->len > NM_RXFILTER_MAXLEN)
+			return EINVAL;
+		insns = nm_os_malloc(size);
+		if (insns == NULL)
+			return ENOMEM;
+		if (copyin((void *)(uintptr_t)req->prog, insns, size)) {
+			error = EFAULT;
+			goto out_free;
+		}
+		error = nm_bpf_validate(insns, req->len);
+		if (error) {
+			D("invalid rx filter program");
+			goto out_free;
+		}
+	}
+
+	NMG_LOCK();
+	na = priv->np_na;
+	if (priv->np_nifp == NULL || na == NULL) {
+		error = ENXIO;
+		goto out;
+	}
+	nrings = priv->np_qlast[NR_RX] - priv->np_qfirst[NR_RX];
+	req->drops = 0;
+	for (i = priv->np_qfirst[NR_RX]; i < priv->np_qlast[NR_RX]; i++) {
+		/* host rings are always served by netmap_rxsync_from_host() */
+		if (i < na->num_rx_rings && !(na->na_flags & NAF_RX_FILTER)) {
+			error = EOPNOTSUPP;
+			goto out;
+		}
+		req->drops += NMR(na, NR_RX)[i].rx_filter_drops;
+	}
+	if (req->flags & NM_RXFILTER_GET)
+		goto out;
+
+	if (insns != NULL && nrings > 0) {
+		/* one copy per ring, so that each ring owns its filter */
+		progs = nm_os_malloc(nrings * sizeof(*progs));
+		if (progs == NULL) {
+			error = ENOMEM;
+			goto out;
+		}
+		for (n = 0; n < nrings; n++) {
+			progs[n] = nm_os_malloc(sizeof(**progs) + size);
+			if (progs[n] == NULL) {
+				error = ENOMEM;
+				goto out;
+			}
+			progs[n]->len = req->len;
+			progs[n]->insns = (struct nm_bpf_insn *)(progs[n] + 1);
+			memcpy(progs[n]->insns, insns, size);
+		}
+	}
+	for (i = priv->np_qfirst[NR_RX], n = 0; i < priv->np_qlast[NR_RX];
+			i++, n++) {
+		netmap_kring_set_rx_filter(&NMR(na, NR_RX)[i], priv,
+				progs ? progs[n] : NULL);
+		if (progs)
+			progs[n] = NULL; /* now owned by the kring */
+	}
+out:
+	NMG_UNLOCK();
+	if (progs) {
+		for (n = 0; n < nrings; n++) {
+			if (progs[n])
+				nm_os_free(progs[n]);
+		}
+		nm_os_free(progs);
+	}
+out_free:
+	if (insns)
+		nm_os_free(insns);
+	return error;
+}
+
 
 /*
  * ioctl(2) support for the "netmap" device.
@@ -2302,6 +2921,21 @@ netmap_ioctl(struct netmap_priv_d *priv, u_long cmd, caddr_t data, struct thread
 			}
 			NMG_UNLOCK();
 			break;
+		} else if (i == NETMAP_SYNC_KLOOP_START) {
+			/* let a kernel thread sync the bound rings */
+			NMG_LOCK();
+			error = netmap_sync_kloop_start(priv, nmr);
+			NMG_UNLOCK();
+			break;
+		} else if (i == NETMAP_SYNC_KLOOP_STOP) {
+			NMG_LOCK();
+			if (priv->np_kloop == NULL) {
+				error = EINVAL;
+			} else {
+				netmap_sync_kloop_stop(priv);
+			}
+			NMG_UNLOCK();
+			break;
 		} else if (i != 0) {
 			D("nr_cmd must be 0 not %d", i);
 			error = EINVAL;
@@ -2353,6 +2987,12 @@ netmap_ioctl(struct netmap_priv_d *priv, u_long cmd, caddr_t data, struct thread
 			nmr->nr_tx_rings = na->num_tx_rings;
 			nmr->nr_rx_slots = na->num_rx_desc;
 			nmr->nr_tx_slots = na->num_tx_desc;
+			if (na->na_flags & NAF_PIPE_FANOUT) {
+				nmr->nr_flags |= NR_PIPE_FANOUT;
+				/* tell the consumer which ring it got */
+				if ((nmr->nr_flags & NR_REG_MASK) == NR_REG_PIPE_SLAVE)
+					nmr->nr_arg1 = priv->np_qfirst[NR_RX];
+			}
 			error = netmap_mem_get_info(na->nm_mem, &nmr->nr_memsize, &memflags,
 				&nmr->nr_arg2);
 			if (error) {
@@ -2432,14 +3072,20 @@ netmap_ioctl(struct netmap_priv_d *priv, u_long cmd, caddr_t data, struct thread
 					    kring->nr_hwcur);
 				if (nm_txsync_prologue(kring, ring) >= kring->nkr_num_slots) {
 					netmap_ring_reinit(kring);
-				} else if (kring->nm_sync(kring, sync_flags | NAF_FORCE_RECLAIM) == 0) {
-					nm_sync_finalize(kring);
+				} else {
+					nm_sync_stats_begin(kring);
+					if (kring->nm_sync(kring, sync_flags | NAF_FORCE_RECLAIM) == 0) {
+						nm_sync_finalize(kring);
+					}
+					nm_sync_stats_end(kring);
 				}
 				if (netmap_verbose & NM_VERB_TXSYNC)
 					D("post txsync ring %d cur %d hwcur %d",
 					    i, ring->cur,
 					    kring->nr_hwcur);
 			} else {
+				u_int hwtail;
+
 				if (nm_rxsync_prologue(kring, ring) >= kring->nkr_num_slots) {
 					netmap_ring_reinit(kring);
 				}
@@ -2447,9 +3093,13 @@ netmap_ioctl(struct netmap_priv_d *priv, u_long cmd, caddr_t data, struct thread
 					/* transparent forwarding, see netmap_poll() */
 					netmap_grab_packets(kring, &q, netmap_fwd);
 				}
+				hwtail = kring->nr_hwtail;
+				nm_sync_stats_begin(kring);
 				if (kring->nm_sync(kring, sync_flags | NAF_FORCE_READ) == 0) {
 					nm_sync_finalize(kring);
+					ring_slot_timestamp_set(kring, hwtail);
 				}
+				nm_sync_stats_end(kring);
 				ring_timestamp_set(ring);
 			}
 			nm_kr_put(kring);
@@ -2461,11 +3111,44 @@ netmap_ioctl(struct netmap_priv_d *priv, u_long cmd, caddr_t data, struct thread
 
 		break;
 
-#ifdef WITH_VALE
 	case NIOCCONFIG:
+		if (((struct nm_kring_stats *)((struct nm_ifreq *)data)->data)->magic
+				== NM_KSTATS_MAGIC) {
+			error = netmap_kring_stats_get((struct nm_ifreq *)data);
+			break;
+		}
+		if (((struct nm_adapter_stats *)((struct nm_ifreq *)data)->data)->magic
+				== NM_ADSTATS_MAGIC) {
+			error = netmap_adapter_stats_get((struct nm_ifreq *)data);
+			break;
+		}
+		if (((struct nm_rx_filter *)((struct nm_ifreq *)data)->data)->magic
+				== NM_RXFILTER_MAGIC) {
+			error = netmap_rx_filter_config(priv,
+					(struct nm_ifreq *)data);
+			break;
+		}
+		if (((struct nm_mon_sampling *)((struct nm_ifreq *)data)->data)->magic
+				== NM_MONSAMPLE_MAGIC) {
+			error = netmap_monitor_sampling_config(priv,
+					(struct nm_ifreq *)data);
+			break;
+		}
+		if (((struct nm_sink_req *)((struct nm_ifreq *)data)->data)->magic
+				== NM_SINK_MAGIC) {
+#ifdef WITH_SINK
+			error = nm_os_sink_config((struct nm_ifreq *)data);
+#else
+			error = EOPNOTSUPP;
+#endif /* WITH_SINK */
+			break;
+		}
+#ifdef WITH_VALE
 		error = netmap_bdg_config(nmr);
-		break;
+#else
+		error = EOPNOTSUPP;
 #endif
+		break;
 #ifdef __FreeBSD__
 	case FIONBIO:
 	case FIOASYNC:
@@ -2656,10 +3339,14 @@ flush_tx:
 				netmap_ring_reinit(kring);
 				revents |= POLLERR;
 			} else {
-				if (kring->nm_sync(kring, sync_flags))
+				nm_sync_stats_begin(kring);
+				/* poll() is where the application waits,
+				 * do not leave slots behind the doorbell */
+				if (kring->nm_sync(kring, sync_flags | NAF_TXDB_FLUSH))
 					revents |= POLLERR;
 				else
 					nm_sync_finalize(kring);
+				nm_sync_stats_end(kring);
 			}
 
 			/*
@@ -2695,6 +3382,7 @@ flush_tx:
 do_retry_rx:
 		for (i = priv->np_qfirst[NR_RX]; i < priv->np_qlast[NR_RX]; i++) {
 			int found = 0;
+			u_int hwtail;
 
 			kring = &na->rx_rings[i];
 			ring = kring->ring;
@@ -2720,10 +3408,15 @@ do_retry_rx:
 			 * the nm_sync() below only on for the host RX ring (see
 			 * netmap_rxsync_from_host()). */
 			kring->nr_kflags &= ~NR_FORWARD;
-			if (kring->nm_sync(kring, sync_flags))
+			hwtail = kring->nr_hwtail;
+			nm_sync_stats_begin(kring);
+			if (kring->nm_sync(kring, sync_flags)) {
 				revents |= POLLERR;
-			else
+			} else {
 				nm_sync_finalize(kring);
+				ring_slot_timestamp_set(kring, hwtail);
+			}
+			nm_sync_stats_end(kring);
 			send_down |= (kring->nr_kflags & NR_FORWARD);
 			ring_timestamp_set(ring);
 			found = kring->rcur != kring->rtail;
@@ -2811,6 +3504,8 @@ netmap_notify(struct netmap_kring *kring, int flags)
 	struct netmap_adapter *na = kring->na;
 	enum txrx t = kring->tx;
 
+	if (unlikely(netmap_sync_stats))
+		kring->stats.notifies++;
 	nm_os_selwakeup(&kring->si);
 	/* optimization: avoid a wake up on the global
 	 * queue if nobody has registered for more
@@ -3127,13 +3822,15 @@ netmap_transmit(struct ifnet *ifp, struct mbuf *m)
 	q = &kring->rx_queue;
 
 	// XXX reconsider long packets if we handle fragments
-	if (len > NETMAP_BUF_SIZE(na)) { /* too long for us */
+	if (na->virt_hdr_len + len > NETMAP_BUF_SIZE(na)) { /* too long for us */
 		D("%s from_host, drop packet size %d > %d", na->name,
-			len, NETMAP_BUF_SIZE(na));
+			na->virt_hdr_len + len, NETMAP_BUF_SIZE(na));
 		goto done;
 	}
 
-	if (nm_os_mbuf_has_offld(m)) {
+	/* With a virtio-net header, the offloads are passed to the
+	 * application (see netmap_rxsync_from_host()). */
+	if (!na->virt_hdr_len && nm_os_mbuf_has_offld(m)) {
 		RD(1, "%s drop mbuf that needs offloadings", na->name);
 		goto done;
 	}
@@ -3175,6 +3872,192 @@ done:
 }
 
 
+/*
+ * Tx doorbell coalescing, called through nm_txdb_kick() by the txsync
+ * of native drivers after queueing n new slots. Returns nonzero if the
+ * driver must write the tail register of the NIC now, otherwise the
+ * slots are left pending and the timer is armed to flush them.
+ */
+int
+netmap_txdb_kick(struct netmap_kring *kring, u_int n, int report, int flags)
+{
+	return netmap_txdb_coalesce(kring, n, report ||
+			(flags & NAF_TXDB_FLUSH) ||
+			(kring->ring->flags & NR_TX_FLUSH),
+			netmap_txdb_slots, netmap_txdb_usecs);
+}
+
+
+/*
+ * The coalescing policy: notify when there are at least slots pending
+ * slots, or the oldest of them has waited for usecs microseconds, or
+ * the caller asks to flush. We never keep more than half a ring
+ * pending, so that the other side does not run dry while the
+ * application waits for free slots.
+ */
+int
+netmap_txdb_coalesce(struct netmap_kring *kring, u_int n, int flush,
+		u_int slots, u_int usecs)
+{
+	struct nm_txdb *db = &kring->txdb;
+	uint64_t now;
+
+	if (n == 0 && db->pending == 0)
+		return 0;
+	now = nm_os_timestamp_ns();
+	if (db->pending == 0)
+		db->t0 = now;
+	db->pending += n;
+	if (slots > kring->nkr_num_slots / 2)
+		slots = kring->nkr_num_slots / 2;
+	if (flush || db->kring == NULL || db->pending >= slots ||
+	    now - db->t0 >= (uint64_t)usecs * 1000 ||
+	    nm_os_txdb_arm(db, usecs)) {
+		db->pending = 0;
+		return 1;
+	}
+	return 0;
+}
+
+
+/*
+ * Timer callback for the tx doorbell coalescing: run the txsync to
+ * flush the pending slots. If the ring is busy we cannot tell whether
+ * the txsync in progress has seen them, so we ask to be called again.
+ */
+int
+netmap_txdb_expire(struct nm_txdb *db)
+{
+	struct netmap_kring *kring = db->kring;
+	int ret;
+
+	if (db->pending == 0)
+		return 0;
+	ret = nm_kr_tryget(kring, 0, NULL);
+	if (ret)
+		return ret != NM_KR_STOPPED;
+	if (kring->nr_mode == NKR_NETMAP_ON && db->pending)
+		kring->nm_sync(kring, NAF_TXDB_FLUSH);
+	nm_kr_put(kring);
+	return 0;
+}
+
+
+/*
+ * Flow hash, used by the emulated adapters for software RSS and by
+ * the sampling monitors. It is the symmetric Toeplitz hash of
+ * apps/lb/pkt_hash.c, so both directions of a flow get the same value.
+ */
+#define NM_FLOW_KEYLEN	96	/* bits of hash input */
+
+static uint32_t nm_flow_key_cache[NM_FLOW_KEYLEN];
+
+static void
+nm_flow_hash_init(void)
+{
+	/* The first 128 bits repeat every 16 bits, so that swapping
+	 * the addresses and the ports gives the same hash. */
+	static const uint8_t key[] = {
+		0x50, 0x6d, 0x50, 0x6d, 0x50, 0x6d, 0x50, 0x6d,
+		0x50, 0x6d, 0x50, 0x6d, 0x50, 0x6d, 0x50, 0x6d,
+		0xcb, 0x2b, 0x5a, 0x5a, 0xb4, 0x30, 0x7b, 0xae,
+		0xa3, 0x2d, 0xcb, 0x77, 0x0c, 0xf2, 0x30, 0x80,
+		0x3b, 0xb7, 0x42, 0x6a, 0xfa, 0x01, 0xac, 0xbe};
+	uint32_t result = ((uint32_t)key[0] << 24) | (key[1] << 16) |
+			  (key[2] << 8) | key[3];
+	u_int i, idx = 32;
+
+	for (i = 0; i < NM_FLOW_KEYLEN; i++, idx++) {
+		nm_flow_key_cache[i] = result;
+		result = (result << 1) | ((key[idx / 8] >> (7 - idx % 8)) & 1);
+	}
+}
+
+static uint32_t
+nm_flow_toeplitz(uint32_t sip, uint32_t dip, uint16_t sp, uint16_t dp)
+{
+	const uint32_t *k = nm_flow_key_cache;
+	uint32_t rc = 0;
+	int i;
+
+	for (i = 0; i < 32; i++) {
+		if (sip & (0x80000000U >> i))
+			rc ^= k[i];
+		if (dip & (0x80000000U >> i))
+			rc ^= k[32 + i];
+	}
+	for (i = 0; i < 16; i++) {
+		if (sp & (0x8000 >> i))
+			rc ^= k[64 + i];
+		if (dp & (0x8000 >> i))
+			rc ^= k[80 + i];
+	}
+	return rc;
+}
+
+#define NM_FLOW_BE16(p)	((uint16_t)(((p)[0] << 8) | (p)[1]))
+#define NM_FLOW_BE32(p)	(((uint32_t)NM_FLOW_BE16(p) << 16) | NM_FLOW_BE16((p) + 2))
+
+/*
+ * Hash the first len bytes of a frame (starting from the ethernet
+ * header). Handles IPv4 and IPv6 (possibly VLAN tagged or tunneled
+ * in IPv4/IPv6), using the ports for TCP and UDP. Other frames
+ * are hashed on the MAC addresses. Never reads past len.
+ */
+uint32_t
+nm_flow_hash(const uint8_t *p, u_int len)
+{
+	uint16_t etype, sp = 0xFFFD, dp = 0xFFFE;
+	uint32_t sip, dip;
+	u_int ofs = 14, l4, tunnels;
+	uint8_t proto;
+	int frag;
+
+	if (len < 14)
+		return 0;
+	etype = NM_FLOW_BE16(p + 12);
+	if (etype == 0x8100 /* VLAN */ && len >= 18) {
+		etype = NM_FLOW_BE16(p + 16);
+		ofs = 18;
+	}
+
+	for (tunnels = 0; tunnels < 2; tunnels++) {
+		if (etype == 0x0800 /* IPv4 */ && len >= ofs + 20) {
+			sip = NM_FLOW_BE32(p + ofs + 12);
+			dip = NM_FLOW_BE32(p + ofs + 16);
+			proto = p[ofs + 9];
+			/* only the first fragment has the ports */
+			frag = (NM_FLOW_BE16(p + ofs + 6) & 0x3fff) != 0;
+			l4 = ofs + ((p[ofs] & 0xf) << 2);
+		} else if (etype == 0x86dd /* IPv6 */ && len >= ofs + 40) {
+			/* first 4 bytes of the addresses, as pkt_hash.c */
+			sip = NM_FLOW_BE32(p + ofs + 8);
+			dip = NM_FLOW_BE32(p + ofs + 24);
+			proto = p[ofs + 6];
+			frag = 0;
+			l4 = ofs + 40;
+		} else {
+			break;
+		}
+
+		if (proto == 4 /* IPIP */ || proto == 41 /* IPv6 */) {
+			etype = (proto == 4) ? 0x0800 : 0x86dd;
+			ofs = l4;
+			continue;
+		}
+		if ((proto == 6 /* TCP */ || proto == 17 /* UDP */) &&
+				!frag && len >= l4 + 4) {
+			sp = NM_FLOW_BE16(p + l4);
+			dp = NM_FLOW_BE16(p + l4 + 2);
+		}
+		return nm_flow_toeplitz(sip, dip, sp, dp);
+	}
+
+	/* not IP, or truncated: use the last 4 bytes of the MACs */
+	return nm_flow_toeplitz(NM_FLOW_BE32(p + 8), NM_FLOW_BE32(p + 2), sp, dp);
+}
+
+
 /*
  * netmap_reset() is called by the driver routines when reinitializing
  * a ring. The driver is in charge of locking to protect the kring.
@@ -3215,6 +4098,8 @@ netmap_reset(struct netmap_adapter *na, enum txrx tx, u_int n,
 
 		// XXX check whether we should use hwcur or rcur
 		new_hwofs = kring->nr_hwcur - new_cur;
+		/* the NIC ring is reset, nothing is pending anymore */
+		kring->txdb.pending = 0;
 	} else {
 		if (n >= na->num_rx_rings)
 			return NULL;
@@ -3388,6 +4273,7 @@ netmap_init(void)
 	error = netmap_mem_init();
 	if (error != 0)
 		goto fail;
+	nm_flow_hash_init();
 	/*
 	 * MAKEDEV_ETERNAL_KLD avoids an expensive check on syscalls
 	 * when the module is compiled in.
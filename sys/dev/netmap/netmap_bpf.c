@@ -0,0 +1,452 @@
+/*
+ * Copyright (C) 2017 Universita` di Pisa. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *   1. Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * $FreeBSD$
+ *
+ * A small classic BPF interpreter, used to filter packets on the
+ * netmap rings before they are made visible to userspace.
+ * The host OS bpf engine is not used because it works on mbufs,
+ * while here packets are in netmap buffers, and because its
+ * availability and interface differ between the supported platforms.
+ *
+ * Programs are checked once with nm_bpf_validate() when attached,
+ * so that nm_bpf_filter() can run them without further checks
+ * on the instructions: it only checks the packet offsets.
+ */
+
+#if defined(linux)
+#include "bsd_glue.h"
+#elif defined (_WIN32)
+#include "win_glue.h"
+#else   /* __FreeBSD__ */
+#include <sys/param.h>
+#include <sys/lock.h>
+#include <sys/mutex.h>
+#include <sys/systm.h>
+#include <sys/errno.h>
+#include <sys/socket.h> /* sockaddrs */
+#include <net/if.h>
+#include <net/if_var.h>
+#include <machine/bus.h>	/* bus_dmamap_* */
+#endif
+
+#include <net/netmap.h>
+#include <dev/netmap/netmap_kern.h>
+
+/* instruction classes */
+#define NM_BPF_CLASS(c)	((c) & 0x07)
+#define NM_BPF_LD	0x00
+#define NM_BPF_LDX	0x01
+#define NM_BPF_ST	0x02
+#define NM_BPF_STX	0x03
+#define NM_BPF_ALU	0x04
+#define NM_BPF_JMP	0x05
+#define NM_BPF_RET	0x06
+#define NM_BPF_MISC	0x07
+
+/* ld/ldx fields */
+#define NM_BPF_W	0x00
+#define NM_BPF_H	0x08
+#define NM_BPF_B	0x10
+#define NM_BPF_IMM	0x00
+#define NM_BPF_ABS	0x20
+#define NM_BPF_IND	0x40
+#define NM_BPF_MEM	0x60
+#define NM_BPF_LEN	0x80
+#define NM_BPF_MSH	0xa0
+
+/* alu/jmp fields */
+#define NM_BPF_ADD	0x00
+#define NM_BPF_SUB	0x10
+#define NM_BPF_MUL	0x20
+#define NM_BPF_DIV	0x30
+#define NM_BPF_OR	0x40
+#define NM_BPF_AND	0x50
+#define NM_BPF_LSH	0x60
+#define NM_BPF_RSH	0x70
+#define NM_BPF_NEG	0x80
+#define NM_BPF_MOD	0x90
+#define NM_BPF_XOR	0xa0
+
+#define NM_BPF_JA	0x00
+#define NM_BPF_JEQ	0x10
+#define NM_BPF_JGT	0x20
+#define NM_BPF_JGE	0x30
+#define NM_BPF_JSET	0x40
+
+#define NM_BPF_K	0x00
+#define NM_BPF_X	0x08
+
+/* ret fields */
+#define NM_BPF_A	0x10
+
+/* misc fields */
+#define NM_BPF_TAX	0x00
+#define NM_BPF_TXA	0x80
+
+#define NM_BPF_MEMWORDS	16	/* scratch memory words */
+
+/*
+ * Check that the program is safe to run: all the opcodes are known,
+ * jumps go forward and stay within the program, scratch memory
+ * accesses are in range, there are no divisions by a zero constant
+ * and the program ends with a return.
+ * Returns 0 if the program is valid, EINVAL otherwise.
+ */
+int
+nm_bpf_validate(const struct nm_bpf_insn *prog, u_int len)
+{
+	u_int i;
+
+	if (len == 0 || len > NM_RXFILTER_MAXLEN)
+		return EINVAL;
+
+	for (i = 0; i < len; i++) {
+		const struct nm_bpf_insn *p = &prog[i];
+		u_int left = len - i - 1; /* instructions after this one */
+
+		switch (p->code) {
+		case NM_BPF_LD|NM_BPF_W|NM_BPF_ABS:
+		case NM_BPF_LD|NM_BPF_H|NM_BPF_ABS:
+		case NM_BPF_LD|NM_BPF_B|NM_BPF_ABS:
+		case NM_BPF_LD|NM_BPF_W|NM_BPF_IND:
+		case NM_BPF_LD|NM_BPF_H|NM_BPF_IND:
+		case NM_BPF_LD|NM_BPF_B|NM_BPF_IND:
+		case NM_BPF_LD|NM_BPF_W|NM_BPF_LEN:
+		case NM_BPF_LDX|NM_BPF_W|NM_BPF_LEN:
+		case NM_BPF_LDX|NM_BPF_MSH|NM_BPF_B:
+		case NM_BPF_LD|NM_BPF_IMM:
+		case NM_BPF_LDX|NM_BPF_IMM:
+		case NM_BPF_RET|NM_BPF_K:
+		case NM_BPF_RET|NM_BPF_A:
+		case NM_BPF_MISC|NM_BPF_TAX:
+		case NM_BPF_MISC|NM_BPF_TXA:
+		case NM_BPF_ALU|NM_BPF_NEG:
+		case NM_BPF_ALU|NM_BPF_ADD|NM_BPF_K:
+		case NM_BPF_ALU|NM_BPF_SUB|NM_BPF_K:
+		case NM_BPF_ALU|NM_BPF_MUL|NM_BPF_K:
+		case NM_BPF_ALU|NM_BPF_AND|NM_BPF_K:
+		case NM_BPF_ALU|NM_BPF_OR|NM_BPF_K:
+		case NM_BPF_ALU|NM_BPF_XOR|NM_BPF_K:
+		case NM_BPF_ALU|NM_BPF_LSH|NM_BPF_K:
+		case NM_BPF_ALU|NM_BPF_RSH|NM_BPF_K:
+		case NM_BPF_ALU|NM_BPF_ADD|NM_BPF_X:
+		case NM_BPF_ALU|NM_BPF_SUB|NM_BPF_X:
+		case NM_BPF_ALU|NM_BPF_MUL|NM_BPF_X:
+		case NM_BPF_ALU|NM_BPF_DIV|NM_BPF_X:
+		case NM_BPF_ALU|NM_BPF_MOD|NM_BPF_X:
+		case NM_BPF_ALU|NM_BPF_AND|NM_BPF_X:
+		case NM_BPF_ALU|NM_BPF_OR|NM_BPF_X:
+		case NM_BPF_ALU|NM_BPF_XOR|NM_BPF_X:
+		case NM_BPF_ALU|NM_BPF_LSH|NM_BPF_X:
+		case NM_BPF_ALU|NM_BPF_RSH|NM_BPF_X:
+			break;
+
+		case NM_BPF_LD|NM_BPF_MEM:
+		case NM_BPF_LDX|NM_BPF_MEM:
+		case NM_BPF_ST:
+		case NM_BPF_STX:
+			if (p->k >= NM_BPF_MEMWORDS)
+				return EINVAL;
+			break;
+
+		case NM_BPF_ALU|NM_BPF_DIV|NM_BPF_K:
+		case NM_BPF_ALU|NM_BPF_MOD|NM_BPF_K:
+			if (p->k == 0)
+				return EINVAL;
+			break;
+
+		case NM_BPF_JMP|NM_BPF_JA:
+			if (p->k >= left)
+				return EINVAL;
+			break;
+
+		case NM_BPF_JMP|NM_BPF_JEQ|NM_BPF_K:
+		case NM_BPF_JMP|NM_BPF_JGT|NM_BPF_K:
+		case NM_BPF_JMP|NM_BPF_JGE|NM_BPF_K:
+		case NM_BPF_JMP|NM_BPF_JSET|NM_BPF_K:
+		case NM_BPF_JMP|NM_BPF_JEQ|NM_BPF_X:
+		case NM_BPF_JMP|NM_BPF_JGT|NM_BPF_X:
+		case NM_BPF_JMP|NM_BPF_JGE|NM_BPF_X:
+		case NM_BPF_JMP|NM_BPF_JSET|NM_BPF_X:
+			if (p->jt >= left || p->jf >= left)
+				return EINVAL;
+			break;
+
+		default:
+			return EINVAL;
+		}
+	}
+	return NM_BPF_CLASS(prog[len - 1].code) == NM_BPF_RET ? 0 : EINVAL;
+}
+
+/*
+ * Run a validated program on a packet. 'buf' contains the first
+ * 'buflen' bytes of a packet of 'wirelen' bytes; loads beyond 'buflen'
+ * terminate the program with a return value of 0, as in the
+ * host bpf engines.
+ * Returns the value of the return instruction, which is 0 if
+ * the packet must be dropped.
+ */
+u_int
+nm_bpf_filter(const struct nm_bpf_insn *pc, const uint8_t *buf,
+		u_int wirelen, u_int buflen)
+{
+	uint32_t A = 0, X = 0, k;
+	uint32_t mem[NM_BPF_MEMWORDS] = { 0 }; /* do not leak the stack */
+
+	--pc;
+	for (;;) {
+		++pc;
+		switch (pc->code) {
+		default: /* cannot happen on a validated program */
+			return 0;
+
+		case NM_BPF_RET|NM_BPF_K:
+			return pc->k;
+
+		case NM_BPF_RET|NM_BPF_A:
+			return A;
+
+		case NM_BPF_LD|NM_BPF_W|NM_BPF_ABS:
+			k = pc->k;
+			if (k > buflen || sizeof(int32_t) > buflen - k)
+				return 0;
+			A = ((uint32_t)buf[k] << 24) | ((uint32_t)buf[k + 1] << 16) |
+			    ((uint32_t)buf[k + 2] << 8) | buf[k + 3];
+			continue;
+
+		case NM_BPF_LD|NM_BPF_H|NM_BPF_ABS:
+			k = pc->k;
+			if (k > buflen || sizeof(int16_t) > buflen - k)
+				return 0;
+			A = ((uint32_t)buf[k] << 8) | buf[k + 1];
+			continue;
+
+		case NM_BPF_LD|NM_BPF_B|NM_BPF_ABS:
+			k = pc->k;
+			if (k >= buflen)
+				return 0;
+			A = buf[k];
+			continue;
+
+		case NM_BPF_LD|NM_BPF_W|NM_BPF_LEN:
+			A = wirelen;
+			continue;
+
+		case NM_BPF_LDX|NM_BPF_W|NM_BPF_LEN:
+			X = wirelen;
+			continue;
+
+		case NM_BPF_LD|NM_BPF_W|NM_BPF_IND:
+			k = X + pc->k;
+			if (pc->k > buflen || X > buflen - pc->k ||
+			    sizeof(int32_t) > buflen - k)
+				return 0;
+			A = ((uint32_t)buf[k] << 24) | ((uint32_t)buf[k + 1] << 16) |
+			    ((uint32_t)buf[k + 2] << 8) | buf[k + 3];
+			continue;
+
+		case NM_BPF_LD|NM_BPF_H|NM_BPF_IND:
+			k = X + pc->k;
+			if (pc->k > buflen || X > buflen - pc->k ||
+			    sizeof(int16_t) > buflen - k)
+				return 0;
+			A = ((uint32_t)buf[k] << 8) | buf[k + 1];
+			continue;
+
+		case NM_BPF_LD|NM_BPF_B|NM_BPF_IND:
+			k = X + pc->k;
+			if (pc->k >= buflen || X >= buflen - pc->k)
+				return 0;
+			A = buf[k];
+			continue;
+
+		case NM_BPF_LDX|NM_BPF_MSH|NM_BPF_B:
+			k = pc->k;
+			if (k >= buflen)
+				return 0;
+			X = (buf[k] & 0xf) << 2;
+			continue;
+
+		case NM_BPF_LD|NM_BPF_IMM:
+			A = pc->k;
+			continue;
+
+		case NM_BPF_LDX|NM_BPF_IMM:
+			X = pc->k;
+			continue;
+
+		case NM_BPF_LD|NM_BPF_MEM:
+			A = mem[pc->k];
+			continue;
+
+		case NM_BPF_LDX|NM_BPF_MEM:
+			X = mem[pc->k];
+			continue;
+
+		case NM_BPF_ST:
+			mem[pc->k] = A;
+			continue;
+
+		case NM_BPF_STX:
+			mem[pc->k] = X;
+			continue;
+
+		case NM_BPF_JMP|NM_BPF_JA:
+			pc += pc->k;
+			continue;
+
+		case NM_BPF_JMP|NM_BPF_JGT|NM_BPF_K:
+			pc += (A > pc->k) ? pc->jt : pc->jf;
+			continue;
+
+		case NM_BPF_JMP|NM_BPF_JGE|NM_BPF_K:
+			pc += (A >= pc->k) ? pc->jt : pc->jf;
+			continue;
+
+		case NM_BPF_JMP|NM_BPF_JEQ|NM_BPF_K:
+			pc += (A == pc->k) ? pc->jt : pc->jf;
+			continue;
+
+		case NM_BPF_JMP|NM_BPF_JSET|NM_BPF_K:
+			pc += (A & pc->k) ? pc->jt : pc->jf;
+			continue;
+
+		case NM_BPF_JMP|NM_BPF_JGT|NM_BPF_X:
+			pc += (A > X) ? pc->jt : pc->jf;
+			continue;
+
+		case NM_BPF_JMP|NM_BPF_JGE|NM_BPF_X:
+			pc += (A >= X) ? pc->jt : pc->jf;
+			continue;
+
+		case NM_BPF_JMP|NM_BPF_JEQ|NM_BPF_X:
+			pc += (A == X) ? pc->jt : pc->jf;
+			continue;
+
+		case NM_BPF_JMP|NM_BPF_JSET|NM_BPF_X:
+			pc += (A & X) ? pc->jt : pc->jf;
+			continue;
+
+		case NM_BPF_ALU|NM_BPF_ADD|NM_BPF_X:
+			A += X;
+			continue;
+
+		case NM_BPF_ALU|NM_BPF_SUB|NM_BPF_X:
+			A -= X;
+			continue;
+
+		case NM_BPF_ALU|NM_BPF_MUL|NM_BPF_X:
+			A *= X;
+			continue;
+
+		case NM_BPF_ALU|NM_BPF_DIV|NM_BPF_X:
+			if (X == 0)
+				return 0;
+			A /= X;
+			continue;
+
+		case NM_BPF_ALU|NM_BPF_MOD|NM_BPF_X:
+			if (X == 0)
+				return 0;
+			A %= X;
+			continue;
+
+		case NM_BPF_ALU|NM_BPF_AND|NM_BPF_X:
+			A &= X;
+			continue;
+
+		case NM_BPF_ALU|NM_BPF_OR|NM_BPF_X:
+			A |= X;
+			continue;
+
+		case NM_BPF_ALU|NM_BPF_XOR|NM_BPF_X:
+			A ^= X;
+			continue;
+
+		case NM_BPF_ALU|NM_BPF_LSH|NM_BPF_X:
+			A = X < 32 ? A << X : 0;
+			continue;
+
+		case NM_BPF_ALU|NM_BPF_RSH|NM_BPF_X:
+			A = X < 32 ? A >> X : 0;
+			continue;
+
+		case NM_BPF_ALU|NM_BPF_ADD|NM_BPF_K:
+			A += pc->k;
+			continue;
+
+		case NM_BPF_ALU|NM_BPF_SUB|NM_BPF_K:
+			A -= pc->k;
+			continue;
+
+		case NM_BPF_ALU|NM_BPF_MUL|NM_BPF_K:
+			A *= pc->k;
+			continue;
+
+		case NM_BPF_ALU|NM_BPF_DIV|NM_BPF_K:
+			A /= pc->k;
+			continue;
+
+		case NM_BPF_ALU|NM_BPF_MOD|NM_BPF_K:
+			A %= pc->k;
+			continue;
+
+		case NM_BPF_ALU|NM_BPF_AND|NM_BPF_K:
+			A &= pc->k;
+			continue;
+
+		case NM_BPF_ALU|NM_BPF_OR|NM_BPF_K:
+			A |= pc->k;
+			continue;
+
+		case NM_BPF_ALU|NM_BPF_XOR|NM_BPF_K:
+			A ^= pc->k;
+			continue;
+
+		case NM_BPF_ALU|NM_BPF_LSH|NM_BPF_K:
+			A = pc->k < 32 ? A << pc->k : 0;
+			continue;
+
+		case NM_BPF_ALU|NM_BPF_RSH|NM_BPF_K:
+			A = pc->k < 32 ? A >> pc->k : 0;
+			continue;
+
+		case NM_BPF_ALU|NM_BPF_NEG:
+			A = -A;
+			continue;
+
+		case NM_BPF_MISC|NM_BPF_TAX:
+			X = A;
+			continue;
+
+		case NM_BPF_MISC|NM_BPF_TXA:
+			A = X;
+			continue;
+		}
+	}
+}
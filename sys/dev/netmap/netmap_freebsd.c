@@ -265,6 +265,61 @@ nm_os_mbuf_has_offld(struct mbuf *m)
 					 CSUM_SCTP_IPV6 | CSUM_TSO);
 }
 
+int
+nm_os_mbuf_vnet_hdr_get(struct mbuf *m, struct nm_vnet_hdr *vh)
+{
+	bzero(vh, sizeof(*vh));
+	if (nm_os_mbuf_has_offld(m))
+		return -1; /* not supported yet */
+	if (m->m_pkthdr.csum_flags & CSUM_DATA_VALID)
+		vh->flags = VIRTIO_NET_HDR_F_DATA_VALID;
+	return 0;
+}
+
+int
+nm_os_mbuf_vnet_hdr_set(struct mbuf *m, const struct nm_vnet_hdr *vh)
+{
+	if (vh->gso_type != VIRTIO_NET_HDR_GSO_NONE ||
+			(vh->flags & VIRTIO_NET_HDR_F_NEEDS_CSUM))
+		return -1; /* not supported yet */
+	if (vh->flags & VIRTIO_NET_HDR_F_DATA_VALID) {
+		m->m_pkthdr.csum_flags |= CSUM_DATA_VALID | CSUM_PSEUDO_HDR;
+		m->m_pkthdr.csum_data = 0xFFFF;
+	}
+	return 0;
+}
+
+uint64_t
+nm_os_timestamp_ns(void)
+{
+	struct timespec ts;
+
+	nanotime(&ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void
+nm_os_mbuf_timestamp_set(struct mbuf *m)
+{
+#ifdef M_TSTMP
+	/* keep the hardware timestamp, if any */
+	if (m->m_flags & M_TSTMP)
+		return;
+	m->m_pkthdr.rcv_tstmp = nm_os_timestamp_ns();
+	m->m_flags |= M_TSTMP;
+#endif /* M_TSTMP */
+}
+
+uint64_t
+nm_os_mbuf_timestamp(struct mbuf *m)
+{
+#ifdef M_TSTMP
+	if (m->m_flags & M_TSTMP)
+		return m->m_pkthdr.rcv_tstmp;
+#endif /* M_TSTMP */
+	return nm_os_timestamp_ns();
+}
+
 static void
 freebsd_generic_rx_handler(struct ifnet *ifp, struct mbuf *m)
 {
@@ -394,6 +449,15 @@ nm_os_generic_xmit_frame(struct nm_os_gen_arg *a)
 }
 
 
+/* Bulk mode is not supported (gna->txbatch is 0), so mbufs are never
+ * queued by nm_os_generic_xmit_frame(). */
+int
+nm_os_generic_xmit_burst(struct nm_os_gen_arg *a)
+{
+	return 0;
+}
+
+
 #if __FreeBSD_version >= 1100005
 struct netmap_adapter *
 netmap_getna(if_t ifp)
@@ -427,7 +491,10 @@ nm_os_generic_set_features(struct netmap_generic_adapter *gna)
 {
 
 	gna->rxsg = 1; /* Supported through m_copydata. */
+	gna->txsg = 0; /* Not supported. */
 	gna->txqdisc = 0; /* Not supported. */
+	gna->txbatch = 0; /* Not supported. */
+	gna->vnethdr = 0; /* Not supported. */
 }
 
 void
@@ -468,6 +535,38 @@ nm_os_mitigation_cleanup(struct nm_generic_mit *mit)
 	ND("called");
 }
 
+static void
+nm_txdb_callout(void *arg)
+{
+	struct nm_txdb *db = arg;
+
+	if (netmap_txdb_expire(db))
+		nm_os_txdb_arm(db, db->usecs);
+}
+
+int
+nm_os_txdb_init(struct nm_txdb *db)
+{
+	callout_init(&db->timer, 1 /* mpsafe */);
+	return 0;
+}
+
+int
+nm_os_txdb_arm(struct nm_txdb *db, u_int usecs)
+{
+	db->usecs = usecs;
+	if (!callout_pending(&db->timer))
+		callout_reset_sbt(&db->timer, SBT_1US * usecs, 0,
+				nm_txdb_callout, db, 0);
+	return 0;
+}
+
+void
+nm_os_txdb_fini(struct nm_txdb *db)
+{
+	callout_drain(&db->timer);
+}
+
 static int
 nm_vi_dummy(struct ifnet *ifp, u_long cmd, caddr_t addr)
 {
@@ -1016,6 +1115,9 @@ struct nm_kctx_ctx {
 	nm_kctx_worker_fn_t worker_fn;
 	void *worker_private;
 
+	/* incremented on each notification from the guest (may be NULL) */
+	uint64_t *kicks;
+
 	struct nm_kctx *nmk;
 
 	/* integer to manage multiple worker contexts (e.g., RX or TX on ptnetmap) */
@@ -1113,8 +1215,14 @@ nm_kctx_worker(void *data)
 				continue;
 			} else if (nmk->run) {
 				/* wait on event with one second timeout */
-				msleep((void *)(uintptr_t)ctx->cfg.wchan, &nmk->worker_lock,
-					0, "nmk_ev", hz);
+				if (msleep((void *)(uintptr_t)ctx->cfg.wchan,
+				    &nmk->worker_lock, 0, "nmk_ev", hz) == 0 &&
+				    nmk->scheduled == old_scheduled && ctx->kicks) {
+					/* woken up on the wchan, but not by
+					 * nm_os_kctx_worker_wakeup(): this
+					 * is a kick from the guest */
+					(*ctx->kicks)++;
+				}
 				nmk->scheduled++;
 			}
 			mtx_unlock(&nmk->worker_lock);
@@ -1130,13 +1238,22 @@ nm_os_kctx_worker_setaff(struct nm_kctx *nmk, int affinity)
 	nmk->affinity = affinity;
 }
 
+int
+nm_os_kctx_worker_shared(struct nm_kctx *nmk)
+{
+	/* The kthreads are attached to the bhyve process, so they cannot
+	 * be shared among different VMs. */
+	return 0;
+}
+
 struct nm_kctx *
 nm_os_kctx_create(struct nm_kctx_cfg *cfg, unsigned int cfgtype,
 		     void *opaque)
 {
 	struct nm_kctx *nmk = NULL;
 
-	if (cfgtype != PTNETMAP_CFGTYPE_BHYVE) {
+	/* cfgtype is only meaningful for ptnetmap (opaque != NULL) */
+	if (opaque && cfgtype != PTNETMAP_CFGTYPE_BHYVE) {
 		D("Unsupported cfgtype %u", cfgtype);
 		return NULL;
 	}
@@ -1148,6 +1265,7 @@ nm_os_kctx_create(struct nm_kctx_cfg *cfg, unsigned int cfgtype,
 	mtx_init(&nmk->worker_lock, "nm_kthread lock", NULL, MTX_DEF);
 	nmk->worker_ctx.worker_fn = cfg->worker_fn;
 	nmk->worker_ctx.worker_private = cfg->worker_private;
+	nmk->worker_ctx.kicks = cfg->kicks;
 	nmk->worker_ctx.type = cfg->type;
 	nmk->affinity = -1;
 
@@ -87,6 +87,7 @@ __FBSDID("$FreeBSD: head/sys/dev/netmap/netmap_generic.c 274353 2014-11-10 20:19
 #define rtnl_lock()	ND("rtnl_lock called")
 #define rtnl_unlock()	ND("rtnl_unlock called")
 #define MBUF_RXQ(m)	((m)->m_pkthdr.flowid)
+#define MBUF_CLONED(m)	0
 #define smp_mb()
 
 /*
@@ -202,6 +203,7 @@ nm_os_get_mbuf(struct ifnet *ifp, int len)
 #define rtnl_unlock()	ND("rtnl_unlock called")
 #define MBUF_TXQ(m) 	0//((m)->m_pkthdr.flowid)
 #define MBUF_RXQ(m)	    0//((m)->m_pkthdr.flowid)
+#define MBUF_CLONED(m)	0
 #define smp_mb()		//XXX: to be correctly defined
 
 #else /* linux */
@@ -212,6 +214,9 @@ nm_os_get_mbuf(struct ifnet *ifp, int len)
 #include <linux/ethtool.h>      /* struct ethtool_ops, get_ringparam */
 #include <linux/hrtimer.h>
 
+/* A clone shares the data of the mbuf. */
+#define MBUF_CLONED(m)	skb_cloned(m)
+
 static inline struct mbuf *
 nm_os_get_mbuf(struct ifnet *ifp, int len)
 {
@@ -242,71 +247,6 @@ nm_os_get_mbuf(struct ifnet *ifp, int len)
             for_each_kring_n(_i, _k, (_na)->rx_rings, (_na)->num_rx_rings + 1)
 
 
-/* ======================== PERFORMANCE STATISTICS =========================== */
-
-#ifdef RATE_GENERIC
-#define IFRATE(x) x
-struct rate_stats {
-	unsigned long txpkt;
-	unsigned long txsync;
-	unsigned long txirq;
-	unsigned long txrepl;
-	unsigned long txdrop;
-	unsigned long rxpkt;
-	unsigned long rxirq;
-	unsigned long rxsync;
-};
-
-struct rate_context {
-	unsigned refcount;
-	struct timer_list timer;
-	struct rate_stats new;
-	struct rate_stats old;
-};
-
-#define RATE_PRINTK(_NAME_) \
-	printk( #_NAME_ " = %lu Hz\n", (cur._NAME_ - ctx->old._NAME_)/RATE_PERIOD);
-#define RATE_PERIOD  2
-static void rate_callback(unsigned long arg)
-{
-	struct rate_context * ctx = (struct rate_context *)arg;
-	struct rate_stats cur = ctx->new;
-	int r;
-
-	RATE_PRINTK(txpkt);
-	RATE_PRINTK(txsync);
-	RATE_PRINTK(txirq);
-	RATE_PRINTK(txrepl);
-	RATE_PRINTK(txdrop);
-	RATE_PRINTK(rxpkt);
-	RATE_PRINTK(rxsync);
-	RATE_PRINTK(rxirq);
-	printk("\n");
-
-	ctx->old = cur;
-	r = mod_timer(&ctx->timer, jiffies +
-			msecs_to_jiffies(RATE_PERIOD * 1000));
-	if (unlikely(r))
-		D("[v1000] Error: mod_timer()");
-}
-
-static struct rate_context rate_ctx;
-
-void generic_rate(int txp, int txs, int txi, int rxp, int rxs, int rxi)
-{
-    if (txp) rate_ctx.new.txpkt++;
-    if (txs) rate_ctx.new.txsync++;
-    if (txi) rate_ctx.new.txirq++;
-    if (rxp) rate_ctx.new.rxpkt++;
-    if (rxs) rate_ctx.new.rxsync++;
-    if (rxi) rate_ctx.new.rxirq++;
-}
-
-#else /* !RATE */
-#define IFRATE(x)
-#endif /* !RATE */
-
-
 /* ========== GENERIC (EMULATED) NETMAP ADAPTER SUPPORT ============= */
 
 /*
@@ -317,16 +257,79 @@ void generic_rate(int txp, int txs, int txi, int rxp, int rxs, int rxi)
 void
 netmap_generic_irq(struct netmap_adapter *na, u_int q, u_int *work_done)
 {
+	enum txrx t = work_done ? NR_RX : NR_TX;
+
 	if (unlikely(!nm_netmap_on(na)))
 		return;
 
 	netmap_common_irq(na, q, work_done);
-#ifdef RATE_GENERIC
-	if (work_done)
-		rate_ctx.new.rxirq++;
-	else
-		rate_ctx.new.txirq++;
-#endif  /* RATE_GENERIC */
+	q &= NETMAP_RING_MASK;
+	if (likely(q < nma_get_nrings(na, t)))
+		NMR(na, t)[q].nstats.intrs++;
+}
+
+/*
+ * Lock-free rx queue (struct nm_mbuf_ring), with room for a full
+ * netmap ring of packets.
+ */
+static int
+generic_mring_init(struct nm_mbuf_ring *mr, u_int num_slots)
+{
+	u_int size = 1;
+
+	while (size < num_slots)
+		size <<= 1;
+	mr->q = nm_os_malloc(size * sizeof(struct mbuf *));
+	if (mr->q == NULL)
+		return ENOMEM;
+	mr->mask = size - 1;
+	mr->head = mr->tail = 0;
+	mtx_init(&mr->prod_lock, "nm_rx_mring", NULL, MTX_SPIN);
+	return 0;
+}
+
+/* Producer side, returns -1 if the queue is full. */
+static inline int
+generic_mring_enqueue(struct nm_mbuf_ring *mr, struct mbuf *m)
+{
+	int ret = 0;
+
+	mtx_lock_spin(&mr->prod_lock);
+	if (unlikely(mr->tail - NM_ACCESS_ONCE(mr->head) > mr->mask)) {
+		ret = -1;
+	} else {
+		mr->q[mr->tail & mr->mask] = m;
+		mb(); /* write the entry before publishing it */
+		NM_ACCESS_ONCE(mr->tail) = mr->tail + 1;
+	}
+	mtx_unlock_spin(&mr->prod_lock);
+
+	return ret;
+}
+
+/* Consumer side, free all the queued mbufs. Like the rxsync, it
+ * must be the only consumer. */
+static void
+generic_mring_purge(struct nm_mbuf_ring *mr)
+{
+	u_int tail = NM_ACCESS_ONCE(mr->tail);
+
+	mb(); /* paired with the one in generic_mring_enqueue() */
+	for (; mr->head != tail; mr->head++) {
+		m_freem(mr->q[mr->head & mr->mask]);
+	}
+}
+
+/* Called when no producer can be running anymore. */
+static void
+generic_mring_fini(struct nm_mbuf_ring *mr)
+{
+	if (mr->q == NULL)
+		return;
+	generic_mring_purge(mr);
+	mtx_destroy(&mr->prod_lock);
+	nm_os_free(mr->q);
+	mr->q = NULL;
 }
 
 static int
@@ -366,8 +369,12 @@ generic_netmap_unregister(struct netmap_adapter *na)
 	for_each_rx_kring(r, kring, na) {
 		/* Free the mbufs still pending in the RX queues,
 		 * that did not end up into the corresponding netmap
-		 * RX rings. */
-		mbq_safe_purge(&kring->rx_queue);
+		 * RX rings. The purge is a consumer of the queue, so
+		 * it must not race with the rxsync of another file
+		 * descriptor still bound to the ring. */
+		if (kring->nr_mode == NKR_NETMAP_OFF) {
+			generic_mring_purge(&kring->rx_mring);
+		}
 		nm_os_mitigation_cleanup(&gna->mit[r]);
 	}
 
@@ -392,7 +399,7 @@ generic_netmap_unregister(struct netmap_adapter *na)
 		nm_os_free(gna->mit);
 
 		for_each_rx_kring(r, kring, na) {
-			mbq_safe_fini(&kring->rx_queue);
+			generic_mring_fini(&kring->rx_mring);
 		}
 
 		for_each_tx_kring(r, kring, na) {
@@ -410,12 +417,6 @@ generic_netmap_unregister(struct netmap_adapter *na)
 			kring->tx_pool = NULL;
 		}
 
-#ifdef RATE_GENERIC
-		if (--rate_ctx.refcount == 0) {
-			D("del_timer()");
-			del_timer(&rate_ctx.timer);
-		}
-#endif
 		D("Emulated adapter for %s deactivated", na->name);
 	}
 
@@ -460,7 +461,12 @@ generic_netmap_register(struct netmap_adapter *na, int enable)
 			/* Initialize the rx queue, as generic_rx_handler() can
 			 * be called as soon as nm_os_catch_rx() returns.
 			 */
-			mbq_safe_init(&kring->rx_queue);
+			error = generic_mring_init(&kring->rx_mring,
+						   kring->nkr_num_slots);
+			if (error) {
+				D("rx queue allocation failed");
+				goto free_rx_queues;
+			}
 		}
 
 		/*
@@ -528,17 +534,6 @@ generic_netmap_register(struct netmap_adapter *na, int enable)
 
 		na->na_flags |= NAF_NETMAP_ON;
 
-#ifdef RATE_GENERIC
-		if (rate_ctx.refcount == 0) {
-			D("setup_timer()");
-			memset(&rate_ctx, 0, sizeof(rate_ctx));
-			setup_timer(&rate_ctx.timer, &rate_callback, (unsigned long)&rate_ctx);
-			if (mod_timer(&rate_ctx.timer, jiffies + msecs_to_jiffies(1500))) {
-				D("Error: mod_timer()");
-			}
-		}
-		rate_ctx.refcount++;
-#endif /* RATE */
 	}
 
 	return 0;
@@ -557,8 +552,9 @@ free_tx_pools:
 		nm_os_free(kring->tx_pool);
 		kring->tx_pool = NULL;
 	}
+free_rx_queues:
 	for_each_rx_kring(r, kring, na) {
-		mbq_safe_fini(&kring->rx_queue);
+		generic_mring_fini(&kring->rx_mring);
 	}
 	nm_os_free(gna->mit);
 out:
@@ -680,8 +676,9 @@ generic_netmap_tx_clean(struct netmap_kring *kring, int txqdisc)
 				/* The event has been consumed, we can go
 				 * ahead. */
 
-			} else if (MBUF_REFCNT(m) != 1) {
-				/* This mbuf is still busy: its refcnt is 2. */
+			} else if (MBUF_REFCNT(m) != 1 || MBUF_CLONED(m)) {
+				/* This mbuf is still busy: its refcnt is 2,
+				 * or a clone still references its data. */
 				break;
 			}
 		}
@@ -777,12 +774,130 @@ generic_set_tx_event(struct netmap_kring *kring, u_int hwcur)
 }
 
 
+/*
+ * Bulk mode: pass to the driver the mbufs queued by
+ * nm_os_generic_xmit_frame(). The mbufs refused by the driver (because
+ * its queue is full) are not dropped: they go back to the tx pool and
+ * their slots are given back to the ring. Returns the index of the
+ * first slot still to be transmitted, i.e. nm_i moved back by the
+ * number of refused mbufs.
+ */
+static u_int
+generic_tx_burst(struct netmap_kring *kring, struct nm_os_gen_arg *a,
+		u_int nm_i)
+{
+	u_int const lim = kring->nkr_num_slots - 1;
+	u_int left = nm_os_generic_xmit_burst(a);
+
+	if (unlikely(left)) {
+		RD(5, "%s: %u mbufs refused by the driver", kring->name, left);
+		/* a->m is the first refused mbuf, its packet starts at
+		 * the slot that owns it in the tx pool. */
+		while (nm_i != kring->nr_hwcur) {
+			nm_i = nm_prev(nm_i, lim);
+			if (kring->tx_pool[nm_i] == a->m)
+				break;
+		}
+	}
+	return nm_i;
+}
+
+
+/*
+ * Returns the mbuf of the tx pool associated to slot i, replenishing
+ * the pool entry if necessary, or NULL if this is not possible.
+ */
+static inline struct mbuf *
+generic_tx_pool_get(struct netmap_kring *kring, u_int i)
+{
+	struct mbuf *m = kring->tx_pool[i];
+
+	if (unlikely(m == NULL)) {
+		kring->tx_pool[i] = m =
+			nm_os_get_mbuf(kring->na->ifp,
+				       NETMAP_BUF_SIZE(kring->na));
+		if (m == NULL) {
+			RD(2, "Failed to replenish mbuf");
+			return NULL;
+		}
+	}
+	return m;
+}
+
+
+/*
+ * Returns the number of slots used by the packet that starts at
+ * slot nm_i (the slot itself plus the following NS_MOREFRAG ones),
+ * or 0 if the user did not queue the last fragment yet.
+ * The userspace buffers of NS_INDIRECT slots are copied into the
+ * netmap buffers of the slots; *drop is set if this fails, and the
+ * packet should not be transmitted.
+ */
+static u_int
+generic_tx_pkt_slots(struct netmap_kring *kring, u_int nm_i, u_int head,
+		int *drop)
+{
+	struct netmap_adapter *na = kring->na;
+	struct netmap_ring *ring = kring->ring;
+	u_int const lim = kring->nkr_num_slots - 1;
+	u_int n = 0;
+
+	*drop = 0;
+	for (;;) {
+		struct netmap_slot *slot = &ring->slot[nm_i];
+
+		if (unlikely(slot->flags & NS_INDIRECT) && !*drop) {
+			if (slot->len > NETMAP_BUF_SIZE(na) ||
+			    copyin((void *)(uintptr_t)slot->ptr,
+				   NMB(na, slot), slot->len)) {
+				RD(5, "%s: bad indirect slot %u", kring->name,
+					nm_i);
+				*drop = 1;
+			}
+		}
+		n++;
+		if (!(slot->flags & NS_MOREFRAG))
+			return n;
+		nm_i = nm_next(nm_i, lim);
+		if (nm_i == head)
+			return 0;
+	}
+}
+
+
+/*
+ * Check the virtio-net header of a packet to be transmitted, since
+ * it comes from userspace. Only the offloads that the OS can map
+ * to the mbuf fields are accepted (see nm_os_mbuf_vnet_hdr_set()).
+ * Segmentation always comes with a partial checksum.
+ */
+static int
+generic_vnet_hdr_bad(const struct nm_vnet_hdr *vh)
+{
+	uint8_t gso_type = vh->gso_type & ~VIRTIO_NET_HDR_GSO_ECN;
+
+	if (vh->flags & ~(VIRTIO_NET_HDR_F_NEEDS_CSUM |
+			  VIRTIO_NET_HDR_F_DATA_VALID)) {
+		return 1;
+	}
+	if (gso_type == VIRTIO_NET_HDR_GSO_NONE) {
+		return 0;
+	}
+	return (gso_type != VIRTIO_NET_HDR_GSO_TCPV4 &&
+		gso_type != VIRTIO_NET_HDR_GSO_TCPV6) ||
+		vh->gso_size == 0 ||
+		!(vh->flags & VIRTIO_NET_HDR_F_NEEDS_CSUM);
+}
+
 /*
  * generic_netmap_txsync() transforms netmap buffers into mbufs
  * and passes them to the standard device driver
  * (ndo_start_xmit() or ifp->if_transmit() ).
  * On linux this is not done directly, but using dev_queue_xmit(),
  * since it implements the TX flow control (and takes some locks).
+ * When txqdisc is not used, the OS may support a bulk mode, where
+ * the mbufs are queued and passed to the driver gna->txbatch at a
+ * time (see generic_tx_burst()).
  */
 static int
 generic_netmap_txsync(struct netmap_kring *kring, int flags)
@@ -796,8 +911,6 @@ generic_netmap_txsync(struct netmap_kring *kring, int flags)
 	u_int const head = kring->rhead;
 	u_int ring_nr = kring->ring_id;
 
-	IFRATE(rate_ctx.new.txsync++);
-
 	rmb();
 
 	/*
@@ -821,40 +934,95 @@ generic_netmap_txsync(struct netmap_kring *kring, int flags)
 		a.ifp = ifp;
 		a.ring_nr = ring_nr;
 		a.head = a.tail = NULL;
+		a.batch = gna->txqdisc ? 0 : gna->txbatch;
+		a.queued = 0;
+		a.kring = kring;
 
 		while (nm_i != head) {
 			struct netmap_slot *slot = &ring->slot[nm_i];
 			u_int len = slot->len;
 			void *addr = NMB(na, slot);
+			u_int nslots = 1;
+			struct nm_vnet_hdr vhdr, *vh = NULL;
+			int drop = 0;
 			/* device-specific */
 			struct mbuf *m;
 			int tx_ret;
+			u_int i, j;
 
 			NM_CHECK_ADDR_LEN(na, addr, len);
 
+			if (unlikely(slot->flags & (NS_MOREFRAG | NS_INDIRECT))) {
+				nslots = generic_tx_pkt_slots(kring, nm_i,
+							      head, &drop);
+				if (nslots == 0) {
+					/* Wait for the last fragment. */
+					break;
+				}
+				if (nslots > 1 && !gna->txsg) {
+					drop = 1;
+				}
+			}
+			if (na->virt_hdr_len) {
+				/* The packet starts with a virtio-net header,
+				 * take a copy that userspace cannot change. */
+				if (likely(len >= na->virt_hdr_len)) {
+					memcpy(&vhdr, addr, sizeof(vhdr));
+					vh = &vhdr;
+				}
+				if (unlikely(vh == NULL ||
+					     generic_vnet_hdr_bad(vh))) {
+					drop = 1;
+				}
+				addr = (char *)addr + na->virt_hdr_len;
+				len -= na->virt_hdr_len;
+			}
+			if (unlikely(drop)) {
+				/* Consume the slots without sending
+				 * the packet. */
+				RD(5, "%s: dropping %u slots at %u",
+					kring->name, nslots, nm_i);
+				kring->nstats.drops++;
+				for (i = 0; i < nslots; i++) {
+					ring->slot[nm_i].flags &=
+					  ~(NS_REPORT | NS_BUF_CHANGED);
+					nm_i = nm_next(nm_i, lim);
+				}
+				continue;
+			}
+
 			/* Tale a mbuf from the tx pool (replenishing the pool
-			 * entry if necessary) and copy in the user packet. */
-			m = kring->tx_pool[nm_i];
+			 * entry if necessary) and copy in the user packet.
+			 * The other slots of the packet need a pool entry
+			 * as well, since generic_netmap_tx_clean() takes a
+			 * NULL entry for a tx event.
+			 * If we run out of mbufs we could schedule a timer
+			 * which retries to replenish after a while, and
+			 * notifies the client when it manages to replenish
+			 * some slots. In any case we break early to avoid
+			 * crashes. */
+			m = generic_tx_pool_get(kring, nm_i);
 			if (unlikely(m == NULL)) {
-				kring->tx_pool[nm_i] = m =
-					nm_os_get_mbuf(ifp, NETMAP_BUF_SIZE(na));
-				if (m == NULL) {
-					RD(2, "Failed to replenish mbuf");
-					/* Here we could schedule a timer which
-					 * retries to replenish after a while,
-					 * and notifies the client when it
-					 * manages to replenish some slots. In
-					 * any case we break early to avoid
-					 * crashes. */
+				break;
+			}
+			for (i = 1, j = nm_i; i < nslots; i++) {
+				j = nm_next(j, lim);
+				if (generic_tx_pool_get(kring, j) == NULL)
 					break;
-				}
-				IFRATE(rate_ctx.new.txrepl++);
+			}
+			if (unlikely(i < nslots)) {
+				break;
 			}
 
 			a.m = m;
 			a.addr = addr;
 			a.len = len;
-			a.qevent = (nm_i == event);
+			a.slot_idx = nm_i;
+			a.nslots = nslots;
+			a.vh = vh;
+			/* the event may fall on any slot of the packet */
+			a.qevent = (event <= lim &&
+				(event + lim + 1 - nm_i) % (lim + 1) < nslots);
 			/* When not in txqdisc mode, we should ask
 			 * notifications when NS_REPORT is set, or roughly
 			 * every half ring. To optimize this, we set a
@@ -900,20 +1068,44 @@ generic_netmap_txsync(struct netmap_kring *kring, int flags)
 				 * being deactivated, or possibly for other
 				 * reasons. In these cases, we just let the
 				 * packet to be dropped. */
-				IFRATE(rate_ctx.new.txdrop++);
+				kring->nstats.drops++;
 			}
 
-			slot->flags &= ~(NS_REPORT | NS_BUF_CHANGED);
-			nm_i = nm_next(nm_i, lim);
-			IFRATE(rate_ctx.new.txpkt++);
+			for (i = 0; i < nslots; i++) {
+				ring->slot[nm_i].flags &=
+					~(NS_REPORT | NS_BUF_CHANGED);
+				nm_i = nm_next(nm_i, lim);
+			}
+
+			if (a.batch && a.queued >= a.batch) {
+				u_int next = nm_i;
+
+				nm_i = generic_tx_burst(kring, &a, nm_i);
+				if (unlikely(nm_i != next)) {
+					/* No room in the device driver, same
+					 * as the failure case above. */
+					generic_set_tx_event(kring, nm_i);
+					if (!generic_netmap_tx_clean(kring, 0))
+						break;
+				}
+			}
 		}
-		if (a.head != NULL) {
+		if (a.batch) {
+			u_int next = nm_i;
+
+			nm_i = generic_tx_burst(kring, &a, nm_i);
+			if (unlikely(nm_i != next))
+				generic_set_tx_event(kring, nm_i);
+		} else if (a.head != NULL) {
 			a.addr = NULL;
 			nm_os_generic_xmit_frame(&a);
 		}
 		/* Update hwcur to the next slot to transmit. Here nm_i
 		 * is not necessarily head, we could break early. */
+		nm_kring_nstats_sync(kring, kring->nr_hwcur, nm_i);
 		kring->nr_hwcur = nm_i;
+	} else {
+		kring->nstats.dry_syncs++;
 	}
 
 	/*
@@ -934,6 +1126,41 @@ generic_netmap_txsync(struct netmap_kring *kring, int flags)
 }
 
 
+/*
+ * Software RSS. When the device has a single rx queue and
+ * netmap_generic_rss_rings is larger than 1, the emulated adapter
+ * exposes that many rx rings and spreads the intercepted packets
+ * among them, using nm_flow_hash(). Both directions of a flow are
+ * hashed to the same ring.
+ */
+#define GENERIC_RSS_MAXRINGS	64
+#define GENERIC_RSS_HDRLEN	96	/* header bytes looked at */
+
+/* select the rx ring for an intercepted mbuf */
+static inline u_int
+generic_rx_ring(struct netmap_generic_adapter *gna, struct mbuf *m)
+{
+	struct netmap_adapter *na = &gna->up.up;
+	u_int r;
+
+	if (gna->rss) {
+		uint8_t hdr[GENERIC_RSS_HDRLEN];
+		u_int len = MBUF_LEN(m);
+
+		if (len > sizeof(hdr))
+			len = sizeof(hdr);
+		m_copydata(m, 0, len, (void *)hdr);
+		return nm_flow_hash(hdr, len) % na->num_rx_rings;
+	}
+
+	r = MBUF_RXQ(m); /* receive ring number */
+	if (r >= na->num_rx_rings) {
+		r = r % na->num_rx_rings;
+	}
+	return r;
+}
+
+
 /*
  * This handler is registered (through nm_os_catch_rx())
  * within the attached network interface
@@ -950,11 +1177,7 @@ generic_rx_handler(struct ifnet *ifp, struct mbuf *m)
 	struct netmap_generic_adapter *gna = (struct netmap_generic_adapter *)na;
 	struct netmap_kring *kring;
 	u_int work_done;
-	u_int r = MBUF_RXQ(m); /* receive ring number */
-
-	if (r >= na->num_rx_rings) {
-		r = r % na->num_rx_rings;
-	}
+	u_int r = generic_rx_ring(gna, m);
 
 	kring = &na->rx_rings[r];
 
@@ -964,17 +1187,24 @@ generic_rx_handler(struct ifnet *ifp, struct mbuf *m)
 	}
 
 	/* limit the size of the queue */
-	if (unlikely(!gna->rxsg && MBUF_LEN(m) > NETMAP_BUF_SIZE(na))) {
+	if (unlikely(!gna->rxsg &&
+		     na->virt_hdr_len + MBUF_LEN(m) > NETMAP_BUF_SIZE(na))) {
 		/* This may happen when GRO/LRO features are enabled for
 		 * the NIC driver when the generic adapter does not
 		 * support RX scatter-gather. */
 		RD(2, "Warning: driver pushed up big packet "
 				"(size=%d)", (int)MBUF_LEN(m));
 		m_freem(m);
-	} else if (unlikely(mbq_len(&kring->rx_queue) > 1024)) {
-		m_freem(m);
 	} else {
-		mbq_safe_enqueue(&kring->rx_queue, m);
+		if (nm_kring_slot_ts(kring)) {
+			/* record the arrival time for NR_SLOT_TIMESTAMP */
+			nm_os_mbuf_timestamp_set(m);
+		}
+		if (unlikely(generic_mring_enqueue(&kring->rx_mring, m))) {
+			/* The rxsync is not keeping up. */
+			kring->stats.drops++;
+			m_freem(m);
+		}
 	}
 
 	if (netmap_generic_mit < 32768) {
@@ -1001,7 +1231,8 @@ generic_rx_handler(struct ifnet *ifp, struct mbuf *m)
  * generic_netmap_rxsync() extracts mbufs from the queue filled by
  * generic_netmap_rx_handler() and puts their content in the netmap
  * receive ring.
- * Access must be protected because the rx handler is asynchronous,
+ * The rx handler is asynchronous, but the queue needs no lock on
+ * this side (see struct nm_mbuf_ring).
  */
 static int
 generic_netmap_rxsync(struct netmap_kring *kring, int flags)
@@ -1017,17 +1248,17 @@ generic_netmap_rxsync(struct netmap_kring *kring, int flags)
 	/* Adapter-specific variables. */
 	uint16_t slot_flags = kring->nkr_slot_flags;
 	u_int nm_buf_len = NETMAP_BUF_SIZE(na);
-	struct mbq tmpq;
+	struct nm_mbuf_ring *mr = &kring->rx_mring;
+	u_int mr_head, mr_tail;
 	struct mbuf *m;
 	int avail; /* in bytes */
 	int mlen;
 	int copy;
+	int slot_ts;
 
 	if (head > lim)
 		return netmap_ring_reinit(kring);
 
-	IFRATE(rate_ctx.new.rxsync++);
-
 	/*
 	 * First part: skip past packets that userspace has released.
 	 * This can possibly make room for the second part.
@@ -1062,85 +1293,100 @@ generic_netmap_rxsync(struct netmap_kring *kring, int flags)
 		avail += lim + 1;
 	avail *= nm_buf_len;
 
-	/* First pass: While holding the lock on the RX mbuf queue,
-	 * extract as many mbufs as they fit the available space,
-	 * and put them in a temporary queue.
+	/* Drain the queue, as long as the packets fit the available
+	 * space, and copy them into the RX slots.
 	 * To avoid performing a per-mbuf division (mlen / nm_buf_len) to
-	 * to update avail, we do the update in a while loop that we
-	 * also use to set the RX slots, but without performing the copy. */
-	mbq_init(&tmpq);
-	mbq_lock(&kring->rx_queue);
-	for (n = 0;; n++) {
-		m = mbq_peek(&kring->rx_queue);
-		if (!m) {
-			/* No more packets from the driver. */
-			break;
-		}
+	 * to update avail, we do the update in a while loop.
+	 * Packets rejected by the rx filter leave their slots to
+	 * the next ones. */
+	mr_head = mr->head;
+	mr_tail = NM_ACCESS_ONCE(mr->tail);
+	mb(); /* paired with the one in generic_mring_enqueue() */
+	nm_i = kring->nr_hwtail;
+	slot_ts = nm_kring_slot_ts(kring);
 
-		mlen = MBUF_LEN(m);
+	for (n = 0; mr_head != mr_tail; n++) {
+		struct netmap_slot *slot;
+		void *nmaddr;
+		int ofs = 0;
+		uint64_t ts = 0;
+		/* virtio-net header, only in the first slot */
+		struct nm_vnet_hdr vh;
+		int hdr = na->virt_hdr_len;
+
+		m = mr->q[mr_head & mr->mask];
+		mlen = hdr + MBUF_LEN(m);
 		if (mlen > avail) {
 			/* No more space in the ring. */
 			break;
 		}
-
-		mbq_dequeue(&kring->rx_queue);
-
-		while (mlen) {
-			copy = nm_buf_len;
-			if (mlen < copy) {
-				copy = mlen;
-			}
-			mlen -= copy;
+		while (mlen > 0) {
+			mlen -= nm_buf_len;
 			avail -= nm_buf_len;
-
-			ring->slot[nm_i].len = copy;
-			ring->slot[nm_i].flags = slot_flags | (mlen ? NS_MOREFRAG : 0);
-			nm_i = nm_next(nm_i, lim);
 		}
+		mr_head++;
 
-		mbq_enqueue(&tmpq, m);
-	}
-	mbq_unlock(&kring->rx_queue);
-
-	/* Second pass: Drain the temporary queue, going over the used RX slots,
-	 * and perform the copy out of the RX queue lock. */
-	nm_i = kring->nr_hwtail;
-
-	for (;;) {
-		void *nmaddr;
-		int ofs = 0;
-		int morefrag;
-
-		m = mbq_dequeue(&tmpq);
-		if (!m)	{
-			break;
+		if (hdr && unlikely(nm_os_mbuf_vnet_hdr_get(m, &vh))) {
+			RD(5, "%s: cannot describe the mbuf offloads",
+				kring->name);
+			kring->stats.drops++;
+			m_freem(m);
+			continue;
 		}
+		if (slot_ts) {
+			ts = nm_os_mbuf_timestamp(m);
+		}
+		mlen = MBUF_LEN(m);
 
 		do {
-			nmaddr = NMB(na, &ring->slot[nm_i]);
+			slot = &ring->slot[nm_i];
+			nmaddr = NMB(na, slot);
 			/* We only check the address here on generic rx rings. */
 			if (nmaddr == NETMAP_BUF_BASE(na)) { /* Bad buffer */
 				m_freem(m);
-				mbq_purge(&tmpq);
-				mbq_fini(&tmpq);
+				mb();
+				NM_ACCESS_ONCE(mr->head) = mr_head;
 				return netmap_ring_reinit(kring);
 			}
 
-			copy = ring->slot[nm_i].len;
-			m_copydata(m, ofs, copy, nmaddr);
+			copy = mlen - ofs;
+			if (copy > nm_buf_len - hdr) {
+				copy = nm_buf_len - hdr;
+			}
+			if (hdr) {
+				bzero(nmaddr, hdr);
+				memcpy(nmaddr, &vh, sizeof(vh));
+			}
+			m_copydata(m, ofs, copy, (char *)nmaddr + hdr);
+			if (ofs == 0 && unlikely(kring->rx_filter != NULL)) {
+				/* the q_lock keeps the filter alive */
+				int drop;
+
+				mtx_lock(&kring->q_lock);
+				drop = nm_kring_rx_filter_drop(kring,
+					(char *)nmaddr + hdr, copy, mlen);
+				mtx_unlock(&kring->q_lock);
+				if (drop)
+					break;
+			}
 			ofs += copy;
-			morefrag = ring->slot[nm_i].flags & NS_MOREFRAG;
+			slot->len = hdr + copy;
+			hdr = 0;
+			slot->flags = slot_flags | (ofs < mlen ? NS_MOREFRAG : 0);
+			if (slot_ts) {
+				slot->ptr = ts;
+			}
 			nm_i = nm_next(nm_i, lim);
-		} while (morefrag);
+		} while (ofs < mlen);
 
 		m_freem(m);
 	}
+	mb(); /* done with the entries, let the producers reuse them */
+	NM_ACCESS_ONCE(mr->head) = mr_head;
 
-	mbq_fini(&tmpq);
-
+	nm_kring_nstats_sync(kring, kring->nr_hwtail, nm_i);
 	if (n) {
 		kring->nr_hwtail = nm_i;
-		IFRATE(rate_ctx.new.rxpkt += n);
 	}
 	kring->nr_kflags &= ~NKR_PENDINTR;
 
@@ -1232,7 +1478,8 @@ generic_netmap_attach(struct ifnet *ifp)
 	/* when using generic, NAF_NETMAP_ON is set so we force
 	 * NAF_SKIP_INTR to use the regular interrupt handler
 	 */
-	na->na_flags = NAF_SKIP_INTR | NAF_HOST_RINGS;
+	na->na_flags = NAF_SKIP_INTR | NAF_HOST_RINGS | NAF_SLOT_TIMESTAMP |
+		NAF_RX_FILTER;
 
 	ND("[GNA] num_tx_queues(%d), real_num_tx_queues(%d), len(%lu)",
 			ifp->num_tx_queues, ifp->real_num_tx_queues,
@@ -1241,6 +1488,13 @@ generic_netmap_attach(struct ifnet *ifp)
 			ifp->num_rx_queues, ifp->real_num_rx_queues);
 
 	nm_os_generic_find_num_queues(ifp, &na->num_tx_rings, &na->num_rx_rings);
+	if (na->num_rx_rings <= 1 && netmap_generic_rss_rings > 1) {
+		/* single rx queue, spread the packets in software */
+		na->num_rx_rings = netmap_generic_rss_rings;
+		if (na->num_rx_rings > GENERIC_RSS_MAXRINGS)
+			na->num_rx_rings = GENERIC_RSS_MAXRINGS;
+		gna->rss = 1;
+	}
 
 	retval = netmap_attach_common(na);
 	if (retval) {
@@ -1256,6 +1510,15 @@ generic_netmap_attach(struct ifnet *ifp)
 
 	nm_os_generic_set_features(gna);
 
+	if (gna->vnethdr && (netmap_generic_vnet_hdr == 12 ||
+		netmap_generic_vnet_hdr == sizeof(struct nm_vnet_hdr))) {
+		na->virt_hdr_len = netmap_generic_vnet_hdr;
+		/* Packets with offloads must go through the OS transmit
+		 * path, that segments them and computes the checksums
+		 * if the device cannot. */
+		gna->txbatch = 0;
+	}
+
 	D("Emulated adapter for %s created (prev was %p)", na->name, gna->prev);
 
 	return retval;
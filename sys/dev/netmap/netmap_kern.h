@@ -77,6 +77,7 @@
 
 #if defined(__FreeBSD__)
 #include <sys/selinfo.h>
+#include <sys/callout.h>
 
 #define likely(x)	__builtin_expect((long)!!(x), 1L)
 #define unlikely(x)	__builtin_expect((long)!!(x), 0L)
@@ -94,6 +95,7 @@
 
 #define	NM_SELINFO_T	struct nm_selinfo
 #define NM_SELRECORD_T	struct thread
+#define NM_TIMER_T	struct callout	/* one-shot timer */
 #define	MBUF_LEN(m)	((m)->m_pkthdr.len)
 #define MBUF_TXQ(m)	((m)->m_pkthdr.flowid)
 #define MBUF_TRANSMIT(na, ifp, m)	((na)->if_transmit(ifp, m))
@@ -145,6 +147,7 @@ struct hrtimer {
 
 #define	NM_LOCK_T	safe_spinlock_t	// see bsd_glue.h
 #define	NM_SELINFO_T	wait_queue_head_t
+#define	NM_TIMER_T	struct hrtimer
 #define	MBUF_LEN(m)	((m)->len)
 #define MBUF_TRANSMIT(na, ifp, m)							\
 	({										\
@@ -184,6 +187,7 @@ struct hrtimer {
 
 #define NM_SELRECORD_T		IO_STACK_LOCATION
 #define NM_SELINFO_T		win_SELINFO		// see win_glue.h
+#define NM_TIMER_T		struct hrtimer		// see below
 #define NM_LOCK_T		win_spinlock_t	// see win_glue.h
 #define NM_MTX_T		KGUARDED_MUTEX	/* OS-specific mutex (sleepable) */
 
@@ -317,6 +321,54 @@ void *nm_os_send_up(struct ifnet *, struct mbuf *m, struct mbuf *prev);
 
 int nm_os_mbuf_has_offld(struct mbuf *m);
 
+struct nm_vnet_hdr;
+/* describe the offloads requested by (or already done on) the mbuf
+ * with a virtio-net header, and vice versa. Both return -1 if the
+ * offloads cannot be translated. */
+int nm_os_mbuf_vnet_hdr_get(struct mbuf *m, struct nm_vnet_hdr *vh);
+int nm_os_mbuf_vnet_hdr_set(struct mbuf *m, const struct nm_vnet_hdr *vh);
+
+/* current time, in nanoseconds since the epoch */
+uint64_t nm_os_timestamp_ns(void);
+/* stamp the mbuf with the current time, unless the driver already did */
+void nm_os_mbuf_timestamp_set(struct mbuf *m);
+/* arrival time of the mbuf, in nanoseconds since the epoch */
+uint64_t nm_os_mbuf_timestamp(struct mbuf *m);
+
+/*
+ * Tx doorbell coalescing for native adapters. At the end of the first
+ * part of their txsync, drivers call nm_txdb_kick() and only write the
+ * tail register of the NIC if it returns nonzero. The policy is in
+ * netmap_txdb_kick(), driven by the tx_doorbell_slots and
+ * tx_doorbell_usecs sysctls. Deferred slots are flushed by a later
+ * txsync, or by a timer which runs the txsync with NAF_TXDB_FLUSH.
+ * Netmap pipes use the same mechanism to coalesce the notifications
+ * to the other end (see netmap_pipe.c).
+ */
+struct nm_txdb {
+	NM_TIMER_T	timer;
+	struct netmap_kring *kring;	/* NULL if there is no timer */
+	u_int		pending;	/* slots not yet notified to the NIC */
+	u_int		usecs;		/* period of the timer */
+	uint64_t	t0;		/* when the first of them was deferred */
+};
+/* returns 0 if the timer can be used */
+int nm_os_txdb_init(struct nm_txdb *);
+/* start the timer unless already running, returns 0 on success */
+int nm_os_txdb_arm(struct nm_txdb *, u_int usecs);
+void nm_os_txdb_fini(struct nm_txdb *);
+/* timer callback, returns nonzero if the timer must be restarted */
+int netmap_txdb_expire(struct nm_txdb *);
+
+/* classic bpf programs, see netmap_bpf.c */
+struct nm_bpf_prog {
+	u_int len;
+	struct nm_bpf_insn *insns;
+};
+int nm_bpf_validate(const struct nm_bpf_insn *prog, u_int len);
+u_int nm_bpf_filter(const struct nm_bpf_insn *prog, const uint8_t *buf,
+		u_int wirelen, u_int buflen);
+
 #include "netmap_mbq.h"
 
 extern NMG_LOCK_T	netmap_global_lock;
@@ -401,6 +453,65 @@ struct netmap_zmon_list {
  * RX rings attached to the VALE switch are accessed by both senders
  * and receiver. They are protected through the q_lock on the RX ring.
  */
+/*
+ * Per-kring statistics, updated only when netmap_sync_stats is set
+ * and exported to userspace as a struct nm_kring_stats.
+ * Updates are not atomic, so values are approximate.
+ */
+struct netmap_kring_stats {
+	uint64_t	syncs;
+	uint64_t	slots;
+	uint64_t	notifies;
+	uint64_t	full;
+	uint64_t	reinits;
+	uint64_t	drops;		/* always collected */
+	uint64_t	hist[NM_SYNC_HIST_LEN];
+
+	/* state of the sync in progress */
+	uint64_t	t0;
+	uint32_t	pos;
+};
+
+/*
+ * Per-kring notification statistics of ptnetmap and emulated adapters,
+ * always collected and exported to userspace (summed over the rings of
+ * the port) as a struct nm_adapter_stats.
+ * Updates are not atomic, so values are approximate.
+ */
+struct netmap_kring_nstats {
+	uint64_t	kicks;
+	uint64_t	wakeups;
+	uint64_t	intrs;
+	uint64_t	intrs_suppressed;
+	uint64_t	syncs;
+	uint64_t	dry_syncs;
+	uint64_t	slots;
+	uint64_t	drops;
+	uint64_t	hist[NM_BATCH_HIST_LEN];
+};
+
+#ifdef WITH_GENERIC
+/*
+ * Bounded queue of mbufs from generic_rx_handler(), which runs in the
+ * receive path of the driver, to generic_netmap_rxsync().
+ * The consumer (the rxsync, serialized by nr_busy) takes no lock.
+ * Producers serialize among themselves with prod_lock, which is not
+ * contended unless several CPUs feed the same kring (e.g. with RPS,
+ * or with more NIC queues than netmap rings).
+ * head and tail are free running counters, the size is a power of 2.
+ */
+struct nm_mbuf_ring {
+	struct mbuf	**q;
+	u_int		mask;		/* size - 1 */
+
+	NM_LOCK_T	prod_lock;
+	u_int		tail;		/* next entry to fill */
+
+	char		pad[64];	/* keep head on another cache line */
+	u_int		head;		/* next entry to drain */
+};
+#endif /* WITH_GENERIC */
+
 struct netmap_kring {
 	struct netmap_ring	*ring;
 
@@ -482,6 +593,9 @@ struct netmap_kring {
 	struct mbuf	*tx_event;	/* TX event used as a notification */
 	NM_LOCK_T	tx_event_lock;	/* protects the tx_event mbuf */
 	struct mbq	rx_queue;       /* intercepted rx mbufs. */
+#ifdef WITH_GENERIC
+	struct nm_mbuf_ring rx_mring;	/* rx mbufs of generic adapters */
+#endif /* WITH_GENERIC */
 
 	uint32_t	users;		/* existing bindings for this ring */
 
@@ -489,6 +603,21 @@ struct netmap_kring {
 	enum txrx	tx;		/* kind of ring (tx or rx) */
 	char name[64];			/* diagnostic */
 
+	struct netmap_kring_stats stats;
+	struct netmap_kring_nstats nstats;
+
+	/* In-kernel rx filter, attached by the owner file descriptor.
+	 * It is read by the rx datapath of the adapter, under the lock
+	 * of the rx_queue (host rings), the bridge lock (VALE ports) or
+	 * the q_lock (generic adapters, copy monitors), and
+	 * netmap_kring_set_rx_filter() swaps it under the same lock.
+	 */
+	struct nm_bpf_prog *rx_filter;
+	struct netmap_priv_d *rx_filter_owner;
+	uint64_t	rx_filter_drops;	/* approximate on VALE ports */
+
+	struct nm_txdb	txdb;		/* tx doorbell coalescing */
+
 	/* [tx]sync callback for this kring.
 	 * The default nm_kring_create callback (netmap_krings_create)
 	 * sets the nm_sync callback of each hardware tx(rx) kring to
@@ -507,6 +636,13 @@ struct netmap_kring {
 	struct netmap_kring *pipe;	/* if this is a pipe ring,
 					 * pointer to the other end
 					 */
+	uint32_t *fo_bufs;		/* rx rings of fan-out pipes: the
+					 * buffers of the ring, saved while
+					 * it holds those of the master
+					 */
+	volatile int need_kick;		/* the user of the ring waits for
+					 * a notification from the other end
+					 */
 #endif /* WITH_PIPES */
 
 #ifdef WITH_VALE
@@ -521,6 +657,20 @@ struct netmap_kring {
 	uint32_t mon_pos[NR_TXRX]; /* index of this ring in the monitored ring array */
 	uint32_t mon_tail;  /* last seen slot on rx */
 
+	/* sampling state of copy monitor krings, under q_lock
+	 * (see NM_MONSAMPLE_MAGIC)
+	 */
+	uint16_t mon_mode;	/* NM_MONSAMPLE_* */
+	uint32_t mon_rate;	/* sample 1 frame in mon_rate */
+	uint32_t mon_max_pps;	/* 0 = no cap */
+	uint32_t mon_skip;	/* frames to skip before the next sample */
+	uint64_t mon_credit;	/* token bucket, in usecs * pps */
+	uint64_t mon_ts;	/* last refill of the bucket, in ns */
+	uint64_t mon_seen;	/* counters, see struct nm_mon_sampling */
+	uint64_t mon_sampled;
+	uint64_t mon_capped;
+	uint64_t mon_overflows;
+
 	/* circular list of zero-copy monitors */
 	struct netmap_zmon_list zmon_list[NR_TXRX];
 
@@ -572,6 +722,27 @@ nm_prev(uint32_t i, uint32_t lim)
 }
 
 
+/* account a sync that moved the ring index from old to cur
+ * in the notification statistics of the kring */
+static inline void
+nm_kring_nstats_sync(struct netmap_kring *kring, uint32_t old, uint32_t cur)
+{
+	struct netmap_kring_nstats *ns = &kring->nstats;
+	uint32_t n = cur >= old ? cur - old : cur + kring->nkr_num_slots - old;
+	u_int b;
+
+	if (n == 0) {
+		ns->dry_syncs++;
+		return;
+	}
+	ns->syncs++;
+	ns->slots += n;
+	for (b = 0; n > 1 && b < NM_BATCH_HIST_LEN - 1; b++)
+		n >>= 1;
+	ns->hist[b]++;
+}
+
+
 /*
  *
  * Here is the layout for the Rx and Tx rings.
@@ -672,6 +843,15 @@ struct netmap_adapter {
 #define NAF_HOST_RINGS  64	/* the adapter supports the host rings */
 #define NAF_FORCE_NATIVE 128	/* the adapter is always NATIVE */
 #define NAF_PTNETMAP_HOST 256	/* the adapter supports ptnetmap in the host */
+#define NAF_SLOT_TIMESTAMP 512	/* the adapter fills per-slot rx timestamps
+				 * on its own (see NR_SLOT_TIMESTAMP)
+				 */
+#define NAF_RX_FILTER	1024	/* the rx rings support the in-kernel
+				 * filter (see NM_RXFILTER_MAGIC)
+				 */
+#define NAF_PIPE_FANOUT	2048	/* one end of a fan-out pipe
+				 * (see NR_PIPE_FANOUT)
+				 */
 #define NAF_ZOMBIE	(1U<<30) /* the nic driver has been unloaded */
 #define	NAF_BUSY	(1U<<31) /* the adapter is used internally and
 				  * cannot be registered from userspace
@@ -766,6 +946,7 @@ struct netmap_adapter {
 #define NAF_FORCE_READ      1
 #define NAF_FORCE_RECLAIM   2
 #define NAF_CAN_FORWARD_DOWN 4
+#define NAF_TXDB_FLUSH      8	/* notify the NIC of all pending tx slots */
 	/* return configuration information */
 	int (*nm_config)(struct netmap_adapter *,
 		u_int *txr, u_int *txd, u_int *rxr, u_int *rxd);
@@ -940,6 +1121,24 @@ struct netmap_generic_adapter {	/* emulated device */
 	/* Is the transmission path controlled by a netmap-aware
 	 * device queue (i.e. qdisc on linux)? */
 	int txqdisc;
+
+	/* Can the transmit routine build a single mbuf out of the
+	 * slots of a NS_MOREFRAG packet? */
+	int txsg;
+
+	/* Max number of mbufs that txsync passes to the driver in a
+	 * single burst (see nm_os_generic_xmit_burst()), 0 if the
+	 * OS-specific code does not support bulk transmission. */
+	u_int txbatch;
+
+	/* Non-zero if the rx ring of each packet is chosen by a
+	 * software hash, since the device has a single rx queue
+	 * (see netmap_generic_rss_rings). */
+	int rss;
+
+	/* Can the OS-specific code translate virtio-net headers to
+	 * mbuf offloads and back (see netmap_generic_vnet_hdr)? */
+	int vnethdr;
 };
 #endif  /* WITH_GENERIC */
 
@@ -1020,6 +1219,7 @@ int netmap_vi_create(struct nmreq *, int);
 #ifdef WITH_PIPES
 
 #define NM_MAXPIPES 	64	/* max number of pipes per adapter */
+#define NM_PIPE_MAXFANOUT	64	/* max consumers of a fan-out pipe */
 
 struct netmap_pipe_adapter {
 	struct netmap_adapter up;
@@ -1033,6 +1233,12 @@ struct netmap_pipe_adapter {
 	struct ifnet *parent_ifp;	/* maybe null */
 
 	u_int parent_slot; /* index in the parent pipe array */
+
+	/* Fan-out pipes (master only): for each slot of the tx ring,
+	 * the number of consumers still holding its buffer, and the
+	 * number of slave rx rings currently bound by a consumer. */
+	u_int *fo_refs;
+	u_int fo_nactive;
 };
 
 #endif /* WITH_PIPES */
@@ -1065,6 +1271,33 @@ nm_kr_txempty(struct netmap_kring *kring)
  * rxsync_prologue */
 #define nm_kr_rxempty(_k)	nm_kr_txempty(_k)
 
+/* Symmetric hash of the flow of an ethernet frame, whose first len
+ * bytes are in p. Both directions of a flow get the same value.
+ */
+uint32_t nm_flow_hash(const uint8_t *p, u_int len);
+
+/* Run the rx filter of the kring (if any) on a packet, whose first
+ * buflen bytes are in buf. Returns nonzero if the packet must be dropped.
+ */
+static inline int
+nm_kring_rx_filter_drop(struct netmap_kring *kring, const void *buf,
+		u_int buflen, u_int wirelen)
+{
+	struct nm_bpf_prog *f = kring->rx_filter;
+
+	if (likely(f == NULL) || nm_bpf_filter(f->insns, buf, wirelen, buflen))
+		return 0;
+	kring->rx_filter_drops++;
+	return 1;
+}
+
+/* True if the user asked for per-slot rx timestamps on this ring */
+static inline int
+nm_kring_slot_ts(struct netmap_kring *kring)
+{
+	return kring->ring->flags & NR_SLOT_TIMESTAMP;
+}
+
 /*
  * protect against multiple threads using the same ring.
  * also check that the ring has not been stopped or locked
@@ -1455,6 +1688,8 @@ int netmap_init_bridges(void);
 void netmap_uninit_bridges(void);
 int netmap_bdg_ctl(struct nmreq *nmr, struct netmap_bdg_ops *bdg_ops);
 int netmap_bdg_config(struct nmreq *nmr);
+struct nm_bpf_prog *netmap_bdg_swap_rx_filter(struct netmap_kring *kring,
+		struct nm_bpf_prog *prog);
 
 #else /* !WITH_VALE */
 #define	netmap_get_bdg_na(_1, _2, _3, _4)	0
@@ -1483,9 +1718,13 @@ int netmap_get_pipe_na(struct nmreq *nmr, struct netmap_adapter **na,
 int netmap_get_monitor_na(struct nmreq *nmr, struct netmap_adapter **na,
 		struct netmap_mem_d *nmd, int create);
 void netmap_monitor_stop(struct netmap_adapter *na);
+int nm_is_copy_monitor(struct netmap_adapter *na);
+int netmap_monitor_sampling_config(struct netmap_priv_d *priv,
+		struct nm_ifreq *ifr);
 #else
 #define netmap_get_monitor_na(nmr, _2, _3, _4) \
 	((nmr)->nr_flags & (NR_MONITOR_TX | NR_MONITOR_RX) ? EOPNOTSUPP : 0)
+#define netmap_monitor_sampling_config(_1, _2)	EOPNOTSUPP
 #endif
 
 #ifdef CONFIG_NET_NS
@@ -1567,8 +1806,32 @@ extern int netmap_flags;
 extern int netmap_generic_mit;
 extern int netmap_generic_ringsize;
 extern int netmap_generic_rings;
+extern int netmap_generic_rss_rings;
+extern int netmap_generic_vnet_hdr;
 extern int netmap_generic_txqdisc;
+extern int netmap_generic_txbatch;
 extern int ptnetmap_tx_workers;
+extern int ptnetmap_workers;
+extern int ptnetmap_poll_usecs;
+extern int netmap_sync_stats;
+extern int netmap_txdb_slots;
+extern int netmap_txdb_usecs;
+
+/* Decide whether a native txsync that queued n new slots (report is
+ * nonzero if any of them had NS_REPORT) must write the tail register
+ * of the NIC now. The common case, coalescing disabled, stays inline.
+ */
+int netmap_txdb_kick(struct netmap_kring *kring, u_int n, int report,
+		int flags);
+int netmap_txdb_coalesce(struct netmap_kring *kring, u_int n, int flush,
+		u_int slots, u_int usecs);
+static inline int
+nm_txdb_kick(struct netmap_kring *kring, u_int n, int report, int flags)
+{
+	if (likely(netmap_txdb_slots == 0 && kring->txdb.pending == 0))
+		return n > 0;
+	return netmap_txdb_kick(kring, n, report, flags);
+}
 
 /*
  * NA returns a pointer to the struct netmap adapter from the ifp,
@@ -1814,6 +2077,35 @@ PNMB(struct netmap_adapter *na, struct netmap_slot *slot, uint64_t *pp)
 	return ret;
 }
 
+/*
+ * this is a slightly optimized copy routine which rounds
+ * to multiple of 64 bytes and is often faster than dealing
+ * with other odd sizes. We assume there is enough room
+ * in the source and destination buffers.
+ *
+ * XXX only for multiples of 64 bytes, non overlapped.
+ */
+static inline void
+nm_pkt_copy(void *_src, void *_dst, int l)
+{
+        uint64_t *src = _src;
+        uint64_t *dst = _dst;
+        if (unlikely(l >= 1024)) {
+                memcpy(dst, src, l);
+                return;
+        }
+        for (; likely(l > 0); l-=64) {
+                *dst++ = *src++;
+                *dst++ = *src++;
+                *dst++ = *src++;
+                *dst++ = *src++;
+                *dst++ = *src++;
+                *dst++ = *src++;
+                *dst++ = *src++;
+                *dst++ = *src++;
+        }
+}
+
 
 /*
  * Structure associated to each netmap file descriptor.
@@ -1849,6 +2141,9 @@ struct netmap_priv_d {
 	 */
 	NM_SELINFO_T *np_si[NR_TXRX];
 	struct thread	*np_td;		/* kqueue, just debugging */
+
+	/* in-kernel sync loop, see NETMAP_SYNC_KLOOP_START */
+	struct netmap_sync_kloop *np_kloop;
 };
 
 struct netmap_priv_d *netmap_priv_new(void);
@@ -1883,6 +2178,7 @@ struct netmap_monitor_adapter {
 
 	struct netmap_priv_d priv;
 	uint32_t flags;
+	u_int snaplen;		/* copy monitors: max bytes per frame, 0 = all */
 };
 
 #endif /* WITH_MONITOR */
@@ -1919,9 +2215,20 @@ struct nm_os_gen_arg {
 	u_int len;	/* packet length */
 	u_int ring_nr;	/* packet length */
 	u_int qevent;   /* in txqdisc mode, place an event on this mbuf */
+	u_int batch;	/* bulk mode: max mbufs to queue on head/tail */
+	u_int queued;	/* bulk mode: mbufs currently queued */
+	/* NS_MOREFRAG packets span nslots > 1 slots of kring, starting
+	 * at slot_idx (addr and len refer to the first one). */
+	struct netmap_kring *kring;
+	u_int slot_idx;
+	u_int nslots;
+	/* virtio-net header in front of the packet (not included
+	 * in addr and len), or NULL */
+	struct nm_vnet_hdr *vh;
 };
 
 int nm_os_generic_xmit_frame(struct nm_os_gen_arg *);
+int nm_os_generic_xmit_burst(struct nm_os_gen_arg *);
 int nm_os_generic_find_num_desc(struct ifnet *ifp, u_int *tx, u_int *rx);
 void nm_os_generic_find_num_queues(struct ifnet *ifp, u_int *txq, u_int *rxq);
 void nm_os_generic_set_features(struct netmap_generic_adapter *gna);
@@ -1937,12 +2244,6 @@ netmap_generic_getifp(struct netmap_generic_adapter *gna)
 
 void netmap_generic_irq(struct netmap_adapter *na, u_int q, u_int *work_done);
 
-//#define RATE_GENERIC  /* Enables communication statistics for generic. */
-#ifdef RATE_GENERIC
-void generic_rate(int txp, int txs, int txi, int rxp, int rxs, int rxi);
-#else
-#define generic_rate(txp, txs, txi, rxp, rxs, rxi)
-#endif
 
 /*
  * netmap_mitigation API. This is used by the generic adapter
@@ -1970,6 +2271,7 @@ void nm_os_mitigation_cleanup(struct nm_generic_mit *mit);
  */
 struct nm_bdg_fwd {	/* forwarding entry for a bridge */
 	void *ft_buf;		/* netmap or indirect buffer */
+	struct netmap_slot *ft_slot; /* source slot, for buffer swaps */
 	uint8_t ft_frags;	/* how many fragments (only on 1st frag) */
 	uint8_t _ft_port;	/* dst port (unused) */
 	uint16_t ft_flags;	/* flags, e.g. indirect */
@@ -2067,6 +2369,11 @@ int nm_os_vi_persist(const char *, struct ifnet **);
 void nm_os_vi_detach(struct ifnet *);
 void nm_os_vi_init_index(void);
 
+#ifdef WITH_SINK
+/* null NICs, see struct nm_sink_req */
+int nm_os_sink_config(struct nm_ifreq *);
+#endif /* WITH_SINK */
+
 /*
  * kernel thread routines
  */
@@ -2080,8 +2387,10 @@ struct nm_kctx_cfg {
 	nm_kctx_worker_fn_t	worker_fn;	/* worker function */
 	void			*worker_private;/* worker parameter */
 	nm_kctx_notify_fn_t	notify_fn;	/* notify function */
+	uint64_t		*kicks;		/* counts guest kicks, or NULL */
 	int			attach_user;	/* attach kthread to user process */
 	int			use_kthread;	/* use a kthread for the context */
+	int			pooled;		/* run on the shared workers */
 };
 /* kthread configuration */
 struct nm_kctx *nm_os_kctx_create(struct nm_kctx_cfg *cfg,
@@ -2093,6 +2402,8 @@ void nm_os_kctx_destroy(struct nm_kctx *);
 void nm_os_kctx_worker_wakeup(struct nm_kctx *nmk);
 void nm_os_kctx_send_irq(struct nm_kctx *);
 void nm_os_kctx_worker_setaff(struct nm_kctx *, int);
+/* non-zero if the context runs on a worker shared with other contexts */
+int nm_os_kctx_worker_shared(struct nm_kctx *);
 u_int nm_os_ncpus(void);
 
 #ifdef WITH_PTNETMAP_HOST
@@ -2154,10 +2465,10 @@ struct netmap_pt_guest_adapter {
 int netmap_pt_guest_attach(struct netmap_adapter *na, void *csb,
 			   unsigned int nifp_offset, unsigned int memid);
 struct ptnet_ring;
-bool netmap_pt_guest_txsync(struct ptnet_ring *ptring, struct netmap_kring *kring,
-			    int flags);
-bool netmap_pt_guest_rxsync(struct ptnet_ring *ptring, struct netmap_kring *kring,
-			    int flags);
+bool netmap_pt_guest_txsync(struct ptnet_ring *ptring, int event_idx,
+			    struct netmap_kring *kring, int flags);
+bool netmap_pt_guest_rxsync(struct ptnet_ring *ptring, int event_idx,
+			    struct netmap_kring *kring, int flags);
 int ptnet_nm_krings_create(struct netmap_adapter *na);
 void ptnet_nm_krings_delete(struct netmap_adapter *na);
 void ptnet_nm_dtor(struct netmap_adapter *na);
@@ -68,6 +68,22 @@
  *
  * Several copy or zero-copy monitors may be active on any ring.
  *
+ * Copy monitors can also be asked to copy only the first nr_snaplen bytes
+ * of each frame, and accept the same in-kernel filters as the rx rings of
+ * the other ports (see NM_RXFILTER_MAGIC). Both are applied while copying,
+ * so that the frames rejected by the filter never reach the monitor ring
+ * and do not take any space in it.
+ *
+ * Finally, copy monitors can sample the frames that pass the filter,
+ * either one in N or one flow in N, and cap the number of frames copied
+ * per second (see NM_MONSAMPLE_MAGIC). Frames that are selected but do
+ * not fit are counted, so that the samples can be scaled correctly.
+ *
+ * With NR_MONITOR_META, copy monitors precede each frame with a small
+ * header (struct nm_mon_meta) saying which ring and direction it comes
+ * from, its original length and when it was seen, so that one monitor
+ * on all the rings and both directions can replace many.
+ *
  */
 
 
@@ -133,6 +149,13 @@ nm_is_zmon(struct netmap_adapter *na)
 	return na->nm_register == netmap_zmon_reg;
 }
 
+static int netmap_monitor_reg(struct netmap_adapter *, int);
+int
+nm_is_copy_monitor(struct netmap_adapter *na)
+{
+	return na->nm_register == netmap_monitor_reg;
+}
+
 /* nm_sync callback for the monitor's own tx rings.
  * This makes no sense and always returns error
  */
@@ -655,20 +678,84 @@ netmap_zmon_dtor(struct netmap_adapter *na)
  ****************************************************************
  */
 
+/* cost of a frame in the token bucket of the rate cap: the bucket
+ * gains mon_max_pps tokens per microsecond
+ */
+#define NM_MON_CREDIT	1000000
+
+/* refill the token bucket of a copy monitor kring, under q_lock */
+static void
+netmap_monitor_refill(struct netmap_kring *mkring)
+{
+	uint64_t now = nm_os_timestamp_ns(), elapsed = now - mkring->mon_ts;
+	uint64_t burst;
+	uint32_t usecs;
+
+	/* allow bursts of up to one monitor ring (or one second) */
+	burst = mkring->nkr_num_slots;
+	if (burst > mkring->mon_max_pps)
+		burst = mkring->mon_max_pps;
+	burst *= NM_MON_CREDIT;
+	if (elapsed >= 1000000000ULL) {
+		/* idle for a while (or first time): full bucket */
+		mkring->mon_credit = burst;
+		mkring->mon_ts = now;
+		return;
+	}
+	usecs = (uint32_t)elapsed / 1000;
+	mkring->mon_ts += (uint64_t)usecs * 1000;
+	mkring->mon_credit += (uint64_t)usecs * mkring->mon_max_pps;
+	if (mkring->mon_credit > burst)
+		mkring->mon_credit = burst;
+}
+
+/* sampling decision for a frame that passed the filter, under q_lock */
+static inline int
+netmap_monitor_sample(struct netmap_kring *mkring, const char *buf, u_int len)
+{
+	switch (mkring->mon_mode) {
+	case NM_MONSAMPLE_COUNT:
+		if (mkring->mon_skip) {
+			mkring->mon_skip--;
+			return 0;
+		}
+		mkring->mon_skip = mkring->mon_rate - 1;
+		return 1;
+	case NM_MONSAMPLE_FLOW:
+		return nm_flow_hash((const uint8_t *)buf, len) %
+			mkring->mon_rate == 0;
+	default:
+		return 1;
+	}
+}
+
 static void
 netmap_monitor_parent_sync(struct netmap_kring *kring, u_int first_new, int new_slots)
 {
+	uint64_t ts = 0;
 	u_int j;
 
 	for (j = 0; j < kring->n_monitors; j++) {
 		struct netmap_kring *mkring = kring->monitors[j];
 		u_int i, mlim, beg;
-		int free_slots, busy, sent = 0, m;
+		int free_slots, busy, sent = 0, m, selective;
 		u_int lim = kring->nkr_num_slots - 1;
 		struct netmap_ring *ring = kring->ring, *mring = mkring->ring;
 		u_int max_len = NETMAP_BUF_SIZE(mkring->na);
+		struct netmap_monitor_adapter *mna =
+			(struct netmap_monitor_adapter *)mkring->na;
+		u_int snaplen = mna->snaplen;
+		u_int src_len = NETMAP_BUF_SIZE(kring->na);
+		u_int hdr_len = 0;
 
 		mlim = mkring->nkr_num_slots - 1;
+		if (mna->flags & NR_MONITOR_META) {
+			/* one timestamp for all the frames of this sync */
+			if (ts == 0)
+				ts = nm_os_timestamp_ns();
+			hdr_len = sizeof(struct nm_mon_meta);
+			max_len -= hdr_len;
+		}
 
 		/* we need to lock the monitor receive ring, since it
 		 * is the target of bot tx and rx traffic from the monitored
@@ -682,19 +769,34 @@ netmap_monitor_parent_sync(struct netmap_kring *kring, u_int first_new, int new_
 			busy += mkring->nkr_num_slots;
 		free_slots = mlim - busy;
 
-		if (!free_slots)
-			goto out;
-
-		/* copy min(free_slots, new_slots) slots */
 		m = new_slots;
 		beg = first_new;
-		if (free_slots < m) {
-			beg += (m - free_slots);
-			if (beg >= kring->nkr_num_slots)
-				beg -= kring->nkr_num_slots;
-			m = free_slots;
+		selective = mkring->rx_filter != NULL ||
+			mkring->mon_mode != NM_MONSAMPLE_ALL ||
+			mkring->mon_max_pps != 0;
+		if (!selective) {
+			/* copy min(free_slots, new_slots) slots: we know in
+			 * advance how many frames fit, and we keep the most
+			 * recent ones
+			 */
+			mkring->mon_seen += m;
+			if (free_slots < m) {
+				mkring->mon_overflows += m - free_slots;
+				mkring->stats.drops += m - free_slots;
+				beg += (m - free_slots);
+				if (beg >= kring->nkr_num_slots)
+					beg -= kring->nkr_num_slots;
+				m = free_slots;
+			}
+		} else if (mkring->mon_max_pps) {
+			netmap_monitor_refill(mkring);
 		}
 
+		/* With a filter or a sampling policy we scan all the new
+		 * slots in order. The frames that are not selected do not
+		 * use a monitor slot; the others are copied until the
+		 * monitor ring fills up, and counted as lost afterwards.
+		 */
 		for ( ; m; m--) {
 			struct netmap_slot *s = &ring->slot[beg];
 			struct netmap_slot *ms = &mring->slot[i];
@@ -702,22 +804,60 @@ netmap_monitor_parent_sync(struct netmap_kring *kring, u_int first_new, int new_
 			char *src = NMB(kring->na, s),
 			     *dst = NMB(mkring->na, ms);
 
+			beg = nm_next(beg, lim);
+			if (selective) {
+				u_int buflen = copy_len < src_len ?
+					copy_len : src_len;
+
+				if (nm_kring_rx_filter_drop(mkring, src,
+						buflen, copy_len))
+					continue;
+				mkring->mon_seen++;
+				if (!netmap_monitor_sample(mkring, src, buflen))
+					continue;
+				if (mkring->mon_max_pps &&
+				    mkring->mon_credit < NM_MON_CREDIT) {
+					mkring->mon_capped++;
+					mkring->stats.drops++;
+					continue;
+				}
+				if (free_slots == 0) {
+					mkring->mon_overflows++;
+					mkring->stats.drops++;
+					continue;
+				}
+				if (mkring->mon_max_pps)
+					mkring->mon_credit -= NM_MON_CREDIT;
+			}
+
+			if (snaplen && copy_len > snaplen)
+				copy_len = snaplen;
 			if (unlikely(copy_len > max_len)) {
 				RD(5, "%s->%s: truncating %d to %d", kring->name,
 						mkring->name, copy_len, max_len);
 				copy_len = max_len;
 			}
 
-			memcpy(dst, src, copy_len);
-			ms->len = copy_len;
+			if (hdr_len) {
+				struct nm_mon_meta *meta = (struct nm_mon_meta *)dst;
+
+				meta->ts = ts;
+				meta->len = s->len;
+				meta->ring = kring->ring_id;
+				meta->dir = kring->tx == NR_TX ?
+					NM_MON_META_TX : NM_MON_META_RX;
+				meta->flags = 0;
+			}
+			memcpy(dst + hdr_len, src, copy_len);
+			ms->len = hdr_len + copy_len;
 			sent++;
+			free_slots--;
 
-			beg = nm_next(beg, lim);
 			i = nm_next(i, mlim);
 		}
+		mkring->mon_sampled += sent;
 		mb();
 		mkring->nr_hwtail = i;
-	out:
 		mtx_unlock(&mkring->q_lock);
 
 		if (sent) {
@@ -824,6 +964,77 @@ netmap_monitor_dtor(struct netmap_adapter *na)
 }
 
 
+/*
+ * NIOCCONFIG handler for struct nm_mon_sampling requests: change the
+ * sampling policy of the rx rings of the copy monitor bound to priv,
+ * and return their counters.
+ */
+int
+netmap_monitor_sampling_config(struct netmap_priv_d *priv,
+		struct nm_ifreq *ifr)
+{
+	struct nm_mon_sampling *req = (struct nm_mon_sampling *)ifr->data;
+	int set = !(req->flags & NM_MONSAMPLE_GET);
+	struct netmap_adapter *na;
+	u_int i;
+	int error = 0;
+
+	if (set) {
+		switch (req->mode) {
+		case NM_MONSAMPLE_ALL:
+			break;
+		case NM_MONSAMPLE_COUNT:
+		case NM_MONSAMPLE_FLOW:
+			if (req->rate == 0)
+				return EINVAL;
+			break;
+		default:
+			return EINVAL;
+		}
+	}
+
+	NMG_LOCK();
+	na = priv->np_na;
+	if (priv->np_nifp == NULL || na == NULL) {
+		error = ENXIO;
+		goto out;
+	}
+	if (!nm_is_copy_monitor(na)) {
+		error = EOPNOTSUPP;
+		goto out;
+	}
+	req->seen = req->sampled = req->capped = req->overflows = 0;
+	for (i = priv->np_qfirst[NR_RX]; i < priv->np_qlast[NR_RX]; i++) {
+		struct netmap_kring *kring = &NMR(na, NR_RX)[i];
+
+		mtx_lock(&kring->q_lock);
+		if (set) {
+			kring->mon_mode = req->mode;
+			kring->mon_rate = req->mode == NM_MONSAMPLE_ALL ?
+				1 : req->rate;
+			kring->mon_max_pps = req->max_pps;
+			kring->mon_skip = 0;
+			kring->mon_ts = 0; /* the next refill fills the bucket */
+		}
+		req->mode = kring->mon_mode;
+		req->rate = kring->mon_rate;
+		req->max_pps = kring->mon_max_pps;
+		req->seen += kring->mon_seen;
+		req->sampled += kring->mon_sampled;
+		req->capped += kring->mon_capped;
+		req->overflows += kring->mon_overflows;
+		if (req->flags & NM_MONSAMPLE_RESET) {
+			kring->mon_seen = kring->mon_sampled = 0;
+			kring->mon_capped = kring->mon_overflows = 0;
+		}
+		mtx_unlock(&kring->q_lock);
+	}
+out:
+	NMG_UNLOCK();
+	return error;
+}
+
+
 /* check if nmr is a request for a monitor adapter that we can satisfy */
 int
 netmap_get_monitor_na(struct nmreq *nmr, struct netmap_adapter **na,
@@ -838,6 +1049,10 @@ netmap_get_monitor_na(struct nmreq *nmr, struct netmap_adapter **na,
 	char monsuff[10] = "";
 
 	if (zcopy) {
+		if (nmr->nr_flags & NR_MONITOR_META) {
+			D("zero-copy monitors cannot store metadata");
+			return EINVAL;
+		}
 		nmr->nr_flags |= (NR_MONITOR_TX | NR_MONITOR_RX);
 	}
 	if ((nmr->nr_flags & (NR_MONITOR_TX | NR_MONITOR_RX)) == 0) {
@@ -854,7 +1069,8 @@ netmap_get_monitor_na(struct nmreq *nmr, struct netmap_adapter **na,
 	 * except other monitors.
 	 */
 	memcpy(&pnmr, nmr, sizeof(pnmr));
-	pnmr.nr_flags &= ~(NR_MONITOR_TX | NR_MONITOR_RX | NR_ZCOPY_MON);
+	pnmr.nr_flags &= ~(NR_MONITOR_TX | NR_MONITOR_RX | NR_ZCOPY_MON |
+			NR_MONITOR_META);
 	error = netmap_get_na(&pnmr, &pna, &ifp, nmd, create);
 	if (error) {
 		D("parent lookup failed: %d", error);
@@ -889,11 +1105,12 @@ netmap_get_monitor_na(struct nmreq *nmr, struct netmap_adapter **na,
 	if (mna->priv.np_qlast[NR_TX] - mna->priv.np_qfirst[NR_TX] == 1) {
 		snprintf(monsuff, 10, "-%d", mna->priv.np_qfirst[NR_TX]);
 	}
-	snprintf(mna->up.name, sizeof(mna->up.name), "%s%s/%s%s%s", pna->name,
+	snprintf(mna->up.name, sizeof(mna->up.name), "%s%s/%s%s%s%s", pna->name,
 			monsuff,
 			zcopy ? "z" : "",
 			(nmr->nr_flags & NR_MONITOR_RX) ? "r" : "",
-			(nmr->nr_flags & NR_MONITOR_TX) ? "t" : "");
+			(nmr->nr_flags & NR_MONITOR_TX) ? "t" : "",
+			(nmr->nr_flags & NR_MONITOR_META) ? "m" : "");
 
 	/* the monitor supports the host rings iff the parent does */
 	mna->up.na_flags |= (pna->na_flags & NAF_HOST_RINGS);
@@ -950,7 +1167,15 @@ netmap_get_monitor_na(struct nmreq *nmr, struct netmap_adapter **na,
 	}
 
 	/* remember the traffic directions we have to monitor */
-	mna->flags = (nmr->nr_flags & (NR_MONITOR_TX | NR_MONITOR_RX | NR_ZCOPY_MON));
+	mna->flags = (nmr->nr_flags & (NR_MONITOR_TX | NR_MONITOR_RX |
+				NR_ZCOPY_MON | NR_MONITOR_META));
+	if (!zcopy) {
+		/* copy monitors can truncate and filter the frames
+		 * before copying them
+		 */
+		mna->snaplen = nmr->nr_snaplen;
+		mna->up.na_flags |= NAF_RX_FILTER;
+	}
 
 	*na = &mna->up;
 	netmap_adapter_get(*na);
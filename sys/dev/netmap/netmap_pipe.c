@@ -77,9 +77,17 @@
 #define NM_PIPE_MAXSLOTS	4096
 
 static int netmap_default_pipes = 0; /* ignored, kept for compatibility */
+/* Coalescing of the notifications to a waiting receiver (see
+ * netmap_pipe_kick_rx()): 0 disables it. */
+static int netmap_pipe_notify_slots = 0;
+static int netmap_pipe_notify_usecs = 20;
 SYSBEGIN(vars_pipes);
 SYSCTL_DECL(_dev_netmap);
 SYSCTL_INT(_dev_netmap, OID_AUTO, default_pipes, CTLFLAG_RW, &netmap_default_pipes, 0 , "");
+SYSCTL_INT(_dev_netmap, OID_AUTO, pipe_notify_slots, CTLFLAG_RW,
+    &netmap_pipe_notify_slots, 0, "Slots to accumulate before waking up a pipe receiver");
+SYSCTL_INT(_dev_netmap, OID_AUTO, pipe_notify_usecs, CTLFLAG_RW,
+    &netmap_pipe_notify_usecs, 0, "Max delay of a pipe receiver wake up");
 SYSEND;
 
 /* allocate the pipe array in the parent adapter */
@@ -172,6 +180,104 @@ netmap_pipe_remove(struct netmap_adapter *parent, struct netmap_pipe_adapter *na
 	parent->na_pipes[n] = NULL;
 }
 
+/* The two ends of a pipe normally share the allocator of the parent, and
+ * the txsync swaps the buffers between the tx and the rx ring. The ends
+ * may also be bound to different allocators (see netmap_pipe_set_mem()),
+ * and in that case the packets are copied. The rings of an end that uses
+ * a different allocator only exist while that end is registered, so the
+ * txsync keeps the packets in the tx ring until the other end shows up.
+ */
+static inline int
+nm_pipe_copy_mode(struct netmap_kring *kring)
+{
+	return kring->na->nm_mem != kring->pipe->na->nm_mem;
+}
+
+/* copy limit packets to the rx ring of an end with another allocator,
+ * starting from slot *k of the tx ring and slot *j of the rx ring
+ */
+static void
+netmap_pipe_copy(struct netmap_kring *txkring, struct netmap_kring *rxkring,
+		u_int *pk, u_int *pj, u_int limit)
+{
+	u_int k = *pk, j = *pj;
+	struct netmap_adapter *txna = txkring->na, *rxna = rxkring->na;
+	u_int lim_tx = txkring->nkr_num_slots - 1,
+	      lim_rx = rxkring->nkr_num_slots - 1;
+	u_int bufsize = NETMAP_BUF_SIZE(rxna);
+	/* rounding up to 64 bytes is safe if both buffers have room */
+	u_int maxround = bufsize < NETMAP_BUF_SIZE(txna) ?
+			bufsize : NETMAP_BUF_SIZE(txna);
+	void *src = NMB(txna, &txkring->ring->slot[k]);
+
+	while (limit-- > 0) {
+		struct netmap_slot *rs = &rxkring->ring->slot[j];
+		struct netmap_slot *ts = &txkring->ring->slot[k];
+		u_int len = ts->len, copy_len;
+		void *next;
+
+		k = nm_next(k, lim_tx);
+		next = NMB(txna, &txkring->ring->slot[k]);
+		__builtin_prefetch(next);
+
+		if (unlikely(len > bufsize)) {
+			RD(5, "%s: %u bytes do not fit in %s, truncated",
+				txkring->name, len, rxkring->name);
+			len = bufsize;
+		}
+		copy_len = (len + 63) & ~63;
+		if (unlikely(copy_len > maxround))
+			memcpy(NMB(rxna, rs), src, len);
+		else
+			nm_pkt_copy(src, NMB(rxna, rs), (int)copy_len);
+		rs->len = len;
+		rs->flags = ts->flags & NS_MOREFRAG;
+
+		src = next;
+		j = nm_next(j, lim_rx);
+	}
+	*pk = k;
+	*pj = j;
+}
+
+/* Notifications.
+ *
+ * Each end only wakes up the other one when it has asked for it, by
+ * setting need_kick at the end of a sync that left the user with nothing
+ * to do (no received slots, or no free slots to transmit). The flag is
+ * written before the sync reports the new state to the user, and read
+ * after the peer has published its own update, with a barrier on both
+ * sides, so that either the user sees the update or the peer sees the
+ * flag. A kring whose nm_notify has been intercepted (e.g. by a monitor)
+ * is always notified.
+ *
+ * On top of this, the wake ups of a waiting receiver can be coalesced
+ * like the tx doorbells of native adapters (netmap_txdb_coalesce()),
+ * according to the pipe_notify_slots and pipe_notify_usecs sysctls.
+ */
+static inline int
+nm_pipe_wants_kick(struct netmap_kring *kring)
+{
+	return kring->need_kick || kring->nm_notify != kring->na->nm_notify;
+}
+
+/* wake up the receiver, if needed, after n new slots */
+static void
+netmap_pipe_kick_rx(struct netmap_kring *txkring, u_int n, int flags)
+{
+	struct netmap_kring *rxkring = txkring->pipe;
+
+	if (!nm_pipe_wants_kick(rxkring)) {
+		/* it will find the slots by itself */
+		txkring->txdb.pending = 0;
+		return;
+	}
+	if (netmap_txdb_coalesce(txkring, n, (flags & NAF_TXDB_FLUSH) ||
+			(txkring->ring->flags & NR_TX_FLUSH),
+			netmap_pipe_notify_slots, netmap_pipe_notify_usecs))
+		rxkring->nm_notify(rxkring, 0);
+}
+
 int
 netmap_pipe_txsync(struct netmap_kring *txkring, int flags)
 {
@@ -180,8 +286,14 @@ netmap_pipe_txsync(struct netmap_kring *txkring, int flags)
         u_int j, k, lim_tx = txkring->nkr_num_slots - 1,
                 lim_rx = rxkring->nkr_num_slots - 1;
         int m, busy;
+        int copy = nm_pipe_copy_mode(txkring);
+        u_int sent = 0;
 
         ND("%p: %s %x -> %s", txkring, txkring->name, flags, rxkring->name);
+	if (unlikely(copy) && rxkring->nr_mode != NKR_NETMAP_ON) {
+		/* the other end is not there, keep the packets */
+		goto out;
+	}
         ND(2, "before: hwcur %d hwtail %d cur %d head %d tail %d", txkring->nr_hwcur, txkring->nr_hwtail,
                 txkring->rcur, txkring->rhead, txkring->rtail);
 
@@ -201,8 +313,16 @@ netmap_pipe_txsync(struct netmap_kring *txkring, int flags)
                 limit = m;
 
 	if (limit == 0) {
-		/* either the rxring is full, or nothing to send */
-		return 0;
+		/* either the rxring is full, or nothing to send,
+		 * but we may have to flush a deferred notification */
+		netmap_pipe_kick_rx(txkring, 0, flags);
+		goto out;
+	}
+	sent = limit;
+
+	if (unlikely(copy)) {
+		netmap_pipe_copy(txkring, rxkring, &k, &j, limit);
+		limit = 0;
 	}
 
         while (limit-- > 0) {
@@ -232,8 +352,12 @@ netmap_pipe_txsync(struct netmap_kring *txkring, int flags)
                 txkring->rcur, txkring->rhead, txkring->rtail, j);
 
         mb(); /* make sure rxkring->nr_hwtail is updated before notifying */
-        rxkring->nm_notify(rxkring, 0);
+        netmap_pipe_kick_rx(txkring, sent, flags);
 
+out:
+	/* ask to be woken up if the user has no free slots */
+	txkring->need_kick = (txkring->nr_hwtail == txkring->rcur);
+	mb(); /* paired with the second mb() in rxsync */
 	return 0;
 }
 
@@ -247,16 +371,273 @@ netmap_pipe_rxsync(struct netmap_kring *rxkring, int flags)
         rxkring->nr_hwcur = rxkring->rhead; /* recover user-relased slots */
         ND(5, "hwcur %d hwtail %d cur %d head %d tail %d", rxkring->nr_hwcur, rxkring->nr_hwtail,
                 rxkring->rcur, rxkring->rhead, rxkring->rtail);
+	/* ask to be woken up if the user has seen all the slots */
+	rxkring->need_kick = (rxkring->nr_hwtail == rxkring->rcur);
         mb(); /* paired with the first mb() in txsync */
 
 	if (oldhwcur != rxkring->nr_hwcur) {
 		/* we have released some slots, notify the other end */
 		mb(); /* make sure nr_hwcur is updated before notifying */
-		txkring->nm_notify(txkring, 0);
+		if (nm_pipe_wants_kick(txkring))
+			txkring->nm_notify(txkring, 0);
 	}
         return 0;
 }
 
+/* Lock a kring of the other end against its ?xsync while we change
+ * something it looks at, preserving its stopped state.
+ */
+static int
+netmap_pipe_kr_lock(struct netmap_kring *kring)
+{
+	int stopped = kring->nkr_stopped;
+
+	nm_kr_stop(kring, NM_KR_LOCKED);
+	return stopped;
+}
+
+static void
+netmap_pipe_kr_unlock(struct netmap_kring *kring, int stopped)
+{
+	kring->nkr_stopped = stopped;
+	nm_kr_put(kring);
+}
+
+/* Forget the content of a kring whose ring has been (or will be)
+ * allocated again: the rx ring is empty and all the tx slots are
+ * available.
+ */
+static void
+netmap_pipe_kring_reset(struct netmap_kring *kring)
+{
+	u_int lim = kring->nkr_num_slots - 1;
+
+	kring->rhead = kring->rcur = kring->nr_hwcur;
+	kring->nr_hwtail = (kring->tx == NR_TX ?
+			nm_prev(kring->nr_hwcur, lim) : kring->nr_hwcur);
+	kring->rtail = kring->nr_hwtail;
+	if (kring->ring) {
+		kring->ring->head = kring->ring->cur = kring->rhead;
+		kring->ring->tail = kring->rtail;
+	}
+}
+
+/* Change the mode of one of our krings. If the other end uses a different
+ * allocator, our ring only exists while the kring is in netmap mode, and
+ * the ?xsync of the other end must see the change atomically.
+ */
+static void
+netmap_pipe_kring_set_mode(struct netmap_kring *kring, int mode)
+{
+	int stopped;
+
+	if (kring->pipe == NULL || !nm_pipe_copy_mode(kring)) {
+		kring->nr_mode = mode;
+		return;
+	}
+	stopped = netmap_pipe_kr_lock(kring->pipe);
+	if (mode == NKR_NETMAP_ON)
+		netmap_pipe_kring_reset(kring);
+	kring->nr_mode = mode;
+	netmap_pipe_kr_unlock(kring->pipe, stopped);
+}
+
+/* Fan-out pipes.
+ *
+ * The slave endpoint of a fan-out pipe has one rx ring for each consumer.
+ * The txsync of the master does not swap the slots, but copies them to the
+ * same position of all the rx rings that are currently bound, so that the
+ * consumers share the buffers of the master tx ring. Each slot of the tx
+ * ring has a counter of the consumers that still hold it. The counter is
+ * decremented by the rxsync of the consumers, and the slot goes back to
+ * the master only when it reaches zero. Since all the rings advance in
+ * order, the master reclaims the slots up to the first one that is still
+ * in use.
+ *
+ * While a consumer is bound, the original buffers of its rx ring are
+ * saved in kring->fo_bufs, and restored when the consumer goes away.
+ * Consumers must not swap the buffers they receive (NS_BUF_CHANGED):
+ * the rxsync puts the master buffers back and reinits the ring.
+ */
+static int
+netmap_pipe_fanout_txsync(struct netmap_kring *txkring, int flags)
+{
+	struct netmap_pipe_adapter *mna =
+		(struct netmap_pipe_adapter *)txkring->na;
+	struct netmap_adapter *sna = &mna->peer->up;
+	u_int *refs = mna->fo_refs;
+	u_int lim = txkring->nkr_num_slots - 1;
+	u_int head = txkring->rhead;
+	u_int i, j, k, nactive = 0;
+
+	if (head != txkring->nr_hwcur) {
+		for (i = 0; i < sna->num_rx_rings; i++) {
+			struct netmap_kring *rxkring = &sna->rx_rings[i];
+
+			if (rxkring->nr_mode != NKR_NETMAP_ON)
+				continue;
+			nactive++;
+			for (k = txkring->nr_hwcur; k != head; k = nm_next(k, lim)) {
+				struct netmap_slot *rs = &rxkring->ring->slot[k];
+
+				*rs = txkring->ring->slot[k];
+				rs->flags |= NS_BUF_CHANGED;
+			}
+		}
+		for (k = txkring->nr_hwcur; k != head; k = nm_next(k, lim)) {
+			txkring->ring->slot[k].flags &= ~NS_BUF_CHANGED;
+			refs[k] = nactive;
+		}
+
+		mb(); /* make sure the slots and refs are updated before publishing them */
+		for (i = 0; i < sna->num_rx_rings; i++) {
+			if (sna->rx_rings[i].nr_mode == NKR_NETMAP_ON)
+				sna->rx_rings[i].nr_hwtail = head;
+		}
+		txkring->nr_hwcur = head;
+
+		mb(); /* make sure the nr_hwtail's are updated before notifying */
+		for (i = 0; i < sna->num_rx_rings; i++) {
+			struct netmap_kring *rxkring = &sna->rx_rings[i];
+
+			if (rxkring->nr_mode == NKR_NETMAP_ON)
+				rxkring->nm_notify(rxkring, 0);
+		}
+	}
+
+	/* reclaim the slots that have been released by all the consumers */
+	k = txkring->nr_hwtail;
+	while ((j = nm_next(k, lim)) != txkring->nr_hwcur &&
+			NM_ACCESS_ONCE(refs[j]) == 0)
+		k = j;
+	txkring->nr_hwtail = k;
+
+	ND(2, "%s: hwcur %d hwtail %d consumers %d", txkring->name,
+		txkring->nr_hwcur, txkring->nr_hwtail, nactive);
+	return 0;
+}
+
+static int
+netmap_pipe_fanout_rxsync(struct netmap_kring *rxkring, int flags)
+{
+	struct netmap_kring *txkring = rxkring->pipe;
+	struct netmap_pipe_adapter *mna =
+		(struct netmap_pipe_adapter *)txkring->na;
+	u_int lim = rxkring->nkr_num_slots - 1;
+	u_int k, head = rxkring->rhead;
+	int released = 0, swapped = 0;
+
+	/* The buffers belong to the master tx ring and are shared with
+	 * the other consumers, so the user cannot swap them: a buffer
+	 * would end up with two owners. Put the master buffers back and
+	 * keep the slots until the user releases them unchanged.
+	 */
+	for (k = rxkring->nr_hwcur; k != head; k = nm_next(k, lim)) {
+		struct netmap_slot *rs = &rxkring->ring->slot[k];
+		uint32_t idx = txkring->ring->slot[k].buf_idx;
+
+		if (unlikely(rs->buf_idx != idx)) {
+			RD(5, "%s: buffer %u swapped in slot %u", rxkring->name,
+				idx, k);
+			rs->buf_idx = idx;
+			rs->flags |= NS_BUF_CHANGED;
+			swapped = 1;
+		}
+	}
+	if (unlikely(swapped))
+		return netmap_ring_reinit(rxkring);
+
+	/* drop our references to the slots released by the user */
+	for (k = rxkring->nr_hwcur; k != head; k = nm_next(k, lim)) {
+		if (refcount_release(&mna->fo_refs[k]))
+			released = 1;
+	}
+	rxkring->nr_hwcur = head;
+	mb(); /* paired with the first mb() in txsync */
+
+	if (released) {
+		/* some slots can go back to the master */
+		txkring->nm_notify(txkring, 0);
+	}
+	return 0;
+}
+
+/* Bind a consumer to the given rx ring of a fan-out slave: save the
+ * buffers of the ring and start receiving from the current position of
+ * the master. The master tx ring is locked, so that its txsync always
+ * sees a consistent set of consumers.
+ */
+static void
+netmap_pipe_fanout_attach(struct netmap_kring *rxkring)
+{
+	struct netmap_kring *txkring = rxkring->pipe;
+	struct netmap_pipe_adapter *mna =
+		(struct netmap_pipe_adapter *)txkring->na;
+	struct netmap_ring *ring = rxkring->ring;
+	int stopped = netmap_pipe_kr_lock(txkring);
+	u_int j, hwcur;
+
+	hwcur = txkring->nr_hwcur;
+	for (j = 0; j < rxkring->nkr_num_slots; j++) {
+		rxkring->fo_bufs[j] = ring->slot[j].buf_idx;
+		ring->slot[j] = txkring->ring->slot[j];
+		ring->slot[j].flags |= NS_BUF_CHANGED;
+	}
+	rxkring->nr_hwcur = rxkring->nr_hwtail = hwcur;
+	rxkring->rhead = rxkring->rcur = rxkring->rtail = hwcur;
+	ring->head = ring->cur = ring->tail = hwcur;
+	rxkring->nr_mode = NKR_NETMAP_ON;
+	mna->fo_nactive++;
+	netmap_pipe_kr_unlock(txkring, stopped);
+}
+
+/* Unbind a consumer: release all the slots it still holds and give
+ * the ring its own buffers back.
+ */
+static void
+netmap_pipe_fanout_detach(struct netmap_kring *rxkring)
+{
+	struct netmap_kring *txkring = rxkring->pipe;
+	struct netmap_pipe_adapter *mna =
+		(struct netmap_pipe_adapter *)txkring->na;
+	struct netmap_ring *ring = rxkring->ring;
+	u_int lim = rxkring->nkr_num_slots - 1;
+	int stopped = netmap_pipe_kr_lock(txkring);
+	int released = 0;
+	u_int j;
+
+	rxkring->nr_mode = NKR_NETMAP_OFF;
+	for (j = rxkring->nr_hwcur; j != rxkring->nr_hwtail; j = nm_next(j, lim)) {
+		if (refcount_release(&mna->fo_refs[j]))
+			released = 1;
+	}
+	for (j = 0; j < rxkring->nkr_num_slots; j++) {
+		ring->slot[j].buf_idx = rxkring->fo_bufs[j];
+		ring->slot[j].flags = 0;
+	}
+	mna->fo_nactive--;
+	netmap_pipe_kr_unlock(txkring, stopped);
+
+	if (released)
+		txkring->nm_notify(txkring, 0);
+}
+
+/* free the arrays allocated by netmap_pipe_krings_create() */
+static void
+netmap_pipe_fanout_bufs_free(struct netmap_adapter *sna)
+{
+	u_int i;
+
+	for (i = 0; i < sna->num_rx_rings; i++) {
+		struct netmap_kring *kring = &sna->rx_rings[i];
+
+		if (kring->fo_bufs) {
+			nm_os_free(kring->fo_bufs);
+			kring->fo_bufs = NULL;
+		}
+	}
+}
+
 /* Pipe endpoints are created and destroyed together, so that endopoints do not
  * have to check for the existence of their peer at each ?xsync.
  *
@@ -327,18 +708,50 @@ netmap_pipe_krings_create(struct netmap_adapter *na)
 		if (error)
 			goto del_krings1;
 
-		/* cross link the krings */
+		/* cross link the krings. The rx rings of a fan-out
+		 * slave all point to the only tx ring of the master */
 		for_rx_tx(t) {
 			enum txrx r = nm_txrx_swap(t); /* swap NR_TX <-> NR_RX */
-			for (i = 0; i < nma_get_nrings(na, t); i++) {
-				NMR(na, t)[i].pipe = NMR(ona, r) + i;
-				NMR(ona, r)[i].pipe = NMR(na, t) + i;
-			}
+			u_int n = nma_get_nrings(na, t),
+			      on = nma_get_nrings(ona, r);
+
+			for (i = 0; i < n; i++)
+				NMR(na, t)[i].pipe = NMR(ona, r) + (i < on ? i : on - 1);
+			for (i = 0; i < on; i++)
+				NMR(ona, r)[i].pipe = NMR(na, t) + (i < n ? i : n - 1);
+		}
+
+		/* timers for the coalesced notifications */
+		for (i = 0; i < 2; i++) {
+			struct netmap_kring *kring =
+				&(i == 0 ? na : ona)->tx_rings[0];
+
+			kring->txdb.kring = kring;
+			if (nm_os_txdb_init(&kring->txdb))
+				kring->txdb.kring = NULL;
 		}
 
+		if (na->na_flags & NAF_PIPE_FANOUT) {
+			struct netmap_adapter *sna =
+				(pna->role == NR_REG_PIPE_SLAVE ? na : ona);
+
+			for (i = 0; i < sna->num_rx_rings; i++) {
+				struct netmap_kring *kring = &sna->rx_rings[i];
+
+				kring->fo_bufs = nm_os_malloc(sizeof(uint32_t) *
+						kring->nkr_num_slots);
+				if (kring->fo_bufs == NULL) {
+					error = ENOMEM;
+					goto del_krings2;
+				}
+			}
+		}
 	}
 	return 0;
 
+del_krings2:
+	netmap_pipe_fanout_bufs_free(pna->role == NR_REG_PIPE_SLAVE ? na : ona);
+	netmap_krings_delete(ona);
 del_krings1:
 	netmap_krings_delete(na);
 err:
@@ -386,6 +799,13 @@ netmap_pipe_reg(struct netmap_adapter *na, int onoff)
 	struct netmap_adapter *ona = &pna->peer->up;
 	int i, error = 0;
 	enum txrx t;
+	/* the other end has its own allocator */
+	int copy = (na->nm_mem != ona->nm_mem);
+	/* the consumers of a fan-out pipe, and the ring they share */
+	enum txrx fo_t = NR_TXRX;
+
+	if (na->na_flags & NAF_PIPE_FANOUT)
+		fo_t = (pna->role == NR_REG_PIPE_SLAVE ? NR_RX : NR_TX);
 
 	ND("%p: onoff %d", na, onoff);
 	if (onoff) {
@@ -393,7 +813,12 @@ netmap_pipe_reg(struct netmap_adapter *na, int onoff)
 			for (i = 0; i < nma_get_nrings(na, t); i++) {
 				struct netmap_kring *kring = &NMR(na, t)[i];
 
-				if (nm_kring_pending_on(kring)) {
+				if (t == fo_t && pna->role == NR_REG_PIPE_MASTER) {
+					/* the consumers need our ring, not
+					 * the other way round */
+					continue;
+				}
+				if (nm_kring_pending_on(kring) && !copy) {
 					/* mark the peer ring as needed */
 					kring->pipe->nr_kflags |= NKR_NEEDRING;
 				}
@@ -410,8 +835,17 @@ netmap_pipe_reg(struct netmap_adapter *na, int onoff)
 			for (i = 0; i < nma_get_nrings(na, t) + 1; i++) {
 				struct netmap_kring *kring = &NMR(na, t)[i];
 
-				if (nm_kring_pending_on(kring)) {
-					kring->nr_mode = NKR_NETMAP_ON;
+				if (!nm_kring_pending_on(kring))
+					continue;
+				if (t == fo_t && pna->role == NR_REG_PIPE_SLAVE &&
+						i < nma_get_nrings(na, t)) {
+					netmap_pipe_fanout_attach(kring);
+					continue;
+				}
+				netmap_pipe_kring_set_mode(kring, NKR_NETMAP_ON);
+				if (copy && t == NR_RX && kring->pipe) {
+					/* the other end may be waiting for us */
+					kring->pipe->nm_notify(kring->pipe, 0);
 				}
 			}
 		}
@@ -425,7 +859,22 @@ netmap_pipe_reg(struct netmap_adapter *na, int onoff)
 				struct netmap_kring *kring = &NMR(na, t)[i];
 
 				if (nm_kring_pending_off(kring)) {
-					kring->nr_mode = NKR_NETMAP_OFF;
+					if (t == fo_t && i < nma_get_nrings(na, t)) {
+						if (pna->role == NR_REG_PIPE_MASTER) {
+							kring->nr_mode = NKR_NETMAP_OFF;
+							continue;
+						}
+						/* also switches the mode, with the
+						 * master ring locked */
+						netmap_pipe_fanout_detach(kring);
+						/* other consumers may still need
+						 * the master ring */
+						if (pna->peer->fo_nactive > 0)
+							continue;
+					} else {
+						netmap_pipe_kring_set_mode(kring,
+							NKR_NETMAP_OFF);
+					}
 					/* mark the peer ring as no longer needed by us
 					 * (it may still be kept if sombody else is using it)
 					 */
@@ -494,8 +943,15 @@ netmap_pipe_krings_delete(struct netmap_adapter *na)
 	}
 	/* case 1) above */
 	ND("%p: case 1, deleting everything", na);
-	netmap_krings_delete(na); /* also zeroes tx_rings etc. */
 	ona = &pna->peer->up;
+	if (na->na_flags & NAF_PIPE_FANOUT) {
+		struct netmap_adapter *sna =
+			(pna->role == NR_REG_PIPE_SLAVE ? na : ona);
+
+		if (sna->rx_rings)
+			netmap_pipe_fanout_bufs_free(sna);
+	}
+	netmap_krings_delete(na); /* also zeroes tx_rings etc. */
 	if (ona->tx_rings == NULL) {
 		/* already deleted, we must be on an
                  * cleanup-after-error path */
@@ -516,14 +972,100 @@ netmap_pipe_dtor(struct netmap_adapter *na)
 		pna->peer_ref = 0;
 		netmap_adapter_put(&pna->peer->up);
 	}
-	if (pna->role == NR_REG_PIPE_MASTER)
+	if (pna->role == NR_REG_PIPE_MASTER) {
 		netmap_pipe_remove(pna->parent, pna);
+		if (pna->fo_refs)
+			nm_os_free(pna->fo_refs);
+	}
 	if (pna->parent_ifp)
 		if_rele(pna->parent_ifp);
 	netmap_adapter_put(pna->parent);
 	pna->parent = NULL;
 }
 
+/* Move an end that is not registered to the allocator requested by the
+ * user (nr_arg2), so that two processes with different allocators can
+ * talk through a pipe. If the other end is registered and uses the old
+ * allocator, it is keeping our rings alive (see netmap_pipe_reg()) and
+ * the packets still queued in them are dropped. If the other end uses
+ * the new allocator, our rings must be there before it can swap buffers
+ * with us again.
+ * Returns EBUSY if the end is registered, EINVAL for fan-out pipes and
+ * ENOMEM if the rings cannot be created (the end then keeps its old
+ * allocator).
+ */
+static int
+netmap_pipe_set_mem(struct netmap_pipe_adapter *pna, struct netmap_mem_d *nmd)
+{
+	struct netmap_adapter *na = &pna->up;
+	struct netmap_mem_d *old = na->nm_mem;
+	int stopped[NR_TXRX];
+	int error = 0;
+	enum txrx t;
+
+	if (nmd == old)
+		return 0;
+	if (na->active_fds > 0) {
+		D("%s: busy, cannot change allocator", na->name);
+		return EBUSY;
+	}
+	if (na->na_flags & NAF_PIPE_FANOUT) {
+		/* the consumers use the buffers of the master */
+		D("%s: fan-out pipes cannot change allocator", na->name);
+		return EINVAL;
+	}
+
+	if (na->tx_rings == NULL) {
+		/* no krings, hence no rings */
+		na->nm_mem = netmap_mem_get(nmd);
+		netmap_mem_put(old);
+		return 0;
+	}
+
+	/* non fan-out pipes have a single pair of rings */
+	for_rx_tx(t) {
+		struct netmap_kring *kring = &NMR(na, t)[0];
+
+		stopped[t] = netmap_pipe_kr_lock(kring->pipe);
+		if (t == NR_RX && kring->ring != NULL &&
+				kring->nr_hwtail != kring->nr_hwcur) {
+			int n = kring->nr_hwtail - kring->nr_hwcur;
+
+			if (n < 0)
+				n += kring->nkr_num_slots;
+			D("%s: dropping %d packets", na->name, n);
+		}
+		kring->nr_kflags &= ~NKR_NEEDRING;
+	}
+	netmap_mem_rings_delete(na);
+
+	na->nm_mem = netmap_mem_get(nmd);
+	for_rx_tx(t) {
+		struct netmap_kring *kring = &NMR(na, t)[0];
+
+		netmap_pipe_kring_reset(kring);
+		if (!nm_pipe_copy_mode(kring) &&
+				kring->pipe->nr_mode == NKR_NETMAP_ON)
+			kring->nr_kflags |= NKR_NEEDRING;
+	}
+	if (netmap_mem_rings_create(na)) {
+		/* go back to the old allocator, where we need no rings */
+		D("%s: cannot create the rings, keeping the old allocator",
+			na->name);
+		for_rx_tx(t)
+			NMR(na, t)[0].nr_kflags &= ~NKR_NEEDRING;
+		netmap_mem_rings_delete(na);
+		netmap_mem_put(na->nm_mem);
+		na->nm_mem = netmap_mem_get(old);
+		error = ENOMEM;
+	}
+	netmap_mem_put(old);
+
+	for_rx_tx(t)
+		netmap_pipe_kr_unlock(NMR(na, t)[0].pipe, stopped[t]);
+	return error;
+}
+
 int
 netmap_get_pipe_na(struct nmreq *nmr, struct netmap_adapter **na,
 		struct netmap_mem_d *nmd, int create)
@@ -635,6 +1177,15 @@ netmap_get_pipe_na(struct nmreq *nmr, struct netmap_adapter **na,
 	mna->up.num_rx_desc = nmr->nr_rx_slots;
 	nm_bound_var(&mna->up.num_rx_desc, pna->num_rx_desc,
 			1, NM_PIPE_MAXSLOTS, NULL);
+	if (nmr->nr_flags & NR_PIPE_FANOUT) {
+		mna->up.na_flags |= NAF_PIPE_FANOUT;
+		mna->up.nm_txsync = netmap_pipe_fanout_txsync;
+		mna->fo_refs = nm_os_malloc(sizeof(u_int) * mna->up.num_tx_desc);
+		if (mna->fo_refs == NULL) {
+			error = ENOMEM;
+			goto free_mna;
+		}
+	}
 	error = netmap_attach_common(&mna->up);
 	if (error)
 		goto free_mna;
@@ -654,6 +1205,17 @@ netmap_get_pipe_na(struct nmreq *nmr, struct netmap_adapter **na,
 	sna->up.nm_mem = netmap_mem_get(mna->up.nm_mem);
 	snprintf(sna->up.name, sizeof(sna->up.name), "%s}%d", pna->name, pipe_id);
 	sna->role = NR_REG_PIPE_SLAVE;
+	if (mna->up.na_flags & NAF_PIPE_FANOUT) {
+		/* one rx ring for each consumer, all as large as
+		 * the master tx ring */
+		sna->up.nm_txsync = netmap_pipe_txsync;
+		sna->up.nm_rxsync = netmap_pipe_fanout_rxsync;
+		sna->up.num_rx_rings = nmr->nr_rx_rings;
+		nm_bound_var(&sna->up.num_rx_rings, 1,
+				1, NM_PIPE_MAXFANOUT, NULL);
+		sna->up.num_rx_desc = mna->up.num_tx_desc;
+		sna->fo_refs = NULL;
+	}
 	error = netmap_attach_common(&sna->up);
 	if (error)
 		goto free_sna;
@@ -681,11 +1243,19 @@ netmap_get_pipe_na(struct nmreq *nmr, struct netmap_adapter **na,
 	}
 	ND("created master %p and slave %p", mna, sna);
 found:
+	netmap_adapter_get(&req->up);
+	if (nmd != NULL) {
+		error = netmap_pipe_set_mem(req, nmd);
+		if (error) {
+			/* this also destroys a pipe we have just created */
+			netmap_adapter_put(&req->up);
+			return error;
+		}
+	}
 
 	ND("pipe %d %s at %p", pipe_id,
 		(req->role == NR_REG_PIPE_MASTER ? "master" : "slave"), req);
 	*na = &req->up;
-	netmap_adapter_get(*na);
 
 	/* keep the reference to the parent.
          * It will be released by the req destructor
@@ -698,6 +1268,8 @@ free_sna:
 unregister_mna:
 	netmap_pipe_remove(pna, mna);
 free_mna:
+	if (mna->fo_refs)
+		nm_os_free(mna->fo_refs);
 	nm_os_free(mna);
 put_out:
 	netmap_unget_na(pna, ifp);
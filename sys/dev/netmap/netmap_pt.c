@@ -40,10 +40,12 @@
 #include <net/if.h>
 #include <net/if_var.h>
 #include <machine/bus.h>
+#include <machine/cpu.h>	/* cpu_spinwait */
 
 //#define usleep_range(_1, _2)
 #define usleep_range(_1, _2) \
 	pause_sbt("ptnetmap-sleep", SBT_1US * _1, SBT_1US * 1, C_ABSOLUTE)
+#define cpu_relax()	cpu_spinwait()
 
 #elif defined(linux)
 #include <bsd_glue.h>
@@ -59,10 +61,19 @@
 /* RX cycle without receive any packets */
 #define PTN_RX_DRY_CYCLES_MAX	10
 
-/* Limit Batch TX to half ring.
- * Currently disabled, since it does not manage NS_MOREFRAG, which
- * results in random drops in the VALE txsync. */
-//#define PTN_TX_BATCH_LIM(_n)	((_n >> 1))
+/* Limit Batch TX to half ring. The limit is moved back to a packet
+ * boundary (see ptnetmap_tx_head_lim()), since a packet split across two
+ * txsyncs would be dropped by the VALE txsync. */
+#define PTN_TX_BATCH_LIM(_n)	((_n >> 1))
+
+/* Smallest polling window used by the adaptive polling (see
+ * ptnetmap_poll_usecs): windows shrinking below it are turned off. */
+#define PTN_POLL_NS_MIN		2000
+
+/* Handler cycles after which a ring served by a shared worker thread
+ * (see ptnetmap_workers) reschedules itself, so that the other rings
+ * of the worker are not starved. */
+#define PTN_SHARED_CYCLES_MAX	4
 
 //#define BUSY_WAIT
 
@@ -74,113 +85,35 @@
 #endif
 
 
-#undef RATE
-//#define RATE  /* Enables communication statistics. */
-#ifdef RATE
-#define IFRATE(x) x
-struct rate_batch_stats {
-    unsigned long sync;
-    unsigned long sync_dry;
-    unsigned long pkt;
-};
-
-struct rate_stats {
-    unsigned long gtxk;     /* Guest --> Host Tx kicks. */
-    unsigned long grxk;     /* Guest --> Host Rx kicks. */
-    unsigned long htxk;     /* Host --> Guest Tx kicks. */
-    unsigned long hrxk;     /* Host --> Guest Rx Kicks. */
-    unsigned long btxwu;    /* Backend Tx wake-up. */
-    unsigned long brxwu;    /* Backend Rx wake-up. */
-    struct rate_batch_stats txbs;
-    struct rate_batch_stats rxbs;
-};
-
-struct rate_context {
-    struct timer_list timer;
-    struct rate_stats new;
-    struct rate_stats old;
+/*
+ * Adaptive polling state of a ring. When a handler runs out of work it
+ * keeps polling for up to poll_ns before re-enabling the notifications
+ * and going to sleep. The window is doubled (up to ptnetmap_poll_usecs)
+ * when the ring is woken up less than ptnetmap_poll_usecs after going to
+ * sleep, since a longer window would have caught the new work, and is
+ * halved when the ring slept longer than that, since polling was wasted.
+ */
+struct ptnetmap_poll {
+    uint64_t poll_ns;   /* current polling window, 0 if not polling */
+    uint64_t deadline;  /* end of the running window, 0 if none */
+    uint64_t idle_ts;   /* when the ring went to sleep, 0 if awake */
 };
 
-#define RATE_PERIOD  2
-static void
-rate_callback(unsigned long arg)
-{
-    struct rate_context * ctx = (struct rate_context *)arg;
-    struct rate_stats cur = ctx->new;
-    struct rate_batch_stats *txbs = &cur.txbs;
-    struct rate_batch_stats *rxbs = &cur.rxbs;
-    struct rate_batch_stats *txbs_old = &ctx->old.txbs;
-    struct rate_batch_stats *rxbs_old = &ctx->old.rxbs;
-    uint64_t tx_batch, rx_batch;
-    unsigned long txpkts, rxpkts;
-    unsigned long gtxk, grxk;
-    int r;
-
-    txpkts = txbs->pkt - txbs_old->pkt;
-    rxpkts = rxbs->pkt - rxbs_old->pkt;
-
-    tx_batch = ((txbs->sync - txbs_old->sync) > 0) ?
-	       txpkts / (txbs->sync - txbs_old->sync): 0;
-    rx_batch = ((rxbs->sync - rxbs_old->sync) > 0) ?
-	       rxpkts / (rxbs->sync - rxbs_old->sync): 0;
-
-    /* Fix-up gtxk and grxk estimates. */
-    gtxk = (cur.gtxk - ctx->old.gtxk) - (cur.btxwu - ctx->old.btxwu);
-    grxk = (cur.grxk - ctx->old.grxk) - (cur.brxwu - ctx->old.brxwu);
-
-    printk("txpkts  = %lu Hz\n", txpkts/RATE_PERIOD);
-    printk("gtxk    = %lu Hz\n", gtxk/RATE_PERIOD);
-    printk("htxk    = %lu Hz\n", (cur.htxk - ctx->old.htxk)/RATE_PERIOD);
-    printk("btxw    = %lu Hz\n", (cur.btxwu - ctx->old.btxwu)/RATE_PERIOD);
-    printk("rxpkts  = %lu Hz\n", rxpkts/RATE_PERIOD);
-    printk("grxk    = %lu Hz\n", grxk/RATE_PERIOD);
-    printk("hrxk    = %lu Hz\n", (cur.hrxk - ctx->old.hrxk)/RATE_PERIOD);
-    printk("brxw    = %lu Hz\n", (cur.brxwu - ctx->old.brxwu)/RATE_PERIOD);
-    printk("txbatch = %llu avg\n", tx_batch);
-    printk("rxbatch = %llu avg\n", rx_batch);
-    printk("\n");
-
-    ctx->old = cur;
-    r = mod_timer(&ctx->timer, jiffies +
-            msecs_to_jiffies(RATE_PERIOD * 1000));
-    if (unlikely(r))
-        D("[ptnetmap] Error: mod_timer()\n");
-}
-
-static void
-rate_batch_stats_update(struct rate_batch_stats *bf, uint32_t pre_tail,
-		        uint32_t act_tail, uint32_t num_slots)
-{
-    int n = (int)act_tail - pre_tail;
-
-    if (n) {
-        if (n < 0)
-            n += num_slots;
-
-        bf->sync++;
-        bf->pkt += n;
-    } else {
-        bf->sync_dry++;
-    }
-}
-
-#else /* !RATE */
-#define IFRATE(x)
-#endif /* RATE */
-
 struct ptnetmap_state {
     /* Kthreads. */
     struct nm_kctx **kctxs;
 
+    /* Adaptive polling, one entry per kctx. */
+    struct ptnetmap_poll *polls;
+
     /* Shared memory with the guest (TX/RX) */
     struct ptnet_ring __user *ptrings;
+    int event_idx;  /* ptrings layout, see PTNETMAP_F_EVENT_IDX */
 
     bool stopped;
 
     /* Netmap adapter wrapping the backend. */
     struct netmap_pt_host_adapter *pth_na;
-
-    IFRATE(struct rate_context rate_ctx;)
 };
 
 static inline void
@@ -198,30 +131,130 @@ ptnetmap_kring_dump(const char *title, const struct netmap_kring *kring)
  */
 
 
-/* Enable or disable guest --> host kicks. */
+/* Ask for a guest --> host kick when the guest moves head past 'event'
+ * (PTNET_EVENT_OFF disables the kicks). When enabling, the caller must
+ * read the CSB again, to catch a head published before the event.
+ * Legacy rings kick on any update. */
 static inline void
-ptring_kick_enable(struct ptnet_ring __user *ptring, uint32_t val)
+ptring_kick_event(struct ptnet_ring __user *ptring, int event_idx,
+		  uint32_t event)
 {
-    CSB_WRITE(ptring, host_need_kick, val);
+    struct ptnet_ring_legacy __user *lptr =
+        (struct ptnet_ring_legacy __user *)ptring;
+
+    if (event_idx) {
+        CSB_WRITE(ptring, head_event, event);
+    } else {
+        CSB_WRITE(lptr, host_need_kick, event != PTNET_EVENT_OFF);
+    }
+    if (event != PTNET_EVENT_OFF)
+        mb(); /* store head_event before reloading head */
 }
 
-/* Are guest interrupt enabled or disabled? */
-static inline uint32_t
-ptring_intr_enabled(struct ptnet_ring __user *ptring)
+/* Does the guest want an interrupt, i.e. did hwtail move past the guest
+ * event index since the last check? '*old' is the hwtail value seen by
+ * the last check, and it is updated to 'hwtail'. Legacy rings want one
+ * while guest_need_kick is set, and we clear it to avoid sending more
+ * interrupts than needed. */
+static inline bool
+ptring_intr_needed(struct ptnet_ring __user *ptring, int event_idx,
+		   uint32_t *old, uint32_t hwtail, uint32_t num_slots)
 {
-    uint32_t v;
+    struct ptnet_ring_legacy __user *lptr =
+        (struct ptnet_ring_legacy __user *)ptring;
+    uint32_t event;
+    bool ret;
+
+    if (!event_idx) {
+        CSB_READ(lptr, guest_need_kick, event);
+        if (event) {
+            CSB_WRITE(lptr, guest_need_kick, 0);
+        }
+        return event != 0;
+    }
+    mb(); /* store hwtail before loading hwtail_event */
+    CSB_READ(ptring, hwtail_event, event);
+    ret = ptnet_need_event(event, hwtail, *old, num_slots);
+    *old = hwtail;
 
-    CSB_READ(ptring, guest_need_kick, v);
+    return ret;
+}
 
-    return v;
+/* The handler of the ring starts: adapt the polling window to the time
+ * the ring spent sleeping. */
+static inline void
+ptnetmap_poll_wakeup(struct ptnetmap_poll *pp)
+{
+    uint64_t max_ns = (uint64_t)ptnetmap_poll_usecs * 1000;
+    uint64_t slept;
+
+    pp->deadline = 0;
+    if (pp->idle_ts == 0) {
+        return;
+    }
+    slept = nm_os_timestamp_ns() - pp->idle_ts;
+    pp->idle_ts = 0;
+    if (slept <= max_ns) {
+        pp->poll_ns = pp->poll_ns ? pp->poll_ns << 1 : PTN_POLL_NS_MIN;
+        if (pp->poll_ns > max_ns) {
+            pp->poll_ns = max_ns;
+        }
+    } else {
+        pp->poll_ns >>= 1;
+        if (pp->poll_ns < PTN_POLL_NS_MIN) {
+            pp->poll_ns = 0;
+        }
+    }
 }
 
-/* Enable or disable guest interrupts. */
+/* The handler found no work: should it keep polling? The window starts
+ * at the first call after some work was done. */
+static inline bool
+ptnetmap_poll_more(struct ptnetmap_poll *pp)
+{
+    uint64_t now;
+
+    if (pp->poll_ns == 0) {
+        return false;
+    }
+    now = nm_os_timestamp_ns();
+    if (pp->deadline == 0) {
+        pp->deadline = now + pp->poll_ns;
+    }
+    if (now < pp->deadline) {
+        cpu_relax();
+        return true;
+    }
+    return false;
+}
+
+/* The handler goes to sleep, with notifications enabled. */
 static inline void
-ptring_intr_enable(struct ptnet_ring __user *ptring, uint32_t val)
+ptnetmap_poll_sleep(struct ptnetmap_poll *pp)
 {
-    CSB_WRITE(ptring, guest_need_kick, val);
+    pp->deadline = 0;
+    pp->idle_ts = (pp->poll_ns || ptnetmap_poll_usecs) ?
+                  nm_os_timestamp_ns() : 0;
+}
+
+#ifdef PTN_TX_BATCH_LIM
+/* Move a TX head limit back, so that it does not split a packet made of
+ * multiple slots (NS_MOREFRAG). Returns hwcur if no packet completes
+ * before the limit. */
+static inline uint32_t
+ptnetmap_tx_head_lim(struct netmap_kring *kring, uint32_t head_lim)
+{
+    struct netmap_slot *slot = kring->ring->slot;
+    uint32_t lim = kring->nkr_num_slots - 1;
+
+    while (head_lim != kring->nr_hwcur &&
+           (slot[nm_prev(head_lim, lim)].flags & NS_MOREFRAG)) {
+        head_lim = nm_prev(head_lim, lim);
+    }
+
+    return head_lim;
 }
+#endif /* PTN_TX_BATCH_LIM */
 
 /* Handle TX events: from the guest or from the backend */
 static void
@@ -234,10 +267,14 @@ ptnetmap_tx_handler(void *data, int is_kthread)
     struct ptnet_ring __user *ptring;
     struct netmap_ring shadow_ring; /* shadow copy of the netmap_ring */
     bool more_txspace = false;
+    struct ptnetmap_poll *pp;
     struct nm_kctx *kth;
     uint32_t num_slots;
+    uint32_t intr_old; /* hwtail at the last interrupt check */
+    uint32_t pre_hwcur;
+    int event_idx;
+    int shared, cycles = 0;
     int batch;
-    IFRATE(uint32_t pre_tail);
 
     if (unlikely(!ptns)) {
         D("ERROR ptnetmap state is NULL");
@@ -254,21 +291,25 @@ ptnetmap_tx_handler(void *data, int is_kthread)
         return;
     }
 
-    /* This is a guess, to be fixed in the rate callback. */
-    IFRATE(ptns->rate_ctx.new.gtxk++);
-
     /* Get TX ptring pointer from the CSB. */
-    ptring = ptns->ptrings + kring->ring_id;
+    event_idx = ptns->event_idx;
+    ptring = PTNET_CSB_RING(ptns->ptrings, event_idx, kring->ring_id);
     kth = ptns->kctxs[kring->ring_id];
+    shared = is_kthread && nm_os_kctx_worker_shared(kth);
+    pp = ptns->polls + kring->ring_id;
+    if (is_kthread && !shared) {
+        ptnetmap_poll_wakeup(pp);
+    }
 
     num_slots = kring->nkr_num_slots;
     shadow_ring.head = kring->rhead;
     shadow_ring.cur = kring->rcur;
+    intr_old = kring->rtail;
 
     /* Disable guest --> host notifications. */
-    ptring_kick_enable(ptring, 0);
+    ptring_kick_event(ptring, event_idx, PTNET_EVENT_OFF);
     /* Copy the guest kring pointers from the CSB */
-    ptnetmap_host_read_kring_csb(ptring, &shadow_ring, num_slots);
+    ptnetmap_host_read_kring_csb(ptring, event_idx, &shadow_ring, num_slots);
 
     for (;;) {
 	/* If guest moves ahead too fast, let's cut the move so
@@ -283,10 +324,17 @@ ptnetmap_tx_handler(void *data, int is_kthread)
 
             if (head_lim >= num_slots)
                 head_lim -= num_slots;
+            head_lim = ptnetmap_tx_head_lim(kring, head_lim);
             ND(1, "batch: %d head: %d head_lim: %d", batch, shadow_ring.head,
 						     head_lim);
-            shadow_ring.head = head_lim;
-	    batch = PTN_TX_BATCH_LIM(num_slots);
+            if (head_lim != kring->nr_hwcur) {
+                /* Otherwise a single packet fills half of the ring,
+                 * and we cannot cut it. */
+                shadow_ring.head = head_lim;
+                batch = head_lim - kring->nr_hwcur;
+                if (batch < 0)
+                    batch += num_slots;
+            }
         }
 #endif /* PTN_TX_BATCH_LIM */
 
@@ -299,7 +347,7 @@ ptnetmap_tx_handler(void *data, int is_kthread)
         if (unlikely(nm_txsync_prologue(kring, &shadow_ring) >= num_slots)) {
             /* Reinit ring and enable notifications. */
             netmap_ring_reinit(kring);
-            ptring_kick_enable(ptring, 1);
+            ptring_kick_event(ptring, event_idx, kring->rhead);
             break;
         }
 
@@ -307,10 +355,10 @@ ptnetmap_tx_handler(void *data, int is_kthread)
             ptnetmap_kring_dump("pre txsync", kring);
 	}
 
-        IFRATE(pre_tail = kring->rtail);
+        pre_hwcur = kring->nr_hwcur;
         if (unlikely(kring->nm_sync(kring, shadow_ring.flags))) {
             /* Reenable notifications. */
-            ptring_kick_enable(ptring, 1);
+            ptring_kick_event(ptring, event_idx, kring->rhead);
             D("ERROR txsync()");
 	    break;
         }
@@ -320,7 +368,7 @@ ptnetmap_tx_handler(void *data, int is_kthread)
          * Copy host hwcur and hwtail into the CSB for the guest sync(), and
 	 * do the nm_sync_finalize.
          */
-        ptnetmap_host_write_kring_csb(ptring, kring->nr_hwcur,
+        ptnetmap_host_write_kring_csb(ptring, event_idx, kring->nr_hwcur,
 				      kring->nr_hwtail);
         if (kring->rtail != kring->nr_hwtail) {
 	    /* Some more room available in the parent adapter. */
@@ -328,45 +376,65 @@ ptnetmap_tx_handler(void *data, int is_kthread)
 	    more_txspace = true;
         }
 
-        IFRATE(rate_batch_stats_update(&ptns->rate_ctx.new.txbs, pre_tail,
-				       kring->rtail, num_slots));
+        if (!na_is_generic(kring->na)) {
+            /* (emulated adapters account their syncs themselves) */
+            nm_kring_nstats_sync(kring, pre_hwcur, kring->nr_hwcur);
+        }
 
         if (unlikely(netmap_verbose & NM_VERB_TXSYNC)) {
             ptnetmap_kring_dump("post txsync", kring);
 	}
 
 #ifndef BUSY_WAIT
-        /* Interrupt the guest if needed. */
-        if (more_txspace && ptring_intr_enabled(ptring) && is_kthread) {
-            /* Disable guest kick to avoid sending unnecessary kicks */
-            ptring_intr_enable(ptring, 0);
-            nm_os_kctx_send_irq(kth);
-            IFRATE(ptns->rate_ctx.new.htxk++);
+        /* Interrupt the guest if hwtail crossed its event index. There
+         * is no need to disable the interrupts afterwards, since the
+         * event is not crossed again until the guest moves it. */
+        if (more_txspace && is_kthread) {
+            if (ptring_intr_needed(ptring, event_idx, &intr_old, kring->rtail,
+                                   num_slots)) {
+                nm_os_kctx_send_irq(kth);
+                kring->nstats.intrs++;
+            } else {
+                kring->nstats.intrs_suppressed++;
+            }
             more_txspace = false;
         }
 #endif
         /* Read CSB to see if there is more work to do. */
-        ptnetmap_host_read_kring_csb(ptring, &shadow_ring, num_slots);
+        ptnetmap_host_read_kring_csb(ptring, event_idx, &shadow_ring,
+                                     num_slots);
 #ifndef BUSY_WAIT
+        /* Keep polling the CSB for a while, with kicks disabled. */
+        while (shadow_ring.head == kring->rhead && is_kthread && !shared &&
+               !ptns->stopped && ptnetmap_poll_more(pp)) {
+            ptnetmap_host_read_kring_csb(ptring, event_idx, &shadow_ring,
+                                         num_slots);
+        }
+        pp->deadline = 0;
         if (shadow_ring.head == kring->rhead) {
             /*
              * No more packets to transmit. We enable notifications and
              * go to sleep, waiting for a kick from the guest when new
              * new slots are ready for transmission.
              */
-            if (is_kthread) {
+            if (is_kthread && !shared) {
+                /* A shared worker has other rings to serve. */
                 usleep_range(1,1);
             }
             /* Reenable notifications. */
-            ptring_kick_enable(ptring, 1);
+            ptring_kick_event(ptring, event_idx, kring->rhead);
             /* Doublecheck. */
-            ptnetmap_host_read_kring_csb(ptring, &shadow_ring, num_slots);
+            ptnetmap_host_read_kring_csb(ptring, event_idx, &shadow_ring,
+                                         num_slots);
             if (shadow_ring.head != kring->rhead) {
 		/* We won the race condition, there are more packets to
 		 * transmit. Disable notifications and do another cycle */
-		ptring_kick_enable(ptring, 0);
+		ptring_kick_event(ptring, event_idx, PTNET_EVENT_OFF);
 		continue;
 	    }
+            if (is_kthread && !shared) {
+                ptnetmap_poll_sleep(pp);
+            }
 	    break;
         }
 
@@ -381,15 +449,24 @@ ptnetmap_tx_handler(void *data, int is_kthread)
             D("backend netmap is being stopped");
             break;
         }
-    }
 
-    nm_kr_put(kring);
+        if (shared && ++cycles >= PTN_SHARED_CYCLES_MAX) {
+            /* Leave the worker to the other rings, and come back later.
+             * Guest kicks are still disabled. */
+            nm_os_kctx_worker_wakeup(kth);
+            kring->nstats.wakeups++;
+            break;
+        }
+    }
 
-    if (more_txspace && ptring_intr_enabled(ptring) && is_kthread) {
-        ptring_intr_enable(ptring, 0);
+    if (more_txspace && is_kthread &&
+		    ptring_intr_needed(ptring, event_idx, &intr_old,
+				       kring->rtail, num_slots)) {
         nm_os_kctx_send_irq(kth);
-        IFRATE(ptns->rate_ctx.new.htxk++);
+        kring->nstats.intrs++;
     }
+
+    nm_kr_put(kring);
 }
 
 /* Called on backend nm_notify when there is no worker thread. */
@@ -411,11 +488,11 @@ ptnetmap_tx_nothread_notify(void *data)
 		return;
 	}
 
-	/* We cannot access the CSB here (to check ptring->guest_need_kick),
+	/* We cannot access the CSB here (to check the guest event index),
 	 * unless we switch address space to the one of the guest. For now
 	 * we unconditionally inject an interrupt. */
         nm_os_kctx_send_irq(ptns->kctxs[kring->ring_id]);
-        IFRATE(ptns->rate_ctx.new.htxk++);
+        kring->nstats.intrs++;
         ND(1, "%s interrupt", kring->name);
 }
 
@@ -442,11 +519,14 @@ ptnetmap_rx_handler(void *data, int is_kthread)
     struct ptnetmap_state *ptns = pth_na->ptns;
     struct ptnet_ring __user *ptring;
     struct netmap_ring shadow_ring; /* shadow copy of the netmap_ring */
+    struct ptnetmap_poll *pp;
     struct nm_kctx *kth;
     uint32_t num_slots;
+    uint32_t intr_old; /* hwtail at the last interrupt check */
+    int shared, cycles = 0;
     int dry_cycles = 0;
+    int event_idx;
     bool some_recvd = false;
-    IFRATE(uint32_t pre_tail);
 
     if (unlikely(!ptns || !ptns->pth_na)) {
         D("ERROR ptnetmap state %p, ptnetmap host adapter %p", ptns,
@@ -464,21 +544,26 @@ ptnetmap_rx_handler(void *data, int is_kthread)
 	return;
     }
 
-    /* This is a guess, to be fixed in the rate callback. */
-    IFRATE(ptns->rate_ctx.new.grxk++);
-
     /* Get RX ptring pointer from the CSB. */
-    ptring = ptns->ptrings + (pth_na->up.num_tx_rings + kring->ring_id);
+    event_idx = ptns->event_idx;
+    ptring = PTNET_CSB_RING(ptns->ptrings, event_idx,
+                            pth_na->up.num_tx_rings + kring->ring_id);
     kth = ptns->kctxs[pth_na->up.num_tx_rings + kring->ring_id];
+    shared = is_kthread && nm_os_kctx_worker_shared(kth);
+    pp = ptns->polls + pth_na->up.num_tx_rings + kring->ring_id;
+    if (is_kthread && !shared) {
+        ptnetmap_poll_wakeup(pp);
+    }
 
     num_slots = kring->nkr_num_slots;
     shadow_ring.head = kring->rhead;
     shadow_ring.cur = kring->rcur;
+    intr_old = kring->rtail;
 
     /* Disable notifications. */
-    ptring_kick_enable(ptring, 0);
+    ptring_kick_event(ptring, event_idx, PTNET_EVENT_OFF);
     /* Copy the guest kring pointers from the CSB */
-    ptnetmap_host_read_kring_csb(ptring, &shadow_ring, num_slots);
+    ptnetmap_host_read_kring_csb(ptring, event_idx, &shadow_ring, num_slots);
 
     for (;;) {
 	uint32_t hwtail;
@@ -488,7 +573,7 @@ ptnetmap_rx_handler(void *data, int is_kthread)
         if (unlikely(nm_rxsync_prologue(kring, &shadow_ring) >= num_slots)) {
             /* Reinit ring and enable notifications. */
             netmap_ring_reinit(kring);
-            ptring_kick_enable(ptring, 1);
+            ptring_kick_event(ptring, event_idx, kring->rhead);
             break;
         }
 
@@ -496,10 +581,9 @@ ptnetmap_rx_handler(void *data, int is_kthread)
             ptnetmap_kring_dump("pre rxsync", kring);
 	}
 
-        IFRATE(pre_tail = kring->rtail);
         if (unlikely(kring->nm_sync(kring, shadow_ring.flags))) {
             /* Reenable notifications. */
-            ptring_kick_enable(ptring, 1);
+            ptring_kick_event(ptring, event_idx, kring->rhead);
             D("ERROR rxsync()");
 	    break;
         }
@@ -508,58 +592,84 @@ ptnetmap_rx_handler(void *data, int is_kthread)
          * Copy host hwcur and hwtail into the CSB for the guest sync()
          */
 	hwtail = NM_ACCESS_ONCE(kring->nr_hwtail);
-        ptnetmap_host_write_kring_csb(ptring, kring->nr_hwcur, hwtail);
+        ptnetmap_host_write_kring_csb(ptring, event_idx, kring->nr_hwcur,
+                                      hwtail);
+        if (!na_is_generic(kring->na)) {
+            nm_kring_nstats_sync(kring, kring->rtail, hwtail);
+        }
         if (kring->rtail != hwtail) {
 	    kring->rtail = hwtail;
             some_recvd = true;
             dry_cycles = 0;
+            pp->deadline = 0; /* restart the polling window */
         } else {
             dry_cycles++;
         }
 
-        IFRATE(rate_batch_stats_update(&ptns->rate_ctx.new.rxbs, pre_tail,
-	                               kring->rtail, num_slots));
-
         if (unlikely(netmap_verbose & NM_VERB_RXSYNC)) {
             ptnetmap_kring_dump("post rxsync", kring);
 	}
 
 #ifndef BUSY_WAIT
-	/* Interrupt the guest if needed. */
-        if (some_recvd && ptring_intr_enabled(ptring)) {
-            /* Disable guest kick to avoid sending unnecessary kicks */
-            ptring_intr_enable(ptring, 0);
-            nm_os_kctx_send_irq(kth);
-            IFRATE(ptns->rate_ctx.new.hrxk++);
+	/* Interrupt the guest if hwtail crossed its event index. */
+        if (some_recvd) {
+            if (ptring_intr_needed(ptring, event_idx, &intr_old, kring->rtail,
+                                   num_slots)) {
+                nm_os_kctx_send_irq(kth);
+                kring->nstats.intrs++;
+            } else {
+                kring->nstats.intrs_suppressed++;
+            }
             some_recvd = false;
         }
 #endif
         /* Read CSB to see if there is more work to do. */
-        ptnetmap_host_read_kring_csb(ptring, &shadow_ring, num_slots);
+        ptnetmap_host_read_kring_csb(ptring, event_idx, &shadow_ring,
+                                     num_slots);
 #ifndef BUSY_WAIT
+        /* Keep polling the CSB for a while, with kicks disabled. */
+        while (ptnetmap_norxslots(kring, shadow_ring.head) && is_kthread &&
+               !shared && !ptns->stopped && ptnetmap_poll_more(pp)) {
+            ptnetmap_host_read_kring_csb(ptring, event_idx, &shadow_ring,
+                                         num_slots);
+        }
         if (ptnetmap_norxslots(kring, shadow_ring.head)) {
             /*
              * No more slots available for reception. We enable notification and
              * go to sleep, waiting for a kick from the guest when new receive
 	     * slots are available.
              */
-            usleep_range(1,1);
+            if (!shared) {
+                usleep_range(1,1);
+            }
             /* Reenable notifications. */
-            ptring_kick_enable(ptring, 1);
+            ptring_kick_event(ptring, event_idx, kring->rhead);
             /* Doublecheck. */
-            ptnetmap_host_read_kring_csb(ptring, &shadow_ring, num_slots);
+            ptnetmap_host_read_kring_csb(ptring, event_idx, &shadow_ring,
+                                         num_slots);
             if (!ptnetmap_norxslots(kring, shadow_ring.head)) {
 		/* We won the race condition, more slots are available. Disable
 		 * notifications and do another cycle. */
-                ptring_kick_enable(ptring, 0);
+                ptring_kick_event(ptring, event_idx, PTNET_EVENT_OFF);
                 continue;
 	    }
+            if (is_kthread && !shared) {
+                ptnetmap_poll_sleep(pp);
+            }
             break;
         }
 
 	hwtail = NM_ACCESS_ONCE(kring->nr_hwtail);
         if (unlikely(hwtail == kring->rhead ||
 		     dry_cycles >= PTN_RX_DRY_CYCLES_MAX)) {
+            /* Poll the backend for a while, calling rxsync again. */
+            if (hwtail == kring->rhead && is_kthread && !shared &&
+                ptnetmap_poll_more(pp)) {
+                continue;
+            }
+            if (is_kthread && !shared) {
+                ptnetmap_poll_sleep(pp);
+            }
 	    /* No more packets to be read from the backend. We stop and
 	     * wait for a notification from the backend (netmap_rx_irq). */
             ND(1, "nr_hwtail: %d rhead: %d dry_cycles: %d",
@@ -571,16 +681,23 @@ ptnetmap_rx_handler(void *data, int is_kthread)
             D("backend netmap is being stopped");
             break;
         }
-    }
 
-    nm_kr_put(kring);
+        if (shared && ++cycles >= PTN_SHARED_CYCLES_MAX) {
+            /* Leave the worker to the other rings, and come back later. */
+            nm_os_kctx_worker_wakeup(kth);
+            kring->nstats.wakeups++;
+            break;
+        }
+    }
 
     /* Interrupt the guest if needed. */
-    if (some_recvd && ptring_intr_enabled(ptring)) {
-        ptring_intr_enable(ptring, 0);
+    if (some_recvd && ptring_intr_needed(ptring, event_idx, &intr_old,
+					 kring->rtail, num_slots)) {
         nm_os_kctx_send_irq(kth);
-        IFRATE(ptns->rate_ctx.new.hrxk++);
+        kring->nstats.intrs++;
     }
+
+    nm_kr_put(kring);
 }
 
 #ifdef NETMAP_PT_DEBUG
@@ -593,7 +710,7 @@ ptnetmap_print_configuration(struct ptnetmap_cfg *cfg)
 	D("  CSB ptrings @%p, num_rings=%u, cfgtype %08x", cfg->ptrings,
 	  cfg->num_rings, cfg->cfgtype);
 	for (k = 0; k < cfg->num_rings; k++) {
-		switch (cfg->cfgtype) {
+		switch (cfg->cfgtype & PTNETMAP_CFGTYPE_MASK) {
 		case PTNETMAP_CFGTYPE_QEMU: {
 			struct ptnetmap_cfgentry_qemu *e =
 				(struct ptnetmap_cfgentry_qemu *)(cfg+1) + k;
@@ -624,8 +741,31 @@ ptnetmap_print_configuration(struct ptnetmap_cfg *cfg)
 
 /* Copy actual state of the host ring into the CSB for the guest init */
 static int
-ptnetmap_kring_snapshot(struct netmap_kring *kring, struct ptnet_ring __user *ptring)
+ptnetmap_kring_snapshot(struct netmap_kring *kring,
+			struct ptnet_ring __user *ptring, int event_idx)
 {
+    uint32_t hwtail = NM_ACCESS_ONCE(kring->nr_hwtail);
+    uint32_t event;
+
+    if (!event_idx) {
+        struct ptnet_ring_legacy __user *lptr =
+            (struct ptnet_ring_legacy __user *)ptring;
+
+        if (CSB_WRITE(lptr, head, kring->rhead))
+            goto err;
+        if (CSB_WRITE(lptr, cur, kring->rcur))
+            goto err;
+
+        if (CSB_WRITE(lptr, hwcur, kring->nr_hwcur))
+            goto err;
+        if (CSB_WRITE(lptr, hwtail, hwtail))
+            goto err;
+
+        DBG(ptnetmap_kring_dump("ptnetmap_kring_snapshot", kring);)
+
+        return 0;
+    }
+
     if (CSB_WRITE(ptring, head, kring->rhead))
         goto err;
     if (CSB_WRITE(ptring, cur, kring->rcur))
@@ -633,7 +773,15 @@ ptnetmap_kring_snapshot(struct netmap_kring *kring, struct ptnet_ring __user *pt
 
     if (CSB_WRITE(ptring, hwcur, kring->nr_hwcur))
         goto err;
-    if (CSB_WRITE(ptring, hwtail, NM_ACCESS_ONCE(kring->nr_hwtail)))
+    if (CSB_WRITE(ptring, hwtail, hwtail))
+        goto err;
+
+    /* Start with guest kicks enabled and, if the guest asked for
+     * interrupts, rebase its event index on the hwtail published above. */
+    if (CSB_WRITE(ptring, head_event, kring->rhead))
+        goto err;
+    CSB_READ(ptring, hwtail_event, event);
+    if (event != PTNET_EVENT_OFF && CSB_WRITE(ptring, hwtail_event, hwtail))
         goto err;
 
     DBG(ptnetmap_kring_dump("ptnetmap_kring_snapshot", kring);)
@@ -665,7 +813,9 @@ ptnetmap_krings_snapshot(struct netmap_pt_host_adapter *pth_na)
 
 	for (k = 0; k < num_rings; k++) {
 		kring = ptnetmap_kring(pth_na, k);
-		err |= ptnetmap_kring_snapshot(kring, ptns->ptrings + k);
+		err |= ptnetmap_kring_snapshot(kring,
+			PTNET_CSB_RING(ptns->ptrings, ptns->event_idx, k),
+			ptns->event_idx);
 	}
 
 	return err;
@@ -688,9 +838,12 @@ ptnetmap_create_kctxs(struct netmap_pt_host_adapter *pth_na,
 	num_rings = pth_na->up.num_tx_rings +
 		    pth_na->up.num_rx_rings;
 
+	bzero(&nmk_cfg, sizeof(nmk_cfg));
 	for (k = 0; k < num_rings; k++) {
 		nmk_cfg.attach_user = 1; /* attach kthread to user process */
+		nmk_cfg.pooled = 1; /* shared workers, if ptnetmap_workers */
 		nmk_cfg.worker_private = ptnetmap_kring(pth_na, k);
+		nmk_cfg.kicks = &ptnetmap_kring(pth_na, k)->nstats.kicks;
 		nmk_cfg.type = k;
 		if (k < pth_na->up.num_tx_rings) {
 			nmk_cfg.worker_fn = ptnetmap_tx_handler;
@@ -702,7 +855,8 @@ ptnetmap_create_kctxs(struct netmap_pt_host_adapter *pth_na,
 		}
 
 		ptns->kctxs[k] = nm_os_kctx_create(&nmk_cfg,
-			cfg->cfgtype, cfg_entries + k * cfg->entry_size);
+			cfg->cfgtype & PTNETMAP_CFGTYPE_MASK,
+			cfg_entries + k * cfg->entry_size);
 		if (ptns->kctxs[k] == NULL) {
 			goto err;
 		}
@@ -823,26 +977,36 @@ ptnetmap_create(struct netmap_pt_host_adapter *pth_na,
         return EINVAL;
     }
 
+    if (num_rings > PTNET_CSB_MAX_RINGS(cfg->cfgtype &
+                                        PTNETMAP_CFG_F_EVENT_IDX)) {
+        D("ERROR %u rings do not fit in the CSB", num_rings);
+        return EINVAL;
+    }
+
     if (!use_tx_kthreads && na_is_generic(pth_na->parent)) {
         D("ERROR ptnetmap direct transmission not supported with "
 	  "passed-through emulated adapters");
         return EOPNOTSUPP;
     }
 
-    ptns = nm_os_malloc(sizeof(*ptns) + num_rings * sizeof(*ptns->kctxs));
+    ptns = nm_os_malloc(sizeof(*ptns) + num_rings * sizeof(*ptns->polls) +
+                        num_rings * sizeof(*ptns->kctxs));
     if (!ptns) {
         return ENOMEM;
     }
 
-    ptns->kctxs = (struct nm_kctx **)(ptns + 1);
+    ptns->polls = (struct ptnetmap_poll *)(ptns + 1);
+    ptns->kctxs = (struct nm_kctx **)(ptns->polls + num_rings);
     ptns->stopped = true;
 
     /* Cross-link data structures. */
     pth_na->ptns = ptns;
     ptns->pth_na = pth_na;
 
-    /* Store the CSB address provided by the hypervisor. */
+    /* Store the CSB address provided by the hypervisor, and the layout
+     * the hypervisor negotiated with the guest. */
     ptns->ptrings = cfg->ptrings;
+    ptns->event_idx = !!(cfg->cfgtype & PTNETMAP_CFG_F_EVENT_IDX);
 
     DBG(ptnetmap_print_configuration(cfg));
 
@@ -880,14 +1044,6 @@ ptnetmap_create(struct netmap_pt_host_adapter *pth_na,
         pth_na->up.tx_rings[i].nm_notify = nm_pt_host_notify;
     }
 
-#ifdef RATE
-    memset(&ptns->rate_ctx, 0, sizeof(ptns->rate_ctx));
-    setup_timer(&ptns->rate_ctx.timer, &rate_callback,
-            (unsigned long)&ptns->rate_ctx);
-    if (mod_timer(&ptns->rate_ctx.timer, jiffies + msecs_to_jiffies(1500)))
-        D("[ptn] Error: mod_timer()\n");
-#endif
-
     DBG(D("[%s] ptnetmap configuration DONE", pth_na->up.name));
 
     return 0;
@@ -936,8 +1092,6 @@ ptnetmap_delete(struct netmap_pt_host_adapter *pth_na)
 	ptns->kctxs[i] = NULL;
     }
 
-    IFRATE(del_timer(&ptns->rate_ctx.timer));
-
     nm_os_free(ptns);
 
     pth_na->ptns = NULL;
@@ -1034,12 +1188,11 @@ nm_pt_host_notify(struct netmap_kring *kring, int flags)
 	/* Notify kthreads (wake up if needed) */
 	if (kring->tx == NR_TX) {
 		ND(1, "TX backend irq");
-		IFRATE(ptns->rate_ctx.new.btxwu++);
 	} else {
 		k += pth_na->up.num_tx_rings;
 		ND(1, "RX backend irq");
-		IFRATE(ptns->rate_ctx.new.brxwu++);
 	}
+	kring->nstats.wakeups++;
 	nm_os_kctx_worker_wakeup(ptns->kctxs[k]);
 
 	return NM_IRQ_COMPLETED;
@@ -1321,26 +1474,38 @@ put_out_noputparent:
  * block (no space in the ring).
  */
 bool
-netmap_pt_guest_txsync(struct ptnet_ring *ptring, struct netmap_kring *kring,
-		       int flags)
+netmap_pt_guest_txsync(struct ptnet_ring *ptring, int event_idx,
+		       struct netmap_kring *kring, int flags)
 {
+	uint32_t old_head = PTNET_RING_FIELD(ptring, event_idx, head);
 	bool notify = false;
 
 	/* Disable notifications */
-	ptring->guest_need_kick = 0;
+	ptnetmap_guest_intr_event(ptring, event_idx, PTNET_EVENT_OFF);
 
 	/*
 	 * First part: tell the host (updating the CSB) to process the new
 	 * packets.
 	 */
-	kring->nr_hwcur = ptring->hwcur;
-	ptnetmap_guest_write_kring_csb(ptring, kring->rcur, kring->rhead);
-
-        /* Ask for a kick from a guest to the host if needed. */
-	if (((kring->rhead != kring->nr_hwcur || nm_kr_txempty(kring))
-		&& NM_ACCESS_ONCE(ptring->host_need_kick)) ||
-			(flags & NAF_FORCE_RECLAIM)) {
-		ptring->sync_flags = flags;
+	kring->nr_hwcur = PTNET_RING_FIELD(ptring, event_idx, hwcur);
+	ptnetmap_guest_write_kring_csb(ptring, event_idx, kring->rcur,
+				       kring->rhead);
+
+        /* Ask for a kick from a guest to the host if head crossed the
+	 * host event index (legacy rings: if there is work and kicks are
+	 * enabled), or if we need the host to reclaim. */
+	if (event_idx) {
+		notify = ptnetmap_guest_need_kick(ptring, event_idx, old_head,
+						  kring->nkr_num_slots) ||
+			(nm_kr_txempty(kring) &&
+			 ptnetmap_guest_kick_enabled(ptring, event_idx));
+	} else {
+		notify = (kring->rhead != kring->nr_hwcur ||
+			  nm_kr_txempty(kring)) &&
+			 ptnetmap_guest_kick_enabled(ptring, event_idx);
+	}
+	if (notify || (flags & NAF_FORCE_RECLAIM)) {
+		PTNET_RING_FIELD(ptring, event_idx, sync_flags) = flags;
 		notify = true;
 	}
 
@@ -1348,7 +1513,7 @@ netmap_pt_guest_txsync(struct ptnet_ring *ptring, struct netmap_kring *kring,
 	 * Second part: reclaim buffers for completed transmissions.
 	 */
 	if (nm_kr_txempty(kring) || (flags & NAF_FORCE_RECLAIM)) {
-                ptnetmap_guest_read_kring_csb(ptring, kring);
+                ptnetmap_guest_read_kring_csb(ptring, event_idx, kring);
 	}
 
         /*
@@ -1357,18 +1522,26 @@ netmap_pt_guest_txsync(struct ptnet_ring *ptring, struct netmap_kring *kring,
 	 * space is available.
          */
 	if (nm_kr_txempty(kring) && !(kring->nr_kflags & NKR_NOINTR)) {
-		/* Reenable notifications. */
-		ptring->guest_need_kick = 1;
+		uint32_t event = kring->nr_hwtail + (kring->nkr_num_slots >> 1);
+
+		if (event >= kring->nkr_num_slots)
+			event -= kring->nkr_num_slots;
+		/* Reenable notifications, asking for an interrupt only when
+		 * half of the ring has been reclaimed. */
+		ptnetmap_guest_intr_event(ptring, event_idx, event);
                 /* Double check */
-                ptnetmap_guest_read_kring_csb(ptring, kring);
+                ptnetmap_guest_read_kring_csb(ptring, event_idx, kring);
                 /* If there is new free space, disable notifications */
 		if (unlikely(!nm_kr_txempty(kring))) {
-			ptring->guest_need_kick = 0;
+			ptnetmap_guest_intr_event(ptring,
+					event_idx, PTNET_EVENT_OFF);
 		}
 	}
 
 	ND(1, "%s CSB(head:%u cur:%u hwtail:%u) KRING(head:%u cur:%u tail:%u)",
-		kring->name, ptring->head, ptring->cur, ptring->hwtail,
+		kring->name, PTNET_RING_FIELD(ptring, event_idx, head),
+		PTNET_RING_FIELD(ptring, event_idx, cur),
+		PTNET_RING_FIELD(ptring, event_idx, hwtail),
 		kring->rhead, kring->rcur, kring->nr_hwtail);
 
 	return notify;
@@ -1386,20 +1559,20 @@ netmap_pt_guest_txsync(struct ptnet_ring *ptring, struct netmap_kring *kring,
  * block (no more completed slots in the ring).
  */
 bool
-netmap_pt_guest_rxsync(struct ptnet_ring *ptring, struct netmap_kring *kring,
-		       int flags)
+netmap_pt_guest_rxsync(struct ptnet_ring *ptring, int event_idx,
+		       struct netmap_kring *kring, int flags)
 {
 	bool notify = false;
 
         /* Disable notifications */
-	ptring->guest_need_kick = 0;
+	ptnetmap_guest_intr_event(ptring, event_idx, PTNET_EVENT_OFF);
 
 	/*
 	 * First part: import newly received packets, by updating the kring
 	 * hwtail to the hwtail known from the host (read from the CSB).
 	 * This also updates the kring hwcur.
 	 */
-        ptnetmap_guest_read_kring_csb(ptring, kring);
+        ptnetmap_guest_read_kring_csb(ptring, event_idx, kring);
 	kring->nr_kflags &= ~NKR_PENDINTR;
 
 	/*
@@ -1407,11 +1580,14 @@ netmap_pt_guest_rxsync(struct ptnet_ring *ptring, struct netmap_kring *kring,
 	 * released, by updating cur and head in the CSB.
 	 */
 	if (kring->rhead != kring->nr_hwcur) {
-		ptnetmap_guest_write_kring_csb(ptring, kring->rcur,
+		uint32_t old_head = PTNET_RING_FIELD(ptring, event_idx, head);
+
+		ptnetmap_guest_write_kring_csb(ptring, event_idx, kring->rcur,
 					       kring->rhead);
                 /* Ask for a kick from the guest to the host if needed. */
-		if (NM_ACCESS_ONCE(ptring->host_need_kick)) {
-			ptring->sync_flags = flags;
+		if (ptnetmap_guest_need_kick(ptring, event_idx, old_head,
+					     kring->nkr_num_slots)) {
+			PTNET_RING_FIELD(ptring, event_idx, sync_flags) = flags;
 			notify = true;
 		}
 	}
@@ -1422,18 +1598,21 @@ netmap_pt_guest_rxsync(struct ptnet_ring *ptring, struct netmap_kring *kring,
 	 * completed.
          */
 	if (nm_kr_rxempty(kring) && !(kring->nr_kflags & NKR_NOINTR)) {
-		/* Reenable notifications. */
-                ptring->guest_need_kick = 1;
+		/* Reenable notifications, for any new slot. */
+		ptnetmap_guest_intr_event(ptring, event_idx, kring->nr_hwtail);
                 /* Double check */
-                ptnetmap_guest_read_kring_csb(ptring, kring);
+                ptnetmap_guest_read_kring_csb(ptring, event_idx, kring);
                 /* If there are new slots, disable notifications. */
 		if (!nm_kr_rxempty(kring)) {
-                        ptring->guest_need_kick = 0;
+			ptnetmap_guest_intr_event(ptring,
+					event_idx, PTNET_EVENT_OFF);
                 }
         }
 
 	ND(1, "%s CSB(head:%u cur:%u hwtail:%u) KRING(head:%u cur:%u tail:%u)",
-		kring->name, ptring->head, ptring->cur, ptring->hwtail,
+		kring->name, PTNET_RING_FIELD(ptring, event_idx, head),
+		PTNET_RING_FIELD(ptring, event_idx, cur),
+		PTNET_RING_FIELD(ptring, event_idx, hwtail),
 		kring->rhead, kring->rcur, kring->nr_hwtail);
 
 	return notify;
@@ -134,6 +134,10 @@ __FBSDID("$FreeBSD: head/sys/dev/netmap/netmap.c 257176 2013-10-26 17:58:36Z gle
  *
  * Unlike physical interfaces, switch ports use their own memory region
  * for rings and buffers.
+ * Packets are copied from the source to the destination port, except
+ * for unicast packets received from a NIC (bwrap) and going to a port
+ * that shares its memory region (see vale-ctl -m), which are moved by
+ * swapping buffers, when bridge_zcopy is set.
  * The virtual interfaces use per-queue lock instead of core lock.
  * In the tx loop, we aggregate traffic in batches to make all operations
  * faster. The batch size is bridge_batch.
@@ -156,9 +160,11 @@ __FBSDID("$FreeBSD: head/sys/dev/netmap/netmap.c 257176 2013-10-26 17:58:36Z gle
  * last packet in the block may overflow the size.
  */
 static int bridge_batch = NM_BDG_BATCH; /* bridge batch size */
+static int bridge_zcopy = 1; /* swap buffers when memory is shared */
 SYSBEGIN(vars_vale);
 SYSCTL_DECL(_dev_netmap);
 SYSCTL_INT(_dev_netmap, OID_AUTO, bridge_batch, CTLFLAG_RW, &bridge_batch, 0 , "");
+SYSCTL_INT(_dev_netmap, OID_AUTO, bridge_zcopy, CTLFLAG_RW, &bridge_zcopy, 0 , "");
 SYSEND;
 
 static int netmap_vp_create(struct nmreq *, struct ifnet *,
@@ -253,36 +259,6 @@ static struct nm_bridge *nm_bridges;
 #endif /* !CONFIG_NET_NS */
 
 
-/*
- * this is a slightly optimized copy routine which rounds
- * to multiple of 64 bytes and is often faster than dealing
- * with other odd sizes. We assume there is enough room
- * in the source and destination buffers.
- *
- * XXX only for multiples of 64 bytes, non overlapped.
- */
-static inline void
-pkt_copy(void *_src, void *_dst, int l)
-{
-        uint64_t *src = _src;
-        uint64_t *dst = _dst;
-        if (unlikely(l >= 1024)) {
-                memcpy(dst, src, l);
-                return;
-        }
-        for (; likely(l > 0); l-=64) {
-                *dst++ = *src++;
-                *dst++ = *src++;
-                *dst++ = *src++;
-                *dst++ = *src++;
-                *dst++ = *src++;
-                *dst++ = *src++;
-                *dst++ = *src++;
-                *dst++ = *src++;
-        }
-}
-
-
 static int
 nm_is_id_char(const char c)
 {
@@ -1447,6 +1423,28 @@ nm_bdg_flush(struct nm_bdg_fwd *ft, u_int n,
 	struct netmap_vp_adapter *na, u_int ring_nr);
 
 
+/* Run the rx filter of the destination kring on the first fragment
+ * of a packet, skipping the virtio-net header of the source port.
+ * Packets in userspace buffers (NS_INDIRECT) are not filtered.
+ */
+static inline int
+nm_bdg_rx_filter_drop(struct netmap_kring *kring,
+		struct netmap_vp_adapter *na, struct nm_bdg_fwd *ft_p)
+{
+	u_int hdr = na->up.virt_hdr_len;
+	u_int len = ft_p->ft_len, wirelen = 0;
+	struct nm_bdg_fwd *f;
+
+	if (ft_p->ft_flags & NS_INDIRECT)
+		return 0;
+	for (f = ft_p; f != ft_p + ft_p->ft_frags; f++)
+		wirelen += f->ft_len;
+	if (len < hdr)
+		hdr = len;
+	return nm_kring_rx_filter_drop(kring, (uint8_t *)ft_p->ft_buf + hdr,
+			len - hdr, wirelen - hdr);
+}
+
 /*
  * main dispatch routine for the bridge.
  * Grab packets from a kring, move them into the ft structure
@@ -1492,6 +1490,7 @@ nm_bdg_preflush(struct netmap_kring *kring, u_int end)
 
 		/* this slot goes into a list so initialize the link field */
 		ft[ft_i].ft_next = NM_FT_NULL;
+		ft[ft_i].ft_slot = slot;
 		buf = ft[ft_i].ft_buf = (slot->flags & NS_INDIRECT) ?
 			(void *)(uintptr_t)slot->ptr : NMB(&na->up, slot);
 		if (unlikely(buf == NULL)) {
@@ -1618,6 +1617,34 @@ netmap_vp_reg(struct netmap_adapter *na, int onoff)
 }
 
 
+/* Replace the rx filter of a kring and return the old one.
+ * On VALE ports the filter is run by nm_bdg_flush() on behalf of the
+ * sender, under the read lock of the bridge, so we need the write lock.
+ * Other krings run it under their q_lock.
+ */
+struct nm_bpf_prog *
+netmap_bdg_swap_rx_filter(struct netmap_kring *kring, struct nm_bpf_prog *prog)
+{
+	struct netmap_adapter *na = kring->na;
+	struct nm_bridge *b = NULL;
+	struct nm_bpf_prog *old;
+
+	if (na->nm_register == netmap_vp_reg)
+		b = ((struct netmap_vp_adapter *)na)->na_bdg;
+	if (b)
+		BDG_WLOCK(b);
+	else
+		mtx_lock(&kring->q_lock);
+	old = kring->rx_filter;
+	kring->rx_filter = prog;
+	if (b)
+		BDG_WUNLOCK(b);
+	else
+		mtx_unlock(&kring->q_lock);
+	return old;
+}
+
+
 /*
  * Lookup function for a learning bridge.
  * Update the hash table with the source address,
@@ -1771,6 +1798,10 @@ nm_bdg_flush(struct nm_bdg_fwd *ft, u_int n, struct netmap_vp_adapter *na,
 	uint16_t num_dsts = 0, *dsts;
 	struct nm_bridge *b = na->na_bdg;
 	u_int i, me = na->bdg_port;
+	/* the buffers of the rx rings of a NIC are not seen by anyone
+	 * else, so they can be swapped with the ones of the destination
+	 */
+	int src_zcopy = bridge_zcopy && nm_is_bwrap(&na->up);
 
 	/*
 	 * The work area (pointed by ft) is followed by an array of
@@ -1854,6 +1885,7 @@ nm_bdg_flush(struct nm_bdg_fwd *ft, u_int n, struct netmap_vp_adapter *na,
 		uint32_t my_start = 0, lease_idx = 0;
 		int nrings;
 		int virt_hdr_mismatch = 0;
+		int zcopy;
 
 		d_i = dsts[i];
 		ND("second pass %d port %d", i, d_i);
@@ -1916,6 +1948,9 @@ nm_bdg_flush(struct nm_bdg_fwd *ft, u_int n, struct netmap_vp_adapter *na,
 			}
 		}
 
+		zcopy = src_zcopy && !virt_hdr_mismatch &&
+			dst_na->up.nm_mem == na->up.nm_mem;
+
 		ND(5, "pass 2 dst %d is %x %s",
 			i, d_i, is_vp ? "virtual" : "nic/host");
 		dst_nr = d_i & (NM_BDG_MAXRINGS-1);
@@ -1964,6 +1999,7 @@ retry:
 			struct netmap_slot *slot;
 			struct nm_bdg_fwd *ft_p, *ft_end;
 			u_int cnt;
+			int swap = zcopy;
 
 			/* find the queue from which we pick next packet.
 			 * NM_FT_NULL is always higher than valid indexes
@@ -1977,6 +2013,8 @@ retry:
 			} else { /* insert broadcast */
 				ft_p = ft + brd_next;
 				brd_next = ft_p->ft_next;
+				/* the buffer also goes to other ports */
+				swap = 0;
 			}
 			cnt = ft_p->ft_frags; // cnt > 0
 			if (unlikely(cnt > howmany))
@@ -1984,15 +2022,36 @@ retry:
 			if (netmap_verbose && cnt > 1)
 				RD(5, "rx %d frags to %d", cnt, j);
 			ft_end = ft_p + cnt;
-			if (unlikely(virt_hdr_mismatch)) {
+			if (unlikely(kring->rx_filter != NULL) &&
+					nm_bdg_rx_filter_drop(kring, na, ft_p)) {
+				/* the unused slots are handled below */
+			} else if (unlikely(virt_hdr_mismatch)) {
 				bdg_mismatch_datapath(na, dst_na, ft_p, ring, &j, lim, &howmany);
 			} else {
+				uint16_t chg = 0;
+
 				howmany -= cnt;
 				do {
 					char *dst, *src = ft_p->ft_buf;
 					size_t copy_len = ft_p->ft_len, dst_len = copy_len;
 
 					slot = &ring->slot[j];
+					if (swap && !(ft_p->ft_flags & NS_INDIRECT) &&
+					    slot->buf_idx >= 2 &&
+					    slot->buf_idx < dst_na->up.na_lut.objtotal &&
+					    copy_len <= NETMAP_BUF_SIZE(&dst_na->up)) {
+						/* give the free buffer of the
+						 * destination back to the NIC
+						 */
+						struct netmap_slot *src_slot = ft_p->ft_slot;
+						uint32_t idx = slot->buf_idx;
+
+						slot->buf_idx = src_slot->buf_idx;
+						src_slot->buf_idx = idx;
+						src_slot->flags |= NS_BUF_CHANGED;
+						chg = NS_BUF_CHANGED;
+						goto next_frag;
+					}
 					dst = NMB(&dst_na->up, slot);
 
 					ND("send [%d] %d(%d) bytes at %s:%d",
@@ -2013,15 +2072,20 @@ retry:
 						}
 					} else {
 						//memcpy(dst, src, copy_len);
-						pkt_copy(src, dst, (int)copy_len);
+						nm_pkt_copy(src, dst, (int)copy_len);
 					}
+next_frag:
 					slot->len = dst_len;
-					slot->flags = (cnt << 8)| NS_MOREFRAG;
+					/* NS_BUF_CHANGED reloads the buffer of
+					 * bwrap destinations
+					 */
+					slot->flags = (cnt << 8) | NS_MOREFRAG | chg;
 					j = nm_next(j, lim);
 					needed--;
 					ft_p++;
 				} while (ft_p != ft_end);
-				slot->flags = (cnt << 8); /* clear flag on last entry */
+				/* clear flag on last entry */
+				slot->flags = (cnt << 8) | chg;
 			}
 			/* are we done ? */
 			if (next == NM_FT_NULL && brd_next == NM_FT_NULL)
@@ -2266,7 +2330,7 @@ netmap_vp_create(struct nmreq *nmr, struct ifnet *ifp,
         if (netmap_verbose)
 		D("max frame size %u", vpna->mfs);
 
-	na->na_flags |= NAF_BDG_MAYSLEEP;
+	na->na_flags |= NAF_BDG_MAYSLEEP | NAF_RX_FILTER;
 	/* persistent VALE ports look like hw devices
 	 * with a native netmap adapter
 	 */
@@ -166,7 +166,8 @@ struct netmap_slot {
 	uint32_t buf_idx;	/* buffer index */
 	uint16_t len;		/* length for this slot */
 	uint16_t flags;		/* buf changed, etc. */
-	uint64_t ptr;		/* pointer for indirect buffers */
+	uint64_t ptr;		/* pointer for indirect buffers (tx),
+				 * or timestamp (rx, NR_SLOT_TIMESTAMP) */
 };
 
 /*
@@ -323,6 +324,27 @@ struct netmap_ring {
 	 * Enables the NS_FORWARD slot flag for the ring.
 	 */
 
+#define	NR_SLOT_TIMESTAMP 0x0008	/* per-slot rx timestamps */
+	/*
+	 * (rx rings only) the kernel stores in the 'ptr' field of each
+	 * received slot the arrival time of the packet, in nanoseconds
+	 * since the epoch. Adapters that see packets individually (e.g.
+	 * the generic adapter, from the skb/mbuf timestamp) report the
+	 * time the packet reached the driver, the others report the
+	 * time of the rxsync that made the slot available.
+	 * For multi-slot packets all the slots carry the same value.
+	 */
+
+#define	NR_TX_FLUSH	0x0010		/* never delay the tx doorbell */
+	/*
+	 * (tx rings only) when the tx_doorbell_slots sysctl is set, native
+	 * drivers may delay telling the NIC about new packets until enough
+	 * of them have been queued or tx_doorbell_usecs have elapsed.
+	 * This flag disables the delay for the ring, for latency sensitive
+	 * traffic. Setting NS_REPORT on a slot flushes the packets up to
+	 * that slot in the same way.
+	 */
+
 
 /*
  * Netmap representation of an interface and its queue(s).
@@ -481,6 +503,15 @@ struct netmap_if {
  *	NETMAP_BDG_DELIF
  *		delete a persistent VALE port. Used by vale-ctl -d ...
  *
+ *	NETMAP_SYNC_KLOOP_START
+ *		issued on a file descriptor already bound with NIOCREGIF,
+ *		starts a kernel thread (pinned on core nr_arg1) that
+ *		continuously polls the bound rings and runs txsync/rxsync
+ *		on behalf of the application, which can then just update
+ *		head/cur and watch tail without issuing any system call.
+ *		The thread is stopped on NETMAP_SYNC_KLOOP_STOP or when
+ *		the file descriptor is closed.
+ *
  * nr_arg1, nr_arg2, nr_arg3  (in/out)		command specific
  *
  *
@@ -526,6 +557,8 @@ struct nmreq {
 #define NETMAP_BDG_POLLING_OFF	11	/* delete polling kthread */
 #define NETMAP_VNET_HDR_GET	12      /* get the port virtio-net-hdr length */
 #define NETMAP_POOLS_INFO_GET	13	/* get memory allocator pools info */
+#define NETMAP_SYNC_KLOOP_START	14	/* start in-kernel sync loop */
+#define NETMAP_SYNC_KLOOP_STOP	15	/* stop in-kernel sync loop */
 	uint16_t	nr_arg1;	/* reserve extra rings in NIOCREGIF */
 #define NETMAP_BDG_HOST		1	/* attach the host stack on ATTACH */
 
@@ -535,6 +568,8 @@ struct nmreq {
 	/* various modes, extends nr_ringid */
 	uint32_t	spare2[1];
 };
+/* copy monitors: bytes of each frame to copy in NIOCREGIF, 0 = all */
+#define nr_snaplen	spare2[0]
 
 #define NR_REG_MASK		0xf /* values for nr_flags */
 enum {	NR_REG_DEFAULT	= 0,	/* backward compat, should not be used. */
@@ -562,6 +597,19 @@ enum {	NR_REG_DEFAULT	= 0,	/* backward compat, should not be used. */
  * to use those headers. If the flag is set, the application can use the
  * NETMAP_VNET_HDR_GET command to figure out the header length. */
 #define NR_ACCEPT_VNET_HDR	0x8000
+/* Create a fan-out pipe (with NR_REG_PIPE_MASTER or NR_REG_PIPE_SLAVE,
+ * when the pipe does not exist yet). The slave endpoint gets nr_rx_rings
+ * rx rings, one for each consumer, and all the buffers sent on the
+ * master tx ring are delivered to each of them, without copies. A buffer
+ * goes back to the master only when all the consumers have released it,
+ * so the consumers must not modify or swap the buffers.
+ * Each registration of the slave endpoint binds a different rx ring,
+ * whose index is returned in nr_arg1. */
+#define NR_PIPE_FANOUT		0x10000
+/* Copy monitors: precede each frame in the monitor buffers with a
+ * struct nm_mon_meta, telling where the frame comes from. The slot
+ * len includes the header. */
+#define NR_MONITOR_META		0x20000
 
 #define	NM_BDG_NAME		"vale"	/* prefix for bridge port name */
 
@@ -645,4 +693,230 @@ struct nm_ifreq {
 	char data[NM_IFRDATA_LEN];
 };
 
+/*
+ * Per-ring statistics. netmap collects them when the sync_stats
+ * sysctl (dev.netmap.sync_stats on FreeBSD, module parameter on linux)
+ * is set, and returns them with ioctl(fd, NIOCCONFIG, req), where
+ * req is a struct nm_ifreq with nifr_name set to the port name and
+ * data holding a struct nm_kring_stats, with magic set to
+ * NM_KSTATS_MAGIC and ring_id/tx selecting the ring.
+ * The file descriptor does not need to be bound to the port.
+ * The drops counter is collected even when sync_stats is not set.
+ */
+#define NM_KSTATS_MAGIC		0x4e4d4b53	/* "NMKS" */
+#define NM_SYNC_HIST_LEN	23	/* buckets of the duration histogram */
+struct nm_kring_stats {
+	uint32_t	magic;		/* (in) NM_KSTATS_MAGIC */
+	uint16_t	ring_id;	/* (in) ring index */
+	uint8_t		tx;		/* (in) 1 for tx rings, 0 for rx rings */
+	uint8_t		flags;		/* (in) */
+#define NM_KSTATS_RESET		0x1	/* clear the counters after reading */
+	uint16_t	num_rings;	/* (out) rings in this direction,
+					 * host ring included */
+	uint16_t	spare;
+	uint32_t	num_slots;	/* (out) slots in the ring */
+	uint32_t	hwcur;		/* (out) snapshot of the kernel */
+	uint32_t	hwtail;		/*       view of the ring */
+
+	uint64_t	syncs;		/* [tr]xsync calls */
+	uint64_t	slots;		/* slots transmitted or received */
+	uint64_t	notifies;	/* wakeups of the ring users */
+	uint64_t	full;		/* syncs that left the ring full */
+	uint64_t	reinits;	/* ring reinitializations */
+	uint64_t	drops;		/* packets dropped before reaching
+					 * the ring (rx queue overflow of
+					 * emulated adapters) */
+	/* hist[i] counts the syncs that took 2^i to 2^(i+1)-1 ns,
+	 * the last bucket also counts all the longer ones
+	 */
+	uint64_t	hist[NM_SYNC_HIST_LEN];
+};
+
+/*
+ * Notification statistics of passed-through (ptnetmap) and emulated
+ * (generic) adapters. They are always collected, and are returned with
+ * ioctl(fd, NIOCCONFIG, req), where req is a struct nm_ifreq with
+ * nifr_name set to the port name and data holding a struct
+ * nm_adapter_stats, with magic set to NM_ADSTATS_MAGIC and tx selecting
+ * the direction. The counters are summed over the hardware rings of
+ * the port. For ptnetmap, the port is the one passed through to the
+ * guest (e.g., a VALE port), and the counters describe the host side
+ * of the communication with the guest.
+ * As for struct nm_kring_stats, fd does not need to be bound.
+ */
+#define NM_ADSTATS_MAGIC	0x4e4d4153	/* "NMAS" */
+#define NM_BATCH_HIST_LEN	16	/* buckets of the batch histogram */
+struct nm_adapter_stats {
+	uint32_t	magic;		/* (in) NM_ADSTATS_MAGIC */
+	uint8_t		tx;		/* (in) 1 for tx rings, 0 for rx rings */
+	uint8_t		flags;		/* (in) */
+#define NM_ADSTATS_RESET	0x1	/* clear the counters after reading */
+	uint16_t	num_rings;	/* (out) hardware rings summed up */
+
+	uint64_t	kicks;		/* ptnetmap: kicks from the guest */
+	uint64_t	wakeups;	/* ptnetmap: host thread wakeups from
+					 * the backend port */
+	uint64_t	intrs;		/* ptnetmap: interrupts sent to the
+					 * guest; generic: notifications from
+					 * the driver */
+	uint64_t	intrs_suppressed; /* ptnetmap: interrupts not sent
+					 * thanks to the guest event index */
+	uint64_t	syncs;		/* syncs that moved some slots */
+	uint64_t	dry_syncs;	/* syncs that found nothing to do */
+	uint64_t	slots;		/* slots moved, slots / syncs is the
+					 * average batch */
+	uint64_t	drops;		/* generic: tx packets dropped */
+	/* hist[i] counts the syncs that moved 2^i to 2^(i+1)-1 slots,
+	 * the last bucket also counts all the larger ones
+	 */
+	uint64_t	hist[NM_BATCH_HIST_LEN];
+};
+
+/*
+ * In-kernel packet filter for the receive rings. The filter is a
+ * classic BPF program, an array of struct nm_bpf_insn (with the same
+ * layout as struct bpf_insn, so the output of pcap_compile() can be
+ * used as is), and is attached with ioctl(fd, NIOCCONFIG, req), where
+ * req is a struct nm_ifreq with data holding a struct nm_rx_filter
+ * with magic set to NM_RXFILTER_MAGIC.
+ * The filter applies to the rx rings bound to fd, which must be
+ * registered, and packets for which the program returns 0 are dropped
+ * before they reach the ring. len = 0 detaches the filter, which is
+ * also detached when fd is closed.
+ * Filters are supported on emulated (generic) adapters, VALE ports,
+ * host rings and copy monitors, where the rejected packets are not
+ * even copied; hardware rings of native adapters and zero-copy
+ * monitors return EOPNOTSUPP.
+ */
+#define NM_RXFILTER_MAGIC	0x4e4d5246	/* "NMRF" */
+#define NM_RXFILTER_MAXLEN	4096		/* max instructions */
+struct nm_bpf_insn {
+	uint16_t	code;
+	uint8_t		jt;
+	uint8_t		jf;
+	uint32_t	k;
+};
+
+struct nm_rx_filter {
+	uint32_t	magic;		/* (in) NM_RXFILTER_MAGIC */
+	uint16_t	flags;		/* (in) */
+#define NM_RXFILTER_GET		0x1	/* only return the counters */
+	uint16_t	len;		/* (in) instructions, 0 to detach */
+	uint64_t	prog;		/* (in) address of the instructions */
+	uint64_t	drops;		/* (out) packets dropped by the filter
+					 * on the bound rings */
+};
+
+/*
+ * Header stored at the beginning of each buffer of a copy monitor
+ * registered with NR_MONITOR_META, followed by the (possibly
+ * truncated) frame. The timestamp is taken when the frame is copied
+ * to the monitor, i.e. in the txsync or rxsync of the monitored ring.
+ */
+struct nm_mon_meta {
+	uint64_t	ts;		/* nanoseconds since the epoch */
+	uint32_t	len;		/* original length of the frame */
+	uint16_t	ring;		/* ring in the monitored port */
+	uint8_t		dir;
+#define NM_MON_META_TX		1	/* sent on a tx ring */
+#define NM_MON_META_RX		2	/* received on an rx ring */
+	uint8_t		flags;		/* reserved, 0 */
+};
+
+/*
+ * Sampling of copy monitors. By default a copy monitor tries to copy
+ * every frame, and silently loses the ones that do not fit in its
+ * rings. ioctl(fd, NIOCCONFIG, req) on a copy monitor fd, with data
+ * holding a struct nm_mon_sampling with magic NM_MONSAMPLE_MAGIC,
+ * changes the policy of the rx rings bound to fd:
+ *
+ * NM_MONSAMPLE_COUNT	copy one frame every rate frames;
+ * NM_MONSAMPLE_FLOW	copy all the frames of one flow every rate
+ *			flows, selected by a symmetric hash of the
+ *			addresses and ports;
+ *
+ * and max_pps, if not 0, caps the frames copied per second on each
+ * ring. Frames are first checked against the filter (if any, see
+ * NM_RXFILTER_MAGIC), then sampled, then capped, and only then
+ * copied if there is room. The counters are the sums over the bound
+ * rings, and let a collector scale the samples: seen frames passed
+ * the filter, sampled frames were copied to the monitor, capped and
+ * overflows are the selected frames lost to the rate cap and to a
+ * full monitor ring. NM_MONSAMPLE_GET only returns the counters,
+ * NM_MONSAMPLE_RESET also clears them.
+ */
+#define NM_MONSAMPLE_MAGIC	0x4e4d4d53	/* "NMMS" */
+struct nm_mon_sampling {
+	uint32_t	magic;		/* (in) NM_MONSAMPLE_MAGIC */
+	uint16_t	flags;		/* (in) */
+#define NM_MONSAMPLE_GET	0x1	/* do not change the policy */
+#define NM_MONSAMPLE_RESET	0x2	/* clear the counters */
+	uint16_t	mode;		/* (in/out) */
+#define NM_MONSAMPLE_ALL	0	/* no sampling */
+#define NM_MONSAMPLE_COUNT	1	/* 1-in-rate frames */
+#define NM_MONSAMPLE_FLOW	2	/* 1-in-rate flows */
+	uint32_t	rate;		/* (in/out) */
+	uint32_t	max_pps;	/* (in/out) per ring, 0 = no cap */
+	uint32_t	spare;
+	uint64_t	seen;		/* (out) */
+	uint64_t	sampled;	/* (out) */
+	uint64_t	capped;		/* (out) */
+	uint64_t	overflows;	/* (out) */
+};
+
+/*
+ * Null NICs (linux only). A null NIC is an interface with a native
+ * netmap adapter and no hardware behind it: the packets sent on its tx
+ * rings are discarded at the configured line rate, and its rx rings are
+ * filled with copies of a template frame at the configured rate, so
+ * that applications, NICs attached to VALE switches and pollers can be
+ * benchmarked on machines without real NICs.
+ *
+ * ioctl(fd, NIOCCONFIG, req), with nifr_name set to the interface name
+ * and data holding a struct nm_sink_req with magic NM_SINK_MAGIC:
+ *
+ * NM_SINK_CREATE	creates the interface, with the given rings and
+ *			slots (0 selects the default) and rx template
+ *			(0 selects a 60 bytes UDP frame);
+ * NM_SINK_DELETE	destroys it, if it is not in netmap mode;
+ * NM_SINK_SET		changes the rates and latencies, also while the
+ *			interface is in use;
+ * NM_SINK_GET		returns the current configuration.
+ *
+ * Each tx ring takes tx_batch_ns to start on the packets of a txsync,
+ * then tx_pkt_ns plus the serialization time at tx_bps (including the
+ * 24 bytes of preamble, FCS and inter-frame gap) for each packet.
+ * Slots are reclaimed, and an interrupt raised, as packets complete,
+ * unless NM_SINK_TXSYNC is set, in which case txsync waits for them.
+ * A synchronous txsync waits at most 1ms, the remaining packets
+ * complete as in asynchronous mode.
+ * Each rx ring receives rx_pps frames per second, raising an interrupt
+ * every rx_batch_ns (at least 1us); frames that find the ring full are
+ * counted as drops (see struct nm_kring_stats). All the commands but
+ * NM_SINK_GET require CAP_NET_ADMIN.
+ */
+#define NM_SINK_MAGIC		0x4e4d534b	/* "NMSK" */
+struct nm_sink_req {
+	uint32_t	magic;		/* (in) NM_SINK_MAGIC */
+	uint16_t	cmd;		/* (in) */
+#define NM_SINK_CREATE		1
+#define NM_SINK_DELETE		2
+#define NM_SINK_SET		3
+#define NM_SINK_GET		4
+	uint16_t	flags;		/* (in/out) */
+#define NM_SINK_TXSYNC		0x1	/* synchronous transmission */
+	uint16_t	tx_rings;	/* (in/out) set at creation */
+	uint16_t	rx_rings;
+	uint32_t	tx_slots;
+	uint32_t	rx_slots;
+	uint32_t	tx_pkt_ns;	/* (in/out) */
+	uint64_t	tx_bps;		/* (in/out) 0 = no line rate */
+	uint32_t	tx_batch_ns;	/* (in/out) */
+	uint32_t	rx_batch_ns;	/* (in/out) 0 = default (20us) */
+	uint64_t	rx_pps;		/* (in/out) per ring, 0 = no rx */
+	uint64_t	rx_template;	/* (in) address of the frame */
+	uint16_t	rx_len;		/* (in/out) length of the frame */
+	uint16_t	spare[3];
+};
+
 #endif /* _NET_NETMAP_H_ */
@@ -321,6 +321,10 @@ typedef void (*nm_cb_t)(u_char *, const struct nm_pkthdr *, const u_char *d);
  *		r		monitor rx side (copy monitor)
  *		R		bind only RX ring(s)
  *		T		bind only TX ring(s)
+ *		sNN		copy monitor: copy only the first NN
+ *				bytes of each frame
+ *		m		copy monitor: precede each frame with
+ *				a struct nm_mon_meta
  *
  * req		provides the initial values of nmreq before parsing ifname.
  *		Remember that the ifname parsing will override the ring
@@ -623,6 +627,7 @@ nm_parse(const char *ifname, struct nm_desc *d, char *err)
 	char errmsg[MAXERRMSG] = "";
 	long num;
 	uint16_t nr_arg2 = 0;
+	uint32_t snaplen = 0;
 	enum { P_START, P_RNGSFXOK, P_GETNUM, P_FLAGS, P_FLAGSOK, P_MEMID } p_state;
 
 	errno = 0;
@@ -752,6 +757,18 @@ nm_parse(const char *ifname, struct nm_desc *d, char *err)
 			case 'T':
 				nr_flags |= NR_TX_RINGS_ONLY;
 				break;
+			case 'm':
+				nr_flags |= NR_MONITOR_META;
+				break;
+			case 's': /* monitor snaplen */
+				num = strtol(port + 1, (char **)&port, 10);
+				if (num <= 0 || num > 0xffff) {
+					snprintf(errmsg, MAXERRMSG, "invalid snaplen %ld", num);
+					goto fail;
+				}
+				snaplen = num;
+				p_state = P_FLAGSOK;
+				continue;
 			default:
 				snprintf(errmsg, MAXERRMSG, "unrecognized flag: '%c'", *port);
 				goto fail;
@@ -788,6 +805,8 @@ nm_parse(const char *ifname, struct nm_desc *d, char *err)
 	d->req.nr_ringid |= nr_ringid;
 	if (nr_arg2)
 		d->req.nr_arg2 = nr_arg2;
+	if (snaplen)
+		d->req.nr_snaplen = snaplen;
 
 	d->self = d;
 
@@ -908,6 +927,11 @@ nm_open(const char *ifname, const struct nmreq *req,
 		/* XXX check validity */
 		d->first_tx_ring = d->last_tx_ring =
 		d->first_rx_ring = d->last_rx_ring = d->req.nr_ringid & NETMAP_RING_MASK;
+	} else if (nr_reg == NR_REG_PIPE_SLAVE &&
+			(d->req.nr_flags & NR_PIPE_FANOUT)) {
+		/* consumer of a fan-out pipe, only one rx ring */
+		d->first_tx_ring = d->last_tx_ring = 0;
+		d->first_rx_ring = d->last_rx_ring = d->req.nr_arg1;
 	} else { /* pipes */
 		d->first_tx_ring = d->last_tx_ring = 0;
 		d->first_rx_ring = d->last_rx_ring = 0;
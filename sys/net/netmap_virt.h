@@ -83,6 +83,8 @@ struct ptnetmap_cfg {
 #define PTNETMAP_CFGTYPE_QEMU		0x1
 #define PTNETMAP_CFGTYPE_BHYVE		0x2
 	uint16_t cfgtype;	/* how to interpret the cfg entries */
+#define PTNETMAP_CFGTYPE_MASK		0xff
+#define PTNETMAP_CFG_F_EVENT_IDX	0x100	/* PTNETMAP_F_EVENT_IDX acked */
 	uint16_t entry_size;	/* size of a config entry */
 	uint32_t num_rings;	/* number of config entries */
 	void *ptrings;		/* ptrings inside CSB */
@@ -140,6 +142,7 @@ nmreq_pointer_put(struct nmreq *nmr, void *userptr)
 
 /* ptnetmap features */
 #define PTNETMAP_F_VNET_HDR        1
+#define PTNETMAP_F_EVENT_IDX       2	/* split CSB rings, event indexes */
 
 /* I/O registers for the ptnet device. */
 #define PTNET_IO_PTFEAT		0
@@ -166,9 +169,33 @@ nmreq_pointer_put(struct nmreq *nmr, void *userptr)
 /* If defined, CSB is allocated by the guest, not by the host. */
 #define PTNET_CSB_ALLOC
 
-/* ptnetmap ring fields shared between guest and host */
-struct ptnet_ring {
-	/* XXX revise the layout to minimize cache bounces. */
+/*
+ * ptnetmap ring fields shared between guest and host.
+ *
+ * Unless PTNETMAP_F_EVENT_IDX has been negotiated, the CSB holds
+ * struct ptnet_ring_legacy, whose notifications are enabled by on/off
+ * flags: guest_need_kick enables the host --> guest interrupts, and the
+ * host clears it after sending one; host_need_kick enables the
+ * guest --> host kicks.
+ *
+ * With PTNETMAP_F_EVENT_IDX the CSB holds struct ptnet_ring, where the
+ * fields written by the guest and the ones written by the host live
+ * on different cache lines, so that each side only pulls the other's line
+ * when it actually needs fresh values, and its own stores never invalidate
+ * what the other side is reading.
+ * Notifications use virtio-style event indexes rather than on/off flags:
+ * the guest publishes in hwtail_event the hwtail value it is waiting for,
+ * and the host interrupts only when an update of hwtail moves past it;
+ * symmetrically, the host publishes in head_event the head value past
+ * which it wants to be kicked. PTNET_EVENT_OFF disables the notification.
+ *
+ * The helpers below take the layout (event_idx) as an argument, and
+ * access legacy rings through struct ptnet_ring pointers.
+ */
+#define PTNET_CSB_LINE		64
+#define PTNET_EVENT_OFF		0xffffffffU
+
+struct ptnet_ring_legacy {
 	uint32_t head;		  /* GW+ HR+ the head of the guest netmap_ring */
 	uint32_t cur;		  /* GW+ HR+ the cur of the guest netmap_ring */
 	uint32_t guest_need_kick; /* GW+ HR+ host-->guest notification enable */
@@ -179,11 +206,56 @@ struct ptnet_ring {
 	char pad[4];
 };
 
+struct ptnet_ring {
+	/* Guest-owned cache line. */
+	uint32_t head;		  /* GW+ HR+ the head of the guest netmap_ring */
+	uint32_t cur;		  /* GW+ HR+ the cur of the guest netmap_ring */
+	uint32_t sync_flags;	  /* GW+ HR+ the flags of the guest [tx|rx]sync() */
+	uint32_t hwtail_event;	  /* GW+ HR+ interrupt when hwtail moves past */
+	char gpad[PTNET_CSB_LINE - 4 * sizeof(uint32_t)];
+	/* Host-owned cache line. */
+	uint32_t hwcur;		  /* GR+ HW+ the hwcur of the host netmap_kring */
+	uint32_t hwtail;	  /* GR+ HW+ the hwtail of the host netmap_kring */
+	uint32_t head_event;	  /* GR+ HW+ kick when head moves past */
+	char hpad[PTNET_CSB_LINE - 3 * sizeof(uint32_t)];
+};
+
 /* CSB for the ptnet device. */
 struct ptnet_csb {
 #define NETMAP_VIRT_CSB_SIZE   4096
 	struct ptnet_ring rings[NETMAP_VIRT_CSB_SIZE/sizeof(struct ptnet_ring)];
 };
+#define PTNET_CSB_MAX_RINGS(event_idx)					\
+	(NETMAP_VIRT_CSB_SIZE / ((event_idx) ? sizeof(struct ptnet_ring) :	\
+				 sizeof(struct ptnet_ring_legacy)))
+
+/* The k-th ring of a CSB, in either layout. */
+#define PTNET_CSB_RING(ptrings, event_idx, k)				\
+	((event_idx) ? (ptrings) + (k) : (__typeof__(ptrings))		\
+	 ((struct ptnet_ring_legacy *)(ptrings) + (k)))
+
+/* A field that exists in both layouts, e.g. PTNET_RING_FIELD(r, 0, head) */
+#define PTNET_RING_FIELD(r, event_idx, f)				\
+	(*((event_idx) ? &(r)->f : &((struct ptnet_ring_legacy *)(r))->f))
+
+/*
+ * Tell whether moving a ring index from 'old' to 'new' crossed 'event',
+ * i.e. whether event is in [old, new) modulo num_slots. This is the
+ * ring-index equivalent of vring_need_event(). An event out of range
+ * (e.g. PTNET_EVENT_OFF) is never crossed.
+ */
+static inline int
+ptnet_need_event(uint32_t event, uint32_t new, uint32_t old,
+		 uint32_t num_slots)
+{
+	uint32_t dnew, devt;
+
+	if (event >= num_slots)
+		return 0;
+	dnew = (new >= old) ? new - old : new + num_slots - old;
+	devt = (event >= old) ? event - old : event + num_slots - old;
+	return devt < dnew;
+}
 
 #ifdef WITH_PTNETMAP_GUEST
 
@@ -197,8 +269,8 @@ uint32_t nm_os_pt_memdev_ioread(struct ptnetmap_memdev *, unsigned int);
 /* Guest driver: Write kring pointers (cur, head) to the CSB.
  * This routine is coupled with ptnetmap_host_read_kring_csb(). */
 static inline void
-ptnetmap_guest_write_kring_csb(struct ptnet_ring *ptr, uint32_t cur,
-			       uint32_t head)
+ptnetmap_guest_write_kring_csb(struct ptnet_ring *ptr, int event_idx,
+			       uint32_t cur, uint32_t head)
 {
     /*
      * We need to write cur and head to the CSB but we cannot do it atomically.
@@ -220,24 +292,77 @@ ptnetmap_guest_write_kring_csb(struct ptnet_ring *ptr, uint32_t cur,
      *          mb() <-----------> mb()
      *          STORE(head)        LOAD(cur)
      */
-    ptr->cur = cur;
+    PTNET_RING_FIELD(ptr, event_idx, cur) = cur;
     mb();
-    ptr->head = head;
+    PTNET_RING_FIELD(ptr, event_idx, head) = head;
 }
 
 /* Guest driver: Read kring pointers (hwcur, hwtail) from the CSB.
  * This routine is coupled with ptnetmap_host_write_kring_csb(). */
 static inline void
-ptnetmap_guest_read_kring_csb(struct ptnet_ring *ptr, struct netmap_kring *kring)
+ptnetmap_guest_read_kring_csb(struct ptnet_ring *ptr, int event_idx,
+			      struct netmap_kring *kring)
 {
     /*
      * We place a memory barrier to make sure that the update of hwtail never
      * overtakes the update of hwcur.
      * (see explanation in ptnetmap_host_write_kring_csb).
      */
-    kring->nr_hwtail = ptr->hwtail;
+    kring->nr_hwtail = PTNET_RING_FIELD(ptr, event_idx, hwtail);
     mb();
-    kring->nr_hwcur = ptr->hwcur;
+    kring->nr_hwcur = PTNET_RING_FIELD(ptr, event_idx, hwcur);
+}
+
+/* Guest driver: ask for an interrupt as soon as hwtail moves past
+ * 'event', or disable interrupts with PTNET_EVENT_OFF. When enabling,
+ * the caller must re-read hwtail afterwards, to catch updates that the
+ * host published before seeing the new event index. Legacy rings
+ * interrupt on any update. */
+static inline void
+ptnetmap_guest_intr_event(struct ptnet_ring *ptr, int event_idx,
+                          uint32_t event)
+{
+    if (event_idx)
+        ptr->hwtail_event = event;
+    else
+        ((struct ptnet_ring_legacy *)ptr)->guest_need_kick =
+            (event != PTNET_EVENT_OFF);
+    if (event != PTNET_EVENT_OFF)
+        mb(); /* store event before reloading hwtail */
+}
+
+/* Guest driver: enable or disable host-->guest notifications. When
+ * enabled, any further update of hwtail interrupts the guest. */
+static inline void
+ptnetmap_guest_intr_enable(struct ptnet_ring *ptr, int event_idx, int onoff)
+{
+    ptnetmap_guest_intr_event(ptr, event_idx, onoff ?
+        NM_ACCESS_ONCE(PTNET_RING_FIELD(ptr, event_idx, hwtail)) :
+        PTNET_EVENT_OFF);
+}
+
+/* Guest driver: are guest-->host kicks enabled at all? */
+static inline int
+ptnetmap_guest_kick_enabled(struct ptnet_ring *ptr, int event_idx)
+{
+    if (event_idx)
+        return NM_ACCESS_ONCE(ptr->head_event) != PTNET_EVENT_OFF;
+    return NM_ACCESS_ONCE(((struct ptnet_ring_legacy *)ptr)->host_need_kick);
+}
+
+/* Guest driver: after head has been moved from old_head by
+ * ptnetmap_guest_write_kring_csb(), tell whether the host asked to be
+ * kicked for this update. Legacy rings ask for all of them while
+ * kicks are enabled. */
+static inline int
+ptnetmap_guest_need_kick(struct ptnet_ring *ptr, int event_idx,
+                         uint32_t old_head, uint32_t num_slots)
+{
+    mb(); /* store head before loading head_event */
+    if (!event_idx)
+        return ptnetmap_guest_kick_enabled(ptr, event_idx);
+    return ptnet_need_event(NM_ACCESS_ONCE(ptr->head_event), ptr->head,
+                            old_head, num_slots);
 }
 
 #endif /* WITH_PTNETMAP_GUEST */
@@ -259,9 +384,12 @@ ptnetmap_guest_read_kring_csb(struct ptnet_ring *ptr, struct netmap_kring *kring
 /* Host netmap: Write kring pointers (hwcur, hwtail) to the CSB.
  * This routine is coupled with ptnetmap_guest_read_kring_csb(). */
 static inline void
-ptnetmap_host_write_kring_csb(struct ptnet_ring __user *ptr, uint32_t hwcur,
-        uint32_t hwtail)
+ptnetmap_host_write_kring_csb(struct ptnet_ring __user *ptr, int event_idx,
+        uint32_t hwcur, uint32_t hwtail)
 {
+    struct ptnet_ring_legacy __user *lptr =
+        (struct ptnet_ring_legacy __user *)ptr;
+
     /*
      * The same scheme used in ptnetmap_guest_write_kring_csb() applies here.
      * We allow the guest to read a value of hwcur more recent than the value
@@ -277,27 +405,43 @@ ptnetmap_host_write_kring_csb(struct ptnet_ring __user *ptr, uint32_t hwcur,
      *          mb() <-------------> mb()
      *          STORE(hwtail)        LOAD(hwcur)
      */
-    CSB_WRITE(ptr, hwcur, hwcur);
-    mb();
-    CSB_WRITE(ptr, hwtail, hwtail);
+    if (event_idx) {
+        CSB_WRITE(ptr, hwcur, hwcur);
+        mb();
+        CSB_WRITE(ptr, hwtail, hwtail);
+    } else {
+        CSB_WRITE(lptr, hwcur, hwcur);
+        mb();
+        CSB_WRITE(lptr, hwtail, hwtail);
+    }
 }
 
 /* Host netmap: Read kring pointers (head, cur, sync_flags) from the CSB.
  * This routine is coupled with ptnetmap_guest_write_kring_csb(). */
 static inline void
-ptnetmap_host_read_kring_csb(struct ptnet_ring __user *ptr,
+ptnetmap_host_read_kring_csb(struct ptnet_ring __user *ptr, int event_idx,
 			     struct netmap_ring *shadow_ring,
 			     uint32_t num_slots)
 {
+    struct ptnet_ring_legacy __user *lptr =
+        (struct ptnet_ring_legacy __user *)ptr;
+
     /*
      * We place a memory barrier to make sure that the update of head never
      * overtakes the update of cur.
      * (see explanation in ptnetmap_guest_write_kring_csb).
      */
-    CSB_READ(ptr, head, shadow_ring->head);
-    mb();
-    CSB_READ(ptr, cur, shadow_ring->cur);
-    CSB_READ(ptr, sync_flags, shadow_ring->flags);
+    if (event_idx) {
+        CSB_READ(ptr, head, shadow_ring->head);
+        mb();
+        CSB_READ(ptr, cur, shadow_ring->cur);
+        CSB_READ(ptr, sync_flags, shadow_ring->flags);
+    } else {
+        CSB_READ(lptr, head, shadow_ring->head);
+        mb();
+        CSB_READ(lptr, cur, shadow_ring->cur);
+        CSB_READ(lptr, sync_flags, shadow_ring->flags);
+    }
 }
 
 #endif /* WITH_PTNETMAP_HOST */